@@ -19,47 +19,128 @@
 
 #include "abuffer.h"
 #include "../config.h"
+#include "../memory.h"
+#include "../thread.h"
 #include "../util.h"
 #include "aencoder.h"
+#include "amix.h"
+#include <libavutil/cpu.h>
+#include <libavutil/time.h>
+
+#define AUDIO_CHUNK_SECONDS 5
+#define AUDIO_MAX_CHUNKS RS_AUDIO_BUFFER_MAX_ENCODERS
+#define AUDIO_OVERLAP_FRAMES 4
+
+typedef struct AudioChunk {
+   RSAudioBuffer *buffer;
+   RSEncoder encoder;
+   int clipStart;
+   int first;
+   int last;
+   int64_t keepStart;
+   int64_t keepEnd;
+   AVPacket **packets;
+   int packetCount;
+   RSFuture future;
+} AudioChunk;
 
 static av_always_inline void audioBufferCopy(RSAudioBuffer *buffer, void *dest,
                                              int destOffset, const void *src,
                                              int srcOffset, int size) {
-   if (size >= 0) {
+   if (size >= 0 && src == NULL) {
+      rsClear((int8_t *)dest + destOffset * buffer->sampleSize,
+              (size_t)(size * buffer->sampleSize));
+   } else if (size >= 0) {
       memcpy((int8_t *)dest + destOffset * buffer->sampleSize,
              (const int8_t *)src + srcOffset * buffer->sampleSize,
              (size_t)(size * buffer->sampleSize));
    }
 }
 
-static int audioBufferGetEncoder(RSAudioBuffer *buffer) {
+static av_always_inline void audioBufferStore(RSAudioBuffer *buffer, int destOffset,
+                                              const AVFrame *frame, int srcOffset,
+                                              int size) {
+   if (size >= 0 && frame->data[0] != NULL && frame->format != buffer->params->format) {
+      // Only float samples from the device are ever packed, see rsAudioBufferCreate
+      const float *src = (const float *)frame->data[0] + srcOffset * buffer->channels;
+      rsAudioPackS16((int16_t *)buffer->data + destOffset * buffer->channels, src,
+                     size * buffer->channels);
+   } else {
+      audioBufferCopy(buffer, buffer->data, destOffset, frame->data[0], srcOffset, size);
+   }
+}
+
+static int audioBufferGetEncoders(RSAudioBuffer *buffer, int count) {
    int ret;
-   if (buffer->encoder.params == NULL) {
-      if ((ret = rsAudioEncoderCreate(&buffer->encoder, buffer->params)) < 0) {
+   RSEncoder encoder;
+   rsMutexLock(&buffer->encoderMutex);
+   while (buffer->encoderCount < count) {
+      // Creating an encoder is slow so the list is not held while doing it
+      rsMutexUnlock(&buffer->encoderMutex);
+      if ((ret = rsAudioEncoderCreate(&encoder, buffer->params)) < 0) {
          return ret;
       }
+
+      rsMutexLock(&buffer->encoderMutex);
+      if (buffer->encoderParams == NULL) {
+         buffer->encoderParams = rsParamsClone(encoder.params);
+         if (buffer->encoderParams == NULL) {
+            rsMutexUnlock(&buffer->encoderMutex);
+            rsEncoderDestroy(&encoder);
+            return AVERROR(ENOMEM);
+         }
+         if (encoder.reset == NULL) {
+            av_log(NULL, AV_LOG_VERBOSE,
+                   "Audio encoder %s cannot be reset, it is recreated after each save\n",
+                   avcodec_get_name(encoder.params->codec_id));
+         }
+      }
+      if (buffer->encoderCount < RS_AUDIO_BUFFER_MAX_ENCODERS) {
+         buffer->encoders[buffer->encoderCount++] = encoder;
+      } else {
+         rsEncoderDestroy(&encoder);
+      }
    }
+   rsMutexUnlock(&buffer->encoderMutex);
    return 0;
 }
 
-static int audioBufferSendFrame(RSAudioBuffer *buffer, int index, int pts,
-                                AVFrame *frame) {
+static void audioBufferPutEncoder(RSAudioBuffer *buffer, RSEncoder *encoder) {
+   // Encoders that cannot be reset have been flushed and have to be recreated
+   if (encoder->params != NULL && rsEncoderReset(encoder) >= 0) {
+      rsMutexLock(&buffer->encoderMutex);
+      if (buffer->encoderCount < RS_AUDIO_BUFFER_MAX_ENCODERS) {
+         buffer->encoders[buffer->encoderCount++] = *encoder;
+         rsClear(encoder, sizeof(RSEncoder));
+      }
+      rsMutexUnlock(&buffer->encoderMutex);
+   }
+   rsEncoderDestroy(encoder);
+}
+
+static int audioBufferSendFrame(RSAudioBuffer *buffer, RSEncoder *encoder, int index,
+                                int end, int64_t pts, AVFrame *frame) {
    int ret;
-   if (index >= buffer->size) {
-      if ((ret = rsEncoderSendFrame(&buffer->encoder, NULL)) < 0) {
+   if (index >= end) {
+      if ((ret = rsEncoderSendFrame(encoder, NULL)) < 0) {
          return ret;
       }
       return 0;
    }
 
-   int size = FFMIN(buffer->encoder.params->frame_size, buffer->size - index);
+   int size = FFMIN(encoder->params->frame_size, end - index);
    frame->format = buffer->params->format;
    frame->channels = buffer->params->channels;
    frame->channel_layout = buffer->params->channel_layout;
    frame->sample_rate = buffer->params->sample_rate;
    frame->nb_samples = size;
    frame->pts = pts;
-   if ((ret = av_frame_get_buffer(frame, 0)) < 0) {
+   if (buffer->framePool.pool != NULL) {
+      ret = rsFramePoolGet(&buffer->framePool, frame);
+   } else {
+      ret = av_frame_get_buffer(frame, 0);
+   }
+   if (ret < 0) {
       return ret;
    }
 
@@ -68,12 +149,87 @@ static int audioBufferSendFrame(RSAudioBuffer *buffer, int index, int pts,
    audioBufferCopy(buffer, frame->data[0], 0, buffer->data, bufIndex, prefix);
    audioBufferCopy(buffer, frame->data[0], prefix, buffer->data, 0,
                    frame->nb_samples - prefix);
-   if ((ret = rsEncoderSendFrame(&buffer->encoder, frame)) < 0) {
+   if ((ret = rsEncoderSendFrame(encoder, frame)) < 0) {
       return ret;
    }
    return size;
 }
 
+static void audioChunkDestroy(AudioChunk *chunk) {
+   for (int i = 0; i < chunk->packetCount; ++i) {
+      av_packet_free(&chunk->packets[i]);
+   }
+   av_freep(&chunk->packets);
+   audioBufferPutEncoder(chunk->buffer, &chunk->encoder);
+   rsFutureDestroy(&chunk->future);
+}
+
+static int audioChunkEncode(AudioChunk *chunk) {
+   int ret;
+   RSAudioBuffer *buffer = chunk->buffer;
+   AVPacket *packet = av_packet_alloc();
+   AVFrame *frame = av_frame_alloc();
+   if (packet == NULL || frame == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto error;
+   }
+
+   // Packets are kept by the position of the audio they represent, which is offset
+   // from their timestamp by the encoder's priming samples
+   int delay = chunk->encoder.params->initial_padding;
+   int index = chunk->first;
+   while ((ret = rsEncoderNextPacket(&chunk->encoder, packet)) != AVERROR_EOF) {
+      if (ret >= 0) {
+         int64_t time = packet->pts + delay;
+         if (time < chunk->keepStart || time >= chunk->keepEnd) {
+            av_packet_unref(packet);
+            continue;
+         }
+         if ((ret = av_dynarray_add_nofree(&chunk->packets, &chunk->packetCount,
+                                           packet)) < 0) {
+            goto error;
+         }
+         packet = av_packet_alloc();
+         if (packet == NULL) {
+            ret = AVERROR(ENOMEM);
+            goto error;
+         }
+      } else if (ret == AVERROR(EAGAIN)) {
+         if ((ret = audioBufferSendFrame(buffer, &chunk->encoder, index, chunk->last,
+                                         index - chunk->clipStart, frame)) < 0) {
+            goto error;
+         }
+         index += ret;
+      } else {
+         goto error;
+      }
+   }
+
+   ret = 0;
+error:
+   av_frame_free(&frame);
+   av_packet_free(&packet);
+   return ret;
+}
+
+static int audioChunkTask(void *extra) {
+   return audioChunkEncode(extra);
+}
+
+static int audioBufferChunkCount(RSAudioBuffer *buffer, int samples) {
+   int count = rsConfig.audioThreads;
+   if (count == RS_CONFIG_AUTO) {
+      count = av_cpu_count();
+   }
+   // Short clips are not worth the extra encoders and the overlap they have to encode
+   count = FFMIN(count, samples / (AUDIO_CHUNK_SECONDS * buffer->params->sample_rate));
+   count = FFMIN(count, AUDIO_MAX_CHUNKS);
+   if (buffer->encoderParams->frame_size <= 0) {
+      count = 1;
+   }
+   return FFMAX(count, 1);
+}
+
 int rsAudioBufferCreate(RSAudioBuffer *buffer, const AVCodecParameters *params) {
    int ret;
    rsClear(buffer, sizeof(RSAudioBuffer));
@@ -82,15 +238,30 @@ int rsAudioBufferCreate(RSAudioBuffer *buffer, const AVCodecParameters *params)
       ret = AVERROR(ENOMEM);
       goto error;
    }
+   if ((ret = rsMutexCreate(&buffer->encoderMutex)) < 0) {
+      goto error;
+   }
+
+   // The ring can store 16-bit samples instead of floats, the encoder's filter graph
+   // converts them back when saving
+   if (rsConfig.audioStorage == RS_CONFIG_AUDIO_S16 &&
+       params->format == AV_SAMPLE_FMT_FLT) {
+      buffer->params->format = AV_SAMPLE_FMT_S16;
+   }
 
-   buffer->sampleSize = params->channels * av_get_bytes_per_sample(params->format);
+   buffer->channels = params->channels;
+   buffer->sampleSize =
+       params->channels * av_get_bytes_per_sample(buffer->params->format);
    buffer->capacity = rsConfig.recordSeconds * params->sample_rate;
-   buffer->data = av_malloc_array((size_t)buffer->capacity, (size_t)buffer->sampleSize);
+   buffer->data = rsMemoryAlloc((size_t)buffer->capacity * (size_t)buffer->sampleSize);
    if (buffer->data == NULL) {
       ret = AVERROR(ENOMEM);
       goto error;
    }
 
+   av_log(NULL, AV_LOG_VERBOSE, "Audio buffer: %s, %.1f MiB\n",
+          av_get_sample_fmt_name(buffer->params->format),
+          (double)buffer->capacity * buffer->sampleSize / (1024.0 * 1024.0));
    return 0;
 error:
    rsAudioBufferDestroy(buffer);
@@ -98,16 +269,22 @@ error:
 }
 
 void rsAudioBufferDestroy(RSAudioBuffer *buffer) {
-   rsEncoderDestroy(&buffer->encoder);
-   av_freep(&buffer->data);
+   for (int i = 0; i < buffer->encoderCount; ++i) {
+      rsEncoderDestroy(&buffer->encoders[i]);
+   }
+   buffer->encoderCount = 0;
+   rsMutexDestroy(&buffer->encoderMutex);
+   avcodec_parameters_free(&buffer->encoderParams);
+   rsFramePoolDestroy(&buffer->framePool);
+   rsMemoryFree(buffer->data, (size_t)buffer->capacity * (size_t)buffer->sampleSize);
+   buffer->data = NULL;
    avcodec_parameters_free(&buffer->params);
 }
 
 int rsAudioBufferAddFrame(RSAudioBuffer *buffer, AVFrame *frame) {
    int prefix = FFMIN(frame->nb_samples, buffer->capacity - buffer->index);
-   audioBufferCopy(buffer, buffer->data, buffer->index, frame->data[0], 0, prefix);
-   audioBufferCopy(buffer, buffer->data, 0, frame->data[0], prefix,
-                   frame->nb_samples - prefix);
+   audioBufferStore(buffer, buffer->index, frame, 0, prefix);
+   audioBufferStore(buffer, 0, frame, prefix, frame->nb_samples - prefix);
    buffer->index = (buffer->index + frame->nb_samples) % buffer->capacity;
    buffer->size = FFMIN(buffer->size + frame->nb_samples, buffer->capacity);
    buffer->endTime = frame->pts + frame->nb_samples;
@@ -115,53 +292,165 @@ int rsAudioBufferAddFrame(RSAudioBuffer *buffer, AVFrame *frame) {
    return 0;
 }
 
+int rsAudioBufferRingCreate(RSAudioBuffer *buffer, RSAudioRing *ring, int seconds) {
+   ring->capacity = seconds * buffer->params->sample_rate;
+   ring->data = rsMemoryAlloc((size_t)ring->capacity * (size_t)buffer->sampleSize);
+   if (ring->data == NULL) {
+      ring->capacity = 0;
+      return AVERROR(ENOMEM);
+   }
+   // Fault the pages in here so the audio thread does not have to
+   rsClear(ring->data, (size_t)ring->capacity * (size_t)buffer->sampleSize);
+   return 0;
+}
+
+void rsAudioBufferRingDestroy(RSAudioBuffer *buffer, RSAudioRing *ring) {
+   rsMemoryFree(ring->data, (size_t)ring->capacity * (size_t)buffer->sampleSize);
+   ring->data = NULL;
+   ring->capacity = 0;
+}
+
+void rsAudioBufferSwap(RSAudioBuffer *buffer, RSAudioRing *ring) {
+   // Keep the newest samples, unwrapped to the start of the new ring
+   int keep = FFMIN(buffer->size, ring->capacity);
+   if (keep > 0) {
+      int start = (buffer->index + buffer->size - keep) % buffer->size;
+      int prefix = FFMIN(keep, buffer->size - start);
+      audioBufferCopy(buffer, ring->data, 0, buffer->data, start, prefix);
+      audioBufferCopy(buffer, ring->data, prefix, buffer->data, 0, keep - prefix);
+   }
+   FFSWAP(int8_t *, buffer->data, ring->data);
+   FFSWAP(int, buffer->capacity, ring->capacity);
+   buffer->size = keep;
+   buffer->index = keep % buffer->capacity;
+}
+
+int rsAudioBufferPrepare(RSAudioBuffer *buffer, int samples) {
+   int ret;
+   int64_t time = av_gettime_relative();
+   if ((ret = audioBufferGetEncoders(buffer, 1)) < 0) {
+      return ret;
+   }
+
+   // Keep enough encoders ready for a full buffer so saving does not have to set them up
+   int count = audioBufferChunkCount(buffer, samples);
+   rsMutexLock(&buffer->encoderMutex);
+   int created = count - buffer->encoderCount;
+   rsMutexUnlock(&buffer->encoderMutex);
+   if ((ret = audioBufferGetEncoders(buffer, count)) < 0) {
+      return ret;
+   }
+   if (created > 0) {
+      av_log(NULL, AV_LOG_VERBOSE, "Prepared %i audio encoders in %.1fms\n", created,
+             (double)(av_gettime_relative() - time) / 1000.0);
+   }
+   return 0;
+}
+
 int rsAudioBufferGetParams(RSAudioBuffer *buffer, const AVCodecParameters **params) {
    int ret;
-   if ((ret = audioBufferGetEncoder(buffer)) < 0) {
+   if ((ret = audioBufferGetEncoders(buffer, 1)) < 0) {
       return ret;
    }
-   *params = buffer->encoder.params;
+   *params = buffer->encoderParams;
    return 0;
 }
 
-int rsAudioBufferWrite(RSAudioBuffer *buffer, RSOutput *output, int stream,
-                       int64_t startTime) {
+int rsAudioBufferWrite(RSAudioBuffer *buffer, RSThreadPool *pool, RSOutput *output,
+                       int stream, int64_t startTime) {
    int ret;
+   AudioChunk *chunks = NULL;
+   int chunkCount = 0;
+   int64_t setupTime = av_gettime_relative();
    startTime = av_rescale(startTime, buffer->params->sample_rate, AV_TIME_BASE);
-   AVPacket *packet = av_packet_alloc();
-   AVFrame *frame = av_frame_alloc();
-   if (packet == NULL || frame == NULL) {
+   if ((ret = audioBufferGetEncoders(buffer, 1)) < 0) {
+      goto error;
+   }
+
+   int64_t bufStartTime = buffer->endTime - buffer->size;
+   int clipStart = (int)FFMIN(FFMAX(startTime - bufStartTime, 0), buffer->size);
+   int samples = buffer->size - clipStart;
+   int count = audioBufferChunkCount(buffer, samples);
+   chunks = av_calloc((size_t)count, sizeof(AudioChunk));
+   if (chunks == NULL) {
       ret = AVERROR(ENOMEM);
       goto error;
    }
-   if ((ret = audioBufferGetEncoder(buffer)) < 0) {
+   if ((ret = audioBufferGetEncoders(buffer, count)) < 0) {
       goto error;
    }
 
-   int64_t bufStartTime = buffer->endTime - buffer->size;
-   int index = (int)FFMAX(startTime - bufStartTime, 0);
-   int pts = 0;
-   while ((ret = rsEncoderNextPacket(&buffer->encoder, packet)) != AVERROR_EOF) {
+   // Every frame sent to the encoders is the same size, apart from the last of a chunk.
+   // If the pool cannot be created each frame is allocated instead.
+   int frameSize = buffer->encoderParams->frame_size;
+   if (buffer->framePool.pool == NULL && frameSize > 0) {
+      rsAudioFramePoolCreate(&buffer->framePool, buffer->params->format,
+                             buffer->params->channels, frameSize);
+   }
+
+   // The clip is split into chunks that are encoded independently. Each chunk also
+   // encodes a few frames either side of it so the encoder is warmed up at its edges,
+   // the packets from those frames are thrown away.
+   frameSize = FFMAX(frameSize, 1);
+   int length = (samples / count + frameSize - 1) / frameSize * frameSize;
+   int overlap = AUDIO_OVERLAP_FRAMES * frameSize;
+   rsMutexLock(&buffer->encoderMutex);
+   for (; chunkCount < count; ++chunkCount) {
+      AudioChunk *chunk = &chunks[chunkCount];
+      int start = clipStart + chunkCount * length;
+      int end = FFMIN(start + length, buffer->size);
+      int last = chunkCount == count - 1;
+      chunk->buffer = buffer;
+      chunk->clipStart = clipStart;
+      chunk->first = chunkCount == 0 ? start : FFMAX(start - overlap, clipStart);
+      chunk->last = last ? buffer->size : FFMIN(end + overlap, buffer->size);
+      chunk->keepStart = chunkCount == 0 ? INT64_MIN : start - clipStart;
+      chunk->keepEnd = last ? INT64_MAX : end - clipStart;
+      chunk->encoder = buffer->encoders[--buffer->encoderCount];
+      rsClear(&buffer->encoders[buffer->encoderCount], sizeof(RSEncoder));
+      if ((ret = rsFutureCreate(&chunk->future)) < 0) {
+         ++chunkCount;
+         rsMutexUnlock(&buffer->encoderMutex);
+         goto error;
+      }
+   }
+   rsMutexUnlock(&buffer->encoderMutex);
+
+   int64_t encodeTime = av_gettime_relative();
+
+   // The pool runs chunks inline when it is full so every future is finished afterwards
+   for (int i = 1; i < chunkCount; ++i) {
+      rsThreadPoolSubmit(pool, &chunks[i].future, audioChunkTask, &chunks[i]);
+   }
+   ret = audioChunkEncode(&chunks[0]);
+   for (int i = 1; i < chunkCount; ++i) {
+      int error = rsFutureWait(&chunks[i].future);
       if (ret >= 0) {
-         packet->stream_index = stream;
-         if ((ret = rsOutputWrite(output, packet)) < 0) {
-            goto error;
-         }
-      } else if (ret == AVERROR(EAGAIN)) {
-         if ((ret = audioBufferSendFrame(buffer, index, pts, frame)) < 0) {
+         ret = error;
+      }
+   }
+   if (ret < 0) {
+      goto error;
+   }
+
+   for (int i = 0; i < chunkCount; ++i) {
+      for (int j = 0; j < chunks[i].packetCount; ++j) {
+         chunks[i].packets[j]->stream_index = stream;
+         if ((ret = rsOutputWrite(output, chunks[i].packets[j])) < 0) {
             goto error;
          }
-         index += ret;
-         pts += ret;
-      } else {
-         goto error;
       }
    }
 
+   av_log(NULL, AV_LOG_VERBOSE,
+          "Audio saved in %i chunks: %.1fms setup, %.1fms encoding\n", chunkCount,
+          (double)(encodeTime - setupTime) / 1000.0,
+          (double)(av_gettime_relative() - encodeTime) / 1000.0);
    ret = 0;
 error:
-   av_frame_free(&frame);
-   av_packet_free(&packet);
-   rsEncoderDestroy(&buffer->encoder);
+   for (int i = 0; i < chunkCount; ++i) {
+      audioChunkDestroy(&chunks[i]);
+   }
+   av_freep(&chunks);
    return ret;
 }
@@ -19,27 +19,54 @@
 
 #ifndef RS_AUDIO_ABUFFER_H
 #define RS_AUDIO_ABUFFER_H
+#include "../device/framepool.h"
 #include "../encoder/encoder.h"
 #include "../output.h"
+#include "../thread.h"
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 
+#define RS_AUDIO_BUFFER_MAX_ENCODERS 16
+
+typedef struct RSAudioRing {
+   int8_t *data;
+   int capacity;
+} RSAudioRing;
+
 typedef struct RSAudioBuffer {
    AVCodecParameters *params;
+   int channels;
    int sampleSize;
    int8_t *data;
    int capacity;
    int index;
    int size;
    int64_t endTime;
-   RSEncoder encoder;
+   RSEncoder encoders[RS_AUDIO_BUFFER_MAX_ENCODERS];
+   int encoderCount;
+   // Guards the encoders, they are prepared on the pool while the buffer is in use
+   RSMutex encoderMutex;
+   AVCodecParameters *encoderParams;
+   RSFramePool framePool;
 } RSAudioBuffer;
 
 int rsAudioBufferCreate(RSAudioBuffer *buffer, const AVCodecParameters *params);
 void rsAudioBufferDestroy(RSAudioBuffer *buffer);
+// The frame may point into the device's own memory and is only valid until the next
+// frame is requested. A NULL data pointer marks a hole and is stored as silence.
 int rsAudioBufferAddFrame(RSAudioBuffer *buffer, AVFrame *frame);
+// Resizing allocates the new ring without the buffer locked, only the swap needs the
+// lock. It keeps as much of the newest audio as fits and leaves the old ring to be
+// destroyed once the lock is released.
+int rsAudioBufferRingCreate(RSAudioBuffer *buffer, RSAudioRing *ring, int seconds);
+void rsAudioBufferRingDestroy(RSAudioBuffer *buffer, RSAudioRing *ring);
+void rsAudioBufferSwap(RSAudioBuffer *buffer, RSAudioRing *ring);
+// Creates enough encoders to save the given number of samples, it does not need the
+// buffer to be locked
+int rsAudioBufferPrepare(RSAudioBuffer *buffer, int samples);
 int rsAudioBufferGetParams(RSAudioBuffer *buffer, const AVCodecParameters **params);
-int rsAudioBufferWrite(RSAudioBuffer *buffer, RSOutput *output, int stream,
-                       int64_t startTime);
+// Chunks of the clip are encoded on the pool, it may be NULL to encode them all inline
+int rsAudioBufferWrite(RSAudioBuffer *buffer, RSThreadPool *pool, RSOutput *output,
+                       int stream, int64_t startTime);
 
 #endif
@@ -21,6 +21,8 @@
 #define RS_AUDIO_ADEVICE_H
 #include "../device/device.h"
 
+#define RS_AUDIO_MAX_SOURCES 8
+
 int rsPulseDeviceCreate(RSDevice *device);
 int rsAudioDeviceCreate(RSDevice *device);
 
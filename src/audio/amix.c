@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "amix.h"
+
+void rsAudioMix(float *restrict dest, const float *restrict src, float gain, int size) {
+   for (int i = 0; i < size; ++i) {
+      dest[i] += src[i] * gain;
+   }
+}
+
+void rsAudioPackS16(int16_t *restrict dest, const float *restrict src, int size) {
+   for (int i = 0; i < size; ++i) {
+      float sample = src[i] * 32767.0f;
+      sample = sample > 32767.0f ? 32767.0f : sample;
+      sample = sample < -32768.0f ? -32768.0f : sample;
+      dest[i] = (int16_t)sample;
+   }
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RS_AUDIO_AMIX_H
+#define RS_AUDIO_AMIX_H
+
+#include <stdint.h>
+
+// Sample kernels used by the audio thread. Kept in their own file so they can be built
+// with vectorization enabled regardless of the build type.
+void rsAudioMix(float *restrict dest, const float *restrict src, float gain, int size);
+void rsAudioPackS16(int16_t *restrict dest, const float *restrict src, int size);
+
+#endif
@@ -18,30 +18,111 @@
  */
 
 #include "audio.h"
+#include "../config.h"
 #include "../log.h"
+#include "../pressure.h"
 #include "../util.h"
 #include "adevice.h"
 #include "aencoder.h"
+#include <libavutil/cpu.h>
+
+static int audioThreadAddFrame(RSAudioThread *thread) {
+   int ret;
+   AVFrame *frame = thread->frame;
+   if (thread->trackCount == 1) {
+      return rsAudioBufferAddFrame(&thread->buffers[0], frame);
+   }
+
+   // Separate tracks come in as one plane per source
+   for (int i = 0; i < thread->trackCount; ++i) {
+      thread->track->format = av_get_packed_sample_fmt(frame->format);
+      thread->track->channels = 1;
+      thread->track->channel_layout = AV_CH_LAYOUT_MONO;
+      thread->track->sample_rate = frame->sample_rate;
+      thread->track->nb_samples = frame->nb_samples;
+      thread->track->pts = frame->pts;
+      thread->track->data[0] = frame->extended_data[i];
+      thread->track->linesize[0] = frame->linesize[0];
+      thread->track->extended_data = thread->track->data;
+      if ((ret = rsAudioBufferAddFrame(&thread->buffers[i], thread->track)) < 0) {
+         goto error;
+      }
+   }
+
+   ret = 0;
+error:
+   av_frame_unref(frame);
+   return ret;
+}
+
+static int audioThreadCreateBuffers(RSAudioThread *thread) {
+   int ret;
+   const AVCodecParameters *params = thread->device.params;
+   if (!av_sample_fmt_is_planar(params->format) || params->channels == 1) {
+      thread->trackCount = 1;
+      return rsAudioBufferCreate(&thread->buffers[0], params);
+   }
+
+   AVCodecParameters *trackParams = rsParamsClone(params);
+   if (trackParams == NULL) {
+      return AVERROR(ENOMEM);
+   }
+   trackParams->format = av_get_packed_sample_fmt(params->format);
+   trackParams->channels = 1;
+   trackParams->channel_layout = AV_CH_LAYOUT_MONO;
+   for (int i = 0; i < params->channels; ++i) {
+      if ((ret = rsAudioBufferCreate(&thread->buffers[i], trackParams)) < 0) {
+         goto error;
+      }
+      ++thread->trackCount;
+   }
+
+   ret = 0;
+error:
+   avcodec_parameters_free(&trackParams);
+   return ret;
+}
+
+static int audioThreadPrepare(RSAudioThread *thread) {
+   int ret;
+   for (int i = 0; i < thread->trackCount; ++i) {
+      if ((ret = rsAudioBufferPrepare(&thread->buffers[i], thread->prepareSamples[i])) <
+          0) {
+         return ret;
+      }
+   }
+   return 0;
+}
+
+static int audioThreadPrepareTask(void *extra) {
+   RSAudioThread *thread = extra;
+   int ret = audioThreadPrepare(thread);
+   if (ret < 0) {
+      av_log(NULL, AV_LOG_WARNING, "Failed to prepare audio encoders: %s\n",
+             av_err2str(ret));
+   }
+   rsAtomicStore(&thread->preparing, 0);
+   return ret;
+}
 
 static void *audioThread(void *extra) {
    int ret;
    RSAudioThread *thread = extra;
-   int silence = 0;
+   RSDeadline deadline;
+   rsThreadSchedule("rs-audio", rsConfig.audioCpus, rsConfig.schedPolicy,
+                    rsConfig.schedPriority);
+   rsDeadlineInit(&deadline, "Audio");
    while (thread->running) {
       if ((ret = rsDeviceNextFrame(&thread->device, thread->frame)) < 0) {
-         av_log(NULL, AV_LOG_WARNING, "Failed to get frame from audio device: %s\n",
-                av_err2str(ret));
-         if (!silence) {
-            rsLogSilence(1);
-            silence = 1;
-         }
+         RS_LOG_LIMITED(NULL, AV_LOG_WARNING,
+                        "Failed to get frame from audio device: %s\n", av_err2str(ret));
       } else {
-         if (silence) {
-            rsLogSilence(-1);
-            silence = 0;
-         }
+         // Each frame holds the audio captured since the last one
+         AVFrame *frame = thread->frame;
+         rsDeadlineTick(&deadline,
+                        av_rescale(frame->nb_samples, AV_TIME_BASE, frame->sample_rate));
          rsAudioThreadLock(thread);
-         ret = rsAudioBufferAddFrame(&thread->buffer, thread->frame);
+         ret = audioThreadAddFrame(thread);
          rsAudioThreadUnlock(thread);
          if (ret < 0) {
             goto error;
@@ -63,12 +144,29 @@ int rsAudioThreadCreate(RSAudioThread *thread) {
    if ((ret = rsAudioDeviceCreate(&thread->device)) < 0) {
       goto error;
    }
-   if ((ret = rsAudioBufferCreate(&thread->buffer, thread->device.params)) < 0) {
+   if ((ret = audioThreadCreateBuffers(thread)) < 0) {
+      goto error;
+   }
+   for (int i = 0; i < thread->trackCount; ++i) {
+      thread->prepareSamples[i] = thread->buffers[i].capacity;
+   }
+   thread->seconds = rsConfig.recordSeconds;
+   if ((ret = audioThreadPrepare(thread)) < 0) {
+      goto error;
+   }
+
+   // The saving thread encodes the first chunk itself
+   int workers = rsConfig.audioThreads;
+   if (workers == RS_CONFIG_AUTO) {
+      workers = av_cpu_count();
+   }
+   if ((ret = rsThreadPoolCreate(&thread->pool, workers - 1)) < 0) {
       goto error;
    }
 
    thread->frame = av_frame_alloc();
-   if (thread->frame == NULL) {
+   thread->track = av_frame_alloc();
+   if (thread->frame == NULL || thread->track == NULL) {
       ret = AVERROR(ENOMEM);
       goto error;
    }
@@ -94,12 +192,82 @@ error:
 void rsAudioThreadDestroy(RSAudioThread *thread) {
    thread->running = 0;
    rsThreadDestroy(&thread->thread);
+   // Destroying the pool runs anything still queued so the future is finished
+   rsThreadPoolDestroy(&thread->pool);
+   if (thread->prepareSubmitted) {
+      rsFutureWait(&thread->prepareFuture);
+      rsFutureDestroy(&thread->prepareFuture);
+   }
    rsMutexDestroy(&thread->mutex);
+   av_frame_free(&thread->track);
    av_frame_free(&thread->frame);
-   rsAudioBufferDestroy(&thread->buffer);
+   for (int i = 0; i < thread->trackCount; ++i) {
+      rsAudioBufferDestroy(&thread->buffers[i]);
+   }
    rsDeviceDestroy(&thread->device);
 }
 
+void rsAudioThreadPrepare(RSAudioThread *thread) {
+   // A save during a refill only creates the encoders that are still missing
+   if (rsAtomicExchange(&thread->preparing, 1)) {
+      return;
+   }
+   if (thread->prepareSubmitted) {
+      rsFutureWait(&thread->prepareFuture);
+      rsFutureDestroy(&thread->prepareFuture);
+      thread->prepareSubmitted = 0;
+   }
+   if (rsFutureCreate(&thread->prepareFuture) < 0) {
+      rsAtomicStore(&thread->preparing, 0);
+      return;
+   }
+
+   // The buffers may be resized by the audio thread
+   rsAudioThreadLock(thread);
+   for (int i = 0; i < thread->trackCount; ++i) {
+      thread->prepareSamples[i] = thread->buffers[i].capacity;
+   }
+   rsAudioThreadUnlock(thread);
+   thread->prepareSubmitted = 1;
+   rsThreadPoolSubmit(&thread->pool, &thread->prepareFuture, audioThreadPrepareTask,
+                      thread);
+}
+
+void rsAudioThreadResize(RSAudioThread *thread) {
+   int ret;
+   int seconds = rsPressureGetSeconds();
+   if (seconds == thread->seconds) {
+      return;
+   }
+
+   // Only the swap is done with the audio locked, the audio thread should not wait on
+   // the allocation or have to fault in the new pages itself
+   RSAudioRing rings[RS_AUDIO_MAX_SOURCES] = {0};
+   for (int i = 0; i < thread->trackCount; ++i) {
+      if ((ret = rsAudioBufferRingCreate(&thread->buffers[i], &rings[i], seconds)) < 0) {
+         goto error;
+      }
+   }
+   rsAudioThreadLock(thread);
+   for (int i = 0; i < thread->trackCount; ++i) {
+      rsAudioBufferSwap(&thread->buffers[i], &rings[i]);
+   }
+   rsAudioThreadUnlock(thread);
+   av_log(NULL, AV_LOG_VERBOSE, "Audio buffers resized from %is to %is\n",
+          thread->seconds, seconds);
+   thread->seconds = seconds;
+
+   ret = 0;
+error:
+   for (int i = 0; i < thread->trackCount; ++i) {
+      rsAudioBufferRingDestroy(&thread->buffers[i], &rings[i]);
+   }
+   if (ret < 0) {
+      RS_LOG_LIMITED(NULL, AV_LOG_WARNING, "Failed to resize audio buffers: %s\n",
+                     av_err2str(ret));
+   }
+}
+
 void rsAudioThreadLock(RSAudioThread *thread) {
    rsMutexLock(&thread->mutex);
 }
@@ -23,20 +23,34 @@
 #include "../encoder/encoder.h"
 #include "../thread.h"
 #include "abuffer.h"
+#include "adevice.h"
 #include <libavcodec/avcodec.h>
 #include <pthread.h>
 
 typedef struct RSAudioThread {
    RSDevice device;
-   RSAudioBuffer buffer;
+   RSAudioBuffer buffers[RS_AUDIO_MAX_SOURCES];
+   int trackCount;
    AVFrame *frame;
+   AVFrame *track;
+   RSThreadPool pool;
    volatile int running;
    RSThread thread;
    RSMutex mutex;
+   RSFuture prepareFuture;
+   int prepareSubmitted;
+   int preparing;
+   int prepareSamples[RS_AUDIO_MAX_SOURCES];
+   int seconds;
 } RSAudioThread;
 
 int rsAudioThreadCreate(RSAudioThread *thread);
 void rsAudioThreadDestroy(RSAudioThread *thread);
+// Refills the encoders used by the last save on the pool, the audio must not be locked
+void rsAudioThreadPrepare(RSAudioThread *thread);
+// Follows the memory pressure, it allocates so it is called off the audio thread and
+// the audio must not be locked
+void rsAudioThreadResize(RSAudioThread *thread);
 void rsAudioThreadLock(RSAudioThread *thread);
 void rsAudioThreadUnlock(RSAudioThread *thread);
 
@@ -18,24 +18,57 @@
  */
 
 #include "../config.h"
+#include "../device/framepool.h"
+#include "../log.h"
 #include "../util.h"
 #include "adevice.h"
+#include "amix.h"
 #include "rsbuild.h"
 #include <libavcodec/avcodec.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/avstring.h>
 #include <libavutil/avutil.h>
 #include <libavutil/bprint.h>
 #include <libavutil/time.h>
+#include <time.h>
 
 #ifdef RS_BUILD_PULSE_FOUND
 #include <pulse/pulseaudio.h>
 
+#define PULSE_REPORT_INTERVAL (10 * AV_TIME_BASE)
+// How far, in seconds, a stream's clock can drift before it is resynced, and how far a
+// stream can fall behind before the others are mixed without it
+#define PULSE_MAX_DRIFT 0.1
+#define PULSE_MAX_LAG 0.5
+#define PULSE_SILENCE_SIZE 1024
+
+typedef struct PulseStream {
+   char *name;
+   int automatic;
+   float gain;
+   pa_stream *stream;
+   int peeked;
+   AVAudioFifo *fifo;
+   int64_t time;
+} PulseStream;
+
 typedef struct PulseDevice {
    int error;
    pa_mainloop *mainloop;
    pa_context *context;
-   pa_stream *stream;
+   PulseStream streams[RS_AUDIO_MAX_SOURCES];
+   int streamCount;
+   int direct;
+   int separate;
+   float *mixBuffer;
+   int mixSize;
+   RSFramePool mixPool;
+   int64_t mixTime;
    char *sink;
    int serverChanged;
+   int64_t reportTime;
+   int64_t reportCPU;
+   int wakeups;
 } PulseDevice;
 
 static int pulseDeviceError(int error) {
@@ -73,9 +106,10 @@ static int pulseDeviceError(int error) {
 
 static int pulseDeviceIterate(PulseDevice *pulse) {
    int ret;
+   ++pulse->wakeups;
    if ((ret = pa_mainloop_iterate(pulse->mainloop, 1, NULL)) < 0) {
-      av_log(NULL, AV_LOG_ERROR, "Failed to iterate PulseAudio mainloop: %s\n",
-             pa_strerror(ret));
+      RS_LOG_LIMITED(NULL, AV_LOG_ERROR, "Failed to iterate PulseAudio mainloop: %s\n",
+                     pa_strerror(ret));
       return pulseDeviceError(ret);
    }
    return 0;
@@ -117,41 +151,74 @@ error:
    return ret;
 }
 
-static void pulseDeviceStreamDestroy(PulseDevice *pulse) {
-   if (pulse->stream != NULL) {
-      if (pa_stream_get_state(pulse->stream) != PA_STREAM_UNCONNECTED) {
-         pa_stream_disconnect(pulse->stream);
+static void pulseDeviceDrop(PulseStream *stream) {
+   if (stream->peeked) {
+      pa_stream_drop(stream->stream);
+      stream->peeked = 0;
+   }
+}
+
+static void pulseDeviceStreamDestroy(PulseStream *stream) {
+   if (stream->stream != NULL) {
+      pulseDeviceDrop(stream);
+      if (pa_stream_get_state(stream->stream) != PA_STREAM_UNCONNECTED) {
+         pa_stream_disconnect(stream->stream);
       }
-      pa_stream_unref(pulse->stream);
+      pa_stream_unref(stream->stream);
+      stream->stream = NULL;
    }
 }
 
-static int pulseDeviceStreamCreate(PulseDevice *pulse, const char *name) {
+static int pulseDeviceStreamCreate(PulseDevice *pulse, PulseStream *stream,
+                                   const char *name) {
    int ret;
-   pulseDeviceStreamDestroy(pulse);
+   pulseDeviceStreamDestroy(stream);
+   if (stream->fifo != NULL) {
+      av_audio_fifo_reset(stream->fifo);
+   }
+   stream->time = -1;
+
    av_log(NULL, AV_LOG_INFO, "Connecting to Pulse Audio device: %s...\n",
           name == NULL ? "system" : name);
-   pulse->stream = pa_stream_new(pulse->context, RS_NAME,
-                                 &(pa_sample_spec){
-                                     .format = PA_SAMPLE_FLOAT32NE,
-                                     .channels = 1,
-                                     .rate = (uint32_t)rsConfig.audioSamplerate,
-                                 },
-                                 NULL);
-   if (pulse->stream == NULL) {
+   pa_sample_spec spec = {
+       .format = PA_SAMPLE_FLOAT32NE,
+       .channels = 1,
+       .rate = (uint32_t)rsConfig.audioSamplerate,
+   };
+   stream->stream = pa_stream_new(pulse->context, RS_NAME, &spec, NULL);
+   if (stream->stream == NULL) {
       ret = pa_context_errno(pulse->context);
       av_log(NULL, AV_LOG_ERROR, "Failed to create PulseAudio stream: %s\n",
              pa_strerror(ret));
       return pulseDeviceError(ret);
    }
-   if ((ret = pa_stream_connect_record(pulse->stream, name, NULL, 0)) < 0) {
+
+   // Larger fragments mean the audio thread wakes up less often to read them
+   pa_buffer_attr attr = {
+       .maxlength = (uint32_t)-1,
+       .tlength = (uint32_t)-1,
+       .prebuf = (uint32_t)-1,
+       .minreq = (uint32_t)-1,
+       .fragsize = (uint32_t)-1,
+   };
+   pa_stream_flags_t flags = PA_STREAM_NOFLAGS;
+   if (rsConfig.audioFragSize != RS_CONFIG_AUTO) {
+      attr.fragsize = (uint32_t)pa_usec_to_bytes(
+          (pa_usec_t)rsConfig.audioFragSize * PA_USEC_PER_MSEC, &spec);
+      flags |= PA_STREAM_ADJUST_LATENCY;
+   }
+   if (rsConfig.audioMaxLength != RS_CONFIG_AUTO) {
+      attr.maxlength = (uint32_t)pa_usec_to_bytes(
+          (pa_usec_t)rsConfig.audioMaxLength * PA_USEC_PER_MSEC, &spec);
+   }
+   if ((ret = pa_stream_connect_record(stream->stream, name, &attr, flags)) < 0) {
       av_log(NULL, AV_LOG_ERROR, "Failed to connect PulseAudio stream: %s\n",
              pa_strerror(ret));
       return pulseDeviceError(ret);
    }
 
    pa_stream_state_t state;
-   while ((state = pa_stream_get_state(pulse->stream)) == PA_STREAM_CREATING) {
+   while ((state = pa_stream_get_state(stream->stream)) == PA_STREAM_CREATING) {
       if ((ret = pulseDeviceIterate(pulse)) < 0) {
          return ret;
       }
@@ -160,6 +227,14 @@ static int pulseDeviceStreamCreate(PulseDevice *pulse, const char *name) {
       av_log(NULL, AV_LOG_ERROR, "Failed to setup PulseAudio stream\n");
       return AVERROR_EXTERNAL;
    }
+
+   const pa_buffer_attr *actual = pa_stream_get_buffer_attr(stream->stream);
+   if (actual != NULL) {
+      av_log(NULL, AV_LOG_VERBOSE, "PulseAudio fragment size: %" PRIu64 "ms\n",
+             pa_bytes_to_usec(actual->fragsize, &spec) / PA_USEC_PER_MSEC);
+      av_log(NULL, AV_LOG_VERBOSE, "PulseAudio max length: %" PRIu64 "ms\n",
+             pa_bytes_to_usec(actual->maxlength, &spec) / PA_USEC_PER_MSEC);
+   }
    return 0;
 }
 
@@ -203,7 +278,13 @@ static int pulseDeviceStreamAuto(PulseDevice *pulse) {
    if (source == NULL) {
       return AVERROR(ENOMEM);
    }
-   ret = pulseDeviceStreamCreate(pulse, source);
+   for (int i = 0; i < pulse->streamCount; ++i) {
+      if (pulse->streams[i].automatic) {
+         if ((ret = pulseDeviceStreamCreate(pulse, &pulse->streams[i], source)) < 0) {
+            break;
+         }
+      }
+   }
    av_freep(&source);
    if (ret < 0) {
       return ret;
@@ -225,7 +306,15 @@ static void pulseDeviceDestroy(RSDevice *device) {
    PulseDevice *pulse = device->extra;
    if (pulse != NULL) {
       av_freep(&pulse->sink);
-      pulseDeviceStreamDestroy(pulse);
+      for (int i = 0; i < pulse->streamCount; ++i) {
+         pulseDeviceStreamDestroy(&pulse->streams[i]);
+         if (pulse->streams[i].fifo != NULL) {
+            av_audio_fifo_free(pulse->streams[i].fifo);
+         }
+         av_freep(&pulse->streams[i].name);
+      }
+      av_freep(&pulse->mixBuffer);
+      rsFramePoolDestroy(&pulse->mixPool);
       if (pulse->context != NULL) {
          if (pa_context_get_state(pulse->context) != PA_CONTEXT_UNCONNECTED) {
             pa_context_disconnect(pulse->context);
@@ -241,7 +330,7 @@ static void pulseDeviceDestroy(RSDevice *device) {
    }
 }
 
-static int pulseDeviceRead(PulseDevice *pulse, AVFrame *frame) {
+static int pulseDeviceServerCheck(PulseDevice *pulse) {
    int ret;
    if (pulse->serverChanged) {
       pulse->serverChanged = 0;
@@ -249,35 +338,200 @@ static int pulseDeviceRead(PulseDevice *pulse, AVFrame *frame) {
          return ret;
       }
    }
+   return 0;
+}
+
+static int pulseDeviceRead(PulseDevice *pulse, AVFrame *frame) {
+   int ret;
+   PulseStream *stream = &pulse->streams[0];
+   // The previous frame pointed straight into the stream's memory, so it is only
+   // released once the caller asks for the next one
+   pulseDeviceDrop(stream);
+   if ((ret = pulseDeviceServerCheck(pulse)) < 0) {
+      return ret;
+   }
 
    const void *data;
    size_t size;
-   if ((ret = pa_stream_peek(pulse->stream, &data, &size)) < 0) {
-      av_log(NULL, AV_LOG_ERROR, "Failed to read from PulseAudio stream: %s\n",
-             pa_strerror(ret));
+   if ((ret = pa_stream_peek(stream->stream, &data, &size)) < 0) {
+      RS_LOG_LIMITED(NULL, AV_LOG_ERROR, "Failed to read from PulseAudio stream: %s\n",
+                     pa_strerror(ret));
       return pulseDeviceError(ret);
    }
    if (size == 0) {
       return AVERROR(EAGAIN);
    }
 
+   stream->peeked = 1;
+   if (data == NULL) {
+      RS_LOG_LIMITED(NULL, AV_LOG_WARNING, "%zu byte hole in PulseAudio stream\n", size);
+   }
    frame->nb_samples = (int)(size / sizeof(float));
    frame->pts = av_rescale(av_gettime_relative(), frame->sample_rate, AV_TIME_BASE) -
                 frame->nb_samples;
-   if ((ret = av_frame_get_buffer(frame, 0)) < 0) {
-      goto error;
+   frame->data[0] = (uint8_t *)data;
+   frame->linesize[0] = (int)size;
+   frame->extended_data = frame->data;
+   return 0;
+}
+
+static int pulseDeviceFill(PulseStream *stream) {
+   int ret;
+   static const float silence[PULSE_SILENCE_SIZE];
+   for (;;) {
+      const void *data;
+      size_t size;
+      if ((ret = pa_stream_peek(stream->stream, &data, &size)) < 0) {
+         RS_LOG_LIMITED(NULL, AV_LOG_ERROR, "Failed to read from PulseAudio stream: %s\n",
+                        pa_strerror(ret));
+         return pulseDeviceError(ret);
+      }
+      if (size == 0) {
+         return 0;
+      }
+
+      // Each stream keeps its own sample clock so timer jitter does not turn into gaps,
+      // it is only corrected once it drifts noticeably from the wall clock
+      int samples = (int)(size / sizeof(float));
+      int64_t time = av_rescale(av_gettime_relative(), rsConfig.audioSamplerate,
+                                AV_TIME_BASE) -
+                     samples - av_audio_fifo_size(stream->fifo);
+      int64_t drift = (int64_t)(PULSE_MAX_DRIFT * rsConfig.audioSamplerate);
+      if (stream->time < 0 || FFABS(time - stream->time) > drift) {
+         if (stream->time >= 0) {
+            av_log(NULL, AV_LOG_VERBOSE, "Resyncing PulseAudio stream by %" PRIi64 "\n",
+                   time - stream->time);
+         }
+         stream->time = time;
+      }
+
+      if (data == NULL) {
+         RS_LOG_LIMITED(NULL, AV_LOG_WARNING, "%zu byte hole in PulseAudio stream\n",
+                        size);
+         for (int i = 0; i < samples && ret >= 0; i += PULSE_SILENCE_SIZE) {
+            void *planes[] = {(void *)silence};
+            ret = av_audio_fifo_write(stream->fifo, planes,
+                                      FFMIN(samples - i, PULSE_SILENCE_SIZE));
+         }
+      } else {
+         void *planes[] = {(void *)data};
+         ret = av_audio_fifo_write(stream->fifo, planes, samples);
+      }
+      pa_stream_drop(stream->stream);
+      if (ret < 0) {
+         return ret;
+      }
    }
-   if (data == NULL) {
-      av_log(NULL, AV_LOG_WARNING, "%zu byte hole in PulseAudio stream\n", size);
-      rsClear(frame->data[0], size);
-   } else {
-      memcpy(frame->data[0], data, size);
+}
+
+static void pulseDeviceMixStream(PulseDevice *pulse, PulseStream *stream, float *dest,
+                                 int size) {
+   if (stream->time < 0) {
+      return;
    }
 
-   ret = 0;
-error:
-   pa_stream_drop(pulse->stream);
-   return ret;
+   // Anything from before the mix position arrived too late to be used
+   if (stream->time < pulse->mixTime) {
+      int late = (int)FFMIN(pulse->mixTime - stream->time, av_audio_fifo_size(stream->fifo));
+      av_audio_fifo_drain(stream->fifo, late);
+      stream->time += late;
+   }
+
+   int64_t offset = stream->time - pulse->mixTime;
+   if (offset >= 0 && offset < size) {
+      int samples = FFMIN(size - (int)offset, av_audio_fifo_size(stream->fifo));
+      void *planes[] = {pulse->mixBuffer};
+      if ((samples = av_audio_fifo_read(stream->fifo, planes, samples)) > 0) {
+         rsAudioMix(dest + offset, pulse->mixBuffer, stream->gain, samples);
+         stream->time += samples;
+      }
+   }
+}
+
+static int pulseDeviceMix(PulseDevice *pulse, AVFrame *frame) {
+   int ret;
+   int64_t start = INT64_MAX;
+   int64_t minEnd = INT64_MAX;
+   int64_t maxEnd = INT64_MIN;
+   for (int i = 0; i < pulse->streamCount; ++i) {
+      PulseStream *stream = &pulse->streams[i];
+      if (stream->time >= 0) {
+         int64_t end = stream->time + av_audio_fifo_size(stream->fifo);
+         start = FFMIN(start, stream->time);
+         minEnd = FFMIN(minEnd, end);
+         maxEnd = FFMAX(maxEnd, end);
+      }
+   }
+   if (maxEnd == INT64_MIN) {
+      return AVERROR(EAGAIN);
+   }
+   if (pulse->mixTime < 0) {
+      pulse->mixTime = start;
+   }
+
+   // Wait for every stream to catch up, unless one has stalled (such as a suspended
+   // source) in which case it is mixed in as silence
+   int64_t lag = (int64_t)(PULSE_MAX_LAG * rsConfig.audioSamplerate);
+   int64_t end = FFMAX(minEnd, maxEnd - lag);
+   if (end <= pulse->mixTime) {
+      return AVERROR(EAGAIN);
+   }
+
+   frame->nb_samples = (int)FFMIN(end - pulse->mixTime, pulse->mixSize);
+   frame->pts = pulse->mixTime;
+   if ((ret = rsFramePoolGet(&pulse->mixPool, frame)) < 0) {
+      return ret;
+   }
+   av_samples_set_silence(frame->extended_data, 0, frame->nb_samples, frame->channels,
+                          frame->format);
+   for (int i = 0; i < pulse->streamCount; ++i) {
+      float *dest = (float *)frame->extended_data[pulse->separate ? i : 0];
+      pulseDeviceMixStream(pulse, &pulse->streams[i], dest, frame->nb_samples);
+   }
+   pulse->mixTime += frame->nb_samples;
+   return 0;
+}
+
+static int pulseDeviceReadMix(PulseDevice *pulse, AVFrame *frame) {
+   int ret;
+   if ((ret = pulseDeviceServerCheck(pulse)) < 0) {
+      return ret;
+   }
+   for (int i = 0; i < pulse->streamCount; ++i) {
+      if ((ret = pulseDeviceFill(&pulse->streams[i])) < 0) {
+         return ret;
+      }
+   }
+   return pulseDeviceMix(pulse, frame);
+}
+
+static int64_t pulseDeviceThreadTime(void) {
+   struct timespec time;
+   if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) == -1) {
+      return 0;
+   }
+   return (int64_t)time.tv_sec * AV_TIME_BASE + time.tv_nsec / 1000;
+}
+
+static void pulseDeviceReport(PulseDevice *pulse) {
+   int64_t time = av_gettime_relative();
+   int64_t cpu = pulseDeviceThreadTime();
+   if (pulse->reportTime == 0) {
+      pulse->reportTime = time;
+      pulse->reportCPU = cpu;
+      pulse->wakeups = 0;
+      return;
+   }
+
+   int64_t elapsed = time - pulse->reportTime;
+   if (elapsed >= PULSE_REPORT_INTERVAL) {
+      av_log(NULL, AV_LOG_VERBOSE, "Audio thread: %.1f wakeups/s, %.2f%% CPU\n",
+             pulse->wakeups * (double)AV_TIME_BASE / (double)elapsed,
+             (double)(cpu - pulse->reportCPU) * 100.0 / (double)elapsed);
+      pulse->reportTime = time;
+      pulse->reportCPU = cpu;
+      pulse->wakeups = 0;
+   }
 }
 
 static int pulseDeviceNextFrame(RSDevice *device, AVFrame *frame) {
@@ -287,7 +541,15 @@ static int pulseDeviceNextFrame(RSDevice *device, AVFrame *frame) {
    frame->channels = device->params->channels;
    frame->channel_layout = device->params->channel_layout;
    frame->sample_rate = device->params->sample_rate;
-   while ((ret = pulseDeviceRead(pulse, frame)) == AVERROR(EAGAIN)) {
+   for (;;) {
+      if (pulse->direct) {
+         ret = pulseDeviceRead(pulse, frame);
+      } else {
+         ret = pulseDeviceReadMix(pulse, frame);
+      }
+      if (ret != AVERROR(EAGAIN)) {
+         break;
+      }
       if ((ret = pulseDeviceIterate(pulse)) < 0) {
          return ret;
       }
@@ -295,8 +557,65 @@ static int pulseDeviceNextFrame(RSDevice *device, AVFrame *frame) {
    if (ret < 0) {
       return ret;
    }
+
+   pulseDeviceReport(pulse);
    return 0;
 }
+
+static int pulseDeviceParseSources(PulseDevice *pulse) {
+   int ret;
+   char *sources = av_strdup(rsConfig.audioDevice);
+   if (sources == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto error;
+   }
+
+   // Sources are separated by commas and may end with @gain, eg. auto,mic@0.5
+   char *state;
+   for (char *source = av_strtok(sources, ",", &state); source != NULL;
+        source = av_strtok(NULL, ",", &state)) {
+      if (pulse->streamCount == RS_AUDIO_MAX_SOURCES) {
+         av_log(NULL, AV_LOG_ERROR, "Too many audio devices, at most %i are supported\n",
+                RS_AUDIO_MAX_SOURCES);
+         ret = AVERROR(EINVAL);
+         goto error;
+      }
+
+      PulseStream *stream = &pulse->streams[pulse->streamCount++];
+      stream->gain = 1.0f;
+      stream->time = -1;
+      char *at = strrchr(source, '@');
+      if (at != NULL) {
+         char *end;
+         *at = 0;
+         stream->gain = strtof(at + 1, &end);
+         if (end == at + 1 || *end != 0) {
+            av_log(NULL, AV_LOG_ERROR, "Invalid audio device gain: %s\n", at + 1);
+            ret = AVERROR(EINVAL);
+            goto error;
+         }
+      }
+
+      stream->automatic = strcmp(source, "auto") == 0;
+      if (!stream->automatic && strcmp(source, "system") != 0) {
+         stream->name = av_strdup(source);
+         if (stream->name == NULL) {
+            ret = AVERROR(ENOMEM);
+            goto error;
+         }
+      }
+   }
+   if (pulse->streamCount == 0) {
+      av_log(NULL, AV_LOG_ERROR, "No audio device specified\n");
+      ret = AVERROR(EINVAL);
+      goto error;
+   }
+
+   ret = 0;
+error:
+   av_freep(&sources);
+   return ret;
+}
 #endif
 
 int rsPulseDeviceCreate(RSDevice *device) {
@@ -318,6 +637,41 @@ int rsPulseDeviceCreate(RSDevice *device) {
       ret = AVERROR(ENOMEM);
       goto error;
    }
+   if ((ret = pulseDeviceParseSources(pulse)) < 0) {
+      goto error;
+   }
+
+   // A single source at unity gain can skip the mixer and go straight into the buffer
+   pulse->separate =
+       pulse->streamCount > 1 && rsConfig.audioTracks == RS_CONFIG_AUDIO_SEPARATE;
+   pulse->direct = pulse->streamCount == 1 && pulse->streams[0].gain == 1.0f;
+   if (pulse->separate) {
+      // Each source gets its own plane which is split into its own track
+      device->params->format = AV_SAMPLE_FMT_FLTP;
+      device->params->channels = pulse->streamCount;
+      device->params->channel_layout = 0;
+   }
+   if (!pulse->direct) {
+      pulse->mixTime = -1;
+      pulse->mixSize = rsConfig.audioSamplerate;
+      pulse->mixBuffer = av_malloc_array((size_t)pulse->mixSize, sizeof(float));
+      if (pulse->mixBuffer == NULL) {
+         ret = AVERROR(ENOMEM);
+         goto error;
+      }
+      if ((ret = rsAudioFramePoolCreate(&pulse->mixPool, device->params->format,
+                                        device->params->channels, pulse->mixSize)) < 0) {
+         goto error;
+      }
+      for (int i = 0; i < pulse->streamCount; ++i) {
+         pulse->streams[i].fifo =
+             av_audio_fifo_alloc(AV_SAMPLE_FMT_FLT, 1, rsConfig.audioSamplerate);
+         if (pulse->streams[i].fifo == NULL) {
+            ret = AVERROR(ENOMEM);
+            goto error;
+         }
+      }
+   }
 
    pulse->mainloop = pa_mainloop_new();
    if (pulse->mainloop == NULL) {
@@ -352,7 +706,16 @@ int rsPulseDeviceCreate(RSDevice *device) {
       }
    }
 
-   if (strcmp(rsConfig.audioDevice, "auto") == 0) {
+   int automatic = 0;
+   for (int i = 0; i < pulse->streamCount; ++i) {
+      PulseStream *stream = &pulse->streams[i];
+      if (stream->automatic) {
+         automatic = 1;
+      } else if ((ret = pulseDeviceStreamCreate(pulse, stream, stream->name)) < 0) {
+         goto error;
+      }
+   }
+   if (automatic) {
       if ((ret = pulseDeviceStreamAuto(pulse)) < 0) {
          goto error;
       }
@@ -363,14 +726,6 @@ int rsPulseDeviceCreate(RSDevice *device) {
       if ((ret = pulseDeviceWait(pulse, op)) < 0) {
          goto error;
       }
-   } else if (strcmp(rsConfig.audioDevice, "system") == 0) {
-      if ((ret = pulseDeviceStreamCreate(pulse, NULL)) < 0) {
-         goto error;
-      }
-   } else {
-      if ((ret = pulseDeviceStreamCreate(pulse, rsConfig.audioDevice)) < 0) {
-         goto error;
-      }
    }
 
    return 0;
@@ -19,7 +19,107 @@
 
 #include "buffer.h"
 #include "config.h"
+#include "encoder/encoder.h"
+#include "journal.h"
+#include "log.h"
+#include "memory.h"
+#include "pressure.h"
+#include "slab.h"
 #include "util.h"
+#include <libavutil/time.h>
+
+// Enough for a few seconds of video at the default settings, it grows from there
+#define BUFFER_SLAB_SIZE ((size_t)4 * 1024 * 1024)
+#define BUFFER_SEI_RECOVERY_POINT 6
+
+typedef struct BufferReader {
+   const uint8_t *data;
+   int size;
+   int pos;
+   int zeros;
+} BufferReader;
+
+// Reads a byte of a NAL unit's payload, skipping emulation prevention bytes
+static int bufferReadByte(BufferReader *reader) {
+   if (reader->pos >= reader->size) {
+      return -1;
+   }
+   int byte = reader->data[reader->pos++];
+   if (reader->zeros >= 2 && byte == 3) {
+      reader->zeros = 0;
+      if (reader->pos >= reader->size) {
+         return -1;
+      }
+      byte = reader->data[reader->pos++];
+   }
+   reader->zeros = byte == 0 ? reader->zeros + 1 : 0;
+   return byte;
+}
+
+static int bufferReadSEIValue(BufferReader *reader) {
+   int value = 0;
+   int byte;
+   while ((byte = bufferReadByte(reader)) == 0xFF) {
+      value += 0xFF;
+   }
+   return byte < 0 ? -1 : value + byte;
+}
+
+static int bufferSEIHasRecovery(const uint8_t *data, int size) {
+   BufferReader reader = {.data = data, .size = size};
+   // Stop at the RBSP trailing bits
+   while (reader.pos < reader.size && reader.data[reader.pos] != 0x80) {
+      int type = bufferReadSEIValue(&reader);
+      int length = bufferReadSEIValue(&reader);
+      if (type < 0 || length < 0) {
+         return 0;
+      }
+      if (type == BUFFER_SEI_RECOVERY_POINT) {
+         return 1;
+      }
+      for (int i = 0; i < length; ++i) {
+         if (bufferReadByte(&reader) < 0) {
+            return 0;
+         }
+      }
+   }
+   return 0;
+}
+
+// With intra refresh the encoder marks where a picture will be fully refreshed with a
+// recovery point SEI instead of an IDR frame
+static int bufferPacketHasRecovery(RSBuffer *buffer, const AVPacket *packet) {
+   int hevc = buffer->params->codec_id == AV_CODEC_ID_HEVC;
+   const uint8_t *data = packet->data;
+   const uint8_t *end = data + packet->size;
+   while (end - data > 3) {
+      if (data[0] != 0 || data[1] != 0 || data[2] != 1) {
+         ++data;
+         continue;
+      }
+      data += 3;
+      const uint8_t *next = data;
+      while (end - next > 3 && (next[0] != 0 || next[1] != 0 || next[2] != 1)) {
+         ++next;
+      }
+      if (end - next <= 3) {
+         next = end;
+      }
+
+      // SEI comes before the slices of an access unit so stop at the first slice
+      int header = hevc ? 2 : 1;
+      int type = hevc ? (data[0] >> 1) & 0x3F : data[0] & 0x1F;
+      if (hevc ? type < 32 : (type >= 1 && type <= 5)) {
+         return 0;
+      }
+      if ((hevc ? type == 39 : type == 6) && next - data > header &&
+          bufferSEIHasRecovery(data + header, (int)(next - data) - header)) {
+         return 1;
+      }
+      data = next;
+   }
+   return 0;
+}
 
 static RSPacketList *bufferPacketCreate(RSBuffer *buffer) {
    if (buffer->pool != NULL) {
@@ -49,6 +149,38 @@ error:
    return NULL;
 }
 
+static int bufferPacketCopy(RSBuffer *buffer, RSPacketList *plist, AVPacket *packet) {
+   int ret;
+   AVPacket *dest = plist->packet;
+   dest->buf = rsSlabAlloc(&buffer->slabs,
+                           (size_t)packet->size + AV_INPUT_BUFFER_PADDING_SIZE);
+   if (dest->buf == NULL) {
+      return AVERROR(ENOMEM);
+   }
+   if ((ret = av_packet_copy_props(dest, packet)) < 0) {
+      av_packet_unref(dest);
+      return ret;
+   }
+   dest->data = dest->buf->data;
+   dest->size = packet->size;
+   memcpy(dest->data, packet->data, (size_t)packet->size);
+   memset(dest->data + packet->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+   av_packet_unref(packet);
+   return 0;
+}
+
+// The stats have already been taken from it, keeping it would copy it for every packet
+static void bufferPacketDropStats(AVPacket *packet) {
+   for (int i = 0; i < packet->side_data_elems;) {
+      if (packet->side_data[i].type == AV_PKT_DATA_QUALITY_STATS) {
+         av_freep(&packet->side_data[i].data);
+         packet->side_data[i] = packet->side_data[--packet->side_data_elems];
+      } else {
+         ++i;
+      }
+   }
+}
+
 static void bufferPacketDestroy(RSBuffer *buffer, RSPacketList *plist) {
    av_packet_unref(plist->packet);
    plist->next = buffer->pool;
@@ -65,9 +197,201 @@ static RSPacketList *bufferPacketGetStart(RSBuffer *buffer) {
    return NULL;
 }
 
-int rsBufferCreate(RSBuffer *buffer) {
+static void bufferPoolFree(RSBuffer *buffer) {
+   RSPacketList *plist = buffer->pool;
+   while (plist != NULL) {
+      RSPacketList *next = plist->next;
+      av_packet_free(&plist->packet);
+      av_freep(&plist);
+      plist = next;
+   }
+   buffer->pool = NULL;
+}
+
+static int bufferPacketSegment(const RSBuffer *buffer, const AVPacket *packet) {
+   for (int i = 0; i < buffer->segmentCount; ++i) {
+      if (packet->pts < buffer->segments[i].end) {
+         return i;
+      }
+   }
+   return -1;
+}
+
+static void bufferSegmentPop(RSBuffer *buffer) {
+   avcodec_parameters_free(&buffer->segments[0].params);
+   --buffer->segmentCount;
+   memmove(buffer->segments, buffer->segments + 1,
+           (size_t)buffer->segmentCount * sizeof(RSBufferSegment));
+}
+
+static int bufferCanSynthesize(const RSEncoder *encoder) {
+   // The new frames come from a second software encoder with the same settings, the
+   // copied frames after it can only follow if they do not refer back past an IDR frame
+   // or reorder frames across the join
+   if (!rsVideoEncoderIsSoftware(encoder->type)) {
+      av_log(NULL, AV_LOG_WARNING, "Exact save start needs a software video encoder\n");
+      return 0;
+   }
+   if (encoder->params->video_delay > 0) {
+      av_log(NULL, AV_LOG_WARNING,
+             "Exact save start needs a video encoder without B-frames, try videoPreset = "
+             "fast\n");
+      return 0;
+   }
+   if (rsConfig.videoRefresh != RS_CONFIG_REFRESH_GOP) {
+      av_log(NULL, AV_LOG_WARNING, "Exact save start does not work with intra refresh\n");
+      return 0;
+   }
+   return 1;
+}
+
+static int bufferSynthesizeDrain(RSEncoder *encoder, RSOutput *output, int stream,
+                                 int64_t startTime, AVPacket *packet) {
+   int ret;
+   while ((ret = rsEncoderNextPacket(encoder, packet)) >= 0) {
+      packet->stream_index = stream;
+      packet->pts -= startTime;
+      packet->dts -= startTime;
+      if ((ret = rsOutputWrite(output, packet)) < 0) {
+         return ret;
+      }
+   }
+   return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static int bufferSynthesizeFrames(AVCodecContext *decoderCtx, RSEncoder *encoder,
+                                  RSOutput *output, int stream, int64_t startTime,
+                                  AVFrame *frame, AVPacket *packet, int *count) {
+   int ret;
+   while ((ret = avcodec_receive_frame(decoderCtx, frame)) >= 0) {
+      frame->pts = frame->best_effort_timestamp;
+      if (frame->pts < startTime) {
+         av_frame_unref(frame);
+         continue;
+      }
+      if ((ret = rsEncoderSendFrame(encoder, frame)) < 0) {
+         return ret;
+      }
+      ++*count;
+      if ((ret = bufferSynthesizeDrain(encoder, output, stream, startTime, packet)) < 0) {
+         return ret;
+      }
+   }
+   return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+// Decodes the GOP from the key-frame and re-encodes the frames from the start time up to
+// the next key-frame, which is returned so the rest can be copied as is
+static int bufferSynthesize(RSBuffer *buffer, RSOutput *output, int stream,
+                            RSPacketList **start, int64_t startTime) {
+   int ret;
+   int count = 0;
+   int64_t time = av_gettime_relative();
+   RSEncoder encoder = {0};
+   AVCodecParameters *input = NULL;
+   AVCodecContext *decoderCtx = NULL;
+   AVFrame *frame = av_frame_alloc();
+   AVPacket *packet = av_packet_alloc();
+   if (frame == NULL || packet == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto error;
+   }
+
+   const AVCodec *decoder = avcodec_find_decoder(buffer->params->codec_id);
+   if (decoder == NULL) {
+      av_log(NULL, AV_LOG_ERROR, "Decoder not found: %s\n",
+             avcodec_get_name(buffer->params->codec_id));
+      ret = AVERROR_DECODER_NOT_FOUND;
+      goto error;
+   }
+   decoderCtx = avcodec_alloc_context3(decoder);
+   if (decoderCtx == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto error;
+   }
+   if ((ret = avcodec_parameters_to_context(decoderCtx, buffer->params)) < 0) {
+      goto error;
+   }
+   decoderCtx->pkt_timebase = AV_TIME_BASE_Q;
+   if ((ret = avcodec_open2(decoderCtx, decoder, NULL)) < 0) {
+      av_log(decoderCtx, AV_LOG_ERROR, "Failed to open decoder: %s\n", av_err2str(ret));
+      goto error;
+   }
+   // The decoded frames are already in the encoder's format and size
+   input = rsParamsClone(buffer->input);
+   if (input == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto error;
+   }
+   input->format = buffer->params->format;
+   input->width = buffer->params->width;
+   input->height = buffer->params->height;
+   if ((ret = rsVideoEncoderCreateType(&encoder, input, NULL, buffer->encoderType)) < 0) {
+      goto error;
+   }
+
+   RSPacketList *plist = *start;
+   do {
+      if ((ret = av_packet_ref(packet, plist->packet)) < 0) {
+         goto error;
+      }
+      ret = avcodec_send_packet(decoderCtx, packet);
+      av_packet_unref(packet);
+      if (ret < 0) {
+         av_log(decoderCtx, AV_LOG_ERROR, "Failed to decode packet: %s\n",
+                av_err2str(ret));
+         goto error;
+      }
+      if ((ret = bufferSynthesizeFrames(decoderCtx, &encoder, output, stream, startTime,
+                                        frame, packet, &count)) < 0) {
+         goto error;
+      }
+      plist = plist->next;
+   } while (plist != NULL && !(plist->packet->flags & AV_PKT_FLAG_KEY));
+
+   if ((ret = avcodec_send_packet(decoderCtx, NULL)) < 0) {
+      goto error;
+   }
+   if ((ret = bufferSynthesizeFrames(decoderCtx, &encoder, output, stream, startTime,
+                                     frame, packet, &count)) < 0) {
+      goto error;
+   }
+   if ((ret = rsEncoderSendFrame(&encoder, NULL)) < 0) {
+      goto error;
+   }
+   if ((ret = bufferSynthesizeDrain(&encoder, output, stream, startTime, packet)) < 0) {
+      goto error;
+   }
+
+   av_log(NULL, AV_LOG_VERBOSE, "Re-encoded %i frames for the save start in %.1fms\n",
+          count, (double)(av_gettime_relative() - time) / 1000.0);
+   *start = plist;
+   ret = 0;
+error:
+   rsEncoderDestroy(&encoder);
+   avcodec_parameters_free(&input);
+   avcodec_free_context(&decoderCtx);
+   av_packet_free(&packet);
+   av_frame_free(&frame);
+   return ret;
+}
+
+int rsBufferCreate(RSBuffer *buffer, const RSEncoder *encoder,
+                   const AVCodecParameters *input) {
    rsClear(buffer, sizeof(RSBuffer));
-   return 0;
+   buffer->seconds = rsPressureGetSeconds();
+   buffer->params = rsParamsClone(encoder->params);
+   buffer->input = rsParamsClone(input);
+   if (buffer->params == NULL || buffer->input == NULL) {
+      return AVERROR(ENOMEM);
+   }
+   buffer->encoderType = encoder->type;
+   buffer->exact = rsConfig.videoSaveStart == RS_CONFIG_START_EXACT &&
+                   bufferCanSynthesize(encoder);
+   buffer->segmentStart = INT64_MIN;
+   rsSlabPoolCreate(&buffer->slabs, BUFFER_SLAB_SIZE);
+   rsJournalSetParams(encoder->params);
+   return rsStatsCreate(&buffer->stats, rsConfig.recordSeconds * rsConfig.videoFramerate);
 }
 
 void rsBufferDestroy(RSBuffer *buffer) {
@@ -78,24 +402,68 @@ void rsBufferDestroy(RSBuffer *buffer) {
       plist = next;
    }
    buffer->tail = NULL;
-
-   plist = buffer->pool;
-   while (plist != NULL) {
-      RSPacketList *next = plist->next;
-      av_packet_free(&plist->packet);
-      av_freep(&plist);
-      plist = next;
+   bufferPoolFree(buffer);
+   rsSlabPoolDestroy(&buffer->slabs);
+   while (buffer->segmentCount > 0) {
+      bufferSegmentPop(buffer);
    }
-   buffer->pool = NULL;
+   avcodec_parameters_free(&buffer->params);
+   avcodec_parameters_free(&buffer->input);
+   rsStatsDestroy(&buffer->stats);
 }
 
 int rsBufferAddPacket(RSBuffer *buffer, AVPacket *packet) {
+   // Treat recovery points like key-frames so saves can start at them and the muxer marks
+   // them as sync samples
+   if (rsConfig.videoRefresh == RS_CONFIG_REFRESH_INTRA &&
+       !(packet->flags & AV_PKT_FLAG_KEY) &&
+       (buffer->params->codec_id == AV_CODEC_ID_H264 ||
+        buffer->params->codec_id == AV_CODEC_ID_HEVC) &&
+       bufferPacketHasRecovery(buffer, packet)) {
+      packet->flags |= AV_PKT_FLAG_KEY;
+   }
+
+   // A re-created encoder can start with a DTS before the last one of the old encoder. A
+   // split segment is saved as its own stream so its timestamps are left alone, otherwise
+   // the muxer needs the DTS to keep increasing and the PTS cannot come before it.
+   int split = buffer->segmentStart == INT64_MAX && buffer->segmentCount > 0 &&
+               buffer->segments[buffer->segmentCount - 1].end == INT64_MAX;
+   if (buffer->head != NULL && !split && packet->dts <= buffer->head->packet->dts) {
+      int64_t dts = packet->dts;
+      int64_t pts = packet->pts;
+      packet->dts = buffer->head->packet->dts + 1;
+      packet->pts = FFMAX(packet->pts, packet->dts);
+      RS_LOG_LIMITED(NULL, AV_LOG_WARNING,
+                     "Moved video packet DTS forward by %" PRIi64 " and PTS by %" PRIi64
+                     "\n",
+                     packet->dts - dts, packet->pts - pts);
+   }
+   if (buffer->segmentStart == INT64_MAX) {
+      buffer->segmentStart = packet->pts;
+      if (buffer->segmentCount > 0 &&
+          buffer->segments[buffer->segmentCount - 1].end == INT64_MAX) {
+         buffer->segments[buffer->segmentCount - 1].end = packet->pts;
+      }
+   }
+
+   rsStatsAdd(&buffer->stats, packet);
+   bufferPacketDropStats(packet);
+   rsJournalAdd(packet);
    RSPacketList *plist = bufferPacketCreate(buffer);
    if (plist == NULL) {
       av_packet_unref(packet);
       return AVERROR(ENOMEM);
    }
-   av_packet_move_ref(plist->packet, packet);
+   if (rsConfig.bufferMemory & RS_CONFIG_MEMORY_LOCK) {
+      int ret;
+      if ((ret = bufferPacketCopy(buffer, plist, packet)) < 0) {
+         av_packet_unref(packet);
+         bufferPacketDestroy(buffer, plist);
+         return ret;
+      }
+   } else {
+      av_packet_move_ref(plist->packet, packet);
+   }
 
    if (buffer->head == NULL) {
       buffer->tail = plist;
@@ -105,26 +473,219 @@ int rsBufferAddPacket(RSBuffer *buffer, AVPacket *packet) {
       buffer->head = plist;
    }
 
-   int64_t startTime = plist->packet->pts - rsConfig.recordSeconds * AV_TIME_BASE;
+   int seconds = rsPressureGetSeconds();
+   int64_t startTime = plist->packet->pts - seconds * AV_TIME_BASE;
+   RSPacketList *keep = NULL;
+   if (buffer->exact) {
+      // The key-frame before the start time is still needed to decode from
+      for (RSPacketList *key = buffer->tail; key != NULL && key->packet->pts <= startTime;
+           key = key->next) {
+         if (key->packet->flags & AV_PKT_FLAG_KEY) {
+            keep = key;
+         }
+      }
+   }
    RSPacketList *remove = buffer->tail;
-   while (remove != NULL && remove->packet->pts < startTime) {
+   while (remove != keep && remove->packet->pts < startTime) {
       RSPacketList *next = remove->next;
       bufferPacketDestroy(buffer, remove);
       remove = next;
    }
    buffer->tail = remove;
+   while (buffer->segmentCount > 0 && buffer->tail->packet->pts >= buffer->segments[0].end) {
+      bufferSegmentPop(buffer);
+   }
+
+   // After shrinking, drop the partial GOP at the start which could never be saved and give
+   // the trimmed packets back instead of keeping them in the pool
+   if (seconds < buffer->seconds) {
+      RSPacketList *key = buffer->tail;
+      while (key != NULL && !(key->packet->flags & AV_PKT_FLAG_KEY)) {
+         key = key->next;
+      }
+      while (key != NULL && buffer->tail != key) {
+         RSPacketList *next = buffer->tail->next;
+         bufferPacketDestroy(buffer, buffer->tail);
+         buffer->tail = next;
+      }
+      bufferPoolFree(buffer);
+      av_log(NULL, AV_LOG_VERBOSE, "Video buffer shrunk to %is\n", seconds);
+   } else if (seconds > buffer->seconds) {
+      av_log(NULL, AV_LOG_VERBOSE, "Video buffer growing to %is\n", seconds);
+   }
+   buffer->seconds = seconds;
+   return 0;
+}
+
+static int bufferGetHeaders(const AVCodecParameters *params, const uint8_t **headers,
+                            int *size) {
+   const uint8_t *data = params->extradata;
+   *headers = data;
+   *size = params->extradata_size;
+   if (*size == 0) {
+      return 1;
+   }
+   switch (params->codec_id) {
+   case AV_CODEC_ID_H264:
+   case AV_CODEC_ID_HEVC:
+      // Only Annex B parameter sets can be put in front of the packet data as is
+      return *size >= 4 && data[0] == 0 && data[1] == 0 &&
+             (data[2] == 1 || (data[2] == 0 && data[3] == 1));
+   case AV_CODEC_ID_AV1:
+      // Skip the AV1CodecConfigurationRecord header to get to the sequence header OBU
+      if (data[0] == 0x81) {
+         *headers += 4;
+         *size -= 4;
+      }
+      return *size >= 0;
+   default:
+      return 0;
+   }
+}
+
+static int bufferPacketPrepend(RSBuffer *buffer, AVPacket *packet, const uint8_t *data,
+                               int size) {
+   int ret;
+   AVPacket *copy = av_packet_alloc();
+   if (copy == NULL) {
+      return AVERROR(ENOMEM);
+   }
+   if (rsConfig.bufferMemory & RS_CONFIG_MEMORY_LOCK) {
+      // Keep it in the locked slabs like the packet it replaces
+      copy->size = size + packet->size;
+      copy->buf = rsSlabAlloc(&buffer->slabs,
+                              (size_t)copy->size + AV_INPUT_BUFFER_PADDING_SIZE);
+      if (copy->buf == NULL) {
+         ret = AVERROR(ENOMEM);
+         goto error;
+      }
+      copy->data = copy->buf->data;
+      memset(copy->data + copy->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+   } else if ((ret = av_new_packet(copy, size + packet->size)) < 0) {
+      goto error;
+   }
+   if ((ret = av_packet_copy_props(copy, packet)) < 0) {
+      goto error;
+   }
+   memcpy(copy->data, data, (size_t)size);
+   memcpy(copy->data + size, packet->data, (size_t)packet->size);
+   av_packet_unref(packet);
+   av_packet_move_ref(packet, copy);
+
+   ret = 0;
+error:
+   av_packet_free(&copy);
+   return ret;
+}
+
+int rsBufferSetEncoder(RSBuffer *buffer, const RSEncoder *encoder,
+                       const AVCodecParameters *input) {
+   int ret;
+   const AVCodecParameters *params = encoder->params;
+   const AVCodecParameters *old = buffer->params;
+   const uint8_t *headers;
+   int size;
+   int split = 0;
+   int same = old->extradata_size == params->extradata_size &&
+              (old->extradata_size == 0 ||
+               memcmp(old->extradata, params->extradata, (size_t)old->extradata_size) == 0);
+   if (buffer->tail == NULL) {
+      // Nothing to keep
+   } else if (old->codec_id != params->codec_id || !bufferGetHeaders(old, &headers, &size)) {
+      // The old packets cannot be decoded with the new parameters so they get saved as
+      // their own stream
+      split = 1;
+   } else if (!same && size > 0) {
+      // Every GOP of the old segment carries its own parameter sets in-band so the
+      // decoder switches over when the segments join in the middle of a save
+      int count = 0;
+      for (RSPacketList *plist = buffer->tail; plist != NULL; plist = plist->next) {
+         AVPacket *packet = plist->packet;
+         if (packet->pts >= buffer->segmentStart && (packet->flags & AV_PKT_FLAG_KEY)) {
+            if ((ret = bufferPacketPrepend(buffer, packet, headers, size)) < 0) {
+               return ret;
+            }
+            ++count;
+         }
+      }
+      av_log(NULL, AV_LOG_VERBOSE, "Video buffer segment has %i in-band headers\n",
+             count);
+   }
+
+   AVCodecParameters *clone = rsParamsClone(params);
+   AVCodecParameters *inputClone = rsParamsClone(input);
+   if (clone == NULL || inputClone == NULL) {
+      avcodec_parameters_free(&clone);
+      avcodec_parameters_free(&inputClone);
+      return AVERROR(ENOMEM);
+   }
+   if (split) {
+      if (buffer->segmentCount == RS_BUFFER_MAX_SEGMENTS) {
+         int64_t end = buffer->segments[0].end;
+         while (buffer->tail != NULL && buffer->tail->packet->pts < end) {
+            RSPacketList *next = buffer->tail->next;
+            bufferPacketDestroy(buffer, buffer->tail);
+            buffer->tail = next;
+         }
+         bufferSegmentPop(buffer);
+      }
+      buffer->segments[buffer->segmentCount++] = (RSBufferSegment){
+          .params = buffer->params,
+          .end = INT64_MAX,
+      };
+      av_log(NULL, AV_LOG_INFO, "Keeping %s video as a separate segment\n",
+             avcodec_get_name(old->codec_id));
+   } else {
+      avcodec_parameters_free(&buffer->params);
+   }
+   buffer->params = clone;
+   avcodec_parameters_free(&buffer->input);
+   buffer->input = inputClone;
+   buffer->encoderType = encoder->type;
+   buffer->exact = rsConfig.videoSaveStart == RS_CONFIG_START_EXACT &&
+                   bufferCanSynthesize(encoder);
+   buffer->segmentStart = INT64_MAX;
+   rsJournalSetParams(params);
    return 0;
 }
 
+static int64_t bufferGetStartTime(RSBuffer *buffer, RSPacketList **start) {
+   *start = bufferPacketGetStart(buffer);
+   if (*start == NULL) {
+      return AVERROR(EAGAIN);
+   }
+   // Only the newest segment can be re-encoded
+   if (!buffer->exact || bufferPacketSegment(buffer, (*start)->packet) >= 0) {
+      return (*start)->packet->pts;
+   }
+
+   int64_t startTime = buffer->head->packet->pts - buffer->seconds * AV_TIME_BASE;
+   startTime = FFMAX(startTime, (*start)->packet->pts);
+   for (RSPacketList *key = *start; key != NULL && key->packet->pts <= startTime;
+        key = key->next) {
+      if (key->packet->flags & AV_PKT_FLAG_KEY) {
+         *start = key;
+      }
+   }
+   return startTime;
+}
+
 int64_t rsBufferGetStartTime(RSBuffer *buffer) {
-   RSPacketList *start = bufferPacketGetStart(buffer);
+   RSPacketList *start;
+   return bufferGetStartTime(buffer, &start);
+}
+
+int rsBufferGetFirstSegment(RSBuffer *buffer) {
+   RSPacketList *start;
+   bufferGetStartTime(buffer, &start);
    if (start == NULL) {
-      return AVERROR(EAGAIN);
+      return buffer->segmentCount;
    }
-   return start->packet->pts;
+   int segment = bufferPacketSegment(buffer, start->packet);
+   return segment < 0 ? buffer->segmentCount : segment;
 }
 
-int rsBufferWrite(RSBuffer *buffer, RSOutput *output, int stream) {
+int rsBufferWrite(RSBuffer *buffer, RSOutput *output, int stream, int segmentStream) {
    int ret;
    AVPacket *packet = av_packet_alloc();
    if (packet == NULL) {
@@ -132,25 +693,45 @@ int rsBufferWrite(RSBuffer *buffer, RSOutput *output, int stream) {
       goto error;
    }
 
-   RSPacketList *start = bufferPacketGetStart(buffer);
+   RSPacketList *start;
+   int64_t startTime = bufferGetStartTime(buffer, &start);
    if (start == NULL) {
-      ret = AVERROR(EAGAIN);
+      ret = (int)startTime;
       goto error;
    }
+   if (startTime > start->packet->pts) {
+      if ((ret = bufferSynthesize(buffer, output, stream, &start, startTime)) < 0) {
+         goto error;
+      }
+   }
+
+   int firstSegment = rsBufferGetFirstSegment(buffer);
    for (RSPacketList *plist = start; plist != NULL; plist = plist->next) {
       if ((ret = av_packet_ref(packet, plist->packet)) < 0) {
          goto error;
       }
 
-      packet->stream_index = stream;
-      packet->pts -= start->packet->pts;
-      packet->dts -= start->packet->pts;
+      int segment = bufferPacketSegment(buffer, packet);
+      packet->stream_index = segment < 0 ? stream : segmentStream + segment - firstSegment;
+      packet->pts -= startTime;
+      packet->dts -= startTime;
       if ((ret = rsOutputWrite(output, packet)) < 0) {
          goto error;
       }
    }
 
-   return 0;
+   // Everything kept in the buffer, including what came before the start
+   int count = 0;
+   int64_t size = 0;
+   for (RSPacketList *plist = buffer->tail; plist != NULL; plist = plist->next) {
+      ++count;
+      size += plist->packet->size;
+   }
+   av_log(NULL, AV_LOG_VERBOSE, "Video buffer holds %i packets, %.1f MiB\n", count,
+          (double)size / (1024.0 * 1024.0));
+   rsStatsLog(&buffer->stats, (int64_t)buffer->seconds * AV_TIME_BASE);
+
+   ret = 0;
 error:
    av_packet_free(&packet);
    return ret;
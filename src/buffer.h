@@ -19,8 +19,11 @@
 
 #ifndef RS_STREAM_H
 #define RS_STREAM_H
+#include "encoder/encoder.h"
 #include "output.h"
 #include "rsbuild.h"
+#include "slab.h"
+#include "stats.h"
 #include <libavcodec/avcodec.h>
 
 typedef struct RSPacketList {
@@ -28,16 +31,47 @@ typedef struct RSPacketList {
    AVPacket *packet;
 } RSPacketList;
 
+#define RS_BUFFER_MAX_SEGMENTS 4
+
+// Packets from an older encoder with a different codec, saved as their own stream
+typedef struct RSBufferSegment {
+   AVCodecParameters *params;
+   // Packets from this time on belong to the next segment
+   int64_t end;
+} RSBufferSegment;
+
 typedef struct RSBuffer {
    RSPacketList *pool;
    RSPacketList *tail;
    RSPacketList *head;
+   // Locked memory the packet data is copied into
+   RSSlabPool slabs;
+   int seconds;
+   AVCodecParameters *params;
+   // The live encoder's backend and the frames it was created for, so the start of a save
+   // is re-encoded by the same backend with the same settings
+   int encoderType;
+   AVCodecParameters *input;
+   // Saves start exactly at the requested time by re-encoding the start of the first GOP
+   int exact;
+   // Packets before this time came from an older encoder
+   int64_t segmentStart;
+   RSBufferSegment segments[RS_BUFFER_MAX_SEGMENTS];
+   int segmentCount;
+   RSStats stats;
 } RSBuffer;
 
-int rsBufferCreate(RSBuffer *buffer);
+int rsBufferCreate(RSBuffer *buffer, const RSEncoder *encoder,
+                   const AVCodecParameters *input);
 void rsBufferDestroy(RSBuffer *buffer);
 int rsBufferAddPacket(RSBuffer *buffer, AVPacket *packet);
+// Starts a new segment after the encoder has been re-created
+int rsBufferSetEncoder(RSBuffer *buffer, const RSEncoder *encoder,
+                       const AVCodecParameters *input);
 int64_t rsBufferGetStartTime(RSBuffer *buffer);
-int rsBufferWrite(RSBuffer *buffer, RSOutput *output, int stream);
+// The first older segment that still has packets to save, this and every segment after it
+// need their own output stream
+int rsBufferGetFirstSegment(RSBuffer *buffer);
+int rsBufferWrite(RSBuffer *buffer, RSOutput *output, int stream, int segmentStream);
 
 #endif
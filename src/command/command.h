@@ -19,9 +19,20 @@
 
 #ifndef RS_COMMAND_H
 #define RS_COMMAND_H
+#include "../device/device.h"
+#include "../socket.h"
+
+typedef int (*RSKmsDeviceFunction)(RSDevice *device, const char *deviceName,
+                                   int framerate);
 
 int rsKmsDevices(void);
 int rsKmsService(void);
+// Serves clients on an already bound socket until stopped, creating each capture with
+// the given function
+int rsKmsServiceRun(RSSocket *sock, RSKmsDeviceFunction create);
+// Stops the service within a second
+void rsKmsServiceStop(void);
 int rsControlSave(void);
+int rsJournalWatchdog(int argc, char *argv[]);
 
 #endif
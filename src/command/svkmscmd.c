@@ -18,17 +18,64 @@
  */
 
 #include "../device/device.h"
+#include "../event.h"
 #include "../socket.h"
+#include "../thread.h"
+#include "../util.h"
 #include "command.h"
 #include "rsbuild.h"
 #include <libavutil/avutil.h>
 #include <libavutil/hwcontext_drm.h>
+#include <libavutil/time.h>
 #include <signal.h>
 #ifdef RS_BUILD_POSIX_IO_FOUND
 #include <sys/stat.h>
 #endif
 
+#define KMS_MAX_CAPTURES 8
+#define KMS_MAX_CLIENTS 8
+#define KMS_QUEUE_SIZE 4
+
+typedef struct KmsBuffer {
+#ifdef RS_BUILD_POSIX_IO_FOUND
+   dev_t device;
+   ino_t inode;
+#endif
+   int used;
+} KmsBuffer;
+
+typedef struct KmsQueued {
+   AVFrame *frame;
+   int64_t pts;
+   int buffer;
+} KmsQueued;
+
+typedef struct KmsClient {
+   RSSocket sock;
+   int known[RS_SERVICE_DEVICE_MAX_BUFFERS];
+   KmsQueued queue[KMS_QUEUE_SIZE];
+   int queueStart;
+   int queueSize;
+   int64_t skipped;
+} KmsClient;
+
+typedef struct KmsCapture {
+   char *deviceName;
+   int framerate;
+   RSDevice device;
+   AVFrame *frame;
+   KmsBuffer buffers[RS_SERVICE_DEVICE_MAX_BUFFERS];
+   int nextBuffer;
+   KmsClient *clients[KMS_MAX_CLIENTS];
+   int clientCount;
+   int running;
+   RSMutex mutex;
+   RSThread thread;
+} KmsCapture;
+
 static volatile sig_atomic_t running = 1;
+static KmsCapture *captures[KMS_MAX_CAPTURES];
+static RSKmsDeviceFunction deviceCreate = NULL;
 
 static void kmsSignal(int sig) {
    av_log(NULL, AV_LOG_INFO, "\nExiting...\n");
@@ -36,75 +83,392 @@ static void kmsSignal(int sig) {
    signal(sig, SIG_DFL);
 }
 
-static int kmsConnection(RSSocket *sock) {
+static int kmsBufferFind(KmsBuffer *buffers, int *next, int fd, int *found) {
+   KmsBuffer key = {.used = 1};
+#ifdef RS_BUILD_POSIX_IO_FOUND
+   struct stat info;
+   if (fstat(fd, &info) == -1) {
+      int ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_ERROR, "Failed to stat frame buffer: %s\n", av_err2str(ret));
+      return ret;
+   }
+   key.device = info.st_dev;
+   key.inode = info.st_ino;
+   for (int i = 0; i < RS_SERVICE_DEVICE_MAX_BUFFERS; ++i) {
+      if (buffers[i].used && buffers[i].device == key.device &&
+          buffers[i].inode == key.inode) {
+         *found = 1;
+         return i;
+      }
+   }
+#else
+   (void)fd;
+#endif
+
+   // Scanout buffers are reused so this should only happen for the first few frames
+   int index = *next;
+   *next = (index + 1) % RS_SERVICE_DEVICE_MAX_BUFFERS;
+   buffers[index] = key;
+   *found = 0;
+   return index;
+}
+
+static void kmsClientDestroy(KmsClient **client) {
+   if (*client != NULL) {
+      for (int i = 0; i < KMS_QUEUE_SIZE; ++i) {
+         av_frame_free(&(*client)->queue[i].frame);
+      }
+      rsSocketDestroy(&(*client)->sock);
+      av_freep(client);
+   }
+}
+
+static int kmsClientCreate(KmsClient **client) {
+   *client = av_mallocz(sizeof(KmsClient));
+   if (*client == NULL) {
+      return AVERROR(ENOMEM);
+   }
+   for (int i = 0; i < KMS_QUEUE_SIZE; ++i) {
+      (*client)->queue[i].frame = av_frame_alloc();
+      if ((*client)->queue[i].frame == NULL) {
+         kmsClientDestroy(client);
+         return AVERROR(ENOMEM);
+      }
+   }
+   return 0;
+}
+
+static int kmsClientPush(KmsClient *client, const AVFrame *frame, int64_t pts,
+                         int buffer) {
    int ret;
-   RSServiceDeviceInfo info;
-   char *deviceName = NULL;
-   RSDevice device = {0};
-   AVFrame *frame = av_frame_alloc();
-   if (frame == NULL) {
-      ret = AVERROR(ENOMEM);
-      goto error;
+   if (client->queueSize == KMS_QUEUE_SIZE) {
+      // The client is not keeping up, drop its oldest frame rather than stall the rest
+      av_frame_unref(client->queue[client->queueStart].frame);
+      client->queueStart = (client->queueStart + 1) % KMS_QUEUE_SIZE;
+      --client->queueSize;
+      ++client->skipped;
+   }
+
+   int index = (client->queueStart + client->queueSize) % KMS_QUEUE_SIZE;
+   KmsQueued *queued = &client->queue[index];
+   if (frame != NULL) {
+      if ((ret = av_frame_ref(queued->frame, frame)) < 0) {
+         return ret;
+      }
    }
-   if ((ret = rsSocketReceive(sock, sizeof(info), &info, 0, NULL)) < 0) {
+   queued->pts = pts;
+   queued->buffer = buffer;
+   ++client->queueSize;
+   return 0;
+}
+
+static void kmsClientForget(KmsClient *client, int buffer) {
+   // Queued frames from the buffer that used to be in this slot would be sent with its fds
+   // and mark the slot as known before the new buffer's frame went out
+   int size = 0;
+   for (int i = 0; i < client->queueSize; ++i) {
+      KmsQueued *queued = &client->queue[(client->queueStart + i) % KMS_QUEUE_SIZE];
+      if (queued->pts >= 0 && queued->buffer == buffer) {
+         av_frame_unref(queued->frame);
+         ++client->skipped;
+         continue;
+      }
+      KmsQueued *dest = &client->queue[(client->queueStart + size) % KMS_QUEUE_SIZE];
+      if (dest != queued) {
+         KmsQueued swap = *dest;
+         *dest = *queued;
+         *queued = swap;
+      }
+      ++size;
+   }
+   client->queueSize = size;
+   client->known[buffer] = 0;
+}
+
+static int kmsClientFlush(KmsClient *client) {
+   int ret;
+   RSServiceDeviceFrame msg;
+   while (client->queueSize > 0) {
+      KmsQueued *queued = &client->queue[client->queueStart];
+      int objects[AV_DRM_MAX_PLANES];
+      size_t objectCount = 0;
+      rsClear(&msg, sizeof(msg));
+      msg.pts = queued->pts;
+      msg.buffer = queued->buffer;
+      if (queued->pts >= 0) {
+         AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)queued->frame->data[0];
+         msg.desc = *desc;
+         if (!client->known[queued->buffer]) {
+            objectCount = (size_t)desc->nb_objects;
+            for (int i = 0; i < desc->nb_objects; ++i) {
+               objects[i] = desc->objects[i].fd;
+            }
+         }
+      }
+      if ((ret = rsSocketSend(&client->sock, sizeof(msg), &msg, objectCount, objects)) <
+          0) {
+         return ret == AVERROR(EAGAIN) ? 0 : ret;
+      }
+
+      if (objectCount > 0) {
+         client->known[queued->buffer] = 1;
+      }
+      av_frame_unref(queued->frame);
+      client->queueStart = (client->queueStart + 1) % KMS_QUEUE_SIZE;
+      --client->queueSize;
+   }
+   return 0;
+}
+
+static void kmsCaptureSend(KmsCapture *capture, int error) {
+   int ret;
+   int found = 1;
+   int buffer = -1;
+   int64_t pts = error;
+   if (error >= 0) {
+      AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)capture->frame->data[0];
+      pts = capture->frame->pts;
+      if ((buffer = kmsBufferFind(capture->buffers, &capture->nextBuffer,
+                                  desc->objects[0].fd, &found)) < 0) {
+         pts = buffer;
+      }
+   }
+
+   for (int i = 0; i < capture->clientCount;) {
+      KmsClient *client = capture->clients[i];
+      if (!found) {
+         kmsClientForget(client, buffer);
+      }
+      if ((ret = kmsClientPush(client, pts < 0 ? NULL : capture->frame, pts, buffer)) >=
+          0) {
+         ret = kmsClientFlush(client);
+      }
+      if (ret < 0) {
+         av_log(NULL, AV_LOG_INFO, "Client disconnected: %s (%" PRIi64 " frames skipped)\n",
+                av_err2str(ret), client->skipped);
+         kmsClientDestroy(&capture->clients[i]);
+         capture->clients[i] = capture->clients[--capture->clientCount];
+      } else {
+         ++i;
+      }
+   }
+}
+
+static void *kmsCaptureThread(void *extra) {
+   int ret;
+   KmsCapture *capture = extra;
+   while (rsAtomicLoad(&capture->running) && running) {
+      ret = rsDeviceNextFrame(&capture->device, capture->frame);
+      rsMutexLock(&capture->mutex);
+      kmsCaptureSend(capture, ret);
+      if (capture->clientCount == 0) {
+         // Checked under the lock so new clients never join a capture that is stopping
+         rsAtomicStore(&capture->running, 0);
+      }
+      rsMutexUnlock(&capture->mutex);
+      av_frame_unref(capture->frame);
+   }
+
+   av_log(NULL, AV_LOG_INFO, "Stopped capturing %s at %i FPS\n", capture->deviceName,
+          capture->framerate);
+   return NULL;
+}
+
+static void kmsCaptureDestroy(KmsCapture **capture) {
+   if (*capture != NULL) {
+      rsAtomicStore(&(*capture)->running, 0);
+      rsThreadDestroy(&(*capture)->thread);
+      for (int i = 0; i < (*capture)->clientCount; ++i) {
+         kmsClientDestroy(&(*capture)->clients[i]);
+      }
+      rsMutexDestroy(&(*capture)->mutex);
+      av_frame_free(&(*capture)->frame);
+      rsDeviceDestroy(&(*capture)->device);
+      av_freep(&(*capture)->deviceName);
+      av_freep(capture);
+   }
+}
+
+static int kmsCaptureCreate(KmsCapture **capture, const char *deviceName,
+                            int framerate) {
+   int ret;
+   *capture = av_mallocz(sizeof(KmsCapture));
+   if (*capture == NULL) {
+      ret = AVERROR(ENOMEM);
       goto error;
    }
 
-   deviceName = av_mallocz((size_t)(info.deviceLength + 1));
-   if (deviceName == NULL) {
+   KmsCapture *cap = *capture;
+   cap->deviceName = av_strdup(deviceName);
+   cap->framerate = framerate;
+   cap->frame = av_frame_alloc();
+   if (cap->deviceName == NULL || cap->frame == NULL) {
       ret = AVERROR(ENOMEM);
       goto error;
    }
-   if ((ret = rsSocketReceive(sock, info.deviceLength, deviceName, 0, NULL)) < 0) {
+   if ((ret = rsMutexCreate(&cap->mutex)) < 0) {
       goto error;
    }
 
-   av_log(NULL, AV_LOG_INFO, "Framerate = %i, Device = %s\n", info.framerate, deviceName);
-   if ((ret = rsKmsDeviceCreate(&device, deviceName, info.framerate)) < 0) {
+   av_log(NULL, AV_LOG_INFO, "Capturing %s at %i FPS\n", deviceName, framerate);
+   if ((ret = deviceCreate(&cap->device, deviceName, framerate)) < 0) {
+      goto error;
+   }
+
+   rsAtomicStore(&cap->running, 1);
+   return 0;
+error:
+   kmsCaptureDestroy(capture);
+   return ret;
+}
+
+static int kmsCaptureAddClient(KmsCapture *capture, KmsClient *client) {
+   int ret;
+   rsMutexLock(&capture->mutex);
+   if (!rsAtomicLoad(&capture->running)) {
+      ret = AVERROR(EAGAIN);
+      goto error;
+   }
+   if (capture->clientCount == KMS_MAX_CLIENTS) {
+      av_log(NULL, AV_LOG_ERROR, "Too many clients for %s\n", capture->deviceName);
+      ret = AVERROR(ENOSPC);
       goto error;
    }
 
-   AVHWFramesContext *hwFramesCtx = (AVHWFramesContext *)device.hwFrames->data;
+   // Only tell the client about the capture once it can no longer stop without it
+   AVHWFramesContext *hwFramesCtx = (AVHWFramesContext *)capture->device.hwFrames->data;
    AVDRMDeviceContext *drmDeviceCtx = hwFramesCtx->device_ctx->hwctx;
-   if ((ret = rsSocketSend(sock, sizeof(AVCodecParameters), device.params, 1,
-                           &drmDeviceCtx->fd)) < 0) {
+   if ((ret = rsSocketSend(&client->sock, sizeof(AVCodecParameters),
+                           capture->device.params, 1, &drmDeviceCtx->fd)) < 0) {
+      goto error;
+   }
+   if ((ret = rsSocketSetNonBlocking(&client->sock)) < 0) {
       goto error;
    }
+   capture->clients[capture->clientCount++] = client;
 
-   while (running) {
-      int64_t pts;
-      if ((ret = rsDeviceNextFrame(&device, frame)) < 0) {
-         pts = ret;
-      } else {
-         pts = frame->pts;
+   ret = 0;
+error:
+   rsMutexUnlock(&capture->mutex);
+   return ret;
+}
+
+static int kmsCaptureJoin(KmsClient *client, const char *deviceName, int framerate) {
+   int ret;
+   KmsCapture **capture = NULL;
+   for (int i = 0; i < KMS_MAX_CAPTURES; ++i) {
+      KmsCapture *cap = captures[i];
+      if (cap != NULL && cap->framerate == framerate &&
+          strcmp(cap->deviceName, deviceName) == 0) {
+         if ((ret = kmsCaptureAddClient(cap, client)) != AVERROR(EAGAIN)) {
+            return ret;
+         }
+         // The capture stopped since the last reap, start a fresh one in its place
+         kmsCaptureDestroy(&captures[i]);
+         capture = &captures[i];
+         break;
       }
-      if ((ret = rsSocketSend(sock, sizeof(int64_t), &pts, 0, NULL)) < 0) {
-         goto error;
+   }
+   if (capture == NULL) {
+      for (int i = 0; i < KMS_MAX_CAPTURES; ++i) {
+         if (captures[i] == NULL || !rsAtomicLoad(&captures[i]->running)) {
+            kmsCaptureDestroy(&captures[i]);
+            capture = &captures[i];
+            break;
+         }
       }
-      if (pts < 0) {
-         continue;
+      if (capture == NULL) {
+         av_log(NULL, AV_LOG_ERROR, "Too many active captures\n");
+         return AVERROR(ENOSPC);
       }
+   }
 
-      int objects[AV_DRM_MAX_PLANES];
-      AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
-      for (int i = 0; i < desc->nb_objects; ++i) {
-         objects[i] = desc->objects[i].fd;
-      }
-      if ((ret = rsSocketSend(sock, sizeof(AVDRMFrameDescriptor), desc,
-                              (size_t)desc->nb_objects, objects)) < 0) {
-         goto error;
-      }
-      av_frame_unref(frame);
+   if ((ret = kmsCaptureCreate(capture, deviceName, framerate)) < 0) {
+      return ret;
+   }
+   // The first client is added before the thread starts, otherwise it would see no
+   // clients and stop straight away
+   if ((ret = kmsCaptureAddClient(*capture, client)) < 0) {
+      kmsCaptureDestroy(capture);
+      return ret;
+   }
+   if ((ret = rsThreadCreate(&(*capture)->thread, kmsCaptureThread, *capture)) < 0) {
+      // The client is still destroyed by the caller
+      (*capture)->clientCount = 0;
+      kmsCaptureDestroy(capture);
+      return ret;
+   }
+   return 0;
+}
+
+static int kmsConnection(KmsClient *client) {
+   int ret;
+   RSServiceDeviceInfo info;
+   char *deviceName = NULL;
+   if ((ret = rsSocketReceive(&client->sock, sizeof(info), &info, 0, NULL)) < 0) {
+      goto error;
+   }
+   if (info.version != RS_SERVICE_DEVICE_VERSION) {
+      av_log(NULL, AV_LOG_ERROR, "Client protocol version mismatch: %i != %i\n",
+             info.version, RS_SERVICE_DEVICE_VERSION);
+      ret = AVERROR(EPROTO);
+      goto error;
+   }
+
+   deviceName = av_mallocz((size_t)(info.deviceLength + 1));
+   if (deviceName == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto error;
+   }
+   if ((ret = rsSocketReceive(&client->sock, info.deviceLength, deviceName, 0, NULL)) <
+       0) {
+      goto error;
+   }
+
+   av_log(NULL, AV_LOG_INFO, "Framerate = %i, Device = %s\n", info.framerate, deviceName);
+   if ((ret = kmsCaptureJoin(client, deviceName, info.framerate)) < 0) {
+      goto error;
    }
 
    ret = 0;
 error:
-   rsDeviceDestroy(&device);
    av_freep(&deviceName);
-   av_frame_free(&frame);
    return ret;
 }
 
+static int kmsAccept(void *extra) {
+   int ret;
+   RSSocket *sock = extra;
+   KmsClient *client;
+   if ((ret = kmsClientCreate(&client)) < 0) {
+      return ret;
+   }
+   if ((ret = rsSocketAccept(sock, &client->sock, 0)) < 0) {
+      kmsClientDestroy(&client);
+      if (ret == AVERROR(EAGAIN)) {
+         return 0;
+      } else {
+         return ret;
+      }
+   }
+
+   if ((ret = kmsConnection(client)) < 0) {
+      av_log(NULL, AV_LOG_WARNING, "Disconnected: %s\n", av_err2str(ret));
+      kmsClientDestroy(&client);
+   }
+   return 0;
+}
+
+static int kmsReap(void *extra) {
+   (void)extra;
+   for (int i = 0; i < KMS_MAX_CAPTURES; ++i) {
+      if (captures[i] != NULL && !rsAtomicLoad(&captures[i]->running)) {
+         kmsCaptureDestroy(&captures[i]);
+      }
+   }
+   return 0;
+}
+
 int rsKmsService(void) {
    int ret;
    RSSocket sock = {0};
@@ -122,25 +486,41 @@ int rsKmsService(void) {
 
    signal(SIGINT, kmsSignal);
    signal(SIGTERM, kmsSignal);
-   while (running) {
-      RSSocket conn = {0};
-      if ((ret = rsSocketAccept(&sock, &conn, -1)) < 0) {
-         if (ret == AVERROR(EAGAIN)) {
-            continue;
-         } else {
-            goto error;
-         }
-      }
+   ret = rsKmsServiceRun(&sock, rsKmsDeviceCreate);
+error:
+   rsSocketDestroy(&sock);
+   return ret;
+}
 
-      ret = kmsConnection(&conn);
-      rsSocketDestroy(&conn);
-      if (ret < 0) {
-         av_log(NULL, AV_LOG_WARNING, "Disconnected: %s\n", av_err2str(ret));
+int rsKmsServiceRun(RSSocket *sock, RSKmsDeviceFunction create) {
+   int ret;
+   RSEventLoop loop = {0};
+   deviceCreate = create;
+   if ((ret = rsEventLoopCreate(&loop)) < 0) {
+      goto error;
+   }
+   if ((ret = rsEventLoopAddFile(&loop, sock->fd, RS_EVENT_READ, kmsAccept, sock)) < 0) {
+      goto error;
+   }
+   if ((ret = rsEventLoopAddTimer(&loop, AV_TIME_BASE, kmsReap, NULL)) < 0) {
+      goto error;
+   }
+
+   while (running) {
+      if ((ret = rsEventLoopRun(&loop, -1)) < 0) {
+         goto error;
       }
    }
 
    ret = 0;
 error:
-   rsSocketDestroy(&sock);
+   for (int i = 0; i < KMS_MAX_CAPTURES; ++i) {
+      kmsCaptureDestroy(&captures[i]);
+   }
+   rsEventLoopDestroy(&loop);
    return ret;
 }
+
+void rsKmsServiceStop(void) {
+   running = 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "../config.h"
+#include "../journal.h"
+#include "../log.h"
+#include "../output.h"
+#include "../thread.h"
+#include "../util.h"
+#include "command.h"
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+#include <rsbuild.h>
+#include <signal.h>
+#include <stdlib.h>
+#ifdef RS_BUILD_JOURNAL_FOUND
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef RS_BUILD_JOURNAL_FOUND
+static AVCodecParameters *watchdogParams(const RSJournalHeader *header) {
+   AVCodecParameters *params = avcodec_parameters_alloc();
+   if (params == NULL) {
+      return NULL;
+   }
+   params->codec_type = AVMEDIA_TYPE_VIDEO;
+   params->codec_id = header->codecID;
+   params->format = header->format;
+   params->width = header->width;
+   params->height = header->height;
+   params->profile = header->profile;
+   params->level = header->level;
+   if (header->extradataSize > 0) {
+      params->extradata =
+          av_mallocz((size_t)header->extradataSize + AV_INPUT_BUFFER_PADDING_SIZE);
+      if (params->extradata == NULL) {
+         avcodec_parameters_free(&params);
+         return NULL;
+      }
+      memcpy(params->extradata, header->extradata, (size_t)header->extradataSize);
+      params->extradata_size = header->extradataSize;
+   }
+   return params;
+}
+
+static int watchdogSave(const RSJournalHeader *header) {
+   int ret;
+   int64_t time = av_gettime_relative();
+   RSOutput output = {0};
+   AVCodecParameters *params = NULL;
+   AVPacket *packet = NULL;
+   uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+   uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+   if (!__atomic_load_n(&header->paramsValid, __ATOMIC_ACQUIRE) || head == tail) {
+      av_log(NULL, AV_LOG_VERBOSE, "Crash journal is empty\n");
+      return 0;
+   }
+
+   // Find the newest packet first to know where the replay starts
+   const RSJournalRecord *record;
+   int64_t endTime = INT64_MIN;
+   uint64_t pos = tail;
+   while ((record = rsJournalNext(header, &pos, head)) != NULL) {
+      endTime = FFMAX(endTime, record->pts);
+   }
+   int64_t minTime = endTime - (int64_t)rsConfig.recordSeconds * AV_TIME_BASE;
+   int64_t startTime = INT64_MIN;
+   uint64_t start = tail;
+   for (pos = tail; (record = rsJournalNext(header, &pos, head)) != NULL;) {
+      if ((record->flags & AV_PKT_FLAG_KEY) && record->pts >= minTime) {
+         startTime = record->pts;
+         break;
+      }
+      start = pos;
+   }
+   if (startTime == INT64_MIN) {
+      av_log(NULL, AV_LOG_ERROR, "No key-frame in the crash journal\n");
+      return AVERROR(EAGAIN);
+   }
+
+   params = watchdogParams(header);
+   packet = av_packet_alloc();
+   if (params == NULL || packet == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto error;
+   }
+   av_log(NULL, AV_LOG_WARNING, "ReplaySorcery exited unexpectedly, saving the replay\n");
+   if ((ret = rsOutputCreate(&output)) < 0) {
+      goto error;
+   }
+   rsOutputAddStream(&output, params);
+   if ((ret = rsOutputOpen(&output)) < 0) {
+      goto error;
+   }
+
+   int count = 0;
+   for (pos = start; (record = rsJournalNext(header, &pos, head)) != NULL; ++count) {
+      if ((ret = av_new_packet(packet, record->size)) < 0) {
+         goto error;
+      }
+      memcpy(packet->data, record + 1, (size_t)record->size);
+      packet->flags = record->flags;
+      packet->pts = record->pts - startTime;
+      packet->dts = record->dts - startTime;
+      if ((ret = rsOutputWrite(&output, packet)) < 0) {
+         goto error;
+      }
+   }
+   if ((ret = rsOutputClose(&output)) < 0) {
+      goto error;
+   }
+   av_log(NULL, AV_LOG_INFO, "Recovered %i video packets in %.1fms\n", count,
+          (double)(av_gettime_relative() - time) / 1000.0);
+
+   ret = 0;
+error:
+   rsOutputDestroy(&output);
+   av_packet_free(&packet);
+   avcodec_parameters_free(&params);
+   return ret;
+}
+#endif
+
+int rsJournalWatchdog(int argc, char *argv[]) {
+#ifdef RS_BUILD_JOURNAL_FOUND
+   int ret;
+   void *mem = MAP_FAILED;
+   struct stat info;
+   if (argc < 2) {
+      av_log(NULL, AV_LOG_ERROR, "The watchdog is started by ReplaySorcery itself\n");
+      return AVERROR(EINVAL);
+   }
+   int memFile = atoi(argv[0]);
+   int waitFile = atoi(argv[1]);
+
+   // Interrupts and service stops are meant for the main process, the watchdog exits
+   // once that does
+   signal(SIGINT, SIG_IGN);
+   signal(SIGTERM, SIG_IGN);
+   signal(SIGHUP, SIG_IGN);
+   rsThreadSetName("rs-watchdog");
+   char byte;
+   ssize_t size;
+   while ((size = read(waitFile, &byte, 1)) != 0) {
+      if (size == -1 && errno != EINTR) {
+         ret = AVERROR(errno);
+         goto error;
+      }
+   }
+
+   if (fstat(memFile, &info) == -1) {
+      ret = AVERROR(errno);
+      goto error;
+   }
+   mem = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, memFile, 0);
+   if (mem == MAP_FAILED) {
+      ret = AVERROR(errno);
+      goto error;
+   }
+   const RSJournalHeader *header = mem;
+   if (header->magic != RS_JOURNAL_MAGIC ||
+       header->dataSize + RS_JOURNAL_HEADER_SIZE > (uint64_t)info.st_size) {
+      ret = AVERROR_INVALIDDATA;
+      goto error;
+   }
+   if (__atomic_load_n(&header->state, __ATOMIC_ACQUIRE) != RS_JOURNAL_RUNNING) {
+      ret = 0;
+      goto error;
+   }
+
+   if ((ret = rsConfigInit()) < 0) {
+      goto error;
+   }
+   if ((ret = rsLogOpenFile(rsConfig.logFile)) < 0) {
+      goto error;
+   }
+   if ((ret = watchdogSave(header)) < 0) {
+      goto error;
+   }
+
+   ret = 0;
+error:
+   if (mem != MAP_FAILED) {
+      munmap(mem, (size_t)info.st_size);
+   }
+   close(memFile);
+   close(waitFile);
+   return ret;
+#else
+   (void)argc;
+   (void)argv;
+   return AVERROR(ENOSYS);
+#endif
+}
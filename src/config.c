@@ -64,7 +64,18 @@ static const AVOption configOptions[] = {
     CONFIG_CONST(verbose, AV_LOG_VERBOSE, logLevel),
     CONFIG_CONST(debug, AV_LOG_DEBUG, logLevel),
     CONFIG_CONST(trace, AV_LOG_TRACE, logLevel),
+    CONFIG_STRING(logFile, ""),
     CONFIG_INT(recordSeconds, 30, 1, INT_MAX, ),
+    CONFIG_FLAGS(bufferMemory, 0, bufferMemory),
+    CONFIG_CONST(none, 0, bufferMemory),
+    CONFIG_CONST(lock, RS_CONFIG_MEMORY_LOCK, bufferMemory),
+    CONFIG_CONST(huge, RS_CONFIG_MEMORY_HUGE, bufferMemory),
+    CONFIG_INT(bufferCrashSize, 0, 0, 65536, bufferCrashSize),
+    CONFIG_CONST(off, 0, bufferCrashSize),
+    CONFIG_INT(pressureThreshold, 0, 0, 1000, pressureThreshold),
+    CONFIG_CONST(off, 0, pressureThreshold),
+    CONFIG_INT(pressureMinSeconds, 5, 1, INT_MAX, NULL),
+    CONFIG_STRING(pressureFile, "/proc/pressure/memory"),
     CONFIG_INT(videoInput, RS_CONFIG_AUTO, RS_CONFIG_DEVICE_HWACCEL,
                RS_CONFIG_DEVICE_KMS_SERVICE, videoInput),
     CONFIG_CONST(hwaccel, RS_CONFIG_DEVICE_HWACCEL, videoInput),
@@ -79,7 +90,7 @@ static const AVOption configOptions[] = {
     CONFIG_INT(videoHeight, RS_CONFIG_AUTO, RS_CONFIG_AUTO, INT_MAX, auto),
     CONFIG_INT(videoFramerate, 30, 1, INT_MAX, NULL),
     CONFIG_INT(videoEncoder, RS_CONFIG_AUTO, RS_CONFIG_ENCODER_HEVC,
-               RS_CONFIG_ENCODER_VAAPI_HEVC, videoEncoder),
+               RS_CONFIG_ENCODER_VP9, videoEncoder),
     CONFIG_CONST(hevc, RS_CONFIG_ENCODER_HEVC, videoEncoder),
     CONFIG_CONST(auto, RS_CONFIG_AUTO, videoEncoder),
     CONFIG_CONST(x264, RS_CONFIG_ENCODER_X264, videoEncoder),
@@ -87,6 +98,8 @@ static const AVOption configOptions[] = {
     CONFIG_CONST(x265, RS_CONFIG_ENCODER_X265, videoEncoder),
     CONFIG_CONST(vaapi_h264, RS_CONFIG_ENCODER_VAAPI_H264, videoEncoder),
     CONFIG_CONST(vaapi_hevc, RS_CONFIG_ENCODER_VAAPI_HEVC, videoEncoder),
+    CONFIG_CONST(svtav1, RS_CONFIG_ENCODER_SVTAV1, videoEncoder),
+    CONFIG_CONST(vp9, RS_CONFIG_ENCODER_VP9, videoEncoder),
     CONFIG_INT(videoProfile, FF_PROFILE_H264_BASELINE, 0, INT_MAX, videoProfile),
     CONFIG_CONST(baseline, FF_PROFILE_H264_BASELINE, videoProfile),
     CONFIG_CONST(main, FF_PROFILE_H264_MAIN, videoProfile),
@@ -99,6 +112,14 @@ static const AVOption configOptions[] = {
     CONFIG_INT(videoQuality, 28, RS_CONFIG_AUTO, 51, auto),
     CONFIG_INT64(videoBitrate, RS_CONFIG_AUTO, RS_CONFIG_AUTO, INT_MAX, auto),
     CONFIG_INT(videoGOP, 30, 0, INT_MAX, videoGOP),
+    CONFIG_INT(videoRefresh, RS_CONFIG_REFRESH_GOP, RS_CONFIG_REFRESH_GOP,
+               RS_CONFIG_REFRESH_INTRA, videoRefresh),
+    CONFIG_CONST(gop, RS_CONFIG_REFRESH_GOP, videoRefresh),
+    CONFIG_CONST(intra, RS_CONFIG_REFRESH_INTRA, videoRefresh),
+    CONFIG_INT(videoSaveStart, RS_CONFIG_START_KEYFRAME, RS_CONFIG_START_KEYFRAME,
+               RS_CONFIG_START_EXACT, videoSaveStart),
+    CONFIG_CONST(keyframe, RS_CONFIG_START_KEYFRAME, videoSaveStart),
+    CONFIG_CONST(exact, RS_CONFIG_START_EXACT, videoSaveStart),
     CONFIG_INT(scaleWidth, RS_CONFIG_AUTO, RS_CONFIG_AUTO, INT_MAX, auto),
     CONFIG_INT(scaleHeight, RS_CONFIG_AUTO, RS_CONFIG_AUTO, INT_MAX, auto),
     CONFIG_INT(audioInput, RS_CONFIG_AUTO, RS_CONFIG_DEVICE_NONE, RS_CONFIG_DEVICE_PULSE,
@@ -108,6 +129,17 @@ static const AVOption configOptions[] = {
     CONFIG_CONST(pulse, RS_CONFIG_DEVICE_PULSE, audioInput),
     CONFIG_STRING(audioDevice, "auto"),
     CONFIG_INT(audioSamplerate, 44100, 1, INT_MAX, auto),
+    CONFIG_INT(audioFragSize, 100, RS_CONFIG_AUTO, INT_MAX, auto),
+    CONFIG_INT(audioMaxLength, RS_CONFIG_AUTO, RS_CONFIG_AUTO, INT_MAX, auto),
+    CONFIG_INT(audioTracks, RS_CONFIG_AUDIO_MIX, RS_CONFIG_AUDIO_MIX,
+               RS_CONFIG_AUDIO_SEPARATE, audioTracks),
+    CONFIG_CONST(mix, RS_CONFIG_AUDIO_MIX, audioTracks),
+    CONFIG_CONST(separate, RS_CONFIG_AUDIO_SEPARATE, audioTracks),
+    CONFIG_INT(audioStorage, RS_CONFIG_AUDIO_FLOAT, RS_CONFIG_AUDIO_FLOAT,
+               RS_CONFIG_AUDIO_S16, audioStorage),
+    CONFIG_CONST(float, RS_CONFIG_AUDIO_FLOAT, audioStorage),
+    CONFIG_CONST(s16, RS_CONFIG_AUDIO_S16, audioStorage),
+    CONFIG_INT(audioThreads, RS_CONFIG_AUTO, RS_CONFIG_AUTO, INT_MAX, auto),
     CONFIG_INT(audioEncoder, RS_CONFIG_AUTO, RS_CONFIG_AUTO, RS_CONFIG_ENCODER_FDK,
                audioEncoder),
     CONFIG_CONST(auto, RS_CONFIG_AUTO, audioEncoder),
@@ -132,6 +164,28 @@ static const AVOption configOptions[] = {
     CONFIG_CONST(super, RS_CONFIG_KEYMOD_SUPER, keyMods),
     CONFIG_STRING(outputFile, "~/Videos/ReplaySorcery/%F_%H-%M-%S.mp4"),
     CONFIG_STRING(outputCommand, "notify-send " RS_NAME " \"Saved replay as %s\""),
+    CONFIG_INT(schedPolicy, RS_CONFIG_SCHED_OTHER, RS_CONFIG_SCHED_OTHER, RS_CONFIG_SCHED_RR,
+               schedPolicy),
+    CONFIG_CONST(other, RS_CONFIG_SCHED_OTHER, schedPolicy),
+    CONFIG_CONST(fifo, RS_CONFIG_SCHED_FIFO, schedPolicy),
+    CONFIG_CONST(rr, RS_CONFIG_SCHED_RR, schedPolicy),
+    CONFIG_INT(schedPriority, 0, -20, 99, NULL),
+    CONFIG_STRING(captureCpus, ""),
+    CONFIG_STRING(audioCpus, ""),
+    CONFIG_INT(savePriority, RS_CONFIG_SAVE_NORMAL, RS_CONFIG_SAVE_NORMAL,
+               RS_CONFIG_SAVE_IDLE, savePriority),
+    CONFIG_CONST(normal, RS_CONFIG_SAVE_NORMAL, savePriority),
+    CONFIG_CONST(idle, RS_CONFIG_SAVE_IDLE, savePriority),
+    CONFIG_INT(recompressEncoder, RS_CONFIG_RECOMPRESS_OFF, RS_CONFIG_RECOMPRESS_OFF,
+               RS_CONFIG_ENCODER_SVTAV1, recompressEncoder),
+    CONFIG_CONST(off, RS_CONFIG_RECOMPRESS_OFF, recompressEncoder),
+    CONFIG_CONST(x264, RS_CONFIG_ENCODER_X264, recompressEncoder),
+    CONFIG_CONST(x265, RS_CONFIG_ENCODER_X265, recompressEncoder),
+    CONFIG_CONST(svtav1, RS_CONFIG_ENCODER_SVTAV1, recompressEncoder),
+    CONFIG_STRING(recompressPreset, "slow"),
+    CONFIG_INT(recompressQuality, 23, 0, 51, NULL),
+    CONFIG_INT(debugFaultFrames, 0, 0, INT_MAX, debugFaultFrames),
+    CONFIG_CONST(off, 0, debugFaultFrames),
     {NULL}};
 
 static const AVClass configClass = {
@@ -142,6 +196,32 @@ static const AVClass configClass = {
 
 RSConfig rsConfig = {.avClass = &configClass};
 
+typedef struct ConfigLive {
+   const char *name;
+   int reload;
+} ConfigLive;
+
+// Options that can change without a restart, the rest are only read during setup or from
+// other threads
+static const ConfigLive configLive[] = {
+    {"logLevel", 0},
+    {"traceLevel", 0},
+    {"videoSaveStart", 0},
+    {"outputFile", 0},
+    {"outputCommand", 0},
+    {"savePriority", 0},
+    {"recompressQuality", 0},
+    {"videoProfile", RS_CONFIG_RELOAD_ENCODER},
+    {"videoPreset", RS_CONFIG_RELOAD_ENCODER},
+    {"videoQuality", RS_CONFIG_RELOAD_ENCODER},
+    {"videoBitrate", RS_CONFIG_RELOAD_ENCODER},
+    {"videoGOP", RS_CONFIG_RELOAD_ENCODER},
+    {"videoRefresh", RS_CONFIG_RELOAD_ENCODER},
+    {"controller", RS_CONFIG_RELOAD_CONTROL},
+    {"keyName", RS_CONFIG_RELOAD_CONTROL},
+    {"keyMods", RS_CONFIG_RELOAD_CONTROL},
+    {NULL}};
+
 static char *configTrim(char *str) {
    while (av_isspace(*str)) {
       ++str;
@@ -154,7 +234,7 @@ static char *configTrim(char *str) {
    return str;
 }
 
-static int configParse(const char *path) {
+static int configParse(RSConfig *config, const char *path) {
    int ret;
    AVIOContext *file;
    if ((ret = avio_open(&file, path, AVIO_FLAG_READ)) < 0) {
@@ -206,12 +286,12 @@ static int configParse(const char *path) {
       char *key = configTrim(line);
       char *value = configTrim(eq + 1);
       av_log(NULL, AV_LOG_INFO, "Setting '%s' to '%s'...\n", key, value);
-      if ((ret = av_opt_set(&rsConfig, key, value, 0)) < 0) {
+      if ((ret = av_opt_set(config, key, value, 0)) < 0) {
          av_log(NULL, AV_LOG_ERROR, "Failed to set '%s' to '%s': %s\n", key, value,
                 av_err2str(ret));
          goto error;
       }
-      av_log_set_level(rsConfig.logLevel);
+      av_log_set_level(config->logLevel);
    }
 
    av_freep(&contents);
@@ -220,14 +300,14 @@ error:
    av_freep(&contents);
    av_bprint_finalize(&buffer, NULL);
    avio_closep(&file);
-   rsConfigExit();
+   av_opt_free(config);
    return ret;
 }
 
-int rsConfigInit(void) {
+static int configLoad(RSConfig *config) {
    int ret;
-   av_opt_set_defaults(&rsConfig);
-   if ((ret = configParse(RS_BUILD_GLOBAL_CONFIG)) < 0) {
+   av_opt_set_defaults(config);
+   if ((ret = configParse(config, RS_BUILD_GLOBAL_CONFIG)) < 0) {
       return ret;
    }
 
@@ -242,7 +322,7 @@ int rsConfigInit(void) {
       return AVERROR(ENOMEM);
    }
 
-   ret = configParse(local);
+   ret = configParse(config, local);
    av_freep(&local);
    if (ret < 0) {
       return ret;
@@ -250,6 +330,56 @@ int rsConfigInit(void) {
    return 0;
 }
 
+static const ConfigLive *configFindLive(const char *name) {
+   for (const ConfigLive *live = configLive; live->name != NULL; ++live) {
+      if (strcmp(live->name, name) == 0) {
+         return live;
+      }
+   }
+   return NULL;
+}
+
+int rsConfigInit(void) {
+   return configLoad(&rsConfig);
+}
+
+int rsConfigReload(void) {
+   int ret;
+   RSConfig config = {.avClass = &configClass};
+   if ((ret = configLoad(&config)) < 0) {
+      av_log_set_level(rsConfig.logLevel);
+      return ret;
+   }
+
+   int reload = 0;
+   const AVOption *option = NULL;
+   while ((option = av_opt_next(&rsConfig, option)) != NULL) {
+      if (option->type == AV_OPT_TYPE_CONST) {
+         continue;
+      }
+      uint8_t *before = NULL;
+      uint8_t *after = NULL;
+      if (av_opt_get(&rsConfig, option->name, 0, &before) >= 0 &&
+          av_opt_get(&config, option->name, 0, &after) >= 0 &&
+          strcmp((char *)before, (char *)after) != 0) {
+         const ConfigLive *live = configFindLive(option->name);
+         if (live == NULL) {
+            av_log(NULL, AV_LOG_WARNING, "Changing '%s' needs a restart\n", option->name);
+         } else if (av_opt_set(&rsConfig, option->name, (char *)after, 0) >= 0) {
+            av_log(NULL, AV_LOG_INFO, "Changed '%s' from '%s' to '%s'\n", option->name,
+                   before, after);
+            reload |= live->reload;
+         }
+      }
+      av_freep(&before);
+      av_freep(&after);
+   }
+
+   av_opt_free(&config);
+   av_log_set_level(rsConfig.logLevel);
+   return reload;
+}
+
 void rsConfigExit(void) {
    av_opt_free(&rsConfig);
 }
@@ -19,6 +19,7 @@
 
 #ifndef RS_CONFIG_H
 #define RS_CONFIG_H
+#include "thread.h"
 #include <libavutil/avutil.h>
 
 #define RS_CONFIG_AUTO -1
@@ -30,15 +31,31 @@
 #define RS_CONFIG_DEVICE_NONE -2
 #define RS_CONFIG_DEVICE_PULSE 0
 
+#define RS_CONFIG_AUDIO_MIX 0
+#define RS_CONFIG_AUDIO_SEPARATE 1
+#define RS_CONFIG_AUDIO_FLOAT 0
+#define RS_CONFIG_AUDIO_S16 1
+
+#define RS_CONFIG_MEMORY_LOCK 1
+#define RS_CONFIG_MEMORY_HUGE 2
+
 #define RS_CONFIG_ENCODER_HEVC -2
 #define RS_CONFIG_ENCODER_X264 0
 #define RS_CONFIG_ENCODER_OPENH264 1
 #define RS_CONFIG_ENCODER_X265 2
 #define RS_CONFIG_ENCODER_VAAPI_H264 3
 #define RS_CONFIG_ENCODER_VAAPI_HEVC 4
+#define RS_CONFIG_ENCODER_SVTAV1 5
+#define RS_CONFIG_ENCODER_VP9 6
 #define RS_CONFIG_ENCODER_AAC 0
 #define RS_CONFIG_ENCODER_FDK 1
 
+#define RS_CONFIG_REFRESH_GOP 0
+#define RS_CONFIG_REFRESH_INTRA 1
+
+#define RS_CONFIG_START_KEYFRAME 0
+#define RS_CONFIG_START_EXACT 1
+
 #define RS_CONFIG_PRESET_FAST 0
 #define RS_CONFIG_PRESET_MEDIUM 1
 #define RS_CONFIG_PRESET_SLOW 2
@@ -47,6 +64,16 @@
 #define RS_CONFIG_CONTROL_X11 1
 #define RS_CONFIG_CONTROL_COMMAND 2
 
+#define RS_CONFIG_SCHED_OTHER RS_THREAD_POLICY_OTHER
+#define RS_CONFIG_SCHED_FIFO RS_THREAD_POLICY_FIFO
+#define RS_CONFIG_SCHED_RR RS_THREAD_POLICY_RR
+#define RS_CONFIG_SAVE_NORMAL 0
+#define RS_CONFIG_SAVE_IDLE 1
+#define RS_CONFIG_RECOMPRESS_OFF -1
+
+#define RS_CONFIG_RELOAD_ENCODER 1
+#define RS_CONFIG_RELOAD_CONTROL 2
+
 #define RS_CONFIG_KEYMOD_CTRL 1
 #define RS_CONFIG_KEYMOD_SHIFT 2
 #define RS_CONFIG_KEYMOD_ALT 4
@@ -56,7 +83,13 @@ typedef struct RSConfig {
    const AVClass *avClass;
    int logLevel;
    int traceLevel;
+   char *logFile;
    int recordSeconds;
+   int bufferMemory;
+   int bufferCrashSize;
+   int pressureThreshold;
+   int pressureMinSeconds;
+   char *pressureFile;
    int videoInput;
    char *videoDevice;
    int videoX;
@@ -70,11 +103,18 @@ typedef struct RSConfig {
    int videoQuality;
    int64_t videoBitrate;
    int videoGOP;
+   int videoRefresh;
+   int videoSaveStart;
    int scaleWidth;
    int scaleHeight;
    int audioInput;
    char *audioDevice;
    int audioSamplerate;
+   int audioFragSize;
+   int audioMaxLength;
+   int audioTracks;
+   int audioStorage;
+   int audioThreads;
    int audioEncoder;
    int audioProfile;
    int64_t audioBitrate;
@@ -83,11 +123,22 @@ typedef struct RSConfig {
    int keyMods;
    char *outputFile;
    char *outputCommand;
+   int schedPolicy;
+   int schedPriority;
+   char *captureCpus;
+   char *audioCpus;
+   int savePriority;
+   int recompressEncoder;
+   char *recompressPreset;
+   int recompressQuality;
+   int debugFaultFrames;
 } RSConfig;
 
 extern RSConfig rsConfig;
 
 int rsConfigInit(void);
+// Applies the options that can change while running, returns what has to be re-created
+int rsConfigReload(void);
 void rsConfigExit(void);
 
 #endif
@@ -59,6 +59,7 @@ int rsCommandControlCreate(RSControl *control) {
    if ((ret = rsSocketBind(sock, RS_COMMAND_CONTROL_PATH)) < 0) {
       goto error;
    }
+   control->fd = sock->fd;
 
    return 0;
 error:
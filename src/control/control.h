@@ -22,6 +22,7 @@
 #include <libavutil/avutil.h>
 
 typedef struct RSControl {
+   int fd;
    void *extra;
    void (*destroy)(struct RSControl *control);
    int (*wantsSave)(struct RSControl *control);
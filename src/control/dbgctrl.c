@@ -40,7 +40,10 @@ static int debugControlWantsSave(RSControl *control) {
          }
          return ret;
       }
-      if (result == 1 && c == '\n') {
+      if (result == 0) {
+         return AVERROR_EOF;
+      }
+      if (c == '\n') {
          ret = 1;
       }
    }
@@ -49,6 +52,7 @@ static int debugControlWantsSave(RSControl *control) {
 
 int rsDebugControlCreate(RSControl *control) {
 #ifdef RS_BUILD_POSIX_IO_FOUND
+   control->fd = 0;
    control->destroy = NULL;
    control->wantsSave = debugControlWantsSave;
    int flags = fcntl(0, F_GETFL);
@@ -70,6 +70,11 @@ static int x11ControlWantsSave(RSControl *control) {
       if (event->response_type == XCB_KEY_PRESS) {
          ret = 1;
       }
+      free(event);
+   }
+   if (xcb_connection_has_error(client->xcb) != 0) {
+      av_log(NULL, AV_LOG_ERROR, "Lost connection to X11 server\n");
+      return AVERROR(EPIPE);
    }
    return ret;
 
@@ -93,6 +98,7 @@ int rsX11ControlCreate(RSControl *control) {
    }
 
 #ifdef RS_BUILD_X11_FOUND
+   control->fd = xcb_get_file_descriptor(client->xcb);
    int key = rsXClientGetKeyCode(client, (uint32_t)XStringToKeysym(rsConfig.keyName));
    if (key < 0) {
       ret = key;
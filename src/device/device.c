@@ -19,6 +19,7 @@
 
 #include "device.h"
 #include "../config.h"
+#include "../probe.h"
 #include "../util.h"
 
 int rsDeviceCreate(RSDevice *device) {
@@ -38,9 +39,8 @@ void rsDeviceDestroy(RSDevice *device) {
    avcodec_parameters_free(&device->params);
 }
 
-int rsVideoDeviceCreate(RSDevice *device) {
-   int ret;
-   switch (rsConfig.videoInput) {
+static int videoDeviceCreate(RSDevice *device, int input) {
+   switch (input) {
    case RS_CONFIG_DEVICE_X11:
       return rsX11DeviceCreate(device);
    case RS_CONFIG_DEVICE_KMS:
@@ -48,10 +48,29 @@ int rsVideoDeviceCreate(RSDevice *device) {
    case RS_CONFIG_DEVICE_KMS_SERVICE:
       return rsKmsServiceDeviceCreate(device);
    }
+   return AVERROR(ENOSYS);
+}
+
+int rsVideoDeviceCreate(RSDevice *device) {
+   int ret;
+   if (rsConfig.videoInput >= 0) {
+      return videoDeviceCreate(device, rsConfig.videoInput);
+   }
+
+   int cached = rsProbeGet("device");
+   if (cached != RS_CONFIG_AUTO) {
+      if ((ret = videoDeviceCreate(device, cached)) >= 0) {
+         av_log(NULL, AV_LOG_INFO, "Created cached device\n");
+         return 0;
+      }
+      av_log(NULL, AV_LOG_WARNING, "Failed to create cached device: %s\n",
+             av_err2str(ret));
+   }
 
    if (rsConfig.videoInput == RS_CONFIG_DEVICE_HWACCEL) {
       if ((ret = rsKmsServiceDeviceCreate(device)) >= 0) {
          av_log(NULL, AV_LOG_INFO, "Created KMS service device\n");
+         rsProbeSet("device", RS_CONFIG_DEVICE_KMS_SERVICE);
          return 0;
       }
       av_log(NULL, AV_LOG_WARNING, "Failed to create KMS service device: %s\n",
@@ -60,6 +79,7 @@ int rsVideoDeviceCreate(RSDevice *device) {
       if ((ret = rsKmsDeviceCreate(device, rsConfig.videoDevice,
                                    rsConfig.videoFramerate)) >= 0) {
          av_log(NULL, AV_LOG_INFO, "Created KMS device\n");
+         rsProbeSet("device", RS_CONFIG_DEVICE_KMS);
          return 0;
       }
       av_log(NULL, AV_LOG_WARNING, "Failed to create KMS device: %s\n", av_err2str(ret));
@@ -69,6 +89,7 @@ int rsVideoDeviceCreate(RSDevice *device) {
 
    if ((ret = rsX11DeviceCreate(device)) >= 0) {
       av_log(NULL, AV_LOG_INFO, "Created X11 device\n");
+      rsProbeSet("device", RS_CONFIG_DEVICE_X11);
       return 0;
    }
    av_log(NULL, AV_LOG_WARNING, "Failed to create X11 device: %s\n", av_err2str(ret));
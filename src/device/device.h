@@ -21,6 +21,7 @@
 #define RS_DEVICE_H
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/hwcontext_drm.h>
 
 typedef struct RSDevice {
    AVCodecParameters *params;
@@ -40,15 +41,28 @@ void rsDeviceDestroy(RSDevice *device);
 int rsX11DeviceCreate(RSDevice *device);
 int rsKmsDeviceCreate(RSDevice *device, const char *deviceName, int framerate);
 int rsKmsServiceDeviceCreate(RSDevice *device);
+// Connects to a KMS service listening somewhere other than RS_SERVICE_DEVICE_PATH
+int rsKmsServiceDeviceOpen(RSDevice *device, const char *path);
 int rsVideoDeviceCreate(RSDevice *device);
 
 // Services
 
 #define RS_SERVICE_DEVICE_PATH "/tmp/replay-sorcery/device.sock"
+#define RS_SERVICE_DEVICE_VERSION 2
+#define RS_SERVICE_DEVICE_MAX_BUFFERS 16
 
 typedef struct RSServiceDeviceInfo {
+   int version;
    int framerate;
    uint8_t deviceLength;
 } RSServiceDeviceInfo;
 
+// Sent once per frame. The buffer files are only attached the first time the service
+// sees a buffer, after that the client uses its cached copy of the descriptor.
+typedef struct RSServiceDeviceFrame {
+   int64_t pts;
+   int buffer;
+   AVDRMFrameDescriptor desc;
+} RSServiceDeviceFrame;
+
 #endif
@@ -18,11 +18,14 @@
  */
 
 #include "ffdev.h"
+#include "../log.h"
 #include "../util.h"
+#include "framepool.h"
 #include <libavcodec/avcodec.h>
 #include <libavdevice/avdevice.h>
 #include <libavformat/avformat.h>
 #include <libavutil/avutil.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/time.h>
 
 typedef struct FFmpegDevice {
@@ -32,6 +35,7 @@ typedef struct FFmpegDevice {
    AVFormatContext *formatCtx;
    AVCodecContext *codecCtx;
    AVPacket *packet;
+   RSFramePool framePool;
 } FFmpegDevice;
 
 static void ffmpegDeviceDestroy(RSDevice *device) {
@@ -40,34 +44,60 @@ static void ffmpegDeviceDestroy(RSDevice *device) {
       av_packet_free(&ffmpeg->packet);
       avcodec_free_context(&ffmpeg->codecCtx);
       avformat_close_input(&ffmpeg->formatCtx);
+      rsFramePoolDestroy(&ffmpeg->framePool);
       rsOptionsDestroy(&ffmpeg->options);
       av_freep(&device->extra);
    }
 }
 
+static int ffmpegDeviceGetBuffer(AVCodecContext *codecCtx, AVFrame *frame, int flags) {
+   int ret;
+   FFmpegDevice *ffmpeg = codecCtx->opaque;
+   const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+   if (codecCtx->codec_type != AVMEDIA_TYPE_VIDEO || desc == NULL ||
+       desc->flags & AV_PIX_FMT_FLAG_HWACCEL) {
+      return avcodec_default_get_buffer2(codecCtx, frame, flags);
+   }
+
+   int width = frame->width;
+   int height = frame->height;
+   int align[AV_NUM_DATA_POINTERS];
+   avcodec_align_dimensions2(codecCtx, &width, &height, align);
+   RSFramePool *pool = &ffmpeg->framePool;
+   if (pool->pool == NULL || pool->format != frame->format || pool->width != width ||
+       pool->height != height) {
+      // Frames from the old pool that are still in the buffer keep it alive
+      rsFramePoolDestroy(pool);
+      if ((ret = rsVideoFramePoolCreate(pool, frame->format, width, height)) < 0) {
+         return ret;
+      }
+   }
+   return rsFramePoolGet(pool, frame);
+}
+
 static int ffmpegDeviceNextFrame(RSDevice *device, AVFrame *frame) {
    int ret;
    FFmpegDevice *ffmpeg = device->extra;
    int64_t pts = av_gettime_relative();
    while ((ret = avcodec_receive_frame(ffmpeg->codecCtx, frame)) == AVERROR(EAGAIN)) {
       if ((ret = av_read_frame(ffmpeg->formatCtx, ffmpeg->packet)) < 0) {
-         av_log(ffmpeg->formatCtx, AV_LOG_ERROR, "Failed to read frame: %s\n",
-                av_err2str(ret));
+         RS_LOG_LIMITED(ffmpeg->formatCtx, AV_LOG_ERROR, "Failed to read frame: %s\n",
+                        av_err2str(ret));
          return ret;
       }
 
       ret = avcodec_send_packet(ffmpeg->codecCtx, ffmpeg->packet);
       av_packet_unref(ffmpeg->packet);
       if (ret < 0) {
-         av_log(ffmpeg->codecCtx, AV_LOG_ERROR, "Failed to send packet to decoder: %s\n",
-                av_err2str(ret));
+         RS_LOG_LIMITED(ffmpeg->codecCtx, AV_LOG_ERROR,
+                        "Failed to send packet to decoder: %s\n", av_err2str(ret));
          return ret;
       }
    }
 
    if (ret < 0) {
-      av_log(ffmpeg->codecCtx, AV_LOG_ERROR, "Failed to receive frame from decoder: %s\n",
-             av_err2str(ret));
+      RS_LOG_LIMITED(ffmpeg->codecCtx, AV_LOG_ERROR,
+                     "Failed to receive frame from decoder: %s\n", av_err2str(ret));
       return ret;
    }
    frame->pts = pts;
@@ -144,6 +174,10 @@ int rsFFmpegDeviceOpen(RSDevice *device, const char *input) {
    if ((ret = avcodec_parameters_to_context(ffmpeg->codecCtx, params)) < 0) {
       return ret;
    }
+   if (codec->capabilities & AV_CODEC_CAP_DR1) {
+      ffmpeg->codecCtx->opaque = ffmpeg;
+      ffmpeg->codecCtx->get_buffer2 = ffmpegDeviceGetBuffer;
+   }
    if ((ret = avcodec_open2(ffmpeg->codecCtx, codec, NULL)) < 0) {
       av_log(ffmpeg->codecCtx, AV_LOG_ERROR, "Failed to open decoder: %s\n",
              av_err2str(ret));
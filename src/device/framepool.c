@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "framepool.h"
+#include "../util.h"
+#include <libavutil/imgutils.h>
+
+// Matches the alignment FFmpeg uses for its own frames on the widest SIMD
+#define FRAME_POOL_ALIGN 64
+
+int rsVideoFramePoolCreate(RSFramePool *pool, enum AVPixelFormat format, int width,
+                           int height) {
+   rsClear(pool, sizeof(RSFramePool));
+   int size = av_image_get_buffer_size(format, width, height, FRAME_POOL_ALIGN);
+   if (size < 0) {
+      return size;
+   }
+
+   // Decoders are allowed to read a little past the last line
+   pool->pool = av_buffer_pool_init(size + 16 + FRAME_POOL_ALIGN - 1, NULL);
+   if (pool->pool == NULL) {
+      return AVERROR(ENOMEM);
+   }
+   pool->format = format;
+   pool->width = width;
+   pool->height = height;
+   return 0;
+}
+
+int rsAudioFramePoolCreate(RSFramePool *pool, enum AVSampleFormat format, int channels,
+                           int samples) {
+   rsClear(pool, sizeof(RSFramePool));
+   if (av_sample_fmt_is_planar(format) && channels > AV_NUM_DATA_POINTERS) {
+      // The extra planes would need their own allocation every frame
+      return AVERROR(ENOSYS);
+   }
+   int size = av_samples_get_buffer_size(NULL, channels, samples, format, 0);
+   if (size < 0) {
+      return size;
+   }
+
+   pool->pool = av_buffer_pool_init(size, NULL);
+   if (pool->pool == NULL) {
+      return AVERROR(ENOMEM);
+   }
+   pool->format = format;
+   pool->channels = channels;
+   pool->samples = samples;
+   return 0;
+}
+
+void rsFramePoolDestroy(RSFramePool *pool) {
+   av_buffer_pool_uninit(&pool->pool);
+}
+
+int rsFramePoolGet(RSFramePool *pool, AVFrame *frame) {
+   int ret;
+   if (pool->channels > 0 && frame->nb_samples > pool->samples) {
+      return AVERROR(EINVAL);
+   }
+   frame->buf[0] = av_buffer_pool_get(pool->pool);
+   if (frame->buf[0] == NULL) {
+      return AVERROR(ENOMEM);
+   }
+
+   if (pool->channels > 0) {
+      ret = av_samples_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+                                   pool->channels, frame->nb_samples, pool->format, 0);
+   } else {
+      ret = av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+                                 pool->format, pool->width, pool->height,
+                                 FRAME_POOL_ALIGN);
+   }
+   if (ret < 0) {
+      av_buffer_unref(&frame->buf[0]);
+      return ret;
+   }
+   frame->extended_data = frame->data;
+   return 0;
+}
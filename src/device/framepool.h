@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RS_DEVICE_FRAMEPOOL_H
+#define RS_DEVICE_FRAMEPOOL_H
+#include <libavutil/avutil.h>
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+
+// Recycles the buffers of same-sized frames so capturing does not go back to the
+// allocator every frame. Buffers still referenced when the pool is destroyed are freed
+// once the last reference goes away.
+typedef struct RSFramePool {
+   AVBufferPool *pool;
+   int format;
+   int width;
+   int height;
+   int channels;
+   int samples;
+} RSFramePool;
+
+int rsVideoFramePoolCreate(RSFramePool *pool, enum AVPixelFormat format, int width,
+                           int height);
+int rsAudioFramePoolCreate(RSFramePool *pool, enum AVSampleFormat format, int channels,
+                           int samples);
+void rsFramePoolDestroy(RSFramePool *pool);
+// Only fills in the buffer, data and line sizes. Video frames are laid out for the
+// size of the pool while audio frames must set nb_samples first.
+int rsFramePoolGet(RSFramePool *pool, AVFrame *frame);
+
+#endif
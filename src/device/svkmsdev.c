@@ -18,6 +18,7 @@
  */
 
 #include "../config.h"
+#include "../log.h"
 #include "../socket.h"
 #include "device.h"
 #include "rsbuild.h"
@@ -28,6 +29,22 @@
 #include <unistd.h>
 #endif
 
+typedef struct KmsServiceDevice {
+   RSSocket sock;
+   AVBufferRef *buffers[RS_SERVICE_DEVICE_MAX_BUFFERS];
+} KmsServiceDevice;
+
+static void kmsServiceCloseFiles(const int *files, int fileCount) {
+#ifdef RS_BUILD_POSIX_IO_FOUND
+   for (int i = 0; i < fileCount; ++i) {
+      close(files[i]);
+   }
+#else
+   (void)files;
+   (void)fileCount;
+#endif
+}
+
 static void kmsServiceBufferDestroy(void *extra, uint8_t *data) {
    (void)extra;
    AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)data;
@@ -40,87 +57,140 @@ static void kmsServiceBufferDestroy(void *extra, uint8_t *data) {
 }
 
 static void kmsServiceDeviceDestroy(RSDevice *device) {
-   RSSocket *sock = device->extra;
-   if (sock != NULL) {
-      rsSocketDestroy(sock);
-      av_freep(&sock);
+   KmsServiceDevice *kms = device->extra;
+   if (kms != NULL) {
+      for (int i = 0; i < RS_SERVICE_DEVICE_MAX_BUFFERS; ++i) {
+         av_buffer_unref(&kms->buffers[i]);
+      }
+      rsSocketDestroy(&kms->sock);
+      av_freep(&device->extra);
    }
 }
 
-static int kmsServiceDeviceNextFrame(RSDevice *device, AVFrame *frame) {
+static int kmsServiceBufferCreate(KmsServiceDevice *kms, const RSServiceDeviceFrame *msg,
+                                  const int *objects, int objectCount) {
    int ret;
-   RSSocket *sock = device->extra;
-   int objects[AV_DRM_MAX_PLANES];
-   AVDRMFrameDescriptor *desc = av_mallocz(sizeof(AVDRMFrameDescriptor));
+   AVDRMFrameDescriptor *desc = NULL;
+   if (objectCount != msg->desc.nb_objects) {
+      av_log(NULL, AV_LOG_ERROR, "KMS service sent %i files for %i objects\n",
+             objectCount, msg->desc.nb_objects);
+      ret = AVERROR(EPROTO);
+      goto error;
+   }
+
+   desc = av_memdup(&msg->desc, sizeof(AVDRMFrameDescriptor));
    if (desc == NULL) {
       ret = AVERROR(ENOMEM);
       goto error;
    }
-   if ((ret = rsSocketReceive(sock, sizeof(int64_t), &frame->pts, 0, NULL)) < 0) {
-      goto error;
+   for (int i = 0; i < objectCount; ++i) {
+      desc->objects[i].fd = objects[i];
    }
-   if (frame->pts < 0) {
-      ret = (int)frame->pts;
-      av_log(NULL, AV_LOG_ERROR, "KMS service failed to get frame: %s\n",
-             av_err2str(ret));
+
+   // Frames still being encoded keep their own reference to the old buffer
+   av_buffer_unref(&kms->buffers[msg->buffer]);
+   kms->buffers[msg->buffer] = av_buffer_create(
+       (uint8_t *)desc, sizeof(AVDRMFrameDescriptor), kmsServiceBufferDestroy, NULL, 0);
+   if (kms->buffers[msg->buffer] == NULL) {
+      ret = AVERROR(ENOMEM);
       goto error;
    }
-   if ((ret = rsSocketReceive(sock, sizeof(AVDRMFrameDescriptor), desc, AV_DRM_MAX_PLANES,
+
+   return 0;
+error:
+   av_freep(&desc);
+   kmsServiceCloseFiles(objects, objectCount);
+   return ret;
+}
+
+static int kmsServiceDeviceNextFrame(RSDevice *device, AVFrame *frame) {
+   int ret;
+   KmsServiceDevice *kms = device->extra;
+   RSServiceDeviceFrame msg;
+   int objects[AV_DRM_MAX_PLANES];
+   if ((ret = rsSocketReceive(&kms->sock, sizeof(msg), &msg, AV_DRM_MAX_PLANES,
                               objects)) < 0) {
-      goto error;
+      return ret;
    }
-   for (int i = 0; i < desc->nb_objects; ++i) {
-      desc->objects[i].fd = objects[i];
+
+   int objectCount = ret;
+   if (msg.pts < 0) {
+      kmsServiceCloseFiles(objects, objectCount);
+      ret = (int)msg.pts;
+      RS_LOG_LIMITED(NULL, AV_LOG_ERROR, "KMS service failed to get frame: %s\n",
+                     av_err2str(ret));
+      return ret;
+   }
+   if (msg.buffer < 0 || msg.buffer >= RS_SERVICE_DEVICE_MAX_BUFFERS) {
+      kmsServiceCloseFiles(objects, objectCount);
+      RS_LOG_LIMITED(NULL, AV_LOG_ERROR, "KMS service sent invalid buffer: %i\n",
+                     msg.buffer);
+      return AVERROR(EPROTO);
+   }
+   if (objectCount > 0) {
+      if ((ret = kmsServiceBufferCreate(kms, &msg, objects, objectCount)) < 0) {
+         return ret;
+      }
    }
 
-   frame->hw_frames_ctx = av_buffer_ref(device->hwFrames);
-   if (frame->hw_frames_ctx == NULL) {
-      goto error;
+   AVBufferRef *buffer = kms->buffers[msg.buffer];
+   if (buffer == NULL) {
+      RS_LOG_LIMITED(NULL, AV_LOG_ERROR, "KMS service sent unknown buffer: %i\n",
+                     msg.buffer);
+      return AVERROR(EPROTO);
    }
 
-   frame->buf[0] = av_buffer_create((uint8_t *)desc, sizeof(AVDRMFrameDescriptor),
-                                    kmsServiceBufferDestroy, NULL, 0);
-   if (frame->buf[0] == NULL) {
+   frame->hw_frames_ctx = av_buffer_ref(device->hwFrames);
+   frame->buf[0] = av_buffer_ref(buffer);
+   if (frame->hw_frames_ctx == NULL || frame->buf[0] == NULL) {
+      ret = AVERROR(ENOMEM);
       goto error;
    }
-   frame->data[0] = (uint8_t *)desc;
+   frame->data[0] = buffer->data;
    frame->width = device->params->width;
    frame->height = device->params->height;
    frame->format = AV_PIX_FMT_DRM_PRIME;
+   frame->pts = msg.pts;
 
    return 0;
 error:
-   av_freep(&desc);
    av_frame_unref(frame);
    return ret;
 }
 
 int rsKmsServiceDeviceCreate(RSDevice *device) {
+   return rsKmsServiceDeviceOpen(device, RS_SERVICE_DEVICE_PATH);
+}
+
+int rsKmsServiceDeviceOpen(RSDevice *device, const char *path) {
    int ret;
    AVBufferRef *hwDeviceRef = NULL;
    if ((ret = rsDeviceCreate(device)) < 0) {
       goto error;
    }
 
-   RSSocket *sock = av_mallocz(sizeof(RSSocket));
+   KmsServiceDevice *kms = av_mallocz(sizeof(KmsServiceDevice));
    hwDeviceRef = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_DRM);
-   device->extra = sock;
+   device->extra = kms;
    device->destroy = kmsServiceDeviceDestroy;
    device->nextFrame = kmsServiceDeviceNextFrame;
    device->hwFrames = av_hwframe_ctx_alloc(hwDeviceRef);
-   if (sock == NULL || hwDeviceRef == NULL || device->hwFrames == NULL) {
+   if (kms == NULL || hwDeviceRef == NULL || device->hwFrames == NULL) {
       ret = AVERROR(ENOMEM);
       goto error;
    }
+
+   RSSocket *sock = &kms->sock;
    if ((ret = rsSocketCreate(sock)) < 0) {
       goto error;
    }
-   if ((ret = rsSocketConnect(sock, RS_SERVICE_DEVICE_PATH)) < 0) {
+   if ((ret = rsSocketConnect(sock, path)) < 0) {
       goto error;
    }
 
    uint8_t deviceLength = (uint8_t)strlen(rsConfig.videoDevice);
-   RSServiceDeviceInfo info = {.framerate = rsConfig.videoFramerate,
+   RSServiceDeviceInfo info = {.version = RS_SERVICE_DEVICE_VERSION,
+                               .framerate = rsConfig.videoFramerate,
                                .deviceLength = deviceLength};
    if ((ret = rsSocketSend(sock, sizeof(RSServiceDeviceInfo), &info, 0, NULL)) < 0) {
       goto error;
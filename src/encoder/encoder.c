@@ -19,10 +19,14 @@
 
 #include "encoder.h"
 #include "../config.h"
+#include "../probe.h"
 #include "../util.h"
 #include <libavutil/avutil.h>
 #include <libavutil/pixdesc.h>
 
+// Backends that failed while running, as bits of their config value
+static int encoderFailed = 0;
+
 int rsEncoderCreate(RSEncoder *encoder) {
    rsClear(encoder, sizeof(RSEncoder));
    encoder->params = avcodec_parameters_alloc();
@@ -39,68 +43,148 @@ void rsEncoderDestroy(RSEncoder *encoder) {
    avcodec_parameters_free(&encoder->params);
 }
 
-int rsVideoEncoderCreate(RSEncoder *encoder, const AVCodecParameters *params,
-                         const AVBufferRef *hwFrames) {
-   int ret;
-   switch (rsConfig.videoEncoder) {
+static int videoEncoderCreate(RSEncoder *encoder, const AVCodecParameters *params,
+                              const AVBufferRef *hwFrames, int type) {
+   switch (type) {
    case RS_CONFIG_ENCODER_X264:
-      return rsX264EncoderCreate(encoder, params);
+      return rsX264EncoderCreate(encoder, params, hwFrames);
    case RS_CONFIG_ENCODER_OPENH264:
       return rsOpenH264EncoderCreate(encoder, params);
    case RS_CONFIG_ENCODER_X265:
-      return rsX265EncoderCreate(encoder, params);
+      return rsX265EncoderCreate(encoder, params, hwFrames);
    case RS_CONFIG_ENCODER_VAAPI_H264:
       return rsVaapiH264EncoderCreate(encoder, params, hwFrames);
    case RS_CONFIG_ENCODER_VAAPI_HEVC:
       return rsVaapiHevcEncoderCreate(encoder, params, hwFrames);
+   case RS_CONFIG_ENCODER_SVTAV1:
+      return rsSvtAv1EncoderCreate(encoder, params);
+   case RS_CONFIG_ENCODER_VP9:
+      return rsVp9EncoderCreate(encoder, params);
+   }
+   return AVERROR(ENOSYS);
+}
+
+static int videoEncoderTry(RSEncoder *encoder, const AVCodecParameters *params,
+                           const AVBufferRef *hwFrames, int type, const char *name) {
+   int ret;
+   if (encoderFailed & (1 << type)) {
+      av_log(NULL, AV_LOG_VERBOSE, "Skipping failed %s encoder\n", name);
+      return AVERROR(EAGAIN);
+   }
+   if ((ret = videoEncoderCreate(encoder, params, hwFrames, type)) < 0) {
+      av_log(NULL, AV_LOG_WARNING, "Failed to create %s encoder: %s\n", name,
+             av_err2str(ret));
+      return ret;
+   }
+   av_log(NULL, AV_LOG_INFO, "Created %s encoder\n", name);
+   encoder->type = type;
+   return 0;
+}
+
+int rsVideoEncoderCreateType(RSEncoder *encoder, const AVCodecParameters *params,
+                             const AVBufferRef *hwFrames, int type) {
+   int ret;
+   if ((ret = videoEncoderCreate(encoder, params, hwFrames, type)) < 0) {
+      return ret;
+   }
+   encoder->type = type;
+   return 0;
+}
+
+int rsVideoEncoderDownload(const AVCodecParameters *params, char **filter, int *width,
+                           int *height) {
+   *width = params->width;
+   *height = params->height;
+   const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(params->format);
+   if (!(desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+      *filter = av_strdup("");
+      return *filter == NULL ? AVERROR(ENOMEM) : 0;
+   }
+
+   // The VA-API encoders crop as part of their filters so it has to be done here as well
+   if (rsConfig.videoWidth != RS_CONFIG_AUTO) {
+      *width = rsConfig.videoWidth;
+   } else {
+      *width -= rsConfig.videoX;
+   }
+   if (rsConfig.videoHeight != RS_CONFIG_AUTO) {
+      *height = rsConfig.videoHeight;
+   } else {
+      *height -= rsConfig.videoY;
+   }
+   *filter = rsFormat("hwmap=derive_device=vaapi,crop=%i:%i:%i:%i,scale_vaapi=format=nv12,"
+                      "hwdownload,format=nv12,",
+                      *width, *height, rsConfig.videoX, rsConfig.videoY);
+   return *filter == NULL ? AVERROR(ENOMEM) : 0;
+}
+
+int rsVideoEncoderIsSoftware(int type) {
+   return type != RS_CONFIG_ENCODER_VAAPI_H264 && type != RS_CONFIG_ENCODER_VAAPI_HEVC;
+}
+
+int rsVideoEncoderCreate(RSEncoder *encoder, const AVCodecParameters *params,
+                         const AVBufferRef *hwFrames) {
+   if (rsConfig.videoEncoder >= 0) {
+      return videoEncoderTry(encoder, params, hwFrames, rsConfig.videoEncoder,
+                             "configured");
+   }
+
+   int cached = rsProbeGet("encoder");
+   if (cached >= 0 && videoEncoderTry(encoder, params, hwFrames, cached, "cached") >= 0) {
+      return 0;
    }
 
+   int types[2];
+   const char *names[2];
+   int count = 0;
    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(params->format);
    if (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) {
+      // The software encoders download the frames, which is slow but keeps recording
+      // when the VA-API encoder fails
       if (rsConfig.videoEncoder == RS_CONFIG_ENCODER_HEVC) {
-         if ((ret = rsVaapiHevcEncoderCreate(encoder, params, hwFrames)) >= 0) {
-            av_log(NULL, AV_LOG_INFO, "Created VA-API HEVC encoder\n");
-            return 0;
-         }
-         av_log(NULL, AV_LOG_WARNING, "Failed to create VA-API HEVC encoder: %s\n",
-                av_err2str(ret));
-
-         return AVERROR(ENOSYS);
-      }
-
-      if ((ret = rsVaapiH264EncoderCreate(encoder, params, hwFrames)) >= 0) {
-         av_log(NULL, AV_LOG_INFO, "Created VA-API encoder\n");
-         return 0;
+         types[count] = RS_CONFIG_ENCODER_VAAPI_HEVC;
+         names[count++] = "VA-API HEVC";
+         types[count] = RS_CONFIG_ENCODER_X265;
+         names[count++] = "downloaded x265";
+      } else {
+         types[count] = RS_CONFIG_ENCODER_VAAPI_H264;
+         names[count++] = "VA-API";
+         types[count] = RS_CONFIG_ENCODER_X264;
+         names[count++] = "downloaded x264";
       }
-      av_log(NULL, AV_LOG_WARNING, "Failed to create VA-API encoder: %s\n",
-             av_err2str(ret));
-
-      return AVERROR(ENOSYS);
+   } else if (rsConfig.videoEncoder == RS_CONFIG_ENCODER_HEVC) {
+      types[count] = RS_CONFIG_ENCODER_X265;
+      names[count++] = "x265";
+   } else {
+      types[count] = RS_CONFIG_ENCODER_X264;
+      names[count++] = "x264";
+      types[count] = RS_CONFIG_ENCODER_OPENH264;
+      names[count++] = "OpenH264";
    }
 
-   if (rsConfig.videoEncoder == RS_CONFIG_ENCODER_HEVC) {
-      if ((ret = rsX265EncoderCreate(encoder, params)) >= 0) {
-         av_log(NULL, AV_LOG_INFO, "Created x265 encoder\n");
+   for (int i = 0; i < count; ++i) {
+      if (videoEncoderTry(encoder, params, hwFrames, types[i], names[i]) >= 0) {
+         rsProbeSet("encoder", types[i]);
          return 0;
       }
-      av_log(NULL, AV_LOG_WARNING, "Failed to create x265 encoder: %s\n",
-             av_err2str(ret));
-
-      return AVERROR(ENOSYS);
    }
+   return AVERROR(ENOSYS);
+}
 
-   if ((ret = rsX264EncoderCreate(encoder, params)) >= 0) {
-      av_log(NULL, AV_LOG_INFO, "Created x264 encoder\n");
-      return 0;
-   }
-   av_log(NULL, AV_LOG_WARNING, "Failed to create x264 encoder: %s\n", av_err2str(ret));
+void rsVideoEncoderFail(const RSEncoder *encoder) {
+   encoderFailed |= 1 << encoder->type;
+}
 
-   if ((ret = rsOpenH264EncoderCreate(encoder, params)) >= 0) {
-      av_log(NULL, AV_LOG_INFO, "Created OpenH264 encoder\n");
+int rsVideoEncoderFailover(RSEncoder *encoder, const AVCodecParameters *params,
+                           const AVBufferRef *hwFrames) {
+   int ret;
+   if ((ret = rsVideoEncoderCreate(encoder, params, hwFrames)) >= 0) {
       return 0;
    }
-   av_log(NULL, AV_LOG_WARNING, "Failed to create OpenH264 encoder: %s\n",
-          av_err2str(ret));
 
-   return AVERROR(ENOSYS);
+   // Every backend has failed at some point, give them all another go since a driver
+   // reset might have fixed the one that failed first
+   av_log(NULL, AV_LOG_WARNING, "No video encoders left, trying them all again\n");
+   encoderFailed = 0;
+   return rsVideoEncoderCreate(encoder, params, hwFrames);
 }
@@ -22,12 +22,18 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 
+// AV1 quantizers go up to 63 instead of 51
+#define RS_SVTAV1_QUALITY(quality) ((quality)*63 / 51)
+
 typedef struct RSEncoder {
    AVCodecParameters *params;
    void *extra;
    void (*destroy)(struct RSEncoder *encoder);
    int (*sendFrame)(struct RSEncoder *encoder, AVFrame *frame);
    int (*nextPacket)(struct RSEncoder *encoder, AVPacket *packet);
+   int (*reset)(struct RSEncoder *encoder);
+   // The backend rsVideoEncoderCreate picked
+   int type;
 } RSEncoder;
 
 static av_always_inline int rsEncoderSendFrame(RSEncoder *encoder, AVFrame *frame) {
@@ -38,17 +44,42 @@ static av_always_inline int rsEncoderNextPacket(RSEncoder *encoder, AVPacket *pa
    return encoder->nextPacket(encoder, packet);
 }
 
+// Makes a flushed encoder ready to be used again, not every encoder supports this
+static av_always_inline int rsEncoderReset(RSEncoder *encoder) {
+   if (encoder->reset == NULL) {
+      return AVERROR(ENOSYS);
+   }
+   return encoder->reset(encoder);
+}
+
 int rsEncoderCreate(RSEncoder *encoder);
 void rsEncoderDestroy(RSEncoder *encoder);
 
-int rsX264EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params);
+int rsX264EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params,
+                        const AVBufferRef *hwFrames);
 int rsOpenH264EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params);
-int rsX265EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params);
+int rsX265EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params,
+                        const AVBufferRef *hwFrames);
+int rsSvtAv1EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params);
+int rsVp9EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params);
 int rsVaapiH264EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params,
                              const AVBufferRef *hwFrames);
 int rsVaapiHevcEncoderCreate(RSEncoder *encoder, const AVCodecParameters *params,
                              const AVBufferRef *hwFrames);
 int rsVideoEncoderCreate(RSEncoder *encoder, const AVCodecParameters *params,
                          const AVBufferRef *hwFrames);
+// Creates exactly this backend, without the probe cache or skipping failed backends
+int rsVideoEncoderCreateType(RSEncoder *encoder, const AVCodecParameters *params,
+                             const AVBufferRef *hwFrames, int type);
+// The filters a software encoder needs in front of it to take hardware frames, and the
+// size of the frames that come out of them
+int rsVideoEncoderDownload(const AVCodecParameters *params, char **filter, int *width,
+                           int *height);
+int rsVideoEncoderIsSoftware(int type);
+// Marks the backend as failed so the next video encoder is created with another one
+void rsVideoEncoderFail(const RSEncoder *encoder);
+int rsVideoEncoderFailover(RSEncoder *encoder, const AVCodecParameters *params,
+                           const AVBufferRef *hwFrames);
+int rsFaultEncoderCreate(RSEncoder *encoder, RSEncoder *inner, int frames);
 
 #endif
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "../util.h"
+#include "encoder.h"
+
+typedef struct FaultEncoder {
+   RSEncoder inner;
+   int frames;
+   int count;
+} FaultEncoder;
+
+static void faultEncoderDestroy(RSEncoder *encoder) {
+   FaultEncoder *fault = encoder->extra;
+   if (fault != NULL) {
+      rsEncoderDestroy(&fault->inner);
+      av_freep(&encoder->extra);
+   }
+}
+
+static int faultEncoderSendFrame(RSEncoder *encoder, AVFrame *frame) {
+   FaultEncoder *fault = encoder->extra;
+   if (frame != NULL && ++fault->count >= fault->frames) {
+      av_frame_unref(frame);
+      av_log(NULL, AV_LOG_WARNING, "Injecting video encoder fault\n");
+      return AVERROR_EXTERNAL;
+   }
+   return rsEncoderSendFrame(&fault->inner, frame);
+}
+
+static int faultEncoderNextPacket(RSEncoder *encoder, AVPacket *packet) {
+   FaultEncoder *fault = encoder->extra;
+   return rsEncoderNextPacket(&fault->inner, packet);
+}
+
+static int faultEncoderReset(RSEncoder *encoder) {
+   FaultEncoder *fault = encoder->extra;
+   fault->count = 0;
+   return rsEncoderReset(&fault->inner);
+}
+
+int rsFaultEncoderCreate(RSEncoder *encoder, RSEncoder *inner, int frames) {
+   int ret;
+   if ((ret = rsEncoderCreate(encoder)) < 0) {
+      goto error;
+   }
+
+   FaultEncoder *fault = av_mallocz(sizeof(FaultEncoder));
+   encoder->extra = fault;
+   encoder->destroy = faultEncoderDestroy;
+   encoder->sendFrame = faultEncoderSendFrame;
+   encoder->nextPacket = faultEncoderNextPacket;
+   encoder->reset = faultEncoderReset;
+   encoder->type = inner->type;
+   if (fault == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto error;
+   }
+   if ((ret = avcodec_parameters_copy(encoder->params, inner->params)) < 0) {
+      goto error;
+   }
+
+   // The fault encoder owns the inner encoder from here on
+   fault->inner = *inner;
+   fault->frames = frames;
+   rsClear(inner, sizeof(RSEncoder));
+   return 0;
+error:
+   rsEncoderDestroy(inner);
+   rsEncoderDestroy(encoder);
+   return ret;
+}
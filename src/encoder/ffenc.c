@@ -132,6 +132,13 @@ static int ffmpegEncoderNextPacket(RSEncoder *encoder, AVPacket *packet) {
    return 0;
 }
 
+static int ffmpegEncoderReset(RSEncoder *encoder) {
+   // Flushing only sends EOF to the encoder so the filter graph can be reused as is
+   FFmpegEncoder *ffmpeg = encoder->extra;
+   avcodec_flush_buffers(ffmpeg->codecCtx);
+   return 0;
+}
+
 int rsFFmpegEncoderCreate(RSEncoder *encoder, const char *name, const char *filterFmt,
                           ...) {
    int ret;
@@ -145,6 +152,7 @@ int rsFFmpegEncoderCreate(RSEncoder *encoder, const char *name, const char *filt
    encoder->destroy = ffmpegEncoderDestroy;
    encoder->sendFrame = ffmpegEncoderSendFrame;
    encoder->nextPacket = ffmpegEncoderNextPacket;
+   encoder->reset = ffmpegEncoderReset;
    if (ffmpeg == NULL) {
       ret = AVERROR(ENOMEM);
       goto error;
@@ -337,6 +345,14 @@ int rsFFmpegEncoderOpen(RSEncoder *encoder, const AVCodecParameters *params,
       goto error;
    }
    rsOptionsDestroy(&ffmpeg->options);
+   // Without the capability flushing is a no-op, and the encoder stays at EOF
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+   if (!(ffmpeg->codecCtx->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH)) {
+      encoder->reset = NULL;
+   }
+#else
+   encoder->reset = NULL;
+#endif
 
    if ((ret = avcodec_parameters_from_context(encoder->params, ffmpeg->codecCtx)) < 0) {
       goto error;
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "../config.h"
+#include "../util.h"
+#include "encoder.h"
+#include "ffenc.h"
+
+int rsSvtAv1EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params) {
+   int ret;
+   int scaleWidth = params->width;
+   int scaleHeight = params->height;
+   rsScaleSize(&scaleWidth, &scaleHeight);
+   if ((ret = rsFFmpegEncoderCreate(encoder, "libsvtav1", "scale=%ix%i,format=yuv420p",
+                                    scaleWidth, scaleHeight)) < 0) {
+      goto error;
+   }
+
+   AVCodecContext *codecCtx = rsFFmpegEncoderGetContext(encoder);
+   codecCtx->profile = FF_PROFILE_AV1_MAIN;
+   if (rsConfig.videoQuality != RS_CONFIG_AUTO) {
+      int quality = RS_SVTAV1_QUALITY(rsConfig.videoQuality);
+      rsFFmpegEncoderSetOption(encoder, "qp", "%i", quality);
+      // Older versions of the wrapper only know qp so it is always set as a fallback
+      if (rsConfig.videoPreset != RS_CONFIG_PRESET_FAST ||
+          rsConfig.videoBitrate != RS_CONFIG_AUTO) {
+         rsFFmpegEncoderSetOption(encoder, "crf", "%i", quality);
+      }
+   }
+   if (rsConfig.videoBitrate != RS_CONFIG_AUTO) {
+      rsFFmpegEncoderSetOption(encoder, "rc", "vbr");
+      codecCtx->rc_max_rate = rsConfig.videoBitrate;
+      codecCtx->rc_buffer_size = (int)rsConfig.videoBitrate;
+   }
+   // Only presets 10 and up are fast enough to keep up with real-time capture
+   switch (rsConfig.videoPreset) {
+   case RS_CONFIG_PRESET_FAST:
+      rsFFmpegEncoderSetOption(encoder, "preset", "12");
+      break;
+   case RS_CONFIG_PRESET_MEDIUM:
+      rsFFmpegEncoderSetOption(encoder, "preset", "11");
+      break;
+   case RS_CONFIG_PRESET_SLOW:
+      rsFFmpegEncoderSetOption(encoder, "preset", "10");
+      break;
+   }
+   if ((ret = rsFFmpegEncoderOpen(encoder, params, NULL)) < 0) {
+      goto error;
+   }
+
+   return 0;
+error:
+   rsEncoderDestroy(encoder);
+   return ret;
+}
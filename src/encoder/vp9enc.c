@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "../config.h"
+#include "../util.h"
+#include "encoder.h"
+#include "ffenc.h"
+#include <libavutil/cpu.h>
+
+// VP9 quantizers go up to 63 instead of 51
+#define VP9_QUALITY(quality) ((quality)*63 / 51)
+
+int rsVp9EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params) {
+   int ret;
+   int scaleWidth = params->width;
+   int scaleHeight = params->height;
+   rsScaleSize(&scaleWidth, &scaleHeight);
+   if ((ret = rsFFmpegEncoderCreate(encoder, "libvpx-vp9", "scale=%ix%i,format=yuv420p",
+                                    scaleWidth, scaleHeight)) < 0) {
+      goto error;
+   }
+
+   AVCodecContext *codecCtx = rsFFmpegEncoderGetContext(encoder);
+   codecCtx->profile = FF_PROFILE_VP9_0;
+   // libvpx only scales with row based multi-threading over several tile columns
+   codecCtx->thread_count = av_cpu_count();
+   rsFFmpegEncoderSetOption(encoder, "row-mt", "true");
+   rsFFmpegEncoderSetOption(encoder, "tile-columns", "2");
+   rsFFmpegEncoderSetOption(encoder, "deadline", "realtime");
+   rsFFmpegEncoderSetOption(encoder, "lag-in-frames", "0");
+   if (rsConfig.videoQuality != RS_CONFIG_AUTO) {
+      int quality = VP9_QUALITY(rsConfig.videoQuality);
+      rsFFmpegEncoderSetOption(encoder, "crf", "%i", quality);
+      if (rsConfig.videoPreset == RS_CONFIG_PRESET_FAST &&
+          rsConfig.videoBitrate == RS_CONFIG_AUTO) {
+         codecCtx->qmin = quality;
+         codecCtx->qmax = quality;
+      }
+   }
+   if (rsConfig.videoBitrate != RS_CONFIG_AUTO) {
+      codecCtx->rc_max_rate = rsConfig.videoBitrate;
+      codecCtx->rc_buffer_size = (int)rsConfig.videoBitrate;
+   }
+   switch (rsConfig.videoPreset) {
+   case RS_CONFIG_PRESET_FAST:
+      rsFFmpegEncoderSetOption(encoder, "cpu-used", "8");
+      break;
+   case RS_CONFIG_PRESET_MEDIUM:
+      rsFFmpegEncoderSetOption(encoder, "cpu-used", "7");
+      break;
+   case RS_CONFIG_PRESET_SLOW:
+      rsFFmpegEncoderSetOption(encoder, "cpu-used", "6");
+      break;
+   }
+   if ((ret = rsFFmpegEncoderOpen(encoder, params, NULL)) < 0) {
+      goto error;
+   }
+
+   return 0;
+error:
+   rsEncoderDestroy(encoder);
+   return ret;
+}
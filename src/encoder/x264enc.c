@@ -22,18 +22,27 @@
 #include "encoder.h"
 #include "ffenc.h"
 
-int rsX264EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params) {
+int rsX264EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params,
+                        const AVBufferRef *hwFrames) {
    int ret;
-   int scaleWidth = params->width;
-   int scaleHeight = params->height;
+   char *download = NULL;
+   int scaleWidth;
+   int scaleHeight;
+   if ((ret = rsVideoEncoderDownload(params, &download, &scaleWidth, &scaleHeight)) < 0) {
+      return ret;
+   }
    rsScaleSize(&scaleWidth, &scaleHeight);
-   if ((ret = rsFFmpegEncoderCreate(encoder, "libx264", "scale=%ix%i,format=yuv420p",
-                                    scaleWidth, scaleHeight)) < 0) {
+   if ((ret = rsFFmpegEncoderCreate(encoder, "libx264", "%sscale=%ix%i,format=yuv420p",
+                                    download, scaleWidth, scaleHeight)) < 0) {
       goto error;
    }
+   av_freep(&download);
 
    AVCodecContext *codecCtx = rsFFmpegEncoderGetContext(encoder);
    rsFFmpegEncoderSetOption(encoder, "forced-idr", "true");
+   if (rsConfig.videoRefresh == RS_CONFIG_REFRESH_INTRA) {
+      rsFFmpegEncoderSetOption(encoder, "intra-refresh", "true");
+   }
    if (rsConfig.videoQuality != RS_CONFIG_AUTO) {
       if (rsConfig.videoPreset == RS_CONFIG_PRESET_FAST &&
           rsConfig.videoBitrate == RS_CONFIG_AUTO) {
@@ -57,12 +66,13 @@ int rsX264EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params) {
       rsFFmpegEncoderSetOption(encoder, "preset", "slower");
       break;
    }
-   if ((ret = rsFFmpegEncoderOpen(encoder, params, NULL)) < 0) {
+   if ((ret = rsFFmpegEncoderOpen(encoder, params, hwFrames)) < 0) {
       goto error;
    }
 
    return 0;
 error:
+   av_freep(&download);
    rsEncoderDestroy(encoder);
    return ret;
 }
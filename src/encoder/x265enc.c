@@ -22,22 +22,35 @@
 #include "encoder.h"
 #include "ffenc.h"
 
-int rsX265EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params) {
+int rsX265EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params,
+                        const AVBufferRef *hwFrames) {
    int ret;
-   int scaleWidth = params->width;
-   int scaleHeight = params->height;
+   char *download = NULL;
+   int scaleWidth;
+   int scaleHeight;
+   if ((ret = rsVideoEncoderDownload(params, &download, &scaleWidth, &scaleHeight)) < 0) {
+      return ret;
+   }
    rsScaleSize(&scaleWidth, &scaleHeight);
-   if ((ret = rsFFmpegEncoderCreate(encoder, "libx265", "scale=%ix%i,format=yuv420p",
-                                    scaleWidth, scaleHeight)) < 0) {
+   if ((ret = rsFFmpegEncoderCreate(encoder, "libx265", "%sscale=%ix%i,format=yuv420p",
+                                    download, scaleWidth, scaleHeight)) < 0) {
       goto error;
    }
+   av_freep(&download);
 
    AVCodecContext *codecCtx = rsFFmpegEncoderGetContext(encoder);
    codecCtx->profile = FF_PROFILE_HEVC_MAIN;
    rsFFmpegEncoderSetOption(encoder, "forced-idr", "true");
+   // Both of these go through x265-params so they have to be set together
+   const char *refresh = "";
+   if (rsConfig.videoRefresh == RS_CONFIG_REFRESH_INTRA) {
+      refresh = "intra-refresh=1";
+      rsFFmpegEncoderSetOption(encoder, "x265-params", "%s", refresh);
+   }
    if (rsConfig.videoQuality != RS_CONFIG_AUTO) {
       if (rsConfig.videoPreset == RS_CONFIG_PRESET_FAST) {
-         rsFFmpegEncoderSetOption(encoder, "x265-params", "qp=%i", rsConfig.videoQuality);
+         rsFFmpegEncoderSetOption(encoder, "x265-params", "qp=%i%s%s",
+                                  rsConfig.videoQuality, refresh[0] ? ":" : "", refresh);
       } else {
          rsFFmpegEncoderSetOption(encoder, "crf", "%i", rsConfig.videoQuality);
       }
@@ -53,12 +66,13 @@ int rsX265EncoderCreate(RSEncoder *encoder, const AVCodecParameters *params) {
       rsFFmpegEncoderSetOption(encoder, "preset", "slower");
       break;
    }
-   if ((ret = rsFFmpegEncoderOpen(encoder, params, NULL)) < 0) {
+   if ((ret = rsFFmpegEncoderOpen(encoder, params, hwFrames)) < 0) {
       goto error;
    }
 
    return 0;
 error:
+   av_freep(&download);
    rsEncoderDestroy(encoder);
    return ret;
 }
@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "event.h"
+#include "rsbuild.h"
+#include "util.h"
+#include <libavutil/time.h>
+#ifdef RS_BUILD_POSIX_IO_FOUND
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#ifdef RS_BUILD_POSIX_IO_FOUND
+static int eventLoopWakeRead(void *extra) {
+   RSEventLoop *loop = extra;
+   char buffer[16];
+   while (read(loop->wakeFiles[0], buffer, sizeof(buffer)) > 0) {
+   }
+   return 0;
+}
+
+static int eventLoopTimeout(RSEventLoop *loop, int timeout) {
+   int64_t now = av_gettime_relative();
+   for (int i = 0; i < loop->timerCount; ++i) {
+      int64_t wait = FFMAX(loop->timers[i].next - now, 0);
+      wait = FFMIN((wait + 999) / 1000, INT_MAX);
+      if (timeout < 0 || wait < timeout) {
+         timeout = (int)wait;
+      }
+   }
+   return timeout;
+}
+
+static void eventLoopCompact(RSEventLoop *loop) {
+   int count = 0;
+   for (int i = 0; i < loop->fileCount; ++i) {
+      if (loop->files[i].fd >= 0) {
+         loop->files[count++] = loop->files[i];
+      }
+   }
+   loop->fileCount = count;
+}
+#endif
+
+static void *eventLoopThread(void *extra) {
+   int ret;
+   RSEventLoop *loop = extra;
+   while (loop->running) {
+      if ((ret = rsEventLoopRun(loop, -1)) < 0) {
+         av_log(NULL, AV_LOG_WARNING, "Event source failed: %s\n", av_err2str(ret));
+      }
+   }
+   return NULL;
+}
+
+int rsEventLoopCreate(RSEventLoop *loop) {
+#ifdef RS_BUILD_POSIX_IO_FOUND
+   int ret;
+   rsClear(loop, sizeof(RSEventLoop));
+   if (pipe(loop->wakeFiles) == -1) {
+      ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_ERROR, "Failed to create event loop pipe: %s\n",
+             av_err2str(ret));
+      return ret;
+   }
+   for (int i = 0; i < 2; ++i) {
+      fcntl(loop->wakeFiles[i], F_SETFL, O_NONBLOCK);
+      fcntl(loop->wakeFiles[i], F_SETFD, FD_CLOEXEC);
+   }
+   if ((ret = rsEventLoopAddFile(loop, loop->wakeFiles[0], RS_EVENT_READ,
+                                 eventLoopWakeRead, loop)) < 0) {
+      goto error;
+   }
+
+   return 0;
+error:
+   rsEventLoopDestroy(loop);
+   return ret;
+
+#else
+   (void)loop;
+   av_log(NULL, AV_LOG_ERROR, "Posix I/O was not found during compilation\n");
+   return AVERROR(ENOSYS);
+#endif
+}
+
+void rsEventLoopDestroy(RSEventLoop *loop) {
+#ifdef RS_BUILD_POSIX_IO_FOUND
+   loop->running = 0;
+   rsEventLoopWake(loop);
+   rsThreadDestroy(&loop->thread);
+   for (int i = 0; i < 2; ++i) {
+      if (loop->wakeFiles[i] > 0) {
+         close(loop->wakeFiles[i]);
+         loop->wakeFiles[i] = -1;
+      }
+   }
+   loop->fileCount = 0;
+   loop->timerCount = 0;
+
+#else
+   (void)loop;
+#endif
+}
+
+int rsEventLoopAddFile(RSEventLoop *loop, int fd, int events, RSEventCallback callback,
+                       void *extra) {
+   if (loop->fileCount >= RS_EVENT_MAX_FILES) {
+      av_log(NULL, AV_LOG_ERROR, "Too many event loop files\n");
+      return AVERROR(ENOSPC);
+   }
+   loop->files[loop->fileCount++] = (RSEventFile){
+       .fd = fd,
+       .events = events,
+       .callback = callback,
+       .extra = extra,
+   };
+   return 0;
+}
+
+void rsEventLoopRemoveFile(RSEventLoop *loop, int fd) {
+   // Files are only marked here and compacted at the end of the next iteration, so
+   // callbacks can remove files while the loop is dispatching
+   for (int i = 0; i < loop->fileCount; ++i) {
+      if (loop->files[i].fd == fd) {
+         loop->files[i].fd = -1;
+      }
+   }
+}
+
+int rsEventLoopAddTimer(RSEventLoop *loop, int64_t interval, RSEventCallback callback,
+                        void *extra) {
+   if (loop->timerCount >= RS_EVENT_MAX_TIMERS) {
+      av_log(NULL, AV_LOG_ERROR, "Too many event loop timers\n");
+      return AVERROR(ENOSPC);
+   }
+   loop->timers[loop->timerCount++] = (RSEventTimer){
+       .interval = interval,
+       .next = av_gettime_relative() + interval,
+       .callback = callback,
+       .extra = extra,
+   };
+   return 0;
+}
+
+int rsEventLoopRun(RSEventLoop *loop, int timeout) {
+#ifdef RS_BUILD_POSIX_IO_FOUND
+   int ret;
+   int error = 0;
+   struct pollfd fds[RS_EVENT_MAX_FILES];
+   int count = loop->fileCount;
+   for (int i = 0; i < count; ++i) {
+      const RSEventFile *file = &loop->files[i];
+      fds[i] = (struct pollfd){.fd = file->fd};
+      if (file->events & RS_EVENT_READ) {
+         fds[i].events |= POLLIN;
+      }
+      if (file->events & RS_EVENT_PRIORITY) {
+         fds[i].events |= POLLPRI;
+      }
+   }
+   if (poll(fds, (nfds_t)count, eventLoopTimeout(loop, timeout)) == -1) {
+      if (errno == EINTR) {
+         return 0;
+      }
+      ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_ERROR, "Failed to poll event loop: %s\n", av_err2str(ret));
+      return ret;
+   }
+
+   for (int i = 0; i < count; ++i) {
+      RSEventFile *file = &loop->files[i];
+      if (fds[i].revents == 0 || file->fd != fds[i].fd) {
+         continue;
+      }
+      if ((ret = file->callback(file->extra)) < 0) {
+         // A failing source would otherwise keep waking us up
+         file->fd = -1;
+         error = ret;
+      }
+   }
+
+   int64_t now = av_gettime_relative();
+   for (int i = 0; i < loop->timerCount; ++i) {
+      RSEventTimer *timer = &loop->timers[i];
+      if (now < timer->next) {
+         continue;
+      }
+      timer->next += timer->interval;
+      if (timer->next <= now) {
+         timer->next = now + timer->interval;
+      }
+      if ((ret = timer->callback(timer->extra)) < 0) {
+         av_log(NULL, AV_LOG_WARNING, "Event loop timer failed: %s\n", av_err2str(ret));
+      }
+   }
+
+   eventLoopCompact(loop);
+   return error;
+
+#else
+   (void)loop;
+   (void)timeout;
+   return AVERROR(ENOSYS);
+#endif
+}
+
+int rsEventLoopStart(RSEventLoop *loop) {
+   int ret;
+   loop->running = 1;
+   if ((ret = rsThreadCreate(&loop->thread, eventLoopThread, loop)) < 0) {
+      loop->running = 0;
+      return ret;
+   }
+   return 0;
+}
+
+void rsEventLoopWake(RSEventLoop *loop) {
+#ifdef RS_BUILD_POSIX_IO_FOUND
+   if (loop->wakeFiles[1] > 0) {
+      char c = 0;
+      if (write(loop->wakeFiles[1], &c, 1) == -1 && errno != EAGAIN) {
+         av_log(NULL, AV_LOG_WARNING, "Failed to wake event loop: %s\n",
+                av_err2str(AVERROR(errno)));
+      }
+   }
+
+#else
+   (void)loop;
+#endif
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RS_EVENT_H
+#define RS_EVENT_H
+#include "thread.h"
+#include <libavutil/avutil.h>
+
+#define RS_EVENT_MAX_FILES 16
+#define RS_EVENT_MAX_TIMERS 8
+
+#define RS_EVENT_READ 1
+#define RS_EVENT_PRIORITY 2
+
+typedef int (*RSEventCallback)(void *extra);
+
+typedef struct RSEventFile {
+   int fd;
+   int events;
+   RSEventCallback callback;
+   void *extra;
+} RSEventFile;
+
+typedef struct RSEventTimer {
+   int64_t interval;
+   int64_t next;
+   RSEventCallback callback;
+   void *extra;
+} RSEventTimer;
+
+typedef struct RSEventLoop {
+   RSEventFile files[RS_EVENT_MAX_FILES];
+   int fileCount;
+   RSEventTimer timers[RS_EVENT_MAX_TIMERS];
+   int timerCount;
+   int wakeFiles[2];
+   volatile int running;
+   RSThread thread;
+} RSEventLoop;
+
+int rsEventLoopCreate(RSEventLoop *loop);
+void rsEventLoopDestroy(RSEventLoop *loop);
+int rsEventLoopAddFile(RSEventLoop *loop, int fd, int events, RSEventCallback callback,
+                       void *extra);
+void rsEventLoopRemoveFile(RSEventLoop *loop, int fd);
+int rsEventLoopAddTimer(RSEventLoop *loop, int64_t interval, RSEventCallback callback,
+                        void *extra);
+int rsEventLoopRun(RSEventLoop *loop, int timeout);
+int rsEventLoopStart(RSEventLoop *loop);
+void rsEventLoopWake(RSEventLoop *loop);
+
+#endif
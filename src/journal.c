@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "journal.h"
+#include "config.h"
+#include "log.h"
+#include "rsbuild.h"
+#include "util.h"
+#include <stdio.h>
+#ifdef RS_BUILD_JOURNAL_FOUND
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define JOURNAL_ALIGN ((uint64_t)8)
+
+static RSJournalHeader *journalHeader = NULL;
+static size_t journalSize = 0;
+static int journalFile = -1;
+static int journalWait = -1;
+static int journalChild = 0;
+
+static uint8_t *journalData(const RSJournalHeader *header) {
+   return (uint8_t *)header + RS_JOURNAL_HEADER_SIZE;
+}
+
+static uint64_t journalSkipWrap(const RSJournalHeader *header, uint64_t pos) {
+   uint64_t offset = pos % header->dataSize;
+   uint64_t remaining = header->dataSize - offset;
+   if (remaining < sizeof(RSJournalRecord)) {
+      return pos + remaining;
+   }
+   const RSJournalRecord *record = (const void *)(journalData(header) + offset);
+   return record->magic == RS_JOURNAL_WRAP ? pos + remaining : pos;
+}
+
+const RSJournalRecord *rsJournalNext(const RSJournalHeader *header, uint64_t *pos,
+                                     uint64_t head) {
+   uint64_t at = journalSkipWrap(header, *pos);
+   if (at >= head) {
+      return NULL;
+   }
+   const RSJournalRecord *record =
+       (const void *)(journalData(header) + at % header->dataSize);
+   if (record->magic != RS_JOURNAL_RECORD || record->size < 0) {
+      return NULL;
+   }
+   uint64_t size =
+       FFALIGN(sizeof(RSJournalRecord) + (uint64_t)record->size, JOURNAL_ALIGN);
+   if (at + size > head) {
+      return NULL;
+   }
+   *pos = at + size;
+   return record;
+}
+
+int rsJournalInit(void) {
+#ifdef RS_BUILD_JOURNAL_FOUND
+   int ret;
+   int files[2] = {-1, -1};
+   if (rsConfig.bufferCrashSize == 0) {
+      return 0;
+   }
+
+   size_t dataSize = (size_t)rsConfig.bufferCrashSize * 1024 * 1024;
+   journalFile = memfd_create("replay-sorcery-journal", MFD_CLOEXEC);
+   if (journalFile == -1) {
+      ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_ERROR, "Failed to create crash journal: %s\n", av_err2str(ret));
+      goto error;
+   }
+   if (ftruncate(journalFile, (off_t)(RS_JOURNAL_HEADER_SIZE + dataSize)) == -1) {
+      ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_ERROR, "Failed to size crash journal: %s\n", av_err2str(ret));
+      goto error;
+   }
+   void *mem = mmap(NULL, RS_JOURNAL_HEADER_SIZE + dataSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, journalFile, 0);
+   if (mem == MAP_FAILED) {
+      ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_ERROR, "Failed to map crash journal: %s\n", av_err2str(ret));
+      goto error;
+   }
+   journalHeader = mem;
+   journalSize = RS_JOURNAL_HEADER_SIZE + dataSize;
+   journalHeader->magic = RS_JOURNAL_MAGIC;
+   journalHeader->state = RS_JOURNAL_RUNNING;
+   journalHeader->dataSize = dataSize;
+
+   // The watchdog waits for the other end of the pipe to close, which happens however
+   // this process exits
+   if (pipe2(files, O_CLOEXEC) == -1) {
+      ret = AVERROR(errno);
+      goto error;
+   }
+   char memArg[16];
+   char waitArg[16];
+   snprintf(memArg, sizeof(memArg), "%i", journalFile);
+   snprintf(waitArg, sizeof(waitArg), "%i", files[0]);
+   pid_t pid = fork();
+   if (pid == -1) {
+      ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_ERROR, "Failed to fork: %s\n", av_err2str(ret));
+      goto error;
+   }
+   if (pid == 0) {
+      // Only async-signal-safe calls are allowed after forking a threaded process
+      fcntl(journalFile, F_SETFD, 0);
+      fcntl(files[0], F_SETFD, 0);
+      execl("/proc/self/exe", "replay-sorcery", "journal-watchdog", memArg, waitArg,
+            (char *)NULL);
+      _exit(127);
+   }
+   close(files[0]);
+   journalWait = files[1];
+   journalChild = pid;
+   av_log(NULL, AV_LOG_INFO, "Started crash watchdog with a %i MiB journal\n",
+          rsConfig.bufferCrashSize);
+   return 0;
+
+error:
+   if (files[0] != -1) {
+      close(files[0]);
+      close(files[1]);
+   }
+   rsJournalExit(0);
+   return ret;
+#else
+   if (rsConfig.bufferCrashSize != 0) {
+      av_log(NULL, AV_LOG_WARNING, "Crash journal is not supported on this system\n");
+   }
+   return 0;
+#endif
+}
+
+void rsJournalExit(int recover) {
+#ifdef RS_BUILD_JOURNAL_FOUND
+   if (journalHeader != NULL) {
+      if (!recover) {
+         __atomic_store_n(&journalHeader->state, RS_JOURNAL_CLOSED, __ATOMIC_RELEASE);
+      }
+      munmap(journalHeader, journalSize);
+      journalHeader = NULL;
+   }
+   if (journalWait != -1) {
+      close(journalWait);
+      journalWait = -1;
+   }
+   if (journalFile != -1) {
+      close(journalFile);
+      journalFile = -1;
+   }
+   if (journalChild > 0) {
+      // Wait for the watchdog to finish saving
+      while (waitpid(journalChild, NULL, 0) == -1 && errno == EINTR) {
+      }
+      journalChild = 0;
+   }
+#else
+   (void)recover;
+#endif
+}
+
+void rsJournalSetParams(const AVCodecParameters *params) {
+   RSJournalHeader *header = journalHeader;
+   if (header == NULL) {
+      return;
+   }
+   __atomic_store_n(&header->paramsValid, 0, __ATOMIC_RELEASE);
+   __atomic_store_n(&header->tail, header->head, __ATOMIC_RELEASE);
+   if (params->extradata_size > RS_JOURNAL_MAX_EXTRADATA) {
+      av_log(NULL, AV_LOG_WARNING, "Video headers are too large for the crash journal\n");
+      return;
+   }
+
+   header->codecID = params->codec_id;
+   header->format = params->format;
+   header->width = params->width;
+   header->height = params->height;
+   header->profile = params->profile;
+   header->level = params->level;
+   header->extradataSize = params->extradata_size;
+   if (params->extradata_size > 0) {
+      memcpy(header->extradata, params->extradata, (size_t)params->extradata_size);
+   }
+   __atomic_store_n(&header->paramsValid, 1, __ATOMIC_RELEASE);
+}
+
+void rsJournalAdd(const AVPacket *packet) {
+   RSJournalHeader *header = journalHeader;
+   if (header == NULL || !header->paramsValid) {
+      return;
+   }
+   uint64_t dataSize = header->dataSize;
+   uint64_t size =
+       FFALIGN(sizeof(RSJournalRecord) + (uint64_t)packet->size, JOURNAL_ALIGN);
+   if (size > dataSize / 2) {
+      RS_LOG_LIMITED(NULL, AV_LOG_WARNING,
+                     "Packet of %i bytes is too large for the crash journal\n",
+                     packet->size);
+      return;
+   }
+
+   // Records are never split, the end of the data is skipped instead
+   uint64_t head = header->head;
+   uint64_t offset = head % dataSize;
+   uint64_t start = dataSize - offset < size ? head + dataSize - offset : head;
+   uint64_t tail = header->tail;
+   while (start + size - tail > dataSize) {
+      if (rsJournalNext(header, &tail, head) == NULL) {
+         tail = head;
+         break;
+      }
+   }
+   __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+
+   uint8_t *data = journalData(header);
+   if (start != head && dataSize - offset >= sizeof(RSJournalRecord)) {
+      ((RSJournalRecord *)(data + offset))->magic = RS_JOURNAL_WRAP;
+   }
+   RSJournalRecord *record = (RSJournalRecord *)(data + start % dataSize);
+   *record = (RSJournalRecord){
+       .magic = RS_JOURNAL_RECORD,
+       .size = packet->size,
+       .flags = packet->flags,
+       .pts = packet->pts,
+       .dts = packet->dts,
+   };
+   memcpy(record + 1, packet->data, (size_t)packet->size);
+   __atomic_store_n(&header->head, start + size, __ATOMIC_RELEASE);
+}
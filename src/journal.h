@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RS_JOURNAL_H
+#define RS_JOURNAL_H
+#include <libavcodec/avcodec.h>
+
+#define RS_JOURNAL_MAGIC MKTAG('R', 'S', 'J', 'H')
+#define RS_JOURNAL_RECORD MKTAG('R', 'S', 'J', 'P')
+#define RS_JOURNAL_WRAP MKTAG('R', 'S', 'J', 'W')
+#define RS_JOURNAL_RUNNING 1
+#define RS_JOURNAL_CLOSED 2
+#define RS_JOURNAL_MAX_EXTRADATA 4096
+#define RS_JOURNAL_HEADER_SIZE 8192
+
+// A copy of the video packets in shared memory which the watchdog process saves if the
+// main process dies. Records are written before the head is moved past them and the tail
+// is moved past records before they are overwritten, so everything between the two is
+// complete no matter where the writer stopped.
+typedef struct RSJournalHeader {
+   uint32_t magic;
+   uint32_t state;
+   uint64_t dataSize;
+   uint64_t tail;
+   uint64_t head;
+   // Cleared while the parameters are being rewritten
+   uint32_t paramsValid;
+   int32_t codecID;
+   int32_t format;
+   int32_t width;
+   int32_t height;
+   int32_t profile;
+   int32_t level;
+   int32_t extradataSize;
+   uint8_t extradata[RS_JOURNAL_MAX_EXTRADATA];
+} RSJournalHeader;
+
+// Followed by the packet data, padded to 8 bytes
+typedef struct RSJournalRecord {
+   uint32_t magic;
+   int32_t size;
+   int32_t flags;
+   uint32_t reserved;
+   int64_t pts;
+   int64_t dts;
+} RSJournalRecord;
+
+int rsJournalInit(void);
+// Unless recover is set the watchdog is told that the exit was clean
+void rsJournalExit(int recover);
+// Starts the journal over since the older packets cannot be decoded with new parameters
+void rsJournalSetParams(const AVCodecParameters *params);
+void rsJournalAdd(const AVPacket *packet);
+// Returns the record at pos and moves pos past it, NULL at the head or a damaged record
+const RSJournalRecord *rsJournalNext(const RSJournalHeader *header, uint64_t *pos,
+                                     uint64_t head);
+
+#endif
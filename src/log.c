@@ -19,16 +19,71 @@
 
 #include "log.h"
 #include "config.h"
+#include "rsbuild.h"
 #include "thread.h"
+#include "util.h"
 #include <backtrace.h>
 #include <libavutil/avutil.h>
+#include <libavutil/time.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
+#if defined(RS_BUILD_POSIX_IO_FOUND) && defined(RS_BUILD_PTHREAD_FOUND)
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LOG_ASYNC
+#endif
+
+#define LOG_RING_SIZE 64
+#define LOG_MESSAGE_SIZE 1024
+#define LOG_TRACE_SIZE 32
+// How long the drain thread sleeps for when there is nothing to write, in milliseconds
+#define LOG_DRAIN_INTERVAL 1000
+// How long a fatal message waits for queued messages to be written, in microseconds
+#define LOG_FLUSH_TIMEOUT 100000
+
+typedef struct LogRecord {
+   uint64_t seq;
+   int level;
+   int traceSize;
+   uintptr_t trace[LOG_TRACE_SIZE];
+   char message[LOG_MESSAGE_SIZE];
+} LogRecord;
+
+// Single producer, single consumer ring. Each thread that logs claims its own ring and
+// the drain thread is the only consumer.
+typedef struct LogRing {
+   struct LogRing *next;
+   int owned;
+   unsigned head;
+   unsigned tail;
+   unsigned dropped;
+   LogRecord records[LOG_RING_SIZE];
+} LogRing;
 
 static struct backtrace_state *traceState = NULL;
-static RSMutex silenceMutex;
-static int silenceCounter;
+static FILE *logFile = NULL;
+static int logJournal = 0;
+static int logLineStart = 1;
+
+#ifdef LOG_ASYNC
+static LogRing *logRings = NULL;
+static RSLogLimit *logLimits = NULL;
+static int64_t logLimitTime = 0;
+static uint64_t logSeq = 0;
+static int logRunning = 0;
+static int logSleeping = 0;
+static int logWakeFiles[2] = {-1, -1};
+static pthread_key_t logRingKey;
+static RSThread logThread;
+static __thread LogRing *logRing = NULL;
+static __thread int logDraining = 0;
+#endif
+static __thread int logPrefix = 1;
 
 static void logDefault(void *ctx, int level, const char *format, ...) {
    va_list args;
@@ -37,9 +92,49 @@ static void logDefault(void *ctx, int level, const char *format, ...) {
    va_end(args);
 }
 
+static int logPriority(int level) {
+   // Syslog priorities understood by journald on a service's standard error
+   if (level <= AV_LOG_PANIC) {
+      return 0;
+   } else if (level <= AV_LOG_FATAL) {
+      return 2;
+   } else if (level <= AV_LOG_ERROR) {
+      return 3;
+   } else if (level <= AV_LOG_WARNING) {
+      return 4;
+   } else if (level <= AV_LOG_INFO) {
+      return 6;
+   } else {
+      return 7;
+   }
+}
+
+static void logWrite(int level, const char *message) {
+   if (logJournal) {
+      for (const char *line = message; *line != 0;) {
+         const char *end = strchr(line, '\n');
+         int size = end == NULL ? (int)strlen(line) : (int)(end - line + 1);
+         if (logLineStart) {
+            fprintf(stderr, "<%i>", logPriority(level));
+         }
+         fprintf(stderr, "%.*s", size, line);
+         logLineStart = end != NULL;
+         line += size;
+      }
+   } else {
+      logDefault(NULL, level, "%s", message);
+   }
+   FILE *file = __atomic_load_n(&logFile, __ATOMIC_ACQUIRE);
+   if (file != NULL) {
+      fputs(message, file);
+   }
+}
+
 static void logTraceError(void *extra, const char *message, int error) {
    (void)extra;
-   logDefault(NULL, AV_LOG_WARNING, "Backtrace error: %s (%i)\n", message, error);
+   char line[LOG_MESSAGE_SIZE];
+   snprintf(line, sizeof(line), "Backtrace error: %s (%i)\n", message, error);
+   logWrite(AV_LOG_WARNING, line);
 }
 
 static int logTrace(void *extra, uintptr_t pc, const char *file, int line,
@@ -47,16 +142,332 @@ static int logTrace(void *extra, uintptr_t pc, const char *file, int line,
    (void)pc;
    int *level = extra;
    if (file != NULL || func != NULL) {
-      logDefault(NULL, *level, " - %s:%i (%s)\n", file, line, func);
+      char message[LOG_MESSAGE_SIZE];
+      snprintf(message, sizeof(message), " - %s:%i (%s)\n", file, line, func);
+      logWrite(*level, message);
    }
    return 0;
 }
 
-static void logCallback(void *ctx, int level, const char *format, va_list args) {
-   av_log_default_callback(ctx, level, format, args);
+static void logFormat(void *ctx, int level, const char *format, va_list args,
+                      char *message) {
+   av_log_format_line2(ctx, level, format, args, message, LOG_MESSAGE_SIZE, &logPrefix);
+}
+
+static void logSync(void *ctx, int level, const char *format, va_list args) {
+   char message[LOG_MESSAGE_SIZE];
+   logFormat(ctx, level, format, args, message);
+   logWrite(level, message);
+   if (level <= rsConfig.traceLevel && traceState != NULL) {
+      backtrace_full(traceState, 2, logTrace, logTraceError, &level);
+   }
+   if (logFile != NULL) {
+      fflush(logFile);
+   }
+}
+
+#ifdef LOG_ASYNC
+static void logRingRelease(void *extra) {
+   LogRing *ring = extra;
+   __atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+static LogRing *logRingGet(void) {
+   if (logRing != NULL) {
+      return logRing;
+   }
+
+   // Reuse the ring of a thread that has exited before allocating a new one
+   LogRing *ring = __atomic_load_n(&logRings, __ATOMIC_ACQUIRE);
+   for (; ring != NULL; ring = ring->next) {
+      int owned = 0;
+      if (__atomic_compare_exchange_n(&ring->owned, &owned, 1, 0, __ATOMIC_ACQUIRE,
+                                      __ATOMIC_RELAXED)) {
+         break;
+      }
+   }
+   if (ring == NULL) {
+      ring = av_mallocz(sizeof(LogRing));
+      if (ring == NULL) {
+         return NULL;
+      }
+      ring->owned = 1;
+      ring->next = __atomic_load_n(&logRings, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n(&logRings, &ring->next, ring, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      }
+   }
+   pthread_setspecific(logRingKey, ring);
+   logRing = ring;
+   return ring;
+}
+
+static int logTraceSimple(void *extra, uintptr_t pc) {
+   LogRecord *record = extra;
+   if (record->traceSize == LOG_TRACE_SIZE) {
+      return 1;
+   }
+   record->trace[record->traceSize++] = pc;
+   return 0;
+}
+
+static int logPush(void *ctx, int level, const char *format, va_list args) {
+   LogRing *ring = logRingGet();
+   if (ring == NULL) {
+      return AVERROR(ENOMEM);
+   }
+
+   unsigned head = ring->head;
+   if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+      __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+      return 0;
+   }
+
+   // Only the raw program counters are collected here, looking up their symbols is
+   // left to the drain thread
+   LogRecord *record = &ring->records[head % LOG_RING_SIZE];
+   record->level = level;
+   record->traceSize = 0;
    if (level <= rsConfig.traceLevel && traceState != NULL) {
-      backtrace_full(traceState, 1, logTrace, logTraceError, &level);
+      backtrace_simple(traceState, 2, logTraceSimple, logTraceError, record);
+   }
+   logFormat(ctx, level, format, args, record->message);
+   record->seq = __atomic_fetch_add(&logSeq, 1, __ATOMIC_RELAXED);
+   __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+   if (__atomic_exchange_n(&logSleeping, 0, __ATOMIC_SEQ_CST)) {
+      char wake = 0;
+      if (write(logWakeFiles[1], &wake, 1) == -1) {
+         // The drain thread will still wake up on its own
+      }
+   }
+   return 0;
+}
+
+static int logDrain(void) {
+   int count = 0;
+   LogRing *rings = __atomic_load_n(&logRings, __ATOMIC_ACQUIRE);
+   for (;;) {
+      // Merge the rings back into the order the messages were logged in
+      LogRing *next = NULL;
+      for (LogRing *ring = rings; ring != NULL; ring = ring->next) {
+         unsigned tail = ring->tail;
+         if (tail != __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)) {
+            if (next == NULL ||
+                ring->records[tail % LOG_RING_SIZE].seq <
+                    next->records[next->tail % LOG_RING_SIZE].seq) {
+               next = ring;
+            }
+         }
+      }
+      if (next == NULL) {
+         break;
+      }
+
+      LogRecord *record = &next->records[next->tail % LOG_RING_SIZE];
+      logWrite(record->level, record->message);
+      for (int i = 0; i < record->traceSize; ++i) {
+         backtrace_pcinfo(traceState, record->trace[i], logTrace, logTraceError,
+                          &record->level);
+      }
+      __atomic_store_n(&next->tail, next->tail + 1, __ATOMIC_RELEASE);
+      ++count;
+   }
+
+   for (LogRing *ring = rings; ring != NULL; ring = ring->next) {
+      unsigned dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+      if (dropped > 0) {
+         char message[LOG_MESSAGE_SIZE];
+         snprintf(message, sizeof(message), "%u log messages were dropped\n", dropped);
+         logWrite(AV_LOG_WARNING, message);
+      }
+   }
+   if (logFile != NULL) {
+      fflush(logFile);
+   }
+   return count;
+}
+
+static int logPending(void) {
+   LogRing *rings = __atomic_load_n(&logRings, __ATOMIC_ACQUIRE);
+   for (LogRing *ring = rings; ring != NULL; ring = ring->next) {
+      if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) !=
+          __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+static void logLimitRefill(void) {
+   int64_t time = av_gettime_relative();
+   if (time < logLimitTime) {
+      return;
+   }
+
+   logLimitTime = time + RS_LOG_LIMIT_INTERVAL * AV_TIME_BASE;
+   RSLogLimit *limits = __atomic_load_n(&logLimits, __ATOMIC_ACQUIRE);
+   for (RSLogLimit *limit = limits; limit != NULL; limit = limit->next) {
+      int tokens = __atomic_exchange_n(&limit->tokens, RS_LOG_LIMIT_BURST, __ATOMIC_RELAXED);
+      if (tokens < 0) {
+         int size = (int)strcspn(limit->format, "\n");
+         av_log(NULL, limit->level, "%i similar messages suppressed: %.*s\n", -tokens, size,
+                limit->format);
+      }
+   }
+}
+
+static void *logDrainThread(void *extra) {
+   (void)extra;
+   logDraining = 1;
+   while (__atomic_load_n(&logRunning, __ATOMIC_ACQUIRE)) {
+      logLimitRefill();
+      logDrain();
+      __atomic_store_n(&logSleeping, 1, __ATOMIC_SEQ_CST);
+      if (logPending()) {
+         __atomic_store_n(&logSleeping, 0, __ATOMIC_SEQ_CST);
+         continue;
+      }
+
+      struct pollfd file = {.fd = logWakeFiles[0], .events = POLLIN};
+      if (poll(&file, 1, LOG_DRAIN_INTERVAL) > 0) {
+         char wake[64];
+         while (read(logWakeFiles[0], wake, sizeof(wake)) > 0) {
+         }
+      }
+      __atomic_store_n(&logSleeping, 0, __ATOMIC_SEQ_CST);
+   }
+   logDrain();
+   return NULL;
+}
+
+static void logFlush(void) {
+   // Give the drain thread a chance to write out what was logged before this
+   int64_t timeout = av_gettime_relative() + LOG_FLUSH_TIMEOUT;
+   while (!logDraining && logPending() && av_gettime_relative() < timeout) {
+      if (__atomic_exchange_n(&logSleeping, 0, __ATOMIC_SEQ_CST)) {
+         char wake = 0;
+         if (write(logWakeFiles[1], &wake, 1) == -1) {
+            break;
+         }
+      }
+      av_usleep(1000);
+   }
+}
+
+static int logAsyncInit(void) {
+   int ret;
+   if (pipe(logWakeFiles) == -1) {
+      ret = AVERROR(errno);
+      goto error;
+   }
+   for (int i = 0; i < 2; ++i) {
+      if (fcntl(logWakeFiles[i], F_SETFL, O_NONBLOCK) == -1 ||
+          fcntl(logWakeFiles[i], F_SETFD, FD_CLOEXEC) == -1) {
+         ret = AVERROR(errno);
+         goto error;
+      }
+   }
+   if ((ret = pthread_key_create(&logRingKey, logRingRelease)) != 0) {
+      ret = AVERROR(ret);
+      goto error;
+   }
+
+   __atomic_store_n(&logRunning, 1, __ATOMIC_RELEASE);
+   if ((ret = rsThreadCreate(&logThread, logDrainThread, NULL)) < 0) {
+      __atomic_store_n(&logRunning, 0, __ATOMIC_RELEASE);
+      pthread_key_delete(logRingKey);
+      goto error;
+   }
+
+   return 0;
+error:
+   for (int i = 0; i < 2; ++i) {
+      if (logWakeFiles[i] != -1) {
+         close(logWakeFiles[i]);
+         logWakeFiles[i] = -1;
+      }
+   }
+   return ret;
+}
+
+static void logAsyncExit(void) {
+   if (__atomic_exchange_n(&logRunning, 0, __ATOMIC_ACQ_REL)) {
+      char wake = 0;
+      if (write(logWakeFiles[1], &wake, 1) == -1) {
+         // The drain thread will notice within its interval
+      }
+      rsThreadDestroy(&logThread);
+      pthread_key_delete(logRingKey);
+      for (int i = 0; i < 2; ++i) {
+         close(logWakeFiles[i]);
+         logWakeFiles[i] = -1;
+      }
+   }
+
+   logRing = NULL;
+   while (logRings != NULL) {
+      LogRing *ring = logRings;
+      logRings = ring->next;
+      av_free(ring);
+   }
+}
+
+static int logJournalCheck(void) {
+   // systemd sets this to the device and inode of the stream it connected us to
+   const char *stream = getenv("JOURNAL_STREAM");
+   unsigned long device, inode;
+   struct stat info;
+   if (stream == NULL || sscanf(stream, "%lu:%lu", &device, &inode) != 2 ||
+       fstat(STDERR_FILENO, &info) == -1) {
+      return 0;
+   }
+   return (unsigned long)info.st_dev == device && (unsigned long)info.st_ino == inode;
+}
+
+static void logLimitRegister(RSLogLimit *limit) {
+   int registered = 0;
+   if (__atomic_compare_exchange_n(&limit->registered, &registered, 1, 0,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      limit->next = __atomic_load_n(&logLimits, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n(&logLimits, &limit->next, limit, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      }
+   }
+}
+#endif
+
+int rsLogLimitCheck(RSLogLimit *limit) {
+#ifdef LOG_ASYNC
+   // The drain thread refills the tokens, without it nothing is limited
+   if (!__atomic_load_n(&logRunning, __ATOMIC_RELAXED)) {
+      return 1;
    }
+   if (!__atomic_load_n(&limit->registered, __ATOMIC_RELAXED)) {
+      logLimitRegister(limit);
+   }
+   return __atomic_sub_fetch(&limit->tokens, 1, __ATOMIC_RELAXED) >= 0;
+#else
+   (void)limit;
+   return 1;
+#endif
+}
+
+static void logCallback(void *ctx, int level, const char *format, va_list args) {
+   if (level > av_log_get_level()) {
+      return;
+   }
+#ifdef LOG_ASYNC
+   // Fatal messages are written straight away since the program might be about to end
+   if (level > AV_LOG_FATAL && __atomic_load_n(&logRunning, __ATOMIC_ACQUIRE)) {
+      if (logPush(ctx, level, format, args) >= 0) {
+         return;
+      }
+   } else {
+      logFlush();
+   }
+#endif
+   logSync(ctx, level, format, args);
 }
 
 static void logSignal(int signal) {
@@ -82,32 +493,43 @@ int rsLogInit(void) {
    signal(SIGSEGV, logSignal);
    signal(SIGILL, logSignal);
    signal(SIGFPE, logSignal);
-   av_log_set_callback(logCallback);
    traceState = backtrace_create_state(NULL, 1, logTraceError, NULL);
    rsConfig.traceLevel = AV_LOG_ERROR;
-   if ((ret = rsMutexCreate(&silenceMutex)) < 0) {
-      return ret;
+#ifdef LOG_ASYNC
+   logJournal = logJournalCheck();
+   if ((ret = logAsyncInit()) < 0) {
+      logDefault(NULL, AV_LOG_WARNING, "Failed to start logging thread: %s\n",
+                 av_err2str(ret));
    }
+#endif
+   av_log_set_callback(logCallback);
    return 0;
 }
 
 void rsLogExit(void) {
-   rsMutexDestroy(&silenceMutex);
+#ifdef LOG_ASYNC
+   logAsyncExit();
+#endif
+   av_log_set_callback(av_log_default_callback);
+   if (logFile != NULL) {
+      fclose(logFile);
+      logFile = NULL;
+   }
 }
 
-void rsLogSilence(int silence) {
-   rsMutexLock(&silenceMutex);
-   silence += silenceCounter;
-   if (silence <= 0) {
-      silence = 0;
-      if (silenceCounter > 0) {
-         av_log_set_level(rsConfig.logLevel);
-         av_log(NULL, AV_LOG_WARNING, "Logs have been unsilenced\n");
-      }
-   } else if (silenceCounter == 0) {
-      av_log(NULL, AV_LOG_WARNING, "Silencing logs for now\n");
-      av_log_set_level(AV_LOG_FATAL);
+int rsLogOpenFile(const char *path) {
+   int ret;
+   if (path == NULL || *path == 0) {
+      return 0;
    }
-   silenceCounter = silence;
-   rsMutexUnlock(&silenceMutex);
+
+   FILE *file = fopen(path, "a");
+   if (file == NULL) {
+      ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_ERROR, "Failed to open log file '%s': %s\n", path,
+             av_err2str(ret));
+      return ret;
+   }
+   __atomic_store_n(&logFile, file, __ATOMIC_RELEASE);
+   return 0;
 }
@@ -19,9 +19,34 @@
 
 #ifndef RS_UTIL_LOG_H
 #define RS_UTIL_LOG_H
+#include <libavutil/log.h>
+
+// Each rate limited callsite may log this many messages every interval (in seconds)
+#define RS_LOG_LIMIT_BURST 5
+#define RS_LOG_LIMIT_INTERVAL 10
+
+typedef struct RSLogLimit {
+   const char *format;
+   int level;
+   int tokens;
+   int registered;
+   struct RSLogLimit *next;
+} RSLogLimit;
+
+// Like av_log but only logs a few messages per interval from the same callsite, the
+// rest are counted and summarised at the end of the interval
+#define RS_LOG_LIMITED(ctx, lvl, fmt, ...)                                               \
+   do {                                                                                  \
+      static RSLogLimit rsLogLimit = {                                                   \
+          .format = fmt, .level = lvl, .tokens = RS_LOG_LIMIT_BURST};                    \
+      if (rsLogLimitCheck(&rsLogLimit)) {                                                \
+         av_log(ctx, lvl, fmt, __VA_ARGS__);                                             \
+      }                                                                                  \
+   } while (0)
 
 int rsLogInit(void);
 void rsLogExit(void);
-void rsLogSilence(int silence);
+int rsLogOpenFile(const char *path);
+int rsLogLimitCheck(RSLogLimit *limit);
 
 #endif
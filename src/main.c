@@ -25,10 +25,18 @@
 #include "control/control.h"
 #include "device/device.h"
 #include "encoder/encoder.h"
+#include "event.h"
+#include "journal.h"
 #include "log.h"
+#include "memory.h"
 #include "output.h"
+#include "pressure.h"
+#include "probe.h"
+#include "recompress.h"
+#include "thread.h"
 #include "util.h"
 #include <libavutil/avutil.h>
+#include <libavutil/time.h>
 #include <signal.h>
 
 static RSDevice videoDevice;
@@ -38,8 +46,21 @@ static AVPacket *videoPacket;
 static AVFrame *videoFrame;
 static RSAudioThread audioThread;
 static RSControl controller;
-static int silence = 0;
+static RSEventLoop eventLoop;
+static RSPressure pressure;
+static RSDeadline captureDeadline;
+static int controlResult = 0;
 static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t reloading = 0;
+// Set after a reload changed the encoder options, applied at the next GOP boundary
+static int encoderPending = 0;
+static int encoderFrames = 0;
+// The IDR interval the running encoder was created with, 0 when it has none to wait for
+static int encoderGOP = 0;
+// Allocations at the start of the last second of capture, zero after a save
+static int allocFrames = 0;
+static int64_t allocCount = 0;
+static int64_t allocBytes = 0;
 
 static void mainSignal(int sig) {
    av_log(NULL, AV_LOG_INFO, "\nExiting...\n");
@@ -47,43 +68,240 @@ static void mainSignal(int sig) {
    signal(sig, SIG_DFL);
 }
 
-static int mainCommand(const char *name) {
+static void mainReloadSignal(int sig) {
+   (void)sig;
+   reloading = 1;
+}
+
+static void mainSetBackground(int background) {
+   if (rsConfig.savePriority == RS_CONFIG_SAVE_IDLE) {
+      rsThreadSetBackground(background, rsConfig.schedPolicy, rsConfig.schedPriority);
+   }
+}
+
+static int mainCommand(int argc, char *argv[]) {
+   const char *name = argv[1];
    if (strcmp(name, "kms-devices") == 0) {
       return rsKmsDevices();
    } else if (strcmp(name, "kms-service") == 0) {
       return rsKmsService();
    } else if (strcmp(name, "save") == 0) {
       return rsControlSave();
+   } else if (strcmp(name, "journal-watchdog") == 0) {
+      return rsJournalWatchdog(argc - 2, argv + 2);
    } else {
       av_log(NULL, AV_LOG_ERROR, "Unknown command: %s\n", name);
       return AVERROR(ENOSYS);
    }
 }
 
-static void mainUnsilence(void) {
-   if (silence) {
-      rsLogSilence(-1);
-      silence = 0;
+static int mainControl(void *extra) {
+   int ret;
+   RSControl *control = extra;
+   if ((ret = rsControlWantsSave(control)) == AVERROR_EOF) {
+      // A closed input can no longer ask for saves but recording carries on
+      av_log(NULL, AV_LOG_WARNING, "Controller input was closed\n");
+      rsEventLoopRemoveFile(&eventLoop, control->fd);
+      return 0;
+   }
+   if (ret != 0) {
+      rsAtomicStore(&controlResult, ret);
+   }
+   return ret < 0 ? ret : 0;
+}
+
+static int mainResize(void *extra) {
+   (void)extra;
+   if (audioThread.running) {
+      rsAudioThreadResize(&audioThread);
+   }
+   return 0;
+}
+
+static int mainEventLoopCreate(void) {
+   int ret;
+   if ((ret = rsDefaultControlCreate(&controller)) < 0) {
+      return ret;
+   }
+
+   // The controller is checked on its own thread so the capture loop does not have to
+   // poll it every frame
+   if ((ret = rsEventLoopCreate(&eventLoop)) < 0) {
+      return ret;
+   }
+   if ((ret = rsEventLoopAddFile(&eventLoop, controller.fd, RS_EVENT_READ, mainControl,
+                                 &controller)) < 0) {
+      return ret;
+   }
+   if ((ret = rsPressureCreate(&pressure, &eventLoop)) < 0) {
+      return ret;
+   }
+   // The audio buffers are resized here since the audio thread should not allocate
+   if ((ret = rsEventLoopAddTimer(&eventLoop, AV_TIME_BASE, mainResize, NULL)) < 0) {
+      return ret;
+   }
+   return rsEventLoopStart(&eventLoop);
+}
+
+static void mainEventLoopDestroy(void) {
+   rsEventLoopDestroy(&eventLoop);
+   rsPressureDestroy(&pressure);
+   rsControlDestroy(&controller);
+}
+
+static int mainEncoderCreate(RSEncoder *encoder, int failover) {
+   int ret;
+   RSEncoder inner;
+   if (failover) {
+      ret = rsVideoEncoderFailover(&inner, videoDevice.params, videoDevice.hwFrames);
+   } else {
+      ret = rsVideoEncoderCreate(&inner, videoDevice.params, videoDevice.hwFrames);
+   }
+   if (ret < 0) {
+      return ret;
+   }
+   encoderGOP = rsConfig.videoRefresh == RS_CONFIG_REFRESH_GOP ? rsConfig.videoGOP : 0;
+   if (rsConfig.debugFaultFrames == 0) {
+      *encoder = inner;
+      return 0;
+   }
+   return rsFaultEncoderCreate(encoder, &inner, rsConfig.debugFaultFrames);
+}
+
+static int mainEncoderFailover(int error) {
+   int ret;
+   int64_t time = av_gettime_relative();
+   RSEncoder encoder;
+   av_log(NULL, AV_LOG_ERROR, "Video encoder failed: %s\n", av_err2str(error));
+   // The failed encoder is only marked here, it stays in place until the replacement is
+   // ready
+   rsVideoEncoderFail(&videoEncoder);
+   encoderPending = 0;
+   encoderFrames = 0;
+   if ((ret = mainEncoderCreate(&encoder, 1)) < 0) {
+      return ret;
+   }
+   if ((ret = rsBufferSetEncoder(&videoBuffer, &encoder, videoDevice.params)) < 0) {
+      rsEncoderDestroy(&encoder);
+      return ret;
+   }
+
+   rsEncoderDestroy(&videoEncoder);
+   videoEncoder = encoder;
+   av_log(NULL, AV_LOG_INFO, "Recovered video encoder in %.1fms\n",
+          (double)(av_gettime_relative() - time) / 1000.0);
+   return 0;
+}
+
+static int mainEncoderSwap(void) {
+   int ret;
+   int64_t time = av_gettime_relative();
+   RSEncoder encoder;
+   encoderPending = 0;
+   if ((ret = mainEncoderCreate(&encoder, 0)) < 0) {
+      av_log(NULL, AV_LOG_WARNING, "Failed to re-create video encoder: %s\n",
+             av_err2str(ret));
+      return 0;
+   }
+
+   // Drain the old encoder so its last GOP is complete before the new one starts
+   if ((ret = rsEncoderSendFrame(&videoEncoder, NULL)) >= 0) {
+      while ((ret = rsEncoderNextPacket(&videoEncoder, videoPacket)) >= 0) {
+         if ((ret = rsBufferAddPacket(&videoBuffer, videoPacket)) < 0) {
+            break;
+         }
+      }
+   }
+   if (ret != AVERROR_EOF && ret < 0) {
+      av_log(NULL, AV_LOG_WARNING, "Failed to flush video encoder: %s\n",
+             av_err2str(ret));
+   }
+   if ((ret = rsBufferSetEncoder(&videoBuffer, &encoder, videoDevice.params)) < 0) {
+      rsEncoderDestroy(&encoder);
+      return ret;
+   }
+
+   rsEncoderDestroy(&videoEncoder);
+   videoEncoder = encoder;
+   av_log(NULL, AV_LOG_INFO, "Re-created video encoder in %.1fms\n",
+          (double)(av_gettime_relative() - time) / 1000.0);
+   return 0;
+}
+
+static int mainReload(void) {
+   int ret;
+   int64_t time = av_gettime_relative();
+   reloading = 0;
+   av_log(NULL, AV_LOG_INFO, "Reloading config...\n");
+   int statsCapacity = rsConfig.recordSeconds * rsConfig.videoFramerate;
+   if ((ret = rsConfigReload()) < 0) {
+      av_log(NULL, AV_LOG_WARNING, "Failed to reload config: %s\n", av_err2str(ret));
+      return 0;
+   }
+
+   int reload = ret;
+   if (rsConfig.recordSeconds * rsConfig.videoFramerate != statsCapacity) {
+      statsCapacity = rsConfig.recordSeconds * rsConfig.videoFramerate;
+      if ((ret = rsStatsResize(&videoBuffer.stats, statsCapacity)) < 0) {
+         av_log(NULL, AV_LOG_WARNING, "Failed to resize encoder stats: %s\n",
+                av_err2str(ret));
+      }
+   }
+   if (reload & RS_CONFIG_RELOAD_CONTROL) {
+      mainEventLoopDestroy();
+      if ((ret = mainEventLoopCreate()) < 0) {
+         return ret;
+      }
+   }
+   if (reload & RS_CONFIG_RELOAD_ENCODER) {
+      encoderPending = 1;
+   }
+   av_log(NULL, AV_LOG_INFO, "Reloaded config in %.1fms\n",
+          (double)(av_gettime_relative() - time) / 1000.0);
+   return 0;
+}
+
+static void mainCountAllocations(void) {
+   int64_t bytes;
+   int64_t count = rsMemoryGetAllocations(&bytes);
+   if (count < 0 || ++allocFrames < rsConfig.videoFramerate) {
+      return;
+   }
+   if (allocCount > 0) {
+      av_log(NULL, AV_LOG_VERBOSE, "Capture made %.1f allocations of %.1f KiB per frame\n",
+             (double)(count - allocCount) / allocFrames,
+             (double)(bytes - allocBytes) / (1024.0 * allocFrames));
    }
+   allocFrames = 0;
+   allocCount = count;
+   allocBytes = bytes;
 }
 
 static int mainStep(void) {
    int ret;
    while ((ret = rsEncoderNextPacket(&videoEncoder, videoPacket)) == AVERROR(EAGAIN)) {
       if ((ret = rsDeviceNextFrame(&videoDevice, videoFrame)) < 0) {
-         av_log(NULL, AV_LOG_WARNING, "Failed to get frame from device: %s\n",
-                av_err2str(ret));
-         if (!silence) {
-            rsLogSilence(1);
-            silence = 1;
-         }
+         RS_LOG_LIMITED(NULL, AV_LOG_WARNING, "Failed to get frame from device: %s\n",
+                        av_err2str(ret));
          return 0;
       }
 
-      mainUnsilence();
+      rsDeadlineTick(&captureDeadline, AV_TIME_BASE / rsConfig.videoFramerate);
+      if (encoderPending && (encoderGOP == 0 || encoderFrames % encoderGOP == 0)) {
+         if ((ret = mainEncoderSwap()) < 0) {
+            av_frame_unref(videoFrame);
+            return ret;
+         }
+         encoderFrames = 0;
+      }
       if ((ret = rsEncoderSendFrame(&videoEncoder, videoFrame)) < 0) {
-         return ret;
+         return mainEncoderFailover(ret);
       }
+      ++encoderFrames;
+      mainCountAllocations();
+   }
+   if (ret < 0) {
+      return mainEncoderFailover(ret);
    }
    if ((ret = rsBufferAddPacket(&videoBuffer, videoPacket)) < 0) {
       return ret;
@@ -99,13 +317,19 @@ static int mainOutput(void) {
       goto error;
    }
 
-   const AVCodecParameters *audioParams;
-   if ((ret = rsAudioBufferGetParams(&audioThread.buffer, &audioParams)) < 0) {
-      goto error;
-   }
-
    rsOutputAddStream(&output, videoEncoder.params);
-   rsOutputAddStream(&output, audioParams);
+   for (int i = 0; i < audioThread.trackCount; ++i) {
+      const AVCodecParameters *audioParams;
+      if ((ret = rsAudioBufferGetParams(&audioThread.buffers[i], &audioParams)) < 0) {
+         goto error;
+      }
+      rsOutputAddStream(&output, audioParams);
+   }
+   // Video from older encoders with another codec goes after the audio
+   int firstSegment = rsBufferGetFirstSegment(&videoBuffer);
+   for (int i = firstSegment; i < videoBuffer.segmentCount; ++i) {
+      rsOutputAddStream(&output, videoBuffer.segments[i].params);
+   }
    if ((ret = rsOutputOpen(&output)) < 0) {
       goto error;
    }
@@ -115,10 +339,13 @@ static int mainOutput(void) {
       ret = (int)startTime;
       goto error;
    }
-   if ((ret = rsAudioBufferWrite(&audioThread.buffer, &output, 1, startTime)) < 0) {
-      goto error;
+   for (int i = 0; i < audioThread.trackCount; ++i) {
+      if ((ret = rsAudioBufferWrite(&audioThread.buffers[i], &audioThread.pool, &output,
+                                    i + 1, startTime)) < 0) {
+         goto error;
+      }
    }
-   if ((ret = rsBufferWrite(&videoBuffer, &output, 0)) < 0) {
+   if ((ret = rsBufferWrite(&videoBuffer, &output, 0, audioThread.trackCount + 1)) < 0) {
       goto error;
    }
    if ((ret = rsOutputClose(&output)) < 0) {
@@ -129,6 +356,8 @@ static int mainOutput(void) {
 error:
    rsOutputDestroy(&output);
    rsAudioThreadUnlock(&audioThread);
+   // Get the audio encoders ready for the next save now that this one is done
+   rsAudioThreadPrepare(&audioThread);
    return ret;
 }
 
@@ -140,10 +369,14 @@ static int mainOutputVideo(void) {
    }
 
    rsOutputAddStream(&output, videoEncoder.params);
+   int firstSegment = rsBufferGetFirstSegment(&videoBuffer);
+   for (int i = firstSegment; i < videoBuffer.segmentCount; ++i) {
+      rsOutputAddStream(&output, videoBuffer.segments[i].params);
+   }
    if ((ret = rsOutputOpen(&output)) < 0) {
       goto error;
    }
-   if ((ret = rsBufferWrite(&videoBuffer, &output, 0)) < 0) {
+   if ((ret = rsBufferWrite(&videoBuffer, &output, 0, 1)) < 0) {
       goto error;
    }
    if ((ret = rsOutputClose(&output)) < 0) {
@@ -162,12 +395,25 @@ int main(int argc, char *argv[]) {
       goto error;
    }
    if (argc >= 2) {
-      ret = mainCommand(argv[1]);
+      ret = mainCommand(argc, argv);
       goto error;
    }
    if ((ret = rsConfigInit()) < 0) {
       goto error;
    }
+   if ((ret = rsLogOpenFile(rsConfig.logFile)) < 0) {
+      goto error;
+   }
+   // The watchdog is started before any encoders or devices that could crash it with us
+   if ((ret = rsJournalInit()) < 0) {
+      goto error;
+   }
+   if ((ret = rsProbeInit()) < 0) {
+      goto error;
+   }
+   if ((ret = rsRecompressInit()) < 0) {
+      goto error;
+   }
 
    av_log(NULL, AV_LOG_INFO, "%s\n",
           RS_NAME "  Copyright (C) 2020-2021  ReplaySorcery developers\n"
@@ -179,11 +425,10 @@ int main(int argc, char *argv[]) {
    if ((ret = rsVideoDeviceCreate(&videoDevice)) < 0) {
       goto error;
    }
-   if ((ret = rsVideoEncoderCreate(&videoEncoder, videoDevice.params,
-                                   videoDevice.hwFrames)) < 0) {
+   if ((ret = mainEncoderCreate(&videoEncoder, 0)) < 0) {
       goto error;
    }
-   if ((ret = rsBufferCreate(&videoBuffer)) < 0) {
+   if ((ret = rsBufferCreate(&videoBuffer, &videoEncoder, videoDevice.params)) < 0) {
       goto error;
    }
 
@@ -197,25 +442,48 @@ int main(int argc, char *argv[]) {
       av_log(NULL, AV_LOG_WARNING, "Failed to create audio thread: %s\n",
              av_err2str(ret));
    }
-   if ((ret = rsDefaultControlCreate(&controller)) < 0) {
+   if ((ret = mainEventLoopCreate()) < 0) {
       goto error;
    }
 
+   // Any threads created after this would inherit the capture thread's scheduling
+   rsThreadSchedule("rs-capture", rsConfig.captureCpus, rsConfig.schedPolicy,
+                    rsConfig.schedPriority);
+   rsDeadlineInit(&captureDeadline, "Capture");
+
    signal(SIGINT, mainSignal);
    signal(SIGTERM, mainSignal);
+   signal(SIGHUP, mainReloadSignal);
    while (running) {
+      if (reloading && (ret = mainReload()) < 0) {
+         goto error;
+      }
       if ((ret = mainStep()) < 0) {
          goto error;
       }
-      if ((ret = rsControlWantsSave(&controller)) < 0) {
+      // Taken in one go so a save requested in between is not cleared without running
+      if ((ret = rsAtomicExchange(&controlResult, 0)) < 0) {
          goto error;
       }
       if (ret > 0) {
+         RSMemoryStats before, after;
+         rsMemoryGetStats(&before);
+         mainSetBackground(1);
          if (audioThread.running) {
             ret = mainOutput();
          } else {
             ret = mainOutputVideo();
          }
+         mainSetBackground(0);
+         rsDeadlineReset(&captureDeadline);
+         allocCount = 0;
+         rsMemoryGetStats(&after);
+         av_log(NULL, AV_LOG_VERBOSE,
+                "Save had %" PRId64 " major and %" PRId64
+                " minor page faults, %.1f MiB locked\n",
+                after.majorFaults - before.majorFaults,
+                after.minorFaults - before.minorFaults,
+                (double)after.locked / (1024.0 * 1024.0));
          if (ret < 0) {
             av_log(NULL, AV_LOG_WARNING, "Failed to output video: %s\n", av_err2str(ret));
          }
@@ -224,14 +492,17 @@ int main(int argc, char *argv[]) {
 
    ret = 0;
 error:
-   mainUnsilence();
-   rsControlDestroy(&controller);
+   mainEventLoopDestroy();
    rsAudioThreadDestroy(&audioThread);
    av_frame_free(&videoFrame);
    av_packet_free(&videoPacket);
    rsBufferDestroy(&videoBuffer);
    rsEncoderDestroy(&videoEncoder);
    rsDeviceDestroy(&videoDevice);
+   // After a fatal error the watchdog saves what is left of the replay
+   rsJournalExit(ret < 0);
+   rsRecompressExit();
+   rsProbeExit();
    rsConfigExit();
    rsLogExit();
    if (ret < 0) {
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "memory.h"
+#include "config.h"
+#include "rsbuild.h"
+#include "util.h"
+#include <stdio.h>
+#ifdef RS_BUILD_DEBUG_ALLOCS
+#include <stdlib.h>
+#endif
+#ifdef RS_BUILD_MMAN_FOUND
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#define MEMORY_HUGE_SIZE (2 * 1024 * 1024)
+
+static int memoryLockFailed = 0;
+
+#ifdef RS_BUILD_DEBUG_ALLOCS
+// glibc's allocator, the functions below replace it for the whole process
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *mem, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+
+static int64_t memoryAllocations = 0;
+static int64_t memoryAllocatedBytes = 0;
+
+static void memoryCount(size_t size) {
+   __atomic_add_fetch(&memoryAllocations, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&memoryAllocatedBytes, (int64_t)size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+   memoryCount(size);
+   return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+   memoryCount(count * size);
+   return __libc_calloc(count, size);
+}
+
+void *realloc(void *mem, size_t size) {
+   memoryCount(size);
+   return __libc_realloc(mem, size);
+}
+
+// av_malloc goes through this one
+int posix_memalign(void **mem, size_t align, size_t size) {
+   memoryCount(size);
+   *mem = __libc_memalign(align, size);
+   return *mem == NULL ? ENOMEM : 0;
+}
+#endif
+
+#ifdef RS_BUILD_MMAN_FOUND
+static void *memoryMap(size_t size) {
+   void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   return mem == MAP_FAILED ? NULL : mem;
+}
+
+static void *memoryMapHuge(size_t size) {
+   // The tail can only be trimmed from a page boundary
+   size = FFALIGN(size, (size_t)sysconf(_SC_PAGESIZE));
+   // Transparent huge pages only back 2MiB aligned ranges, so map extra and trim it
+   uint8_t *mem = memoryMap(size + MEMORY_HUGE_SIZE);
+   if (mem == NULL) {
+      return NULL;
+   }
+   uintptr_t addr = (uintptr_t)mem;
+   uintptr_t aligned = FFALIGN(addr, (uintptr_t)MEMORY_HUGE_SIZE);
+   size_t head = aligned - addr;
+   if (head > 0) {
+      munmap(mem, head);
+   }
+   munmap(mem + head + size, MEMORY_HUGE_SIZE - head);
+
+#ifdef MADV_HUGEPAGE
+   if (madvise((void *)aligned, size, MADV_HUGEPAGE) == -1) {
+      av_log(NULL, AV_LOG_DEBUG, "Failed to advise huge pages: %s\n",
+             av_err2str(AVERROR(errno)));
+   }
+#endif
+   return (void *)aligned;
+}
+#endif
+
+void *rsMemoryAlloc(size_t size) {
+#ifdef RS_BUILD_MMAN_FOUND
+   int ret;
+   size = FFMAX(size, 1);
+   void *mem;
+   if ((rsConfig.bufferMemory & RS_CONFIG_MEMORY_HUGE) && size >= MEMORY_HUGE_SIZE) {
+      mem = memoryMapHuge(size);
+   } else {
+      mem = memoryMap(size);
+   }
+   if (mem == NULL) {
+      return NULL;
+   }
+
+   if (rsConfig.bufferMemory & RS_CONFIG_MEMORY_LOCK) {
+      // Locking also faults every page in so later reads never wait on the disk
+      if (mlock(mem, size) == -1) {
+         ret = AVERROR(errno);
+         if (!__atomic_exchange_n(&memoryLockFailed, 1, __ATOMIC_RELAXED)) {
+            av_log(NULL, AV_LOG_WARNING,
+                   "Failed to lock buffer memory, it may be swapped out: %s\n"
+                   "Try raising RLIMIT_MEMLOCK, for example with LimitMEMLOCK\n",
+                   av_err2str(ret));
+         }
+      }
+   }
+   return mem;
+
+#else
+   return av_mallocz(size);
+#endif
+}
+
+void rsMemoryFree(void *mem, size_t size) {
+   if (mem == NULL) {
+      return;
+   }
+#ifdef RS_BUILD_MMAN_FOUND
+   // Unmapping also unlocks it
+   munmap(mem, FFMAX(size, 1));
+
+#else
+   (void)size;
+   av_free(mem);
+#endif
+}
+
+void rsMemoryGetStats(RSMemoryStats *stats) {
+   rsClear(stats, sizeof(RSMemoryStats));
+#ifdef RS_BUILD_MMAN_FOUND
+   // Ask the kernel since it knows about pages that failed to lock or are shared
+   FILE *file = fopen("/proc/self/status", "r");
+   if (file != NULL) {
+      char line[256];
+      long long locked;
+      while (fgets(line, sizeof(line), file) != NULL) {
+         if (sscanf(line, "VmLck: %lld kB", &locked) == 1) {
+            stats->locked = locked * 1024;
+            break;
+         }
+      }
+      fclose(file);
+   }
+
+   struct rusage usage;
+   if (getrusage(RUSAGE_SELF, &usage) == 0) {
+      stats->majorFaults = usage.ru_majflt;
+      stats->minorFaults = usage.ru_minflt;
+   }
+#endif
+}
+
+int64_t rsMemoryGetAllocations(int64_t *bytes) {
+#ifdef RS_BUILD_DEBUG_ALLOCS
+   *bytes = __atomic_load_n(&memoryAllocatedBytes, __ATOMIC_RELAXED);
+   return __atomic_load_n(&memoryAllocations, __ATOMIC_RELAXED);
+
+#else
+   *bytes = 0;
+   return AVERROR(ENOSYS);
+#endif
+}
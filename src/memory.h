@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RS_MEMORY_H
+#define RS_MEMORY_H
+#include <libavutil/avutil.h>
+
+typedef struct RSMemoryStats {
+   int64_t locked;
+   int64_t majorFaults;
+   int64_t minorFaults;
+} RSMemoryStats;
+
+// Allocates long-lived zeroed memory for the replay buffers. Depending on the config it
+// is locked into RAM and backed by huge pages, and has to be freed with the same size.
+void *rsMemoryAlloc(size_t size);
+void rsMemoryFree(void *mem, size_t size);
+void rsMemoryGetStats(RSMemoryStats *stats);
+// Heap allocations made by the whole process so far, including FFmpeg's. Only counted
+// when built with RS_DEBUG_ALLOCS, otherwise this returns AVERROR(ENOSYS).
+int64_t rsMemoryGetAllocations(int64_t *bytes);
+
+#endif
@@ -19,7 +19,9 @@
 
 #include "output.h"
 #include "config.h"
+#include "recompress.h"
 #include "rsbuild.h"
+#include "thread.h"
 #include "util.h"
 #include <libavutil/avutil.h>
 #include <libavutil/bprint.h>
@@ -90,6 +92,10 @@ void rsOutputAddStream(RSOutput *output, const AVCodecParameters *params) {
    if ((ret = avcodec_parameters_copy(stream->codecpar, params)) < 0) {
       goto error;
    }
+   if (params->codec_id == AV_CODEC_ID_VP9 || params->codec_id == AV_CODEC_ID_AV1) {
+      // Older versions of FFmpeg still mark these as experimental in MP4
+      output->formatCtx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+   }
    if (params->codec_type == AVMEDIA_TYPE_AUDIO) {
       stream->time_base = av_make_q(1, params->sample_rate);
    } else {
@@ -145,10 +151,12 @@ int rsOutputClose(RSOutput *output) {
    }
 
    av_log(NULL, AV_LOG_INFO, "Running command: %s\n", command);
-   if ((ret = system(command)) != 0) {
+   int idle = rsConfig.savePriority == RS_CONFIG_SAVE_IDLE;
+   if ((ret = rsThreadRunCommand(command, idle)) != 0) {
       av_log(NULL, AV_LOG_WARNING, "Command returned non-zero exit-code: %i\n", ret);
    }
    av_log(NULL, AV_LOG_INFO, "Video saved!\n");
+   rsRecompressAdd(output->path);
 
    ret = 0;
 error:
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pressure.h"
+#include "config.h"
+#include "rsbuild.h"
+#include "util.h"
+#include <libavutil/avstring.h>
+#include <libavutil/time.h>
+#include <stdio.h>
+#ifdef RS_BUILD_POSIX_IO_FOUND
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define PRESSURE_CHECK_INTERVAL AV_TIME_BASE
+// Unprivileged PSI triggers need a window that is a multiple of 2 seconds
+#define PRESSURE_WINDOW (2 * AV_TIME_BASE)
+#define PRESSURE_SHRINK_INTERVAL (2 * AV_TIME_BASE)
+#define PRESSURE_GROW_INTERVAL (10 * AV_TIME_BASE)
+// The cgroup counts as under pressure once it is this close to memory.high
+#define PRESSURE_CGROUP_RATIO 0.9
+
+static int pressureSeconds = 0;
+
+#ifdef RS_BUILD_POSIX_IO_FOUND
+static int64_t pressureReadValue(const char *dir, const char *name) {
+   int64_t value = -1;
+   char *path = rsFormat("%s/%s", dir, name);
+   if (path == NULL) {
+      return -1;
+   }
+   FILE *file = fopen(path, "r");
+   if (file != NULL) {
+      long long num;
+      // memory.high is "max" when there is no limit
+      if (fscanf(file, "%lld", &num) == 1) {
+         value = num;
+      }
+      fclose(file);
+   }
+   av_freep(&path);
+   return value;
+}
+
+static char *pressureFindCgroup(void) {
+   char *path = NULL;
+   FILE *file = fopen("/proc/self/cgroup", "r");
+   if (file == NULL) {
+      return NULL;
+   }
+   char line[1024];
+   while (fgets(line, sizeof(line), file) != NULL) {
+      // Only the unified cgroup v2 hierarchy has memory.high
+      if (av_strstart(line, "0::", NULL)) {
+         line[strcspn(line, "\n")] = '\0';
+         path = rsFormat("/sys/fs/cgroup%s", line + 3);
+         break;
+      }
+   }
+   fclose(file);
+   return path;
+}
+
+static void pressureResize(RSPressure *pressure, int seconds, const char *reason) {
+   seconds = av_clip(seconds, FFMIN(rsConfig.pressureMinSeconds, rsConfig.recordSeconds),
+                     rsConfig.recordSeconds);
+   pressure->resizeTime = av_gettime_relative();
+   if (seconds == pressure->seconds) {
+      return;
+   }
+   av_log(NULL, AV_LOG_INFO, "%s, keeping %is of replay instead of %is\n", reason,
+          seconds, pressure->seconds);
+   pressure->seconds = seconds;
+   __atomic_store_n(&pressureSeconds, seconds, __ATOMIC_RELAXED);
+}
+
+static void pressureRaise(RSPressure *pressure, const char *reason) {
+   int64_t time = av_gettime_relative();
+   pressure->pressureTime = time;
+   if (time - pressure->resizeTime >= PRESSURE_SHRINK_INTERVAL) {
+      pressureResize(pressure, pressure->seconds / 2, reason);
+   }
+}
+
+static int pressureTrigger(void *extra) {
+   pressureRaise(extra, "Memory pressure stall");
+   return 0;
+}
+
+static int pressurePollFile(RSPressure *pressure) {
+   // Without a trigger the file is read directly, which also allows testing with a normal
+   // file containing a line like "some avg10=50.00"
+   char buffer[256];
+   ssize_t size = pread(pressure->psiFile, buffer, sizeof(buffer) - 1, 0);
+   if (size <= 0) {
+      return 0;
+   }
+   buffer[size] = '\0';
+   double avg10;
+   if (sscanf(buffer, "some avg10=%lf", &avg10) != 1) {
+      return 0;
+   }
+   // The threshold is stall time per second and avg10 is a percentage
+   return avg10 > rsConfig.pressureThreshold / 10.0;
+}
+
+static int pressureCheck(void *extra) {
+   RSPressure *pressure = extra;
+   if (pressure->psiFile >= 0 && !pressure->triggered && pressurePollFile(pressure)) {
+      pressureRaise(pressure, "Memory pressure stall");
+   }
+   if (pressure->cgroupPath != NULL) {
+      int64_t current = pressureReadValue(pressure->cgroupPath, "memory.current");
+      int64_t high = pressureReadValue(pressure->cgroupPath, "memory.high");
+      if (current >= 0 && high > 0 && (double)current > PRESSURE_CGROUP_RATIO * (double)high) {
+         pressureRaise(pressure, "Close to the cgroup memory limit");
+      }
+   }
+
+   int64_t time = av_gettime_relative();
+   if (pressure->seconds < rsConfig.recordSeconds &&
+       time - pressure->pressureTime >= PRESSURE_GROW_INTERVAL &&
+       time - pressure->resizeTime >= PRESSURE_GROW_INTERVAL) {
+      int step = FFMAX(rsConfig.recordSeconds / 4, 1);
+      pressureResize(pressure, pressure->seconds + step, "Memory pressure cleared");
+   }
+   return 0;
+}
+
+static int pressureOpenPSI(RSPressure *pressure) {
+   int ret;
+   const char *path = rsConfig.pressureFile;
+   // Only real PSI files accept triggers, anything else would just be written to
+   if (av_strstart(path, "/proc/pressure/", NULL)) {
+      pressure->psiFile = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+      if (pressure->psiFile >= 0) {
+         char trigger[64];
+         snprintf(trigger, sizeof(trigger), "some %lld %lld",
+                  (long long)rsConfig.pressureThreshold * PRESSURE_WINDOW / 1000,
+                  (long long)PRESSURE_WINDOW);
+         if (write(pressure->psiFile, trigger, strlen(trigger) + 1) >= 0) {
+            pressure->triggered = 1;
+            return 0;
+         }
+         ret = AVERROR(errno);
+         av_log(NULL, AV_LOG_VERBOSE, "Failed to create PSI trigger, polling instead: %s\n",
+                av_err2str(ret));
+         close(pressure->psiFile);
+      }
+   }
+
+   pressure->psiFile = open(path, O_RDONLY | O_CLOEXEC);
+   if (pressure->psiFile < 0) {
+      ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_WARNING, "Failed to open %s: %s\n", path, av_err2str(ret));
+      return ret;
+   }
+   return 0;
+}
+#endif
+
+int rsPressureCreate(RSPressure *pressure, RSEventLoop *loop) {
+   int ret;
+   rsClear(pressure, sizeof(RSPressure));
+   pressure->psiFile = -1;
+   pressure->seconds = rsConfig.recordSeconds;
+   if (rsConfig.pressureThreshold == 0) {
+      return 0;
+   }
+
+#ifdef RS_BUILD_POSIX_IO_FOUND
+   // Either source on its own is still useful
+   pressureOpenPSI(pressure);
+   pressure->cgroupPath = pressureFindCgroup();
+   if (pressure->cgroupPath != NULL &&
+       pressureReadValue(pressure->cgroupPath, "memory.current") < 0) {
+      av_freep(&pressure->cgroupPath);
+   }
+   if (pressure->psiFile < 0 && pressure->cgroupPath == NULL) {
+      av_log(NULL, AV_LOG_WARNING, "No memory pressure sources available\n");
+      return 0;
+   }
+
+   if (pressure->triggered && (ret = rsEventLoopAddFile(loop, pressure->psiFile,
+                                                        RS_EVENT_PRIORITY,
+                                                        pressureTrigger, pressure)) < 0) {
+      goto error;
+   }
+   if ((ret = rsEventLoopAddTimer(loop, PRESSURE_CHECK_INTERVAL, pressureCheck,
+                                  pressure)) < 0) {
+      goto error;
+   }
+   if (pressure->psiFile >= 0) {
+      av_log(NULL, AV_LOG_VERBOSE, "Watching memory pressure in %s%s\n",
+             rsConfig.pressureFile, pressure->triggered ? " with a trigger" : "");
+   }
+   if (pressure->cgroupPath != NULL) {
+      av_log(NULL, AV_LOG_VERBOSE, "Watching memory limit of %s\n", pressure->cgroupPath);
+   }
+   return 0;
+
+error:
+   rsPressureDestroy(pressure);
+   return ret;
+
+#else
+   (void)loop;
+   (void)ret;
+   av_log(NULL, AV_LOG_WARNING, "Posix I/O was not found during compilation\n");
+   return 0;
+#endif
+}
+
+void rsPressureDestroy(RSPressure *pressure) {
+#ifdef RS_BUILD_POSIX_IO_FOUND
+   if (pressure->psiFile > 0) {
+      close(pressure->psiFile);
+      pressure->psiFile = -1;
+   }
+#endif
+   av_freep(&pressure->cgroupPath);
+   __atomic_store_n(&pressureSeconds, 0, __ATOMIC_RELAXED);
+}
+
+int rsPressureGetSeconds(void) {
+   int seconds = __atomic_load_n(&pressureSeconds, __ATOMIC_RELAXED);
+   return seconds > 0 ? seconds : rsConfig.recordSeconds;
+}
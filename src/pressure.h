@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RS_PRESSURE_H
+#define RS_PRESSURE_H
+#include "event.h"
+#include <libavutil/avutil.h>
+
+typedef struct RSPressure {
+   int psiFile;
+   int triggered;
+   char *cgroupPath;
+   int64_t pressureTime;
+   int64_t resizeTime;
+   int seconds;
+} RSPressure;
+
+// Watches PSI and the cgroup memory limit from the event loop and shrinks the replay
+// buffers while memory is tight
+int rsPressureCreate(RSPressure *pressure, RSEventLoop *loop);
+void rsPressureDestroy(RSPressure *pressure);
+// The number of seconds the replay buffers should currently keep
+int rsPressureGetSeconds(void);
+
+#endif
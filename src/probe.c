@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "probe.h"
+#include "config.h"
+#include "rsbuild.h"
+#include "util.h"
+#include <libavcodec/avcodec.h>
+#include <libavutil/avstring.h>
+#include <stdio.h>
+
+#define PROBE_MAX_ENTRIES 8
+#define PROBE_MAX_NAME 16
+#define PROBE_MAX_LINE 1024
+
+typedef struct ProbeEntry {
+   char name[PROBE_MAX_NAME];
+   int value;
+} ProbeEntry;
+
+static char *probePath = NULL;
+static char *probeFingerprint = NULL;
+static ProbeEntry probeEntries[PROBE_MAX_ENTRIES];
+static int probeCount = 0;
+
+static char *probeGetPath(void) {
+   const char *cache = getenv("XDG_CACHE_HOME");
+   if (cache != NULL && cache[0] == '/') {
+      return rsFormat("%s/replay-sorcery/probe", cache);
+   }
+   const char *home = getenv("HOME");
+   if (home == NULL) {
+      return NULL;
+   }
+   return rsFormat("%s/.cache/replay-sorcery/probe", home);
+}
+
+static char *probeGetFingerprint(void) {
+   return rsFormat("%s %s %u %i %s %i %i %i %i %i %i %i %i %i %" PRId64, RS_BUILD_VERSION,
+                   av_version_info(), avcodec_version(), rsConfig.videoInput,
+                   rsConfig.videoDevice, rsConfig.videoEncoder, rsConfig.videoProfile,
+                   rsConfig.videoPreset, rsConfig.videoQuality, rsConfig.videoFramerate,
+                   rsConfig.videoWidth, rsConfig.videoHeight, rsConfig.scaleWidth,
+                   rsConfig.scaleHeight, rsConfig.videoBitrate);
+}
+
+static void probeLoad(void) {
+   FILE *file = fopen(probePath, "r");
+   if (file == NULL) {
+      return;
+   }
+
+   char line[PROBE_MAX_LINE];
+   if (fgets(line, sizeof(line), file) == NULL) {
+      goto error;
+   }
+   line[strcspn(line, "\n")] = '\0';
+   if (strcmp(line, probeFingerprint) != 0) {
+      av_log(NULL, AV_LOG_VERBOSE, "Probe cache is out of date\n");
+      goto error;
+   }
+
+   ProbeEntry *entry = &probeEntries[probeCount];
+   while (probeCount < PROBE_MAX_ENTRIES &&
+          fscanf(file, "%15s %i", entry->name, &entry->value) == 2) {
+      av_log(NULL, AV_LOG_VERBOSE, "Cached %s: %i\n", entry->name, entry->value);
+      entry = &probeEntries[++probeCount];
+   }
+
+error:
+   fclose(file);
+}
+
+static void probeSave(void) {
+   int ret;
+   char *temp = rsFormat("%s.tmp", probePath);
+   if (temp == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto error;
+   }
+   if ((ret = rsDirectoryCreate(temp)) < 0) {
+      goto error;
+   }
+
+   FILE *file = fopen(temp, "w");
+   if (file == NULL) {
+      ret = AVERROR(errno);
+      goto error;
+   }
+   fprintf(file, "%s\n", probeFingerprint);
+   for (int i = 0; i < probeCount; ++i) {
+      fprintf(file, "%s %i\n", probeEntries[i].name, probeEntries[i].value);
+   }
+   if (fclose(file) != 0 || rename(temp, probePath) == -1) {
+      ret = AVERROR(errno);
+      remove(temp);
+      goto error;
+   }
+
+   ret = 0;
+error:
+   if (ret < 0) {
+      av_log(NULL, AV_LOG_WARNING, "Failed to save probe cache: %s\n", av_err2str(ret));
+   }
+   av_freep(&temp);
+}
+
+int rsProbeInit(void) {
+   probePath = probeGetPath();
+   if (probePath == NULL) {
+      av_log(NULL, AV_LOG_WARNING, "Failed to find cache directory, not caching probes\n");
+      return 0;
+   }
+   probeFingerprint = probeGetFingerprint();
+   if (probeFingerprint == NULL) {
+      rsProbeExit();
+      return AVERROR(ENOMEM);
+   }
+   probeLoad();
+   return 0;
+}
+
+void rsProbeExit(void) {
+   av_freep(&probeFingerprint);
+   av_freep(&probePath);
+   probeCount = 0;
+}
+
+int rsProbeGet(const char *name) {
+   for (int i = 0; i < probeCount; ++i) {
+      if (strcmp(probeEntries[i].name, name) == 0) {
+         return probeEntries[i].value;
+      }
+   }
+   return RS_CONFIG_AUTO;
+}
+
+void rsProbeSet(const char *name, int value) {
+   if (probeFingerprint == NULL || rsProbeGet(name) == value) {
+      return;
+   }
+
+   ProbeEntry *entry = NULL;
+   for (int i = 0; i < probeCount; ++i) {
+      if (strcmp(probeEntries[i].name, name) == 0) {
+         entry = &probeEntries[i];
+      }
+   }
+   if (entry == NULL) {
+      if (probeCount == PROBE_MAX_ENTRIES) {
+         return;
+      }
+      entry = &probeEntries[probeCount++];
+      av_strlcpy(entry->name, name, sizeof(entry->name));
+   }
+   entry->value = value;
+   probeSave();
+}
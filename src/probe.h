@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RS_PROBE_H
+#define RS_PROBE_H
+#include <libavutil/avutil.h>
+
+// Remembers which device and encoder worked last time so startup can skip straight to
+// them. The cache is ignored whenever the config or FFmpeg version changes.
+int rsProbeInit(void);
+void rsProbeExit(void);
+int rsProbeGet(const char *name);
+void rsProbeSet(const char *name, int value);
+
+#endif
@@ -0,0 +1,517 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "recompress.h"
+#include "config.h"
+#include "encoder/encoder.h"
+#include "thread.h"
+#include "util.h"
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/cpu.h>
+#include <libavutil/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RECOMPRESS_MAX_QUEUE 16
+// How often the system load is checked in decoded frames
+#define RECOMPRESS_CHECK_FRAMES 30
+// CPU pressure as a percentage that counts as the system being busy
+#define RECOMPRESS_BUSY_PRESSURE 10.0
+
+typedef struct RecompressStream {
+   AVCodecContext *decoderCtx;
+   AVCodecContext *encoderCtx;
+   AVStream *output;
+} RecompressStream;
+
+typedef struct RecompressJob {
+   const char *path;
+   char *tempPath;
+   AVFormatContext *inputCtx;
+   AVFormatContext *outputCtx;
+   RecompressStream *streams;
+   AVFrame *frame;
+   AVPacket *packet;
+   int frames;
+} RecompressJob;
+
+static RSThread recompressThread;
+static RSMutex recompressMutex;
+static RSCond recompressCond;
+static char *recompressQueue[RECOMPRESS_MAX_QUEUE];
+static int recompressCount = 0;
+static int recompressRunning = 0;
+
+static int64_t recompressThreadTime(void) {
+   struct timespec time;
+   if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) == -1) {
+      return 0;
+   }
+   return (int64_t)time.tv_sec * AV_TIME_BASE + time.tv_nsec / 1000;
+}
+
+static int64_t recompressFileSize(const char *path) {
+   int64_t size = -1;
+   FILE *file = fopen(path, "rb");
+   if (file != NULL) {
+      if (fseek(file, 0, SEEK_END) == 0) {
+         size = ftell(file);
+      }
+      fclose(file);
+   }
+   return size;
+}
+
+static int recompressBusy(void) {
+   // Prefer CPU pressure since it reacts within seconds, the load average is a fallback
+   FILE *file = fopen("/proc/pressure/cpu", "r");
+   if (file != NULL) {
+      double avg10;
+      int found = fscanf(file, "some avg10=%lf", &avg10) == 1;
+      fclose(file);
+      if (found) {
+         return avg10 > RECOMPRESS_BUSY_PRESSURE;
+      }
+   }
+   double load;
+   if (getloadavg(&load, 1) == 1) {
+      return load >= av_cpu_count();
+   }
+   return 0;
+}
+
+static void recompressWait(void) {
+   int paused = 0;
+   while (rsAtomicLoad(&recompressRunning) && recompressBusy()) {
+      if (!paused) {
+         av_log(NULL, AV_LOG_VERBOSE, "System is busy, pausing recompression\n");
+         paused = 1;
+      }
+      av_usleep(AV_TIME_BASE);
+   }
+   if (paused) {
+      av_log(NULL, AV_LOG_VERBOSE, "Resuming recompression\n");
+   }
+}
+
+static const char *recompressEncoderName(void) {
+   switch (rsConfig.recompressEncoder) {
+   case RS_CONFIG_ENCODER_X264:
+      return "libx264";
+   case RS_CONFIG_ENCODER_X265:
+      return "libx265";
+   case RS_CONFIG_ENCODER_SVTAV1:
+      return "libsvtav1";
+   default:
+      return NULL;
+   }
+}
+
+// SVT-AV1 presets are numbers from 0 (slowest) to 13, the x264 names map onto them
+static const char *recompressSvtAv1Preset(const char *preset) {
+   static const char *const names[][2] = {
+       {"ultrafast", "12"}, {"superfast", "11"}, {"veryfast", "10"}, {"faster", "9"},
+       {"fast", "8"},       {"medium", "7"},     {"slow", "6"},      {"slower", "4"},
+       {"veryslow", "2"},   {"placebo", "0"},
+   };
+   for (size_t i = 0; i < FF_ARRAY_ELEMS(names); ++i) {
+      if (strcmp(preset, names[i][0]) == 0) {
+         return names[i][1];
+      }
+   }
+   return preset;
+}
+
+static int recompressOpenVideo(RecompressJob *job, RecompressStream *stream,
+                               const AVStream *input) {
+   int ret;
+   AVDictionary *options = NULL;
+   const AVCodec *decoder = avcodec_find_decoder(input->codecpar->codec_id);
+   if (decoder == NULL) {
+      ret = AVERROR_DECODER_NOT_FOUND;
+      goto error;
+   }
+   stream->decoderCtx = avcodec_alloc_context3(decoder);
+   if (stream->decoderCtx == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto error;
+   }
+   if ((ret = avcodec_parameters_to_context(stream->decoderCtx, input->codecpar)) < 0) {
+      goto error;
+   }
+   stream->decoderCtx->pkt_timebase = input->time_base;
+   if ((ret = avcodec_open2(stream->decoderCtx, decoder, NULL)) < 0) {
+      av_log(stream->decoderCtx, AV_LOG_ERROR, "Failed to open decoder: %s\n",
+             av_err2str(ret));
+      goto error;
+   }
+
+   const char *name = recompressEncoderName();
+   AVCodec *encoder = avcodec_find_encoder_by_name(name);
+   if (encoder == NULL) {
+      av_log(NULL, AV_LOG_ERROR, "Encoder not found: %s\n", name);
+      ret = AVERROR_ENCODER_NOT_FOUND;
+      goto error;
+   }
+   stream->encoderCtx = avcodec_alloc_context3(encoder);
+   if (stream->encoderCtx == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto error;
+   }
+   AVCodecContext *encoderCtx = stream->encoderCtx;
+   encoderCtx->width = input->codecpar->width;
+   encoderCtx->height = input->codecpar->height;
+   encoderCtx->pix_fmt = input->codecpar->format;
+   encoderCtx->sample_aspect_ratio = input->codecpar->sample_aspect_ratio;
+   encoderCtx->time_base = input->time_base;
+   encoderCtx->framerate = input->avg_frame_rate;
+   if (job->outputCtx->oformat->flags & AVFMT_GLOBALHEADER) {
+      encoderCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+   }
+   if (rsConfig.recompressEncoder == RS_CONFIG_ENCODER_SVTAV1) {
+      rsOptionsSet(&options, &ret, "preset", "%s",
+                   recompressSvtAv1Preset(rsConfig.recompressPreset));
+      rsOptionsSet(&options, &ret, "crf", "%i",
+                   RS_SVTAV1_QUALITY(rsConfig.recompressQuality));
+   } else {
+      rsOptionsSet(&options, &ret, "preset", "%s", rsConfig.recompressPreset);
+      rsOptionsSet(&options, &ret, "crf", "%i", rsConfig.recompressQuality);
+   }
+   if (ret < 0) {
+      goto error;
+   }
+   if ((ret = avcodec_open2(encoderCtx, encoder, &options)) < 0) {
+      av_log(encoderCtx, AV_LOG_ERROR, "Failed to open encoder: %s\n", av_err2str(ret));
+      goto error;
+   }
+   if ((ret = avcodec_parameters_from_context(stream->output->codecpar, encoderCtx)) <
+       0) {
+      goto error;
+   }
+   if (encoderCtx->codec_id == AV_CODEC_ID_HEVC) {
+      // Apple players only accept HEVC in MP4 with this tag
+      stream->output->codecpar->codec_tag = MKTAG('h', 'v', 'c', '1');
+   }
+   stream->output->time_base = encoderCtx->time_base;
+
+   ret = 0;
+error:
+   rsOptionsDestroy(&options);
+   return ret;
+}
+
+static int recompressOpen(RecompressJob *job) {
+   int ret;
+   if ((ret = avformat_open_input(&job->inputCtx, job->path, NULL, NULL)) < 0) {
+      av_log(NULL, AV_LOG_ERROR, "Failed to open '%s': %s\n", job->path, av_err2str(ret));
+      return ret;
+   }
+   if ((ret = avformat_find_stream_info(job->inputCtx, NULL)) < 0) {
+      return ret;
+   }
+   if ((ret = avformat_alloc_output_context2(&job->outputCtx, NULL, "mp4",
+                                             job->tempPath)) < 0) {
+      return ret;
+   }
+
+   job->streams = av_calloc(job->inputCtx->nb_streams, sizeof(RecompressStream));
+   if (job->streams == NULL) {
+      return AVERROR(ENOMEM);
+   }
+   for (unsigned i = 0; i < job->inputCtx->nb_streams; ++i) {
+      const AVStream *input = job->inputCtx->streams[i];
+      RecompressStream *stream = &job->streams[i];
+      stream->output = avformat_new_stream(job->outputCtx, NULL);
+      if (stream->output == NULL) {
+         return AVERROR(ENOMEM);
+      }
+      // Only the video is re-encoded, the audio is small enough already
+      if (input->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+         if ((ret = recompressOpenVideo(job, stream, input)) < 0) {
+            return ret;
+         }
+      } else {
+         if ((ret = avcodec_parameters_copy(stream->output->codecpar, input->codecpar)) <
+             0) {
+            return ret;
+         }
+         stream->output->codecpar->codec_tag = 0;
+         stream->output->time_base = input->time_base;
+      }
+   }
+
+   if ((ret = avio_open(&job->outputCtx->pb, job->tempPath, AVIO_FLAG_WRITE)) < 0) {
+      av_log(NULL, AV_LOG_ERROR, "Failed to open '%s': %s\n", job->tempPath,
+             av_err2str(ret));
+      return ret;
+   }
+   AVDictionary *options = NULL;
+   rsOptionsSet(&options, &ret, "movflags", "+faststart");
+   if (ret >= 0) {
+      ret = avformat_write_header(job->outputCtx, &options);
+   }
+   rsOptionsDestroy(&options);
+   return ret;
+}
+
+static int recompressWritePackets(RecompressJob *job, unsigned index) {
+   int ret;
+   RecompressStream *stream = &job->streams[index];
+   while ((ret = avcodec_receive_packet(stream->encoderCtx, job->packet)) >= 0) {
+      job->packet->stream_index = (int)index;
+      av_packet_rescale_ts(job->packet, stream->encoderCtx->time_base,
+                           stream->output->time_base);
+      if ((ret = av_interleaved_write_frame(job->outputCtx, job->packet)) < 0) {
+         return ret;
+      }
+   }
+   return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static int recompressEncodeFrames(RecompressJob *job, unsigned index) {
+   int ret;
+   RecompressStream *stream = &job->streams[index];
+   while ((ret = avcodec_receive_frame(stream->decoderCtx, job->frame)) >= 0) {
+      job->frame->pts = job->frame->best_effort_timestamp;
+      job->frame->pict_type = AV_PICTURE_TYPE_NONE;
+      ret = avcodec_send_frame(stream->encoderCtx, job->frame);
+      av_frame_unref(job->frame);
+      if (ret < 0) {
+         return ret;
+      }
+      if ((ret = recompressWritePackets(job, index)) < 0) {
+         return ret;
+      }
+      if (++job->frames % RECOMPRESS_CHECK_FRAMES == 0) {
+         recompressWait();
+      }
+   }
+   return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static int recompressFlush(RecompressJob *job) {
+   int ret;
+   for (unsigned i = 0; i < job->inputCtx->nb_streams; ++i) {
+      RecompressStream *stream = &job->streams[i];
+      if (stream->decoderCtx == NULL) {
+         continue;
+      }
+      if ((ret = avcodec_send_packet(stream->decoderCtx, NULL)) < 0) {
+         return ret;
+      }
+      if ((ret = recompressEncodeFrames(job, i)) < 0) {
+         return ret;
+      }
+      if ((ret = avcodec_send_frame(stream->encoderCtx, NULL)) < 0) {
+         return ret;
+      }
+      if ((ret = recompressWritePackets(job, i)) < 0) {
+         return ret;
+      }
+   }
+   return 0;
+}
+
+static int recompressRun(RecompressJob *job) {
+   int ret;
+   if ((ret = recompressOpen(job)) < 0) {
+      return ret;
+   }
+   while ((ret = av_read_frame(job->inputCtx, job->packet)) >= 0) {
+      if (!rsAtomicLoad(&recompressRunning)) {
+         av_packet_unref(job->packet);
+         return AVERROR_EXIT;
+      }
+      unsigned index = (unsigned)job->packet->stream_index;
+      RecompressStream *stream = &job->streams[index];
+      if (stream->decoderCtx != NULL) {
+         ret = avcodec_send_packet(stream->decoderCtx, job->packet);
+         av_packet_unref(job->packet);
+         if (ret < 0 || (ret = recompressEncodeFrames(job, index)) < 0) {
+            return ret;
+         }
+      } else {
+         av_packet_rescale_ts(job->packet, job->inputCtx->streams[index]->time_base,
+                              stream->output->time_base);
+         if ((ret = av_interleaved_write_frame(job->outputCtx, job->packet)) < 0) {
+            return ret;
+         }
+      }
+   }
+   if (ret != AVERROR_EOF) {
+      return ret;
+   }
+   if ((ret = recompressFlush(job)) < 0) {
+      return ret;
+   }
+   if ((ret = av_write_trailer(job->outputCtx)) < 0) {
+      return ret;
+   }
+   return avio_closep(&job->outputCtx->pb);
+}
+
+static void recompressJobDestroy(RecompressJob *job) {
+   if (job->streams != NULL) {
+      for (unsigned i = 0; i < job->inputCtx->nb_streams; ++i) {
+         avcodec_free_context(&job->streams[i].decoderCtx);
+         avcodec_free_context(&job->streams[i].encoderCtx);
+      }
+      av_freep(&job->streams);
+   }
+   if (job->outputCtx != NULL) {
+      avio_closep(&job->outputCtx->pb);
+      avformat_free_context(job->outputCtx);
+      job->outputCtx = NULL;
+   }
+   avformat_close_input(&job->inputCtx);
+   av_packet_free(&job->packet);
+   av_frame_free(&job->frame);
+   av_freep(&job->tempPath);
+}
+
+static void recompressFile(const char *path) {
+   int ret;
+   RecompressJob job = {.path = path};
+   int64_t time = recompressThreadTime();
+   int64_t inputSize = recompressFileSize(path);
+   job.tempPath = rsFormat("%s.tmp", path);
+   job.frame = av_frame_alloc();
+   job.packet = av_packet_alloc();
+   if (job.tempPath == NULL || job.frame == NULL || job.packet == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto error;
+   }
+   if ((ret = recompressRun(&job)) < 0) {
+      goto error;
+   }
+
+   // Renaming over the original is atomic so there is never a half written clip
+   if (rename(job.tempPath, path) == -1) {
+      ret = AVERROR(errno);
+      goto error;
+   }
+   int64_t outputSize = recompressFileSize(path);
+   av_log(NULL, AV_LOG_INFO,
+          "Recompressed '%s': %.1f MiB to %.1f MiB (%.0f%%) using %.1fs of CPU\n", path,
+          (double)inputSize / (1024.0 * 1024.0), (double)outputSize / (1024.0 * 1024.0),
+          inputSize > 0 ? 100.0 * (double)outputSize / (double)inputSize : 0.0,
+          (double)(recompressThreadTime() - time) / AV_TIME_BASE);
+   recompressJobDestroy(&job);
+   return;
+
+error:
+   if (ret != AVERROR_EXIT) {
+      av_log(NULL, AV_LOG_WARNING, "Failed to recompress '%s': %s\n", path,
+             av_err2str(ret));
+   }
+   if (job.tempPath != NULL) {
+      remove(job.tempPath);
+   }
+   recompressJobDestroy(&job);
+}
+
+static void *recompressThreadRun(void *extra) {
+   (void)extra;
+   rsThreadSetName("rs-recompress");
+   rsThreadSetPriority(RS_THREAD_POLICY_OTHER, 19);
+   rsThreadSetIdleIO(1);
+
+   rsMutexLock(&recompressMutex);
+   while (recompressRunning) {
+      if (recompressCount == 0) {
+         rsCondWait(&recompressCond, &recompressMutex);
+         continue;
+      }
+      char *path = recompressQueue[0];
+      --recompressCount;
+      memmove(recompressQueue, recompressQueue + 1,
+              (size_t)recompressCount * sizeof(char *));
+      rsMutexUnlock(&recompressMutex);
+      recompressFile(path);
+      av_freep(&path);
+      rsMutexLock(&recompressMutex);
+   }
+   rsMutexUnlock(&recompressMutex);
+   return NULL;
+}
+
+int rsRecompressInit(void) {
+   int ret;
+   if (rsConfig.recompressEncoder == RS_CONFIG_RECOMPRESS_OFF) {
+      return 0;
+   }
+   if (recompressEncoderName() == NULL) {
+      av_log(NULL, AV_LOG_ERROR,
+             "Cannot recompress with encoder %i, use x264, x265 or svtav1\n",
+             rsConfig.recompressEncoder);
+      return AVERROR(EINVAL);
+   }
+   if ((ret = rsMutexCreate(&recompressMutex)) < 0) {
+      goto error;
+   }
+   if ((ret = rsCondCreate(&recompressCond)) < 0) {
+      goto error;
+   }
+   rsAtomicStore(&recompressRunning, 1);
+   if ((ret = rsThreadCreate(&recompressThread, recompressThreadRun, NULL)) < 0) {
+      goto error;
+   }
+   return 0;
+
+error:
+   rsRecompressExit();
+   return ret;
+}
+
+void rsRecompressExit(void) {
+   if (recompressRunning) {
+      rsMutexLock(&recompressMutex);
+      rsAtomicStore(&recompressRunning, 0);
+      rsCondBroadcast(&recompressCond);
+      rsMutexUnlock(&recompressMutex);
+   }
+   rsThreadDestroy(&recompressThread);
+   for (int i = 0; i < recompressCount; ++i) {
+      av_freep(&recompressQueue[i]);
+   }
+   recompressCount = 0;
+   rsCondDestroy(&recompressCond);
+   rsMutexDestroy(&recompressMutex);
+}
+
+void rsRecompressAdd(const char *path) {
+   if (!rsAtomicLoad(&recompressRunning)) {
+      return;
+   }
+   rsMutexLock(&recompressMutex);
+   if (recompressCount < RECOMPRESS_MAX_QUEUE) {
+      recompressQueue[recompressCount] = av_strdup(path);
+      if (recompressQueue[recompressCount] != NULL) {
+         ++recompressCount;
+         rsCondSignal(&recompressCond);
+      }
+   } else {
+      av_log(NULL, AV_LOG_WARNING, "Too many clips waiting, not recompressing '%s'\n",
+             path);
+   }
+   rsMutexUnlock(&recompressMutex);
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RS_RECOMPRESS_H
+#define RS_RECOMPRESS_H
+#include <libavutil/avutil.h>
+
+// Re-encodes saved clips with a slower encoder on an idle priority thread and replaces
+// them once done
+int rsRecompressInit(void);
+void rsRecompressExit(void);
+void rsRecompressAdd(const char *path);
+
+#endif
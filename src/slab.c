@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "slab.h"
+#include "memory.h"
+#include "util.h"
+
+#define SLAB_ALIGN ((size_t)64)
+
+struct RSSlab {
+   uint8_t *data;
+   size_t size;
+   size_t head;
+   size_t tail;
+   // Where the lap before the head wrapped around
+   size_t end;
+   int refs;
+   // Replaced by a bigger slab, it is freed once nothing refers to it
+   int retired;
+};
+
+typedef struct SlabBlock {
+   RSSlab *slab;
+   size_t size;
+   int freed;
+} SlabBlock;
+
+#define SLAB_HEADER_SIZE FFALIGN(sizeof(SlabBlock), SLAB_ALIGN)
+
+static void slabDestroy(RSSlab *slab) {
+   rsMemoryFree(slab->data, slab->size);
+   av_free(slab);
+}
+
+static RSSlab *slabCreate(size_t size) {
+   RSSlab *slab = av_mallocz(sizeof(RSSlab));
+   if (slab == NULL) {
+      return NULL;
+   }
+   slab->data = rsMemoryAlloc(size);
+   if (slab->data == NULL) {
+      av_free(slab);
+      return NULL;
+   }
+   slab->size = size;
+   slab->end = size;
+   av_log(NULL, AV_LOG_VERBOSE, "Created %.1f MiB packet slab\n",
+          (double)size / (1024.0 * 1024.0));
+   return slab;
+}
+
+static void slabFree(void *extra, uint8_t *data) {
+   (void)extra;
+   SlabBlock *block = (SlabBlock *)(data - SLAB_HEADER_SIZE);
+   RSSlab *slab = block->slab;
+   block->freed = 1;
+   --slab->refs;
+
+   // Packets that were saved can be freed out of order, the tail waits for them
+   while (slab->tail != slab->head) {
+      if (slab->tail == slab->end) {
+         slab->tail = 0;
+         slab->end = slab->size;
+         continue;
+      }
+      SlabBlock *tail = (SlabBlock *)(slab->data + slab->tail);
+      if (!tail->freed) {
+         break;
+      }
+      slab->tail += tail->size;
+   }
+   if (slab->refs == 0) {
+      slab->head = 0;
+      slab->tail = 0;
+      slab->end = slab->size;
+      if (slab->retired) {
+         slabDestroy(slab);
+      }
+   }
+}
+
+static uint8_t *slabTake(RSSlab *slab, size_t size) {
+   size_t offset;
+   if (slab->head >= slab->tail && slab->size - slab->head >= size) {
+      offset = slab->head;
+   } else if (slab->head >= slab->tail && slab->tail > size) {
+      // The head never catches up to the tail so an equal head and tail means empty
+      slab->end = slab->head;
+      offset = 0;
+   } else if (slab->head < slab->tail && slab->tail - slab->head > size) {
+      offset = slab->head;
+   } else {
+      return NULL;
+   }
+
+   slab->head = offset + size;
+   ++slab->refs;
+   SlabBlock *block = (SlabBlock *)(slab->data + offset);
+   block->slab = slab;
+   block->size = size;
+   block->freed = 0;
+   return slab->data + offset + SLAB_HEADER_SIZE;
+}
+
+int rsSlabPoolCreate(RSSlabPool *pool, size_t size) {
+   rsClear(pool, sizeof(RSSlabPool));
+   pool->size = size;
+   return 0;
+}
+
+void rsSlabPoolDestroy(RSSlabPool *pool) {
+   RSSlab *slab = pool->current;
+   if (slab != NULL) {
+      slab->retired = 1;
+      if (slab->refs == 0) {
+         slabDestroy(slab);
+      }
+   }
+   pool->current = NULL;
+}
+
+AVBufferRef *rsSlabAlloc(RSSlabPool *pool, size_t size) {
+   size_t blockSize = SLAB_HEADER_SIZE + FFALIGN(size, SLAB_ALIGN);
+   uint8_t *data = NULL;
+   if (pool->current != NULL) {
+      data = slabTake(pool->current, blockSize);
+   }
+   if (data == NULL) {
+      // Slabs are only retired when full so they double until the buffer fits in one
+      if (pool->current != NULL) {
+         pool->size = pool->current->size * 2;
+      }
+      while (pool->size < blockSize * 2) {
+         pool->size *= 2;
+      }
+      RSSlab *slab = slabCreate(pool->size);
+      if (slab == NULL) {
+         return NULL;
+      }
+      rsSlabPoolDestroy(pool);
+      pool->current = slab;
+      data = slabTake(slab, blockSize);
+   }
+   AVBufferRef *buf = av_buffer_create(data, (int)size, slabFree, NULL, 0);
+   if (buf == NULL) {
+      slabFree(NULL, data);
+   }
+   return buf;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RS_SLAB_H
+#define RS_SLAB_H
+#include <libavutil/buffer.h>
+
+typedef struct RSSlab RSSlab;
+
+// Hands out packet memory from large locked blocks. Memory is taken from a slab like a
+// ring since packets are freed in about the order they were added, and a full slab is
+// replaced by one twice the size that takes over once the old packets are gone.
+typedef struct RSSlabPool {
+   RSSlab *current;
+   size_t size;
+} RSSlabPool;
+
+int rsSlabPoolCreate(RSSlabPool *pool, size_t size);
+// Slabs that still have memory in use are freed with their last buffer
+void rsSlabPoolDestroy(RSSlabPool *pool);
+// Not thread-safe, the buffers also have to be freed on the thread using the pool
+AVBufferRef *rsSlabAlloc(RSSlabPool *pool, size_t size);
+
+#endif
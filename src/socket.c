@@ -22,6 +22,7 @@
 #include "util.h"
 #include <stdio.h>
 #ifdef RS_BUILD_UNIX_SOCKET_FOUND
+#include <fcntl.h>
 #include <poll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -156,6 +157,23 @@ int rsSocketAccept(RSSocket *sock, RSSocket *conn, int timeout) {
 #endif
 }
 
+int rsSocketSetNonBlocking(RSSocket *sock) {
+#ifdef RS_BUILD_UNIX_SOCKET_FOUND
+   int flags = fcntl(sock->fd, F_GETFL);
+   if (flags == -1 || fcntl(sock->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+      int ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_ERROR, "Failed to make socket non-blocking: %s\n",
+             av_err2str(ret));
+      return ret;
+   }
+   return 0;
+
+#else
+   (void)sock;
+   return AVERROR(ENOSYS);
+#endif
+}
+
 int rsSocketSend(RSSocket *sock, size_t size, const void *buffer, size_t fileCount,
                  const int *files) {
 #ifdef RS_BUILD_UNIX_SOCKET_FOUND
@@ -172,16 +190,18 @@ int rsSocketSend(RSSocket *sock, size_t size, const void *buffer, size_t fileCou
    if (fileCount > 0) {
       size_t filesSize = sizeof(int) * fileCount;
       msg.msg_control = sock->buffer;
-      msg.msg_controllen = CMSG_LEN(filesSize);
+      msg.msg_controllen = CMSG_SPACE(filesSize);
       struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-      cmsg->cmsg_len = msg.msg_controllen;
+      cmsg->cmsg_len = CMSG_LEN(filesSize);
       cmsg->cmsg_level = SOL_SOCKET;
       cmsg->cmsg_type = SCM_RIGHTS;
-      memcpy(CMSG_DATA(cmsg), files, 4);
+      memcpy(CMSG_DATA(cmsg), files, filesSize);
    }
-   if (sendmsg(sock->fd, &msg, 0) == -1) {
+   if (sendmsg(sock->fd, &msg, MSG_NOSIGNAL) == -1) {
       int ret = AVERROR(errno);
-      av_log(NULL, AV_LOG_ERROR, "Failed to send message: %s\n", av_err2str(ret));
+      if (ret != AVERROR(EAGAIN)) {
+         av_log(NULL, AV_LOG_ERROR, "Failed to send message: %s\n", av_err2str(ret));
+      }
       return ret;
    }
    return 0;
@@ -205,29 +225,49 @@ int rsSocketReceive(RSSocket *sock, size_t size, void *buffer, size_t fileCount,
 
    struct msghdr msg = {0};
    struct iovec *iov = &(struct iovec){.iov_base = buffer, .iov_len = size};
-   size_t filesSize = sizeof(int) * fileCount;
-   struct cmsghdr *cmsg = NULL;
    if (size > 0) {
       msg.msg_iovlen = 1;
       msg.msg_iov = iov;
    }
    if (fileCount > 0) {
       msg.msg_control = sock->buffer;
-      msg.msg_controllen = CMSG_LEN(filesSize);
-      cmsg = CMSG_FIRSTHDR(&msg);
-      cmsg->cmsg_len = msg.msg_controllen;
-      cmsg->cmsg_level = SOL_SOCKET;
-      cmsg->cmsg_type = SCM_RIGHTS;
+      msg.msg_controllen = CMSG_SPACE(sizeof(int) * fileCount);
    }
    if (recvmsg(sock->fd, &msg, 0) == -1) {
       int ret = AVERROR(errno);
       av_log(NULL, AV_LOG_ERROR, "Failed to receive message: %s\n", av_err2str(ret));
       return ret;
    }
-   if (cmsg != NULL) {
-      memcpy(files, CMSG_DATA(cmsg), filesSize);
+
+   // The sender may attach fewer files than we have room for, or none at all. The
+   // control buffer is padded so it can also fit more than were asked for.
+   size_t received = 0;
+   int truncated = (msg.msg_flags & MSG_CTRUNC) != 0;
+   for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+        cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+         size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+         for (size_t i = 0; i < count; ++i) {
+            int file;
+            memcpy(&file, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (received < fileCount) {
+               files[received++] = file;
+            } else {
+               close(file);
+               truncated = 1;
+            }
+         }
+      }
    }
-   return 0;
+   if (truncated) {
+      // A partial set of files cannot be used, the kernel already closed the rest
+      for (size_t i = 0; i < received; ++i) {
+         close(files[i]);
+      }
+      av_log(NULL, AV_LOG_ERROR, "Received more files than expected\n");
+      return AVERROR(EPROTO);
+   }
+   return (int)received;
 
 #else
    (void)sock;
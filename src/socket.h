@@ -43,6 +43,7 @@ void rsSocketDestroy(RSSocket *sock);
 int rsSocketBind(RSSocket *sock, const char *path);
 int rsSocketConnect(RSSocket *sock, const char *path);
 int rsSocketAccept(RSSocket *sock, RSSocket *conn, int timeout);
+int rsSocketSetNonBlocking(RSSocket *sock);
 int rsSocketSend(RSSocket *sock, size_t size, const void *buffer, size_t fileCount,
                  const int *files);
 int rsSocketReceive(RSSocket *sock, size_t size, void *buffer, size_t fileCount,
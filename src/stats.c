@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+#include "config.h"
+#include "util.h"
+#include <libavutil/intreadwrite.h>
+
+#define STATS_NO_QP 0xFF
+
+static const RSStatsEntry *statsGetEntry(const RSStats *stats, int index) {
+   // Index 0 is the oldest entry
+   int i = stats->next - stats->count + index;
+   if (i < 0) {
+      i += stats->capacity;
+   }
+   return &stats->entries[i];
+}
+
+int rsStatsCreate(RSStats *stats, int capacity) {
+   rsClear(stats, sizeof(RSStats));
+   stats->entries = av_malloc_array((size_t)capacity, sizeof(RSStatsEntry));
+   if (stats->entries == NULL) {
+      return AVERROR(ENOMEM);
+   }
+   stats->capacity = capacity;
+   return 0;
+}
+
+int rsStatsResize(RSStats *stats, int capacity) {
+   if (capacity == stats->capacity) {
+      return 0;
+   }
+   RSStatsEntry *entries = av_malloc_array((size_t)capacity, sizeof(RSStatsEntry));
+   if (entries == NULL) {
+      return AVERROR(ENOMEM);
+   }
+   // Keep the newest entries, oldest first
+   int count = FFMIN(stats->count, capacity);
+   for (int i = 0; i < count; ++i) {
+      entries[i] = *statsGetEntry(stats, stats->count - count + i);
+   }
+   av_freep(&stats->entries);
+   stats->entries = entries;
+   stats->capacity = capacity;
+   stats->count = count;
+   stats->next = count % capacity;
+   return 0;
+}
+
+void rsStatsDestroy(RSStats *stats) {
+   av_freep(&stats->entries);
+   stats->capacity = 0;
+   stats->count = 0;
+}
+
+void rsStatsAdd(RSStats *stats, const AVPacket *packet) {
+   if (stats->capacity == 0) {
+      return;
+   }
+
+   RSStatsEntry *entry = &stats->entries[stats->next];
+   entry->dts = packet->dts;
+   entry->size = packet->size;
+   entry->key = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+   entry->type = AV_PICTURE_TYPE_NONE;
+   entry->qp = STATS_NO_QP;
+   int size;
+   const uint8_t *quality =
+       av_packet_get_side_data(packet, AV_PKT_DATA_QUALITY_STATS, &size);
+   if (quality != NULL && size >= 5) {
+      // The quality is stored as a lambda in the first 4 bytes, followed by the frame type
+      int qp = (int)(AV_RL32(quality) / FF_QP2LAMBDA);
+      entry->qp = (uint8_t)FFMIN(qp, STATS_NO_QP - 1);
+      entry->type = quality[4];
+   }
+
+   stats->next = (stats->next + 1) % stats->capacity;
+   stats->count = FFMIN(stats->count + 1, stats->capacity);
+}
+
+void rsStatsGetSummary(const RSStats *stats, int64_t window, RSStatsSummary *summary) {
+   rsClear(summary, sizeof(RSStatsSummary));
+   summary->averageQP = -1.0;
+   if (stats->count == 0) {
+      return;
+   }
+
+   int64_t last = statsGetEntry(stats, stats->count - 1)->dts;
+   int first = stats->count - 1;
+   while (first > 0 && statsGetEntry(stats, first - 1)->dts > last - window) {
+      --first;
+   }
+
+   int qpCount = 0;
+   int64_t qpSum = 0;
+   int64_t peak = 0;
+   int64_t second = 0;
+   int start = first;
+   for (int i = first; i < stats->count; ++i) {
+      const RSStatsEntry *entry = statsGetEntry(stats, i);
+      ++summary->frames;
+      summary->bytes += entry->size;
+      if (entry->key) {
+         ++summary->keyFrames;
+         summary->keyBytes += entry->size;
+      }
+      if (entry->qp != STATS_NO_QP) {
+         ++qpCount;
+         qpSum += entry->qp;
+      }
+
+      // Slide a one second window along to find the peak
+      second += entry->size;
+      while (statsGetEntry(stats, start)->dts <= entry->dts - AV_TIME_BASE) {
+         second -= statsGetEntry(stats, start++)->size;
+      }
+      peak = FFMAX(peak, second);
+   }
+
+   // Each packet covers one frame of time
+   int64_t frameTime = AV_TIME_BASE / rsConfig.videoFramerate;
+   summary->duration = last - statsGetEntry(stats, first)->dts + frameTime;
+   summary->averageBitrate =
+       (double)summary->bytes * 8.0 * AV_TIME_BASE / (double)summary->duration;
+   summary->peakBitrate = (double)peak * 8.0;
+   if (qpCount > 0) {
+      summary->averageQP = (double)qpSum / qpCount;
+   }
+}
+
+void rsStatsLog(const RSStats *stats, int64_t window) {
+   RSStatsSummary summary;
+   rsStatsGetSummary(stats, window, &summary);
+   if (summary.frames == 0) {
+      return;
+   }
+
+   double bytesPerSecond = summary.averageBitrate / 8.0;
+   av_log(NULL, AV_LOG_VERBOSE,
+          "Video bitrate over %.1fs: %.2f Mbit/s average, %.2f Mbit/s peak, %.1f KiB/s\n",
+          (double)summary.duration / AV_TIME_BASE, summary.averageBitrate / 1000000.0,
+          summary.peakBitrate / 1000000.0, bytesPerSecond / 1024.0);
+   av_log(NULL, AV_LOG_VERBOSE,
+          "Key-frames are %.1f%% of frames and %.1f%% of bytes, average QP %.1f\n",
+          100.0 * summary.keyFrames / summary.frames,
+          100.0 * (double)summary.keyBytes / (double)summary.bytes, summary.averageQP);
+   av_log(NULL, AV_LOG_VERBOSE, "A %is video buffer needs about %.1f MiB\n",
+          rsConfig.recordSeconds,
+          bytesPerSecond * rsConfig.recordSeconds / (1024.0 * 1024.0));
+}
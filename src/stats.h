@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RS_STATS_H
+#define RS_STATS_H
+#include <libavcodec/avcodec.h>
+
+// Per-packet encoder statistics for tuning the quality and bitrate and predicting the
+// buffer memory
+typedef struct RSStatsEntry {
+   int64_t dts;
+   int size;
+   uint8_t key;
+   uint8_t type;
+   // Only some encoders report this, 0xFF otherwise
+   uint8_t qp;
+} RSStatsEntry;
+
+typedef struct RSStats {
+   RSStatsEntry *entries;
+   int capacity;
+   int count;
+   int next;
+} RSStats;
+
+typedef struct RSStatsSummary {
+   int64_t duration;
+   int frames;
+   int keyFrames;
+   int64_t bytes;
+   int64_t keyBytes;
+   // In bits per second, the peak is over any one second
+   double averageBitrate;
+   double peakBitrate;
+   // Negative when the encoder does not report it
+   double averageQP;
+} RSStatsSummary;
+
+int rsStatsCreate(RSStats *stats, int capacity);
+// Keeps as many of the newest entries as fit
+int rsStatsResize(RSStats *stats, int capacity);
+void rsStatsDestroy(RSStats *stats);
+void rsStatsAdd(RSStats *stats, const AVPacket *packet);
+// Sums up the last window microseconds of packets
+void rsStatsGetSummary(const RSStats *stats, int64_t window, RSStatsSummary *summary);
+void rsStatsLog(const RSStats *stats, int64_t window);
+
+#endif
@@ -17,8 +17,27 @@
  * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include "thread.h"
 #include "util.h"
+#include <libavutil/avstring.h>
+#include <libavutil/time.h>
+#include <stdlib.h>
+#ifdef RS_BUILD_SCHED_FOUND
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Not exported by glibc, see ioprio_set(2)
+#define THREAD_IOPRIO_WHO_PROCESS 1
+#define THREAD_IOPRIO_CLASS_SHIFT 13
+#define THREAD_IOPRIO_CLASS_NONE 0
+#define THREAD_IOPRIO_CLASS_IDLE 3
+
+#define THREAD_DEADLINE_REPORT (10 * AV_TIME_BASE)
 
 int rsThreadCreate(RSThread *thread, RSThreadFunction func, void *extra) {
 #ifdef RS_BUILD_PTHREAD_FOUND
@@ -56,6 +75,242 @@ void *rsThreadDestroy(RSThread *thread) {
    return result;
 }
 
+void rsThreadSetName(const char *name) {
+#ifdef RS_BUILD_SCHED_FOUND
+   // Linux limits thread names to 15 characters
+   char buffer[16];
+   av_strlcpy(buffer, name, sizeof(buffer));
+   pthread_setname_np(pthread_self(), buffer);
+
+#else
+   (void)name;
+#endif
+}
+
+int rsThreadSetAffinity(const char *cpus) {
+#ifdef RS_BUILD_SCHED_FOUND
+   int ret;
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   const char *str = cpus;
+   while (*str != '\0') {
+      char *end;
+      long first = strtol(str, &end, 10);
+      long last = first;
+      if (end == str) {
+         goto invalid;
+      }
+      if (*end == '-') {
+         str = end + 1;
+         last = strtol(str, &end, 10);
+         if (end == str) {
+            goto invalid;
+         }
+      }
+      if (first < 0 || last < first || last >= CPU_SETSIZE) {
+         goto invalid;
+      }
+      for (long cpu = first; cpu <= last; ++cpu) {
+         CPU_SET((size_t)cpu, &set);
+      }
+      if (*end == ',') {
+         ++end;
+      } else if (*end != '\0') {
+         goto invalid;
+      }
+      str = end;
+   }
+   if (CPU_COUNT(&set) == 0) {
+      goto invalid;
+   }
+
+   if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+      ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_WARNING, "Failed to set thread affinity to '%s': %s\n", cpus,
+             av_err2str(ret));
+      return ret;
+   }
+   return 0;
+
+invalid:
+   av_log(NULL, AV_LOG_ERROR, "Invalid CPU list: %s\n", cpus);
+   return AVERROR(EINVAL);
+
+#else
+   (void)cpus;
+   av_log(NULL, AV_LOG_WARNING, "Thread affinity was not found during compilation\n");
+   return AVERROR(ENOSYS);
+#endif
+}
+
+int rsThreadSetPriority(int policy, int priority) {
+#ifdef RS_BUILD_SCHED_FOUND
+   int ret;
+   struct sched_param param = {0};
+   int schedPolicy;
+   switch (policy) {
+   case RS_THREAD_POLICY_FIFO:
+      schedPolicy = SCHED_FIFO;
+      param.sched_priority = priority;
+      break;
+   case RS_THREAD_POLICY_RR:
+      schedPolicy = SCHED_RR;
+      param.sched_priority = priority;
+      break;
+   case RS_THREAD_POLICY_IDLE:
+      schedPolicy = SCHED_IDLE;
+      break;
+   default:
+      schedPolicy = SCHED_OTHER;
+      break;
+   }
+
+   // sched_setscheduler and setpriority with a thread ID only affect that thread on Linux
+   pid_t tid = (pid_t)syscall(SYS_gettid);
+   if (sched_setscheduler(tid, schedPolicy, &param) == -1) {
+      ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_WARNING, "Failed to set thread scheduling policy: %s\n",
+             av_err2str(ret));
+      return ret;
+   }
+   if (schedPolicy == SCHED_OTHER && setpriority(PRIO_PROCESS, (id_t)tid, priority) == -1) {
+      ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_WARNING, "Failed to set thread nice value: %s\n",
+             av_err2str(ret));
+      return ret;
+   }
+   return 0;
+
+#else
+   (void)policy;
+   (void)priority;
+   av_log(NULL, AV_LOG_WARNING,
+          "Thread scheduling policies were not found during compilation\n");
+   return AVERROR(ENOSYS);
+#endif
+}
+
+int rsThreadSetIdleIO(int idle) {
+#ifdef RS_BUILD_SCHED_FOUND
+   int ret;
+   int ioClass = idle ? THREAD_IOPRIO_CLASS_IDLE : THREAD_IOPRIO_CLASS_NONE;
+   if (syscall(SYS_ioprio_set, THREAD_IOPRIO_WHO_PROCESS, 0,
+               ioClass << THREAD_IOPRIO_CLASS_SHIFT) == -1) {
+      ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_WARNING, "Failed to set I/O priority: %s\n", av_err2str(ret));
+      return ret;
+   }
+   return 0;
+
+#else
+   (void)idle;
+   return AVERROR(ENOSYS);
+#endif
+}
+
+void rsThreadSchedule(const char *name, const char *cpus, int policy, int priority) {
+   rsThreadSetName(name);
+   if (cpus[0] != '\0' && rsThreadSetAffinity(cpus) >= 0) {
+      av_log(NULL, AV_LOG_VERBOSE, "Pinned %s thread to CPUs %s\n", name, cpus);
+   }
+
+   if (policy == RS_THREAD_POLICY_OTHER && priority == 0) {
+      return;
+   }
+   if (rsThreadSetPriority(policy, priority) >= 0) {
+      av_log(NULL, AV_LOG_VERBOSE, "Scheduling %s thread with priority %i\n", name,
+             priority);
+   }
+}
+
+void rsThreadSetBackground(int background, int policy, int priority) {
+   rsThreadSetIdleIO(background);
+
+   // Leaving SCHED_IDLE or raising the nice value back needs privileges we may not have,
+   // so only a real-time thread is dropped and only down to the normal policy
+   if (policy != RS_THREAD_POLICY_OTHER) {
+      if (background) {
+         rsThreadSetPriority(RS_THREAD_POLICY_OTHER, 0);
+      } else {
+         rsThreadSetPriority(policy, priority);
+      }
+   }
+}
+
+int rsThreadRunCommand(const char *command, int idle) {
+#ifdef RS_BUILD_SCHED_FOUND
+   int ret;
+   if (!idle) {
+      return system(command);
+   }
+
+   pid_t pid = fork();
+   if (pid == -1) {
+      ret = AVERROR(errno);
+      av_log(NULL, AV_LOG_ERROR, "Failed to fork: %s\n", av_err2str(ret));
+      return ret;
+   }
+   if (pid == 0) {
+      // Only async-signal-safe calls are allowed after forking a threaded process
+      struct sched_param param = {0};
+      sched_setscheduler(0, SCHED_IDLE, &param);
+      syscall(SYS_ioprio_set, THREAD_IOPRIO_WHO_PROCESS, 0,
+              THREAD_IOPRIO_CLASS_IDLE << THREAD_IOPRIO_CLASS_SHIFT);
+      execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+      _exit(127);
+   }
+
+   int status;
+   while (waitpid(pid, &status, 0) == -1) {
+      if (errno != EINTR) {
+         ret = AVERROR(errno);
+         av_log(NULL, AV_LOG_ERROR, "Failed to wait for command: %s\n", av_err2str(ret));
+         return ret;
+      }
+   }
+   return status;
+
+#else
+   (void)idle;
+   return system(command);
+#endif
+}
+
+void rsDeadlineInit(RSDeadline *deadline, const char *name) {
+   rsClear(deadline, sizeof(RSDeadline));
+   deadline->name = name;
+   deadline->last = av_gettime_relative();
+   deadline->reportTime = deadline->last + THREAD_DEADLINE_REPORT;
+}
+
+void rsDeadlineTick(RSDeadline *deadline, int64_t interval) {
+   int64_t time = av_gettime_relative();
+   // Ticks that come in early or in bursts carry over so they can catch up, and a bit of
+   // jitter is allowed before counting a wakeup as missed
+   int64_t due = deadline->last + interval;
+   int64_t late = time - due;
+   if (late > interval / 2) {
+      ++deadline->missed;
+      deadline->worst = FFMAX(deadline->worst, late);
+   }
+   ++deadline->ticks;
+   deadline->last = late > 0 ? time : due;
+
+   if (time >= deadline->reportTime) {
+      av_log(NULL, deadline->missed > 0 ? AV_LOG_VERBOSE : AV_LOG_DEBUG,
+             "%s thread: %i of %i deadlines missed, worst %.1fms late\n", deadline->name,
+             deadline->missed, deadline->ticks, (double)deadline->worst / 1000.0);
+      deadline->ticks = 0;
+      deadline->missed = 0;
+      deadline->worst = 0;
+      deadline->reportTime = time + THREAD_DEADLINE_REPORT;
+   }
+}
+
+void rsDeadlineReset(RSDeadline *deadline) {
+   deadline->last = av_gettime_relative();
+}
+
 int rsMutexCreate(RSMutex *mutex) {
 #ifdef RS_BUILD_PTHREAD_FOUND
    int ret;
@@ -110,3 +365,303 @@ void rsMutexUnlock(RSMutex *mutex) {
    (void)mutex;
 #endif
 }
+
+int rsCondCreate(RSCond *cond) {
+#ifdef RS_BUILD_PTHREAD_FOUND
+   int ret;
+   rsClear(cond, sizeof(RSCond));
+   if ((ret = pthread_cond_init(&cond->cond, NULL)) != 0) {
+      ret = AVERROR(ret);
+      av_log(NULL, AV_LOG_ERROR, "Failed to create PThread condition: %s\n",
+             av_err2str(ret));
+      return ret;
+   }
+   cond->created = 1;
+
+#else
+   (void)cond;
+#endif
+   return 0;
+}
+
+void rsCondDestroy(RSCond *cond) {
+#ifdef RS_BUILD_PTHREAD_FOUND
+   if (cond->created) {
+      pthread_cond_destroy(&cond->cond);
+      cond->created = 0;
+   }
+
+#else
+   (void)cond;
+#endif
+}
+
+void rsCondWait(RSCond *cond, RSMutex *mutex) {
+#ifdef RS_BUILD_PTHREAD_FOUND
+   int ret;
+   if ((ret = pthread_cond_wait(&cond->cond, &mutex->mutex)) != 0) {
+      ret = AVERROR(ret);
+      av_log(NULL, AV_LOG_ERROR, "Failed to wait on condition: %s\n", av_err2str(ret));
+   }
+
+#else
+   (void)cond;
+   (void)mutex;
+#endif
+}
+
+void rsCondSignal(RSCond *cond) {
+#ifdef RS_BUILD_PTHREAD_FOUND
+   pthread_cond_signal(&cond->cond);
+#else
+   (void)cond;
+#endif
+}
+
+void rsCondBroadcast(RSCond *cond) {
+#ifdef RS_BUILD_PTHREAD_FOUND
+   pthread_cond_broadcast(&cond->cond);
+#else
+   (void)cond;
+#endif
+}
+
+int rsSemaphoreCreate(RSSemaphore *sem, int value) {
+   int ret;
+   rsClear(sem, sizeof(RSSemaphore));
+   sem->value = value;
+   if ((ret = rsMutexCreate(&sem->mutex)) < 0) {
+      return ret;
+   }
+   if ((ret = rsCondCreate(&sem->cond)) < 0) {
+      rsMutexDestroy(&sem->mutex);
+      return ret;
+   }
+   return 0;
+}
+
+void rsSemaphoreDestroy(RSSemaphore *sem) {
+   rsCondDestroy(&sem->cond);
+   rsMutexDestroy(&sem->mutex);
+}
+
+void rsSemaphoreWait(RSSemaphore *sem) {
+   rsMutexLock(&sem->mutex);
+   while (sem->value <= 0) {
+      rsCondWait(&sem->cond, &sem->mutex);
+   }
+   --sem->value;
+   rsMutexUnlock(&sem->mutex);
+}
+
+int rsSemaphoreTryWait(RSSemaphore *sem) {
+   int taken = 0;
+   rsMutexLock(&sem->mutex);
+   if (sem->value > 0) {
+      --sem->value;
+      taken = 1;
+   }
+   rsMutexUnlock(&sem->mutex);
+   return taken;
+}
+
+void rsSemaphorePost(RSSemaphore *sem) {
+   rsMutexLock(&sem->mutex);
+   ++sem->value;
+   rsCondSignal(&sem->cond);
+   rsMutexUnlock(&sem->mutex);
+}
+
+int rsFutureCreate(RSFuture *future) {
+   int ret;
+   rsClear(future, sizeof(RSFuture));
+   if ((ret = rsMutexCreate(&future->mutex)) < 0) {
+      return ret;
+   }
+   if ((ret = rsCondCreate(&future->cond)) < 0) {
+      rsMutexDestroy(&future->mutex);
+      return ret;
+   }
+   return 0;
+}
+
+void rsFutureDestroy(RSFuture *future) {
+   rsCondDestroy(&future->cond);
+   rsMutexDestroy(&future->mutex);
+}
+
+int rsFutureWait(RSFuture *future) {
+   rsMutexLock(&future->mutex);
+   while (!future->done) {
+      rsCondWait(&future->cond, &future->mutex);
+   }
+   int result = future->result;
+   rsMutexUnlock(&future->mutex);
+   return result;
+}
+
+static void threadTaskRun(RSThreadTask *task) {
+   int result = task->func(task->extra);
+   RSFuture *future = task->future;
+   rsMutexLock(&future->mutex);
+   future->result = result;
+   future->done = 1;
+   rsCondBroadcast(&future->cond);
+   rsMutexUnlock(&future->mutex);
+}
+
+static int threadWorkerPush(RSThreadWorker *worker, const RSThreadTask *task) {
+   int pushed = 0;
+   rsMutexLock(&worker->mutex);
+   if (worker->size < RS_THREAD_POOL_QUEUE_SIZE) {
+      int index = (worker->start + worker->size) % RS_THREAD_POOL_QUEUE_SIZE;
+      worker->tasks[index] = *task;
+      ++worker->size;
+      pushed = 1;
+   }
+   rsMutexUnlock(&worker->mutex);
+   return pushed;
+}
+
+static int threadWorkerPop(RSThreadWorker *worker, RSThreadTask *task) {
+   int popped = 0;
+   rsMutexLock(&worker->mutex);
+   if (worker->size > 0) {
+      --worker->size;
+      int index = (worker->start + worker->size) % RS_THREAD_POOL_QUEUE_SIZE;
+      *task = worker->tasks[index];
+      popped = 1;
+   }
+   rsMutexUnlock(&worker->mutex);
+   return popped;
+}
+
+static int threadWorkerSteal(RSThreadWorker *worker, RSThreadTask *task) {
+   int stolen = 0;
+   rsMutexLock(&worker->mutex);
+   if (worker->size > 0) {
+      *task = worker->tasks[worker->start];
+      worker->start = (worker->start + 1) % RS_THREAD_POOL_QUEUE_SIZE;
+      --worker->size;
+      stolen = 1;
+   }
+   rsMutexUnlock(&worker->mutex);
+   return stolen;
+}
+
+// Our own queue first, then one pass over everyone else's
+static int threadWorkerFind(RSThreadWorker *worker, RSThreadTask *task) {
+   RSThreadPool *pool = worker->pool;
+   if (threadWorkerPop(worker, task)) {
+      return 1;
+   }
+   for (int i = 1; i < pool->workerCount; ++i) {
+      RSThreadWorker *victim = &pool->workers[(worker->index + i) % pool->workerCount];
+      if (threadWorkerSteal(victim, task)) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+static void *threadWorkerRun(void *extra) {
+   RSThreadWorker *worker = extra;
+   RSThreadPool *pool = worker->pool;
+   char name[16];
+   snprintf(name, sizeof(name), "rs-pool-%i", worker->index);
+   rsThreadSetName(name);
+   int woken = 0;
+   while (rsAtomicLoad((int *)&pool->running)) {
+      RSThreadTask task;
+      if (threadWorkerFind(worker, &task)) {
+         // Every submit posts once, take the post for a task we found without waiting so
+         // sleeping workers are not woken for it later
+         if (!woken) {
+            rsSemaphoreTryWait(&pool->pending);
+         }
+         woken = 0;
+         threadTaskRun(&task);
+      } else {
+         // Every queue was empty. Tasks are queued before they post so anything submitted
+         // after the scan wakes us up again.
+         rsSemaphoreWait(&pool->pending);
+         woken = 1;
+      }
+   }
+   return NULL;
+}
+
+int rsThreadPoolCreate(RSThreadPool *pool, int workerCount) {
+   int ret;
+   rsClear(pool, sizeof(RSThreadPool));
+   pool->running = 1;
+   if ((ret = rsSemaphoreCreate(&pool->pending, 0)) < 0) {
+      goto error;
+   }
+
+#ifdef RS_BUILD_PTHREAD_FOUND
+   workerCount = av_clip(workerCount, 0, RS_THREAD_POOL_MAX_WORKERS);
+#else
+   workerCount = 0;
+#endif
+   for (int i = 0; i < workerCount; ++i) {
+      RSThreadWorker *worker = &pool->workers[i];
+      worker->pool = pool;
+      worker->index = i;
+      if ((ret = rsMutexCreate(&worker->mutex)) < 0) {
+         goto error;
+      }
+   }
+   // Workers index each other through workerCount so it must be set before they start
+   pool->workerCount = workerCount;
+   for (int i = 0; i < workerCount; ++i) {
+      RSThreadWorker *worker = &pool->workers[i];
+      if ((ret = rsThreadCreate(&worker->thread, threadWorkerRun, worker)) < 0) {
+         goto error;
+      }
+   }
+   return 0;
+
+error:
+   rsThreadPoolDestroy(pool);
+   return ret;
+}
+
+void rsThreadPoolDestroy(RSThreadPool *pool) {
+   rsAtomicStore((int *)&pool->running, 0);
+   for (int i = 0; i < pool->workerCount; ++i) {
+      rsSemaphorePost(&pool->pending);
+   }
+   for (int i = 0; i < pool->workerCount; ++i) {
+      RSThreadWorker *worker = &pool->workers[i];
+      rsThreadDestroy(&worker->thread);
+   }
+
+   // Anything still queued has a caller waiting on it
+   for (int i = 0; i < pool->workerCount; ++i) {
+      RSThreadWorker *worker = &pool->workers[i];
+      RSThreadTask task;
+      while (threadWorkerSteal(worker, &task)) {
+         threadTaskRun(&task);
+      }
+      rsMutexDestroy(&worker->mutex);
+   }
+   pool->workerCount = 0;
+   rsSemaphoreDestroy(&pool->pending);
+}
+
+void rsThreadPoolSubmit(RSThreadPool *pool, RSFuture *future, RSTaskFunction func,
+                        void *extra) {
+   RSThreadTask task = {.func = func, .extra = extra, .future = future};
+   if (pool != NULL && rsAtomicLoad((int *)&pool->running)) {
+      for (int i = 0; i < pool->workerCount; ++i) {
+         int index = rsAtomicAdd(&pool->nextWorker, 1) & INT_MAX;
+         RSThreadWorker *worker = &pool->workers[index % pool->workerCount];
+         if (threadWorkerPush(worker, &task)) {
+            rsSemaphorePost(&pool->pending);
+            return;
+         }
+      }
+   }
+   threadTaskRun(&task);
+}
@@ -25,7 +25,16 @@
 #include <pthread.h>
 #endif
 
+#define RS_THREAD_POOL_MAX_WORKERS 32
+#define RS_THREAD_POOL_QUEUE_SIZE 64
+
+#define RS_THREAD_POLICY_OTHER 0
+#define RS_THREAD_POLICY_FIFO 1
+#define RS_THREAD_POLICY_RR 2
+#define RS_THREAD_POLICY_IDLE 3
+
 typedef void *(*RSThreadFunction)(void *extra);
+typedef int (*RSTaskFunction)(void *extra);
 
 typedef struct RSThread {
 #ifdef RS_BUILD_PTHREAD_FOUND
@@ -41,11 +50,131 @@ typedef struct RSMutex {
    int created;
 } RSMutex;
 
+typedef struct RSCond {
+#ifdef RS_BUILD_PTHREAD_FOUND
+   pthread_cond_t cond;
+#endif
+   int created;
+} RSCond;
+
+typedef struct RSSemaphore {
+   RSMutex mutex;
+   RSCond cond;
+   int value;
+} RSSemaphore;
+
+typedef struct RSFuture {
+   RSMutex mutex;
+   RSCond cond;
+   int done;
+   int result;
+} RSFuture;
+
+typedef struct RSThreadTask {
+   RSTaskFunction func;
+   void *extra;
+   RSFuture *future;
+} RSThreadTask;
+
+// Each worker has its own queue which it takes from the back of, idle workers steal from
+// the front of the others
+typedef struct RSThreadWorker {
+   struct RSThreadPool *pool;
+   int index;
+   RSThread thread;
+   RSMutex mutex;
+   RSThreadTask tasks[RS_THREAD_POOL_QUEUE_SIZE];
+   int start;
+   int size;
+} RSThreadWorker;
+
+// Counts the times a periodic thread woke up later than it should have
+typedef struct RSDeadline {
+   const char *name;
+   int64_t last;
+   int64_t reportTime;
+   int64_t worst;
+   int ticks;
+   int missed;
+} RSDeadline;
+
+typedef struct RSThreadPool {
+   RSThreadWorker workers[RS_THREAD_POOL_MAX_WORKERS];
+   int workerCount;
+   int nextWorker;
+   RSSemaphore pending;
+   volatile int running;
+} RSThreadPool;
+
+static av_always_inline int rsAtomicLoad(const int *value) {
+   return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+static av_always_inline void rsAtomicStore(int *value, int desired) {
+   __atomic_store_n(value, desired, __ATOMIC_RELEASE);
+}
+
+static av_always_inline int rsAtomicAdd(int *value, int add) {
+   return __atomic_add_fetch(value, add, __ATOMIC_ACQ_REL);
+}
+
+static av_always_inline int rsAtomicExchange(int *value, int desired) {
+   return __atomic_exchange_n(value, desired, __ATOMIC_ACQ_REL);
+}
+
+static av_always_inline int rsAtomicCompareExchange(int *value, int expected,
+                                                    int desired) {
+   return __atomic_compare_exchange_n(value, &expected, desired, 0, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_ACQUIRE);
+}
+
 int rsThreadCreate(RSThread *thread, RSThreadFunction func, void *extra);
 void *rsThreadDestroy(RSThread *thread);
+// These apply to the calling thread
+void rsThreadSetName(const char *name);
+int rsThreadSetAffinity(const char *cpus);
+int rsThreadSetPriority(int policy, int priority);
+int rsThreadSetIdleIO(int idle);
+// Names the calling thread, pins it to the CPU list (empty for any) and sets its policy
+void rsThreadSchedule(const char *name, const char *cpus, int policy, int priority);
+// Drops the calling thread to idle I/O and out of a real-time policy while saving, and
+// puts it back afterwards
+void rsThreadSetBackground(int background, int policy, int priority);
+// Like system() but optionally runs the command at idle CPU and I/O priority
+int rsThreadRunCommand(const char *command, int idle);
+
+void rsDeadlineInit(RSDeadline *deadline, const char *name);
+// The interval is how long this tick should have taken in microseconds
+void rsDeadlineTick(RSDeadline *deadline, int64_t interval);
+// Forget the last tick after the thread was intentionally busy
+void rsDeadlineReset(RSDeadline *deadline);
+
 int rsMutexCreate(RSMutex *mutex);
 void rsMutexDestroy(RSMutex *mutex);
 void rsMutexLock(RSMutex *mutex);
 void rsMutexUnlock(RSMutex *mutex);
 
+int rsCondCreate(RSCond *cond);
+void rsCondDestroy(RSCond *cond);
+void rsCondWait(RSCond *cond, RSMutex *mutex);
+void rsCondSignal(RSCond *cond);
+void rsCondBroadcast(RSCond *cond);
+
+int rsSemaphoreCreate(RSSemaphore *sem, int value);
+void rsSemaphoreDestroy(RSSemaphore *sem);
+void rsSemaphoreWait(RSSemaphore *sem);
+// Returns 1 if the semaphore was taken without waiting
+int rsSemaphoreTryWait(RSSemaphore *sem);
+void rsSemaphorePost(RSSemaphore *sem);
+
+int rsFutureCreate(RSFuture *future);
+void rsFutureDestroy(RSFuture *future);
+int rsFutureWait(RSFuture *future);
+
+int rsThreadPoolCreate(RSThreadPool *pool, int workerCount);
+void rsThreadPoolDestroy(RSThreadPool *pool);
+// Runs the task on the calling thread if the pool has no workers or is full
+void rsThreadPoolSubmit(RSThreadPool *pool, RSFuture *future, RSTaskFunction func,
+                        void *extra);
+
 #endif
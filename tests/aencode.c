@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "audio/abuffer.h"
+#include "config.h"
+#include "test.h"
+#include <libavutil/channel_layout.h>
+#include <libavutil/time.h>
+#include <float.h>
+
+#define TEST_RATE 48000
+#define TEST_CHANNELS 2
+#define TEST_SECONDS 30
+#define TEST_SAMPLES (TEST_SECONDS * TEST_RATE)
+#define TEST_FRAME_SIZE 1024
+#define TEST_THREADS 4
+// Each block of the chunked encode has to be within 20dB of the serial encode, so a
+// click or a shift at a chunk boundary fails the test
+#define TEST_MIN_SNR 100.0
+
+RSConfig rsConfig;
+
+static float testSerial[TEST_SAMPLES + TEST_RATE];
+static float testChunked[TEST_SAMPLES + TEST_RATE];
+
+static int testFill(RSAudioBuffer *buffer) {
+   AVFrame *frame = av_frame_alloc();
+   RS_TEST_CHECK(frame != NULL);
+   for (int i = 0; i < TEST_SAMPLES; i += TEST_FRAME_SIZE) {
+      frame->format = AV_SAMPLE_FMT_FLT;
+      frame->channels = TEST_CHANNELS;
+      frame->channel_layout = AV_CH_LAYOUT_STEREO;
+      frame->sample_rate = TEST_RATE;
+      frame->nb_samples = TEST_FRAME_SIZE;
+      frame->pts = i;
+      RS_TEST_CHECK(av_frame_get_buffer(frame, 0) >= 0);
+      // A triangle wave on the left and its inverse on the right
+      float *data = (float *)frame->data[0];
+      for (int j = 0; j < TEST_FRAME_SIZE; ++j) {
+         float phase = (float)((i + j) % 1000) / 1000.0f;
+         float sample = (phase < 0.5f ? phase : 1.0f - phase) - 0.25f;
+         data[j * TEST_CHANNELS] = sample;
+         data[j * TEST_CHANNELS + 1] = -sample;
+      }
+      RS_TEST_CHECK(rsAudioBufferAddFrame(buffer, frame) >= 0);
+   }
+   av_frame_free(&frame);
+   return 0;
+}
+
+static int testEncode(RSAudioBuffer *buffer, const char *path, int threads,
+                      int prepare, int64_t *time) {
+   RSThreadPool pool;
+   RSOutput output = {0};
+   const AVCodecParameters *params;
+   rsConfig.audioThreads = threads;
+   RS_TEST_CHECK(rsThreadPoolCreate(&pool, threads - 1) >= 0);
+   RS_TEST_CHECK(rsAudioBufferPrepare(buffer, buffer->size) >= 0);
+   if (!prepare) {
+      // Without the pool every chunk creates its encoder while saving
+      for (int i = 0; i < buffer->encoderCount; ++i) {
+         rsEncoderDestroy(&buffer->encoders[i]);
+      }
+      buffer->encoderCount = 0;
+   }
+   RS_TEST_CHECK(rsAudioBufferGetParams(buffer, &params) >= 0);
+
+   RS_TEST_CHECK(avformat_alloc_output_context2(&output.formatCtx, NULL, "mp4", path) >=
+                 0);
+   RS_TEST_CHECK(avio_open(&output.formatCtx->pb, path, AVIO_FLAG_WRITE) >= 0);
+   rsOutputAddStream(&output, params);
+   RS_TEST_CHECK(rsOutputOpen(&output) >= 0);
+   int64_t start = av_gettime_relative();
+   RS_TEST_CHECK(rsAudioBufferWrite(buffer, &pool, &output, 0, 0) >= 0);
+   *time = av_gettime_relative() - start;
+   RS_TEST_CHECK(av_write_trailer(output.formatCtx) >= 0);
+   rsOutputDestroy(&output);
+   rsThreadPoolDestroy(&pool);
+   return 0;
+}
+
+static int testDecode(const char *path, float *samples, int *size) {
+   int ret;
+   AVFormatContext *formatCtx = NULL;
+   AVPacket *packet = av_packet_alloc();
+   AVFrame *frame = av_frame_alloc();
+   RS_TEST_CHECK(packet != NULL && frame != NULL);
+   RS_TEST_CHECK(avformat_open_input(&formatCtx, path, NULL, NULL) >= 0);
+   RS_TEST_CHECK(avformat_find_stream_info(formatCtx, NULL) >= 0);
+   const AVCodecParameters *params = formatCtx->streams[0]->codecpar;
+   const AVCodec *codec = avcodec_find_decoder(params->codec_id);
+   RS_TEST_CHECK(codec != NULL);
+   AVCodecContext *codecCtx = avcodec_alloc_context3(codec);
+   RS_TEST_CHECK(codecCtx != NULL);
+   RS_TEST_CHECK(avcodec_parameters_to_context(codecCtx, params) >= 0);
+   RS_TEST_CHECK(avcodec_open2(codecCtx, codec, NULL) >= 0);
+
+   // Only the first channel is compared
+   *size = 0;
+   while ((ret = avcodec_receive_frame(codecCtx, frame)) != AVERROR_EOF) {
+      if (ret == AVERROR(EAGAIN)) {
+         if ((ret = av_read_frame(formatCtx, packet)) == AVERROR_EOF) {
+            RS_TEST_CHECK(avcodec_send_packet(codecCtx, NULL) >= 0);
+         } else {
+            RS_TEST_CHECK(ret >= 0);
+            RS_TEST_CHECK(avcodec_send_packet(codecCtx, packet) >= 0);
+            av_packet_unref(packet);
+         }
+         continue;
+      }
+      RS_TEST_CHECK(ret >= 0);
+      RS_TEST_CHECK(frame->format == AV_SAMPLE_FMT_FLTP);
+      int count = FFMIN(frame->nb_samples, TEST_SAMPLES + TEST_RATE - *size);
+      memcpy(samples + *size, frame->data[0], (size_t)count * sizeof(float));
+      *size += count;
+      av_frame_unref(frame);
+   }
+
+   avcodec_free_context(&codecCtx);
+   avformat_close_input(&formatCtx);
+   av_frame_free(&frame);
+   av_packet_free(&packet);
+   return 0;
+}
+
+int main(void) {
+   AVCodecParameters *params = avcodec_parameters_alloc();
+   RS_TEST_CHECK(params != NULL);
+   params->codec_type = AVMEDIA_TYPE_AUDIO;
+   params->format = AV_SAMPLE_FMT_FLT;
+   params->channels = TEST_CHANNELS;
+   params->channel_layout = AV_CH_LAYOUT_STEREO;
+   params->sample_rate = TEST_RATE;
+   rsConfig.recordSeconds = TEST_SECONDS;
+   rsConfig.audioEncoder = RS_CONFIG_ENCODER_AAC;
+   rsConfig.audioProfile = FF_PROFILE_AAC_LOW;
+   rsConfig.audioBitrate = RS_CONFIG_AUTO;
+   rsConfig.audioStorage = RS_CONFIG_AUDIO_FLOAT;
+
+   RSAudioBuffer buffer;
+   RS_TEST_CHECK(rsAudioBufferCreate(&buffer, params) >= 0);
+   RS_TEST_CHECK(testFill(&buffer) == 0);
+   int64_t serialTime, chunkedTime, unpreparedTime;
+   RS_TEST_CHECK(testEncode(&buffer, "test-aencode-serial.mp4", 1, 1, &serialTime) == 0);
+   RS_TEST_CHECK(testEncode(&buffer, "test-aencode-chunked.mp4", TEST_THREADS, 1,
+                            &chunkedTime) == 0);
+   RS_TEST_CHECK(testEncode(&buffer, "test-aencode-unprepared.mp4", TEST_THREADS, 0,
+                            &unpreparedTime) == 0);
+   rsAudioBufferDestroy(&buffer);
+   avcodec_parameters_free(&params);
+   remove("test-aencode-unprepared.mp4");
+   fprintf(stderr, "Serial: %.1fms, %i chunks: %.1fms, %.2fx faster\n",
+           (double)serialTime / 1000.0, TEST_THREADS, (double)chunkedTime / 1000.0,
+           (double)serialTime / (double)FFMAX(chunkedTime, 1));
+   fprintf(stderr, "Without prepared encoders: %.1fms, the pool saves %.1fms\n",
+           (double)unpreparedTime / 1000.0,
+           (double)(unpreparedTime - chunkedTime) / 1000.0);
+
+   int serialSize, chunkedSize;
+   RS_TEST_CHECK(testDecode("test-aencode-serial.mp4", testSerial, &serialSize) == 0);
+   RS_TEST_CHECK(testDecode("test-aencode-chunked.mp4", testChunked, &chunkedSize) ==
+                 0);
+   remove("test-aencode-serial.mp4");
+   remove("test-aencode-chunked.mp4");
+   RS_TEST_CHECK(serialSize == chunkedSize);
+   RS_TEST_CHECK(serialSize >= TEST_SAMPLES);
+
+   double worst = DBL_MAX;
+   for (int i = 0; i + TEST_FRAME_SIZE <= serialSize; i += TEST_FRAME_SIZE) {
+      double signal = 0.0;
+      double noise = 0.0;
+      for (int j = i; j < i + TEST_FRAME_SIZE; ++j) {
+         double diff = (double)testChunked[j] - (double)testSerial[j];
+         signal += (double)testSerial[j] * (double)testSerial[j];
+         noise += diff * diff;
+      }
+      worst = FFMIN(worst, signal / FFMAX(noise, 1e-12));
+   }
+   fprintf(stderr, "Worst block signal to noise ratio: %.0f\n", worst);
+   RS_TEST_CHECK(worst >= TEST_MIN_SNR);
+   return 0;
+}
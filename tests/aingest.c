@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "audio/abuffer.h"
+#include "config.h"
+#include "test.h"
+#include <libavutil/channel_layout.h>
+#include <libavutil/time.h>
+
+#define TEST_RATE 48000
+#define TEST_CHANNELS 2
+#define TEST_FRAME_SIZE 1024
+// Enough frames to wrap around the one second ring a few times
+#define TEST_FRAMES 200
+#define TEST_HOLE (TEST_FRAMES - 10)
+#define TEST_BENCH_FRAMES 20000
+// 80dB, the 16-bit samples only have to lose what the rounding does
+#define TEST_MIN_SNR 1e8
+
+RSConfig rsConfig;
+
+static float testSamples[TEST_FRAME_SIZE * TEST_CHANNELS];
+
+static float testSample(int64_t index) {
+   return (float)(index % 997) / 997.0f;
+}
+
+static void testFrameSet(AVFrame *frame, float *data, int64_t pts) {
+   frame->format = AV_SAMPLE_FMT_FLT;
+   frame->channels = TEST_CHANNELS;
+   frame->channel_layout = AV_CH_LAYOUT_STEREO;
+   frame->sample_rate = TEST_RATE;
+   frame->nb_samples = TEST_FRAME_SIZE;
+   frame->pts = pts;
+   // Like the PulseAudio device, the frame borrows memory it does not own
+   frame->data[0] = (uint8_t *)data;
+   frame->linesize[0] = (int)sizeof(testSamples);
+}
+
+static int testRing(const AVCodecParameters *params, int storage, double *snr) {
+   RSAudioBuffer buffer;
+   rsConfig.audioStorage = storage;
+   RS_TEST_CHECK(rsAudioBufferCreate(&buffer, params) >= 0);
+   AVFrame *frame = av_frame_alloc();
+   RS_TEST_CHECK(frame != NULL);
+   for (int i = 0; i < TEST_FRAMES; ++i) {
+      for (int j = 0; j < TEST_FRAME_SIZE * TEST_CHANNELS; ++j) {
+         testSamples[j] = testSample((int64_t)i * TEST_FRAME_SIZE * TEST_CHANNELS + j);
+      }
+      testFrameSet(frame, i == TEST_HOLE ? NULL : testSamples,
+                   (int64_t)i * TEST_FRAME_SIZE);
+      RS_TEST_CHECK(rsAudioBufferAddFrame(&buffer, frame) >= 0);
+   }
+   av_frame_free(&frame);
+
+   // The ring is full so its oldest sample is at the write index
+   RS_TEST_CHECK(buffer.size == buffer.capacity);
+   double signal = 0.0;
+   double noise = 0.0;
+   int64_t first = (int64_t)TEST_FRAMES * TEST_FRAME_SIZE - buffer.size;
+   for (int i = 0; i < buffer.size; ++i) {
+      int64_t index = first + i;
+      int ring = (buffer.index + i) % buffer.capacity;
+      for (int c = 0; c < TEST_CHANNELS; ++c) {
+         float expected = testSample(index * TEST_CHANNELS + c);
+         if (index / TEST_FRAME_SIZE == TEST_HOLE) {
+            expected = 0.0f;
+         }
+         float sample;
+         if (storage == RS_CONFIG_AUDIO_S16) {
+            int16_t value = ((int16_t *)buffer.data)[ring * TEST_CHANNELS + c];
+            RS_TEST_CHECK(value == (int16_t)(expected * 32767.0f));
+            sample = value / 32767.0f;
+         } else {
+            sample = ((float *)buffer.data)[ring * TEST_CHANNELS + c];
+            RS_TEST_CHECK(sample == expected);
+         }
+         signal += (double)expected * (double)expected;
+         noise += ((double)sample - expected) * ((double)sample - expected);
+      }
+   }
+   *snr = signal / FFMAX(noise, 1e-12);
+   rsAudioBufferDestroy(&buffer);
+   return 0;
+}
+
+static int testBench(RSAudioBuffer *buffer, int copy, double *result) {
+   AVFrame *frame = av_frame_alloc();
+   RS_TEST_CHECK(frame != NULL);
+   int64_t start = av_gettime_relative();
+   for (int i = 0; i < TEST_BENCH_FRAMES; ++i) {
+      int64_t pts = (int64_t)i * TEST_FRAME_SIZE;
+      if (copy) {
+         // The device used to copy every chunk into a frame of its own first
+         testFrameSet(frame, NULL, pts);
+         RS_TEST_CHECK(av_frame_get_buffer(frame, 0) >= 0);
+         memcpy(frame->data[0], testSamples, sizeof(testSamples));
+      } else {
+         testFrameSet(frame, testSamples, pts);
+      }
+      RS_TEST_CHECK(rsAudioBufferAddFrame(buffer, frame) >= 0);
+   }
+   int64_t time = av_gettime_relative() - start;
+   av_frame_free(&frame);
+   *result = (double)time * 1000.0 / ((double)TEST_BENCH_FRAMES * TEST_FRAME_SIZE);
+   return 0;
+}
+
+int main(void) {
+   AVCodecParameters *params = avcodec_parameters_alloc();
+   RS_TEST_CHECK(params != NULL);
+   params->codec_type = AVMEDIA_TYPE_AUDIO;
+   params->format = AV_SAMPLE_FMT_FLT;
+   params->channels = TEST_CHANNELS;
+   params->channel_layout = AV_CH_LAYOUT_STEREO;
+   params->sample_rate = TEST_RATE;
+   rsConfig.recordSeconds = 1;
+   double floatSNR, s16SNR;
+   RS_TEST_CHECK(testRing(params, RS_CONFIG_AUDIO_FLOAT, &floatSNR) == 0);
+   RS_TEST_CHECK(testRing(params, RS_CONFIG_AUDIO_S16, &s16SNR) == 0);
+   fprintf(stderr, "16-bit storage signal to noise ratio: %.0f\n", s16SNR);
+   RS_TEST_CHECK(s16SNR >= TEST_MIN_SNR);
+
+   RSAudioBuffer buffer;
+   double copied, direct, packed;
+   rsConfig.audioStorage = RS_CONFIG_AUDIO_FLOAT;
+   RS_TEST_CHECK(rsAudioBufferCreate(&buffer, params) >= 0);
+   RS_TEST_CHECK(testBench(&buffer, 1, &copied) == 0);
+   RS_TEST_CHECK(testBench(&buffer, 0, &direct) == 0);
+   double floatMinute = buffer.sampleSize * TEST_RATE * 60.0 / (1024.0 * 1024.0);
+   rsAudioBufferDestroy(&buffer);
+   rsConfig.audioStorage = RS_CONFIG_AUDIO_S16;
+   RS_TEST_CHECK(rsAudioBufferCreate(&buffer, params) >= 0);
+   RS_TEST_CHECK(testBench(&buffer, 0, &packed) == 0);
+   double s16Minute = buffer.sampleSize * TEST_RATE * 60.0 / (1024.0 * 1024.0);
+   rsAudioBufferDestroy(&buffer);
+   fprintf(stderr, "Copied first: %.3fns per sample, direct: %.3fns per sample\n",
+           copied, direct);
+   fprintf(stderr, "Float: %.1f MiB/min, 16-bit: %.1f MiB/min at %.3fns per sample\n",
+           floatMinute, s16Minute, packed);
+   RS_TEST_CHECK(s16Minute * 2.0 == floatMinute);
+   avcodec_parameters_free(&params);
+   return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "audio/amix.h"
+#include "test.h"
+#include <libavutil/common.h>
+#include <libavutil/time.h>
+
+// An odd size so the vectorized loops also run their scalar tail
+#define TEST_SIZE 1027
+#define TEST_BENCH_SIZE (48000 * 2)
+#define TEST_BENCH_ROUNDS 2000
+
+static float testDest[TEST_BENCH_SIZE + 1];
+static float testSrc[TEST_BENCH_SIZE + 1];
+
+static int testMix(void) {
+   float expected[TEST_SIZE];
+   for (int i = 0; i < TEST_SIZE; ++i) {
+      testDest[i + 1] = (float)(i % 17) / 17.0f - 0.5f;
+      testSrc[i] = (float)(i % 13) / 13.0f - 0.5f;
+      expected[i] = testDest[i + 1] + testSrc[i] * 0.75f;
+   }
+   // Neither pointer is aligned to a vector
+   rsAudioMix(testDest + 1, testSrc, 0.75f, TEST_SIZE);
+   for (int i = 0; i < TEST_SIZE; ++i) {
+      RS_TEST_CHECK(FFABS(testDest[i + 1] - expected[i]) < 1e-6f);
+   }
+   return 0;
+}
+
+static int testPack(void) {
+   static const float src[] = {-2.0f, -1.0f, -0.5f, 0.0f, 0.5f, 1.0f, 2.0f};
+   static const int16_t expected[] = {-32768, -32767, -16383, 0, 16383, 32767, 32767};
+   int16_t dest[FF_ARRAY_ELEMS(src)];
+   rsAudioPackS16(dest, src, FF_ARRAY_ELEMS(src));
+   for (size_t i = 0; i < FF_ARRAY_ELEMS(src); ++i) {
+      RS_TEST_CHECK(dest[i] == expected[i]);
+   }
+   return 0;
+}
+
+int main(void) {
+   RS_TEST_CHECK(testMix() == 0);
+   RS_TEST_CHECK(testPack() == 0);
+
+   // One second of stereo audio mixed over and over
+   for (int i = 0; i < TEST_BENCH_SIZE; ++i) {
+      testSrc[i] = (float)(i % 101) / 101.0f;
+   }
+   int64_t start = av_gettime_relative();
+   for (int i = 0; i < TEST_BENCH_ROUNDS; ++i) {
+      rsAudioMix(testDest, testSrc, 0.5f, TEST_BENCH_SIZE);
+   }
+   int64_t time = FFMAX(av_gettime_relative() - start, 1);
+   fprintf(stderr, "Mixed %.1f million samples per second (%.1fx realtime)\n",
+           (double)TEST_BENCH_SIZE * TEST_BENCH_ROUNDS / (double)time,
+           (double)TEST_BENCH_ROUNDS * AV_TIME_BASE / (double)time);
+   return 0;
+}
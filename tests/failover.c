@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "buffer.h"
+#include "config.h"
+#include "encoder/encoder.h"
+#include "test.h"
+#include <libavutil/time.h>
+
+#define TEST_WIDTH 1920
+#define TEST_HEIGHT 1080
+#define TEST_FRAMERATE 60
+#define TEST_SECONDS 2
+#define TEST_GOP 30
+#define TEST_SIZE 4096
+#define TEST_FAULT 500
+#define TEST_FAILOVERS 4
+// Every encoder fails on its TEST_FAULT-th frame, the last one stops just short of it
+#define TEST_FRAMES (TEST_FAULT * (TEST_FAILOVERS + 1) - 1)
+
+typedef struct TestEncoder {
+   int64_t pts;
+   int64_t frames;
+   int delay;
+} TestEncoder;
+
+RSConfig rsConfig;
+
+static const uint8_t testHeaders[] = {0, 0, 0, 1, 0x67, 0x64, 0, 0x28};
+
+static void testEncoderDestroy(RSEncoder *encoder) {
+   av_freep(&encoder->extra);
+}
+
+static int testEncoderSendFrame(RSEncoder *encoder, AVFrame *frame) {
+   TestEncoder *test = encoder->extra;
+   if (frame == NULL) {
+      return AVERROR_EOF;
+   }
+   test->pts = frame->pts;
+   av_frame_unref(frame);
+   return 0;
+}
+
+static int testEncoderNextPacket(RSEncoder *encoder, AVPacket *packet) {
+   int ret;
+   TestEncoder *test = encoder->extra;
+   if (test->pts == AV_NOPTS_VALUE) {
+      return AVERROR(EAGAIN);
+   }
+   if ((ret = av_new_packet(packet, TEST_SIZE)) < 0) {
+      return ret;
+   }
+   // A deeper reorder delay makes the first DTS go back past the last encoder's
+   packet->pts = test->pts;
+   packet->dts = test->pts - test->delay * AV_TIME_BASE / TEST_FRAMERATE;
+   packet->flags = test->frames++ % TEST_GOP == 0 ? AV_PKT_FLAG_KEY : 0;
+   test->pts = AV_NOPTS_VALUE;
+   return 0;
+}
+
+// Every replacement either has new headers for the same codec or switches codec, to go
+// through both ways a segment can start
+static int testEncoderCreate(RSEncoder *encoder, int index) {
+   int ret;
+   RSEncoder inner;
+   if ((ret = rsEncoderCreate(&inner)) < 0) {
+      return ret;
+   }
+   TestEncoder *test = av_mallocz(sizeof(TestEncoder));
+   inner.extra = test;
+   inner.destroy = testEncoderDestroy;
+   inner.sendFrame = testEncoderSendFrame;
+   inner.nextPacket = testEncoderNextPacket;
+   inner.params->extradata =
+       av_mallocz(sizeof(testHeaders) + AV_INPUT_BUFFER_PADDING_SIZE);
+   if (test == NULL || inner.params->extradata == NULL) {
+      rsEncoderDestroy(&inner);
+      return AVERROR(ENOMEM);
+   }
+   test->pts = AV_NOPTS_VALUE;
+   test->delay = index * 3;
+
+   AVCodecParameters *params = inner.params;
+   params->codec_type = AVMEDIA_TYPE_VIDEO;
+   params->codec_id = index % 3 == 2 ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264;
+   params->format = AV_PIX_FMT_YUV420P;
+   params->width = TEST_WIDTH;
+   params->height = TEST_HEIGHT;
+   memcpy(params->extradata, testHeaders, sizeof(testHeaders));
+   params->extradata[sizeof(testHeaders) - 1] = (uint8_t)index;
+   params->extradata_size = sizeof(testHeaders);
+   return rsFaultEncoderCreate(encoder, &inner, TEST_FAULT);
+}
+
+static int testFailover(int memory) {
+   rsConfig.bufferMemory = memory;
+   RSEncoder encoder;
+   RSBuffer buffer;
+   AVCodecParameters *input = avcodec_parameters_alloc();
+   AVFrame *frame = av_frame_alloc();
+   AVPacket *packet = av_packet_alloc();
+   RS_TEST_CHECK(input != NULL && frame != NULL && packet != NULL);
+   input->codec_type = AVMEDIA_TYPE_VIDEO;
+   input->format = AV_PIX_FMT_YUV420P;
+   input->width = TEST_WIDTH;
+   input->height = TEST_HEIGHT;
+   RS_TEST_CHECK(testEncoderCreate(&encoder, 0) >= 0);
+   RS_TEST_CHECK(rsBufferCreate(&buffer, &encoder, input) >= 0);
+
+   int failovers = 0;
+   int64_t faultTime = 0;
+   int64_t recoverTime = 0;
+   int64_t worstTime = 0;
+   for (int i = 0; i < TEST_FRAMES; ++i) {
+      int64_t pts = (int64_t)i * AV_TIME_BASE / TEST_FRAMERATE;
+      frame->pts = pts;
+      if (rsEncoderSendFrame(&encoder, frame) < 0) {
+         // Same order as the capture loop, the replacement is ready before the old
+         // encoder goes
+         RSEncoder replacement;
+         faultTime = av_gettime_relative();
+         RS_TEST_CHECK(testEncoderCreate(&replacement, ++failovers) >= 0);
+         RS_TEST_CHECK(rsBufferSetEncoder(&buffer, &replacement, input) >= 0);
+         if (failovers % 3 == 1) {
+            // Same codec with new headers, the old key-frames carry their own in front
+            for (RSPacketList *plist = buffer.tail; plist != NULL; plist = plist->next) {
+               AVPacket *key = plist->packet;
+               if (key->pts >= buffer.segmentStart && (key->flags & AV_PKT_FLAG_KEY)) {
+                  RS_TEST_CHECK(key->size >= TEST_SIZE + (int)sizeof(testHeaders));
+                  RS_TEST_CHECK(key->buf != NULL && key->data == key->buf->data);
+               }
+            }
+         }
+         rsEncoderDestroy(&encoder);
+         encoder = replacement;
+         continue;
+      }
+
+      int64_t dts = buffer.head == NULL ? INT64_MIN : buffer.head->packet->dts;
+      int split = buffer.segmentStart == INT64_MAX && buffer.segmentCount > 0 &&
+                  buffer.segments[buffer.segmentCount - 1].end == INT64_MAX;
+      RS_TEST_CHECK(rsEncoderNextPacket(&encoder, packet) >= 0);
+      RS_TEST_CHECK(rsBufferAddPacket(&buffer, packet) >= 0);
+      if (faultTime != 0) {
+         int64_t time = av_gettime_relative() - faultTime;
+         recoverTime += time;
+         worstTime = FFMAX(worstTime, time);
+         faultTime = 0;
+      }
+
+      // Presentation times are never moved. The DTS is only moved to keep it increasing
+      // within the same stream, a codec switch starts a stream of its own.
+      RS_TEST_CHECK(buffer.head->packet->pts == pts);
+      RS_TEST_CHECK(buffer.head->packet->dts > dts || split);
+   }
+
+   RS_TEST_CHECK(failovers == TEST_FAILOVERS);
+   RS_TEST_CHECK(buffer.head->packet->pts ==
+                 (int64_t)(TEST_FRAMES - 1) * AV_TIME_BASE / TEST_FRAMERATE);
+   int count = 0;
+   for (RSPacketList *plist = buffer.tail; plist != NULL; plist = plist->next) {
+      ++count;
+   }
+   // The buffer still holds its full length, less the frames lost to the last fault
+   RS_TEST_CHECK(count >= TEST_SECONDS * TEST_FRAMERATE - 1);
+   printf("Recovered from %i faults in %.3fms on average, %.3fms at worst%s\n",
+          failovers, (double)recoverTime / (1000.0 * failovers),
+          (double)worstTime / 1000.0, memory ? " with locked memory" : "");
+
+   // A shorter record length keeps the newest stats
+   int64_t last = buffer.head->packet->dts;
+   RS_TEST_CHECK(rsStatsResize(&buffer.stats, TEST_FRAMERATE) >= 0);
+   RS_TEST_CHECK(buffer.stats.count == TEST_FRAMERATE);
+   RSStatsSummary summary;
+   rsStatsGetSummary(&buffer.stats, AV_TIME_BASE * TEST_SECONDS, &summary);
+   RS_TEST_CHECK(summary.frames == TEST_FRAMERATE);
+   RS_TEST_CHECK(buffer.stats.entries[TEST_FRAMERATE - 1].dts == last);
+
+   rsBufferDestroy(&buffer);
+   rsEncoderDestroy(&encoder);
+   av_packet_free(&packet);
+   av_frame_free(&frame);
+   avcodec_parameters_free(&input);
+   return 0;
+}
+
+int main(void) {
+   rsConfig.recordSeconds = TEST_SECONDS;
+   rsConfig.videoFramerate = TEST_FRAMERATE;
+   RS_TEST_CHECK(testFailover(0) == 0);
+   // The in-band headers have to stay in the locked slabs
+   RS_TEST_CHECK(testFailover(RS_CONFIG_MEMORY_LOCK) == 0);
+   return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "device/framepool.h"
+#include "memory.h"
+#include "test.h"
+
+#define TEST_FRAMES 100
+// Each frame may allocate its buffer reference, and before FFmpeg 4.4 the buffer that
+// wraps the pooled data, but never the data itself
+#define TEST_MAX_ALLOCS 2
+#define TEST_MAX_BYTES 256
+
+RSConfig rsConfig;
+
+static int testFrames(RSFramePool *pool, int samples) {
+   AVFrame *frame = av_frame_alloc();
+   RS_TEST_CHECK(frame != NULL);
+   // The pool only allocates a buffer when there are none left to reuse
+   frame->nb_samples = samples;
+   RS_TEST_CHECK(rsFramePoolGet(pool, frame) >= 0);
+   av_frame_unref(frame);
+
+   int64_t startBytes;
+   int64_t start = rsMemoryGetAllocations(&startBytes);
+   for (int i = 0; i < TEST_FRAMES; ++i) {
+      frame->nb_samples = samples;
+      RS_TEST_CHECK(rsFramePoolGet(pool, frame) >= 0);
+      frame->data[0][0] = (uint8_t)i;
+      av_frame_unref(frame);
+   }
+   int64_t endBytes;
+   int64_t end = rsMemoryGetAllocations(&endBytes);
+   av_frame_free(&frame);
+
+   fprintf(stderr, "%" PRId64 " allocations of %" PRId64 " bytes for %i frames\n",
+           end - start, endBytes - startBytes, TEST_FRAMES);
+   RS_TEST_CHECK(start >= 0);
+   RS_TEST_CHECK(end - start <= TEST_FRAMES * TEST_MAX_ALLOCS);
+   RS_TEST_CHECK(endBytes - startBytes <= TEST_FRAMES * TEST_MAX_BYTES);
+   return 0;
+}
+
+int main(void) {
+   RSFramePool pool;
+   RS_TEST_CHECK(rsVideoFramePoolCreate(&pool, AV_PIX_FMT_BGR0, 1920, 1080) >= 0);
+   RS_TEST_CHECK(testFrames(&pool, 0) == 0);
+   rsFramePoolDestroy(&pool);
+
+   RS_TEST_CHECK(rsAudioFramePoolCreate(&pool, AV_SAMPLE_FMT_FLTP, 2, 1024) >= 0);
+   RS_TEST_CHECK(testFrames(&pool, 1024) == 0);
+   rsFramePoolDestroy(&pool);
+   return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "journal.h"
+#include "config.h"
+#include "test.h"
+#include <libavutil/time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The journal is started by the recorder and the watchdog reports back through this
+#define TEST_RESULT_ENV "RS_TEST_RESULT_FILE"
+#define TEST_WIDTH 1920
+#define TEST_HEIGHT 1080
+#define TEST_GOP 30
+#define TEST_MAX_SIZE 4064
+// Enough packets to wrap around the 1 MiB journal a few times before the recorder is
+// killed
+#define TEST_READY 3000
+
+RSConfig rsConfig;
+
+static const uint8_t testExtradata[] = {0, 0, 0, 1, 0x67, 0x64, 0, 0x28};
+
+static int testSize(int64_t index) {
+   return TEST_MAX_SIZE - (int)(index * 37 % 4000);
+}
+
+static uint8_t testByte(int64_t index, int offset) {
+   return (uint8_t)(index * 7 + offset);
+}
+
+static int testFlags(int64_t index) {
+   return index % TEST_GOP == 0 ? AV_PKT_FLAG_KEY : 0;
+}
+
+static int testRecord(int readyFile) {
+   rsConfig.bufferCrashSize = 1;
+   RS_TEST_CHECK(rsJournalInit() >= 0);
+   AVCodecParameters *params = avcodec_parameters_alloc();
+   AVPacket *packet = av_packet_alloc();
+   RS_TEST_CHECK(params != NULL && packet != NULL);
+   params->codec_type = AVMEDIA_TYPE_VIDEO;
+   params->codec_id = AV_CODEC_ID_H264;
+   params->format = AV_PIX_FMT_YUV420P;
+   params->width = TEST_WIDTH;
+   params->height = TEST_HEIGHT;
+   params->extradata = av_mallocz(sizeof(testExtradata) + AV_INPUT_BUFFER_PADDING_SIZE);
+   RS_TEST_CHECK(params->extradata != NULL);
+   memcpy(params->extradata, testExtradata, sizeof(testExtradata));
+   params->extradata_size = sizeof(testExtradata);
+   rsJournalSetParams(params);
+   RS_TEST_CHECK(av_new_packet(packet, TEST_MAX_SIZE) >= 0);
+
+   // Keep capturing until killed
+   for (int64_t i = 0;; ++i) {
+      packet->size = testSize(i);
+      for (int j = 0; j < packet->size; ++j) {
+         packet->data[j] = testByte(i, j);
+      }
+      packet->flags = testFlags(i);
+      packet->pts = i;
+      packet->dts = i;
+      rsJournalAdd(packet);
+      if (i == TEST_READY) {
+         char ready = 0;
+         RS_TEST_CHECK(write(readyFile, &ready, 1) == 1);
+      }
+   }
+}
+
+static int testVerify(const RSJournalHeader *header, int *count, int64_t *last) {
+   RS_TEST_CHECK(header->magic == RS_JOURNAL_MAGIC);
+   RS_TEST_CHECK(header->state == RS_JOURNAL_RUNNING);
+   RS_TEST_CHECK(header->paramsValid);
+   RS_TEST_CHECK(header->codecID == AV_CODEC_ID_H264);
+   RS_TEST_CHECK(header->width == TEST_WIDTH && header->height == TEST_HEIGHT);
+   RS_TEST_CHECK(header->extradataSize == sizeof(testExtradata));
+   RS_TEST_CHECK(memcmp(header->extradata, testExtradata, sizeof(testExtradata)) == 0);
+
+   uint64_t head = header->head;
+   uint64_t pos = header->tail;
+   RS_TEST_CHECK(head > header->dataSize);
+   const RSJournalRecord *record;
+   *count = 0;
+   *last = -1;
+   while ((record = rsJournalNext(header, &pos, head)) != NULL) {
+      // Every packet between the tail and the head is there and undamaged, however the
+      // recorder was stopped
+      RS_TEST_CHECK(*last == -1 || record->pts == *last + 1);
+      RS_TEST_CHECK(record->dts == record->pts);
+      RS_TEST_CHECK(record->flags == testFlags(record->pts));
+      RS_TEST_CHECK(record->size == testSize(record->pts));
+      const uint8_t *data = (const uint8_t *)(record + 1);
+      for (int i = 0; i < record->size; ++i) {
+         RS_TEST_CHECK(data[i] == testByte(record->pts, i));
+      }
+      *last = record->pts;
+      ++*count;
+   }
+   RS_TEST_CHECK(pos == head);
+   RS_TEST_CHECK(*count > 0);
+   return 0;
+}
+
+static int testWatchdog(int memFile, int waitFile) {
+   // Like the real watchdog, wait for the recorder to die
+   char byte;
+   ssize_t size;
+   while ((size = read(waitFile, &byte, 1)) != 0) {
+      RS_TEST_CHECK(size != -1);
+   }
+
+   struct stat info;
+   RS_TEST_CHECK(fstat(memFile, &info) != -1);
+   void *mem = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, memFile, 0);
+   RS_TEST_CHECK(mem != MAP_FAILED);
+   int count;
+   int64_t last;
+   int ret = testVerify(mem, &count, &last);
+   munmap(mem, (size_t)info.st_size);
+
+   const char *result = getenv(TEST_RESULT_ENV);
+   RS_TEST_CHECK(result != NULL);
+   char line[64];
+   int lineSize = snprintf(line, sizeof(line), "%i %i %" PRId64 "\n", ret, count, last);
+   RS_TEST_CHECK(write(atoi(result), line, (size_t)lineSize) == lineSize);
+   return ret;
+}
+
+int main(int argc, char *argv[]) {
+   // The journal starts the watchdog by running this executable again
+   if (argc >= 4 && strcmp(argv[1], "journal-watchdog") == 0) {
+      return testWatchdog(atoi(argv[2]), atoi(argv[3]));
+   }
+
+   // Only the result pipe is passed on to the watchdog
+   int results[2];
+   int ready[2];
+   RS_TEST_CHECK(pipe(results) != -1);
+   RS_TEST_CHECK(pipe2(ready, O_CLOEXEC) != -1);
+   char resultArg[16];
+   snprintf(resultArg, sizeof(resultArg), "%i", results[1]);
+   RS_TEST_CHECK(setenv(TEST_RESULT_ENV, resultArg, 1) == 0);
+   pid_t pid = fork();
+   RS_TEST_CHECK(pid != -1);
+   if (pid == 0) {
+      close(results[0]);
+      close(ready[0]);
+      _exit(testRecord(ready[1]));
+   }
+   close(results[1]);
+   close(ready[1]);
+
+   // Kill the recorder in the middle of capturing
+   char byte;
+   RS_TEST_CHECK(read(ready[0], &byte, 1) == 1);
+   av_usleep(10000);
+   RS_TEST_CHECK(kill(pid, SIGKILL) == 0);
+   int status;
+   RS_TEST_CHECK(waitpid(pid, &status, 0) == pid);
+   RS_TEST_CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+   close(ready[0]);
+
+   // The pipe closes once the watchdog is done
+   char line[64] = {0};
+   size_t lineSize = 0;
+   ssize_t size;
+   while ((size = read(results[0], line + lineSize, sizeof(line) - 1 - lineSize)) > 0) {
+      lineSize += (size_t)size;
+   }
+   close(results[0]);
+   int ret, count;
+   int64_t last;
+   RS_TEST_CHECK(sscanf(line, "%i %i %" SCNd64, &ret, &count, &last) == 3);
+   fprintf(stderr, "Recovered %i packets, the last was %" PRId64 "\n", count, last);
+   RS_TEST_CHECK(ret == 0);
+   RS_TEST_CHECK(last >= TEST_READY);
+   return 0;
+}
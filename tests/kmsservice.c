@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "command/command.h"
+#include "config.h"
+#include "device/device.h"
+#include "socket.h"
+#include "test.h"
+#include "thread.h"
+#include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_drm.h>
+#include <libavutil/time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TEST_PATH "test-kmsservice.sock"
+#define TEST_BUFFERS 3
+#define TEST_WIDTH 64
+#define TEST_HEIGHT 64
+#define TEST_INTERVAL 1000
+#define TEST_FRAMES 500
+#define TEST_CLIENTS 3
+#define TEST_RESTARTS 20
+// The service may send a few frames past the last one we counted
+#define TEST_SLACK 4
+
+RSConfig rsConfig;
+
+static int testFiles[TEST_BUFFERS];
+static struct stat testInfo[TEST_BUFFERS];
+static int testSends = 0;
+static int testReceives = 0;
+static int testPassed = 0;
+static int testResult = 0;
+
+// Every message is counted by wrapping the socket calls when linking. Files are counted
+// as they arrive since the service may still be counting a send the client has received.
+ssize_t __real_sendmsg(int fd, const struct msghdr *msg, int flags);
+ssize_t __real_recvmsg(int fd, struct msghdr *msg, int flags);
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags);
+ssize_t __wrap_recvmsg(int fd, struct msghdr *msg, int flags);
+
+static void testCountFiles(const struct msghdr *msg) {
+   for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+        cmsg = CMSG_NXTHDR((struct msghdr *)msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+         rsAtomicAdd(&testPassed, (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int)));
+      }
+   }
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags) {
+   ssize_t ret = __real_sendmsg(fd, msg, flags);
+   if (ret >= 0) {
+      rsAtomicAdd(&testSends, 1);
+   }
+   return ret;
+}
+
+ssize_t __wrap_recvmsg(int fd, struct msghdr *msg, int flags) {
+   ssize_t ret = __real_recvmsg(fd, msg, flags);
+   if (ret >= 0) {
+      rsAtomicAdd(&testReceives, 1);
+      testCountFiles(msg);
+   }
+   return ret;
+}
+
+static int testSame(int fd, int buffer) {
+   struct stat info;
+   if (fstat(fd, &info) == -1) {
+      return 0;
+   }
+   return info.st_dev == testInfo[buffer].st_dev && info.st_ino == testInfo[buffer].st_ino;
+}
+
+static void testFrameFree(void *extra, uint8_t *data) {
+   (void)extra;
+   AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)data;
+   close(desc->objects[0].fd);
+   av_free(desc);
+}
+
+static int testDeviceNextFrame(RSDevice *device, AVFrame *frame) {
+   int64_t *index = device->extra;
+   av_usleep(TEST_INTERVAL);
+   AVDRMFrameDescriptor *desc = av_mallocz(sizeof(AVDRMFrameDescriptor));
+   if (desc == NULL) {
+      return AVERROR(ENOMEM);
+   }
+
+   // KMS hands out a new file for the same scanout buffer every frame
+   desc->nb_objects = 1;
+   desc->objects[0].fd = dup(testFiles[*index % TEST_BUFFERS]);
+   desc->objects[0].size = TEST_WIDTH * TEST_HEIGHT * 4;
+   desc->nb_layers = 1;
+   desc->layers[0].nb_planes = 1;
+   desc->layers[0].planes[0].pitch = TEST_WIDTH * 4;
+   frame->buf[0] = av_buffer_create((uint8_t *)desc, sizeof(AVDRMFrameDescriptor),
+                                    testFrameFree, NULL, 0);
+   if (frame->buf[0] == NULL) {
+      testFrameFree(NULL, (uint8_t *)desc);
+      return AVERROR(ENOMEM);
+   }
+   frame->data[0] = (uint8_t *)desc;
+   frame->width = TEST_WIDTH;
+   frame->height = TEST_HEIGHT;
+   frame->format = AV_PIX_FMT_DRM_PRIME;
+   frame->pts = (*index)++;
+   return 0;
+}
+
+static void testDeviceDestroy(RSDevice *device) {
+   av_freep(&device->extra);
+}
+
+static int testDeviceCreate(RSDevice *device, const char *deviceName, int framerate) {
+   int ret;
+   AVBufferRef *hwDevice = NULL;
+   (void)deviceName;
+   (void)framerate;
+   if ((ret = rsDeviceCreate(device)) < 0) {
+      goto error;
+   }
+
+   device->extra = av_mallocz(sizeof(int64_t));
+   device->destroy = testDeviceDestroy;
+   device->nextFrame = testDeviceNextFrame;
+   hwDevice = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_DRM);
+   if (device->extra == NULL || hwDevice == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto error;
+   }
+
+   // Clients only pass the DRM device along so any file will do
+   AVDRMDeviceContext *drmDeviceCtx = ((AVHWDeviceContext *)hwDevice->data)->hwctx;
+   drmDeviceCtx->fd = memfd_create("test-drm", MFD_CLOEXEC);
+   if (drmDeviceCtx->fd == -1) {
+      ret = AVERROR(errno);
+      goto error;
+   }
+   if ((ret = av_hwdevice_ctx_init(hwDevice)) < 0) {
+      goto error;
+   }
+
+   device->hwFrames = av_hwframe_ctx_alloc(hwDevice);
+   if (device->hwFrames == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto error;
+   }
+   AVHWFramesContext *hwFramesCtx = (AVHWFramesContext *)device->hwFrames->data;
+   hwFramesCtx->width = TEST_WIDTH;
+   hwFramesCtx->height = TEST_HEIGHT;
+   hwFramesCtx->format = AV_PIX_FMT_DRM_PRIME;
+   hwFramesCtx->sw_format = AV_PIX_FMT_BGR0;
+   if ((ret = av_hwframe_ctx_init(device->hwFrames)) < 0) {
+      goto error;
+   }
+
+   device->params->codec_type = AVMEDIA_TYPE_VIDEO;
+   device->params->codec_id = AV_CODEC_ID_WRAPPED_AVFRAME;
+   device->params->format = AV_PIX_FMT_BGR0;
+   device->params->width = TEST_WIDTH;
+   device->params->height = TEST_HEIGHT;
+   av_buffer_unref(&hwDevice);
+   return 0;
+error:
+   av_buffer_unref(&hwDevice);
+   rsDeviceDestroy(device);
+   return ret;
+}
+
+static void *testServe(void *extra) {
+   testResult = rsKmsServiceRun(extra, testDeviceCreate);
+   return NULL;
+}
+
+static int testSocket(void) {
+   int pair[2];
+   RS_TEST_CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) == 0);
+   RSSocket sender = {.fd = pair[0]};
+   RSSocket receiver = {.fd = pair[1]};
+   int files[RS_SOCKET_MAX_FILES];
+   int received[RS_SOCKET_MAX_FILES];
+   char byte = 0;
+   for (int i = 0; i < RS_SOCKET_MAX_FILES; ++i) {
+      files[i] = testFiles[i % TEST_BUFFERS];
+   }
+
+   RS_TEST_CHECK(rsSocketSend(&sender, 1, &byte, RS_SOCKET_MAX_FILES, files) >= 0);
+   RS_TEST_CHECK(rsSocketReceive(&receiver, 1, &byte, RS_SOCKET_MAX_FILES, received) ==
+                 RS_SOCKET_MAX_FILES);
+   for (int i = 0; i < RS_SOCKET_MAX_FILES; ++i) {
+      RS_TEST_CHECK(testSame(received[i], i % TEST_BUFFERS));
+      close(received[i]);
+   }
+
+   // More files than the receiver has room for has to fail instead of dropping some
+   RS_TEST_CHECK(rsSocketSend(&sender, 1, &byte, RS_SOCKET_MAX_FILES, files) >= 0);
+   RS_TEST_CHECK(rsSocketReceive(&receiver, 1, &byte, 1, received) == AVERROR(EPROTO));
+
+   rsSocketDestroy(&sender);
+   rsSocketDestroy(&receiver);
+   return 0;
+}
+
+static int testReceive(RSDevice *device, AVFrame *frame, int64_t *pts) {
+   RS_TEST_CHECK(rsDeviceNextFrame(device, frame) >= 0);
+   RS_TEST_CHECK(frame->pts > *pts);
+   *pts = frame->pts;
+
+   // A cached descriptor has to still point at the buffer the frame came from
+   const AVDRMFrameDescriptor *desc = (const AVDRMFrameDescriptor *)frame->data[0];
+   RS_TEST_CHECK(desc->nb_objects == 1);
+   RS_TEST_CHECK(testSame(desc->objects[0].fd, (int)(frame->pts % TEST_BUFFERS)));
+   av_frame_unref(frame);
+   return 0;
+}
+
+static int testConnect(RSDevice *device, AVFrame *frame, int64_t *pts) {
+   RS_TEST_CHECK(rsKmsServiceDeviceOpen(device, TEST_PATH) >= 0);
+
+   // Files are only attached until the client has seen every buffer once
+   int seen = 0;
+   *pts = -1;
+   while (seen != (1 << TEST_BUFFERS) - 1) {
+      RS_TEST_CHECK(testReceive(device, frame, pts) == 0);
+      seen |= 1 << (*pts % TEST_BUFFERS);
+   }
+   return 0;
+}
+
+static int testFanOut(AVFrame *frame) {
+   RSDevice devices[TEST_CLIENTS];
+   int64_t pts[TEST_CLIENTS];
+   for (int i = 0; i < TEST_CLIENTS; ++i) {
+      RS_TEST_CHECK(testConnect(&devices[i], frame, &pts[i]) == 0);
+   }
+
+   // Clients leave one at a time while the rest keep receiving
+   for (int count = TEST_CLIENTS; count > 0; --count) {
+      for (int i = 0; i < TEST_FRAMES / TEST_CLIENTS; ++i) {
+         for (int j = 0; j < count; ++j) {
+            RS_TEST_CHECK(testReceive(&devices[j], frame, &pts[j]) == 0);
+         }
+      }
+      rsDeviceDestroy(&devices[count - 1]);
+   }
+   return 0;
+}
+
+int main(void) {
+   for (int i = 0; i < TEST_BUFFERS; ++i) {
+      testFiles[i] = memfd_create("test-buffer", MFD_CLOEXEC);
+      RS_TEST_CHECK(testFiles[i] != -1);
+      RS_TEST_CHECK(fstat(testFiles[i], &testInfo[i]) == 0);
+   }
+   RS_TEST_CHECK(testSocket() == 0);
+
+   rsConfig.videoDevice = "test";
+   rsConfig.videoFramerate = 1000000 / TEST_INTERVAL;
+   RSSocket sock = {0};
+   RSThread thread;
+   // A failed run leaves its socket behind
+   remove(TEST_PATH);
+   RS_TEST_CHECK(rsSocketCreate(&sock) >= 0);
+   RS_TEST_CHECK(rsSocketBind(&sock, TEST_PATH) >= 0);
+   RS_TEST_CHECK(rsThreadCreate(&thread, testServe, &sock) >= 0);
+
+   RSDevice device;
+   int64_t pts;
+   AVFrame *frame = av_frame_alloc();
+   RS_TEST_CHECK(frame != NULL);
+   RS_TEST_CHECK(testConnect(&device, frame, &pts) == 0);
+
+   int64_t start = pts;
+   int64_t time = av_gettime_relative();
+   int sends = rsAtomicLoad(&testSends);
+   int receives = rsAtomicLoad(&testReceives);
+   int passed = rsAtomicLoad(&testPassed);
+   for (int i = 0; i < TEST_FRAMES; ++i) {
+      RS_TEST_CHECK(testReceive(&device, frame, &pts) == 0);
+   }
+   time = av_gettime_relative() - time;
+   sends = rsAtomicLoad(&testSends) - sends;
+   receives = rsAtomicLoad(&testReceives) - receives;
+   passed = rsAtomicLoad(&testPassed) - passed;
+   rsDeviceDestroy(&device);
+
+   int64_t produced = pts - start;
+   printf("%i frames (%" PRIi64 " produced) in %" PRIi64 " us\n", TEST_FRAMES, produced,
+          time);
+   printf("%.2f sendmsg, %.2f recvmsg and %.2f files per frame\n",
+          (double)sends / TEST_FRAMES, (double)receives / TEST_FRAMES,
+          (double)passed / TEST_FRAMES);
+   RS_TEST_CHECK(passed == 0);
+   RS_TEST_CHECK(receives == TEST_FRAMES);
+   RS_TEST_CHECK(sends <= produced + TEST_SLACK);
+
+   RS_TEST_CHECK(testFanOut(frame) == 0);
+   // Every client leaving stops the capture, whoever connects next has to get a working
+   // one whether or not it was reaped yet
+   for (int i = 0; i < TEST_RESTARTS; ++i) {
+      RS_TEST_CHECK(testConnect(&device, frame, &pts) == 0);
+      rsDeviceDestroy(&device);
+      av_usleep((unsigned)(TEST_INTERVAL * (i % 4)));
+   }
+
+   av_frame_free(&frame);
+   rsKmsServiceStop();
+   rsThreadDestroy(&thread);
+   rsSocketDestroy(&sock);
+   RS_TEST_CHECK(testResult >= 0);
+   for (int i = 0; i < TEST_BUFFERS; ++i) {
+      close(testFiles[i]);
+   }
+   return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "log.h"
+#include "config.h"
+#include "test.h"
+#include "thread.h"
+#include <libavutil/time.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_FILE "test-log.txt"
+#define TEST_THREADS 4
+#define TEST_MESSAGES 10000
+
+typedef struct TestThread {
+   RSThread thread;
+   int index;
+   int64_t time;
+} TestThread;
+
+RSConfig rsConfig;
+
+static void *testThreadRun(void *extra) {
+   TestThread *thread = extra;
+   int64_t start = av_gettime_relative();
+   for (int i = 0; i < TEST_MESSAGES; ++i) {
+      av_log(NULL, AV_LOG_INFO, "test %i %i\n", thread->index, i);
+   }
+   thread->time = av_gettime_relative() - start;
+   return NULL;
+}
+
+static int testLog(double *result) {
+   TestThread threads[TEST_THREADS];
+   for (int i = 0; i < TEST_THREADS; ++i) {
+      threads[i].index = i;
+      RS_TEST_CHECK(rsThreadCreate(&threads[i].thread, testThreadRun, &threads[i]) >= 0);
+   }
+   int64_t time = 0;
+   for (int i = 0; i < TEST_THREADS; ++i) {
+      rsThreadDestroy(&threads[i].thread);
+      time += threads[i].time;
+   }
+   *result = (double)time * 1000.0 / (TEST_THREADS * TEST_MESSAGES);
+   return 0;
+}
+
+int main(void) {
+   // The messages are checked in the log file, they would only flood the test output
+   int output = dup(STDERR_FILENO);
+   int devNull = open("/dev/null", O_WRONLY);
+   RS_TEST_CHECK(output != -1 && devNull != -1);
+   RS_TEST_CHECK(dup2(devNull, STDERR_FILENO) != -1);
+
+   // Before the log is set up every message is written by the thread that logs it
+   double syncTime, asyncTime;
+   int syncRet = testLog(&syncTime);
+   remove(TEST_FILE);
+   rsLogInit();
+   int fileRet = rsLogOpenFile(TEST_FILE);
+   int asyncRet = testLog(&asyncTime);
+   // Only the program counters are collected here, the drain thread looks them up
+   av_log(NULL, AV_LOG_ERROR, "test error\n");
+   rsLogExit();
+   dup2(output, STDERR_FILENO);
+   close(output);
+   close(devNull);
+   RS_TEST_CHECK(syncRet == 0 && fileRet >= 0 && asyncRet == 0);
+
+   FILE *file = fopen(TEST_FILE, "r");
+   RS_TEST_CHECK(file != NULL);
+   int next[TEST_THREADS] = {0};
+   int written = 0;
+   int dropped = 0;
+   int traced = 0;
+   char line[1024];
+   while (fgets(line, sizeof(line), file) != NULL) {
+      int thread, index;
+      unsigned count;
+      if (sscanf(line, "test %i %i", &thread, &index) == 2) {
+         // Messages from the same thread stay in order
+         RS_TEST_CHECK(thread >= 0 && thread < TEST_THREADS);
+         RS_TEST_CHECK(index >= next[thread]);
+         next[thread] = index + 1;
+         ++written;
+      } else if (sscanf(line, "%u log messages were dropped", &count) == 1) {
+         dropped += (int)count;
+      } else if (strstr(line, "(main)") != NULL) {
+         traced = 1;
+      }
+   }
+   fclose(file);
+   remove(TEST_FILE);
+
+   fprintf(stderr, "Synchronous: %.0fns per call, background thread: %.0fns per call\n",
+           syncTime, asyncTime);
+   fprintf(stderr, "%i messages written, %i dropped\n", written, dropped);
+   RS_TEST_CHECK(written > 0);
+   RS_TEST_CHECK(written + dropped == TEST_THREADS * TEST_MESSAGES);
+   RS_TEST_CHECK(traced);
+   return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "audio/audio.h"
+#include "config.h"
+#include "event.h"
+#include "pressure.h"
+#include "test.h"
+#include "util.h"
+#include <libavutil/time.h>
+
+#define TEST_PATH "/tmp/rs-test-pressure"
+#define TEST_RATE 8000
+#define TEST_FRAME_SIZE 160
+#define TEST_SECONDS 2
+#define TEST_MIN_SECONDS 1
+// The first shrink is after one check, growing back waits for the pressure to clear
+#define TEST_SHRINK_TIMEOUT (5 * AV_TIME_BASE)
+#define TEST_GROW_TIMEOUT (20 * AV_TIME_BASE)
+
+RSConfig rsConfig;
+
+static char testPath[] = TEST_PATH;
+static RSAudioThread testAudio;
+static int testRunning;
+static int64_t testLockWait;
+
+// The test feeds the buffer itself so no device is ever opened
+int rsAudioDeviceCreate(RSDevice *device) {
+   (void)device;
+   return AVERROR(ENOSYS);
+}
+
+void rsDeviceDestroy(RSDevice *device) {
+   (void)device;
+}
+
+static float testSample(int64_t index) {
+   return (float)(index % 997) / 997.0f;
+}
+
+static void *testFeed(void *extra) {
+   float samples[TEST_FRAME_SIZE];
+   AVFrame *frame = extra;
+   for (int64_t pts = 0; rsAtomicLoad(&testRunning); pts += TEST_FRAME_SIZE) {
+      for (int i = 0; i < TEST_FRAME_SIZE; ++i) {
+         samples[i] = testSample(pts + i);
+      }
+      frame->format = AV_SAMPLE_FMT_FLT;
+      frame->channels = 1;
+      frame->channel_layout = AV_CH_LAYOUT_MONO;
+      frame->sample_rate = TEST_RATE;
+      frame->nb_samples = TEST_FRAME_SIZE;
+      frame->pts = pts;
+      frame->data[0] = (uint8_t *)samples;
+      frame->linesize[0] = (int)sizeof(samples);
+
+      // Like the audio thread, only adding the frame is done with the audio locked
+      int64_t time = av_gettime_relative();
+      rsAudioThreadLock(&testAudio);
+      testLockWait = FFMAX(testLockWait, av_gettime_relative() - time);
+      rsAudioBufferAddFrame(&testAudio.buffers[0], frame);
+      rsAudioThreadUnlock(&testAudio);
+      av_usleep(1000);
+   }
+   return NULL;
+}
+
+static int testResize(void *extra) {
+   rsAudioThreadResize(extra);
+   return 0;
+}
+
+static int testPressure(double avg10) {
+   FILE *file = fopen(TEST_PATH, "w");
+   RS_TEST_CHECK(file != NULL);
+   fprintf(file, "some avg10=%.2f avg60=0.00 avg300=0.00 total=0\n", avg10);
+   fprintf(file, "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+   RS_TEST_CHECK(fclose(file) == 0);
+   return 0;
+}
+
+static int testWait(int seconds, int64_t timeout) {
+   int64_t start = av_gettime_relative();
+   for (;;) {
+      rsAudioThreadLock(&testAudio);
+      RSAudioBuffer *buffer = &testAudio.buffers[0];
+      if (buffer->capacity == seconds * TEST_RATE && buffer->size > 0) {
+         break;
+      }
+      rsAudioThreadUnlock(&testAudio);
+      RS_TEST_CHECK(av_gettime_relative() - start < timeout);
+      av_usleep(100000);
+   }
+
+   // The newest audio has to have been kept in order across the swap
+   RSAudioBuffer *buffer = &testAudio.buffers[0];
+   const float *data = (const float *)buffer->data;
+   int64_t first = buffer->endTime - buffer->size;
+   int oldest = (buffer->index - buffer->size + buffer->capacity) % buffer->capacity;
+   int failed = 0;
+   for (int i = 0; i < buffer->size; ++i) {
+      failed |= data[(oldest + i) % buffer->capacity] != testSample(first + i);
+   }
+   rsAudioThreadUnlock(&testAudio);
+   RS_TEST_CHECK(!failed);
+   fprintf(stderr, "Resized to %is after %.1fs\n", seconds,
+           (double)(av_gettime_relative() - start) / AV_TIME_BASE);
+   return 0;
+}
+
+int main(void) {
+   AVCodecParameters *params = avcodec_parameters_alloc();
+   RS_TEST_CHECK(params != NULL);
+   params->codec_type = AVMEDIA_TYPE_AUDIO;
+   params->format = AV_SAMPLE_FMT_FLT;
+   params->channels = 1;
+   params->channel_layout = AV_CH_LAYOUT_MONO;
+   params->sample_rate = TEST_RATE;
+   rsConfig.recordSeconds = TEST_SECONDS;
+   rsConfig.pressureMinSeconds = TEST_MIN_SECONDS;
+   // An average stall above 10% counts as pressure
+   rsConfig.pressureThreshold = 100;
+   rsConfig.pressureFile = testPath;
+   RS_TEST_CHECK(testPressure(90.0) == 0);
+
+   // Only the parts of the audio thread the resize uses are set up
+   rsClear(&testAudio, sizeof(RSAudioThread));
+   RS_TEST_CHECK(rsAudioBufferCreate(&testAudio.buffers[0], params) >= 0);
+   testAudio.trackCount = 1;
+   testAudio.seconds = TEST_SECONDS;
+   RS_TEST_CHECK(rsMutexCreate(&testAudio.mutex) >= 0);
+   AVFrame *frame = av_frame_alloc();
+   RS_TEST_CHECK(frame != NULL);
+   RSThread feed;
+   testRunning = 1;
+   RS_TEST_CHECK(rsThreadCreate(&feed, testFeed, frame) >= 0);
+
+   // Resizing runs on the event loop like it does in the main program
+   RSEventLoop loop;
+   RSPressure pressure;
+   RS_TEST_CHECK(rsEventLoopCreate(&loop) >= 0);
+   RS_TEST_CHECK(rsPressureCreate(&pressure, &loop) >= 0);
+   RS_TEST_CHECK(rsEventLoopAddTimer(&loop, AV_TIME_BASE, testResize, &testAudio) >= 0);
+   RS_TEST_CHECK(rsEventLoopStart(&loop) >= 0);
+   RS_TEST_CHECK(testWait(TEST_MIN_SECONDS, TEST_SHRINK_TIMEOUT) == 0);
+   RS_TEST_CHECK(testPressure(0.0) == 0);
+   RS_TEST_CHECK(testWait(TEST_SECONDS, TEST_GROW_TIMEOUT) == 0);
+   fprintf(stderr, "Longest wait for the audio lock: %.3fms\n",
+           (double)testLockWait / 1000.0);
+
+   rsEventLoopDestroy(&loop);
+   rsPressureDestroy(&pressure);
+   rsAtomicStore(&testRunning, 0);
+   rsThreadDestroy(&feed);
+   av_frame_free(&frame);
+   rsMutexDestroy(&testAudio.mutex);
+   rsAudioBufferDestroy(&testAudio.buffers[0]);
+   avcodec_parameters_free(&params);
+   remove(TEST_PATH);
+   return 0;
+}
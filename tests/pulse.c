@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "audio/adevice.h"
+#include "config.h"
+#include "test.h"
+#include <libavutil/time.h>
+#include <time.h>
+
+#define TEST_RATE 48000
+#define TEST_TIME (3 * AV_TIME_BASE)
+#define TEST_FRAG_SIZE 100
+// A 100ms fragment should come in about ten times a second, the server default is a
+// few milliseconds
+#define TEST_MAX_FRAMES 20.0
+#define TEST_MAX_CPU 5.0
+// CTest marks the test as skipped when there is no server to record from
+#define TEST_SKIP 77
+
+RSConfig rsConfig;
+
+static char testDevice[] = "auto";
+
+static int64_t testThreadTime(void) {
+   struct timespec time;
+   if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) == -1) {
+      return 0;
+   }
+   return (int64_t)time.tv_sec * AV_TIME_BASE + time.tv_nsec / 1000;
+}
+
+static int testRecord(int fragSize, double *frames, double *cpu) {
+   RSDevice device;
+   rsConfig.audioFragSize = fragSize;
+   RS_TEST_CHECK(rsPulseDeviceCreate(&device) >= 0);
+   AVFrame *frame = av_frame_alloc();
+   RS_TEST_CHECK(frame != NULL);
+   // The first frame can hold whatever the server had buffered before connecting
+   RS_TEST_CHECK(rsDeviceNextFrame(&device, frame) >= 0);
+   av_frame_unref(frame);
+
+   int count = 0;
+   int64_t samples = 0;
+   int64_t start = av_gettime_relative();
+   int64_t startCPU = testThreadTime();
+   int64_t elapsed;
+   while ((elapsed = av_gettime_relative() - start) < TEST_TIME) {
+      RS_TEST_CHECK(rsDeviceNextFrame(&device, frame) >= 0);
+      samples += frame->nb_samples;
+      ++count;
+      av_frame_unref(frame);
+   }
+   *frames = count * (double)AV_TIME_BASE / (double)elapsed;
+   *cpu = (double)(testThreadTime() - startCPU) * 100.0 / (double)elapsed;
+   av_frame_free(&frame);
+   rsDeviceDestroy(&device);
+
+   // Larger fragments must not lose any audio, the null sink runs in real time
+   double seconds = (double)samples / TEST_RATE;
+   RS_TEST_CHECK(seconds > 0.8 * (double)TEST_TIME / AV_TIME_BASE);
+   RS_TEST_CHECK(seconds < 1.2 * (double)TEST_TIME / AV_TIME_BASE + 0.5);
+   return 0;
+}
+
+int main(void) {
+   int ret;
+   rsConfig.audioDevice = testDevice;
+   rsConfig.audioSamplerate = TEST_RATE;
+   rsConfig.audioMaxLength = RS_CONFIG_AUTO;
+   rsConfig.audioTracks = RS_CONFIG_AUDIO_MIX;
+
+   RSDevice device;
+   if ((ret = rsPulseDeviceCreate(&device)) < 0) {
+      fprintf(stderr, "No PulseAudio server to record from: %s\n", av_err2str(ret));
+      return TEST_SKIP;
+   }
+   rsDeviceDestroy(&device);
+
+   double autoFrames, autoCPU, frames, cpu;
+   RS_TEST_CHECK(testRecord(RS_CONFIG_AUTO, &autoFrames, &autoCPU) == 0);
+   RS_TEST_CHECK(testRecord(TEST_FRAG_SIZE, &frames, &cpu) == 0);
+   fprintf(stderr, "Server fragments: %.1f frames/s, %.2f%% CPU\n", autoFrames, autoCPU);
+   fprintf(stderr, "%ims fragments: %.1f frames/s, %.2f%% CPU\n", TEST_FRAG_SIZE, frames,
+           cpu);
+   RS_TEST_CHECK(frames <= TEST_MAX_FRAMES);
+   RS_TEST_CHECK(cpu <= TEST_MAX_CPU);
+   return 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RS_TEST_H
+#define RS_TEST_H
+#include <stdio.h>
+
+// Every test is its own executable that fails with the first check that does not hold
+#define RS_TEST_CHECK(cond)                                                              \
+   do {                                                                                  \
+      if (!(cond)) {                                                                     \
+         fprintf(stderr, "%s:%i: Check failed: %s\n", __FILE__, __LINE__, #cond);        \
+         return 1;                                                                       \
+      }                                                                                  \
+   } while (0)
+
+#endif
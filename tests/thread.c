@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "thread.h"
+#include "test.h"
+#include <libavutil/time.h>
+#include <time.h>
+
+#define TEST_THREADS 4
+#define TEST_WORKERS 4
+#define TEST_BATCHES 80
+#define TEST_BATCH 256
+// Idle workers are given this long to show they are not spinning
+#define TEST_IDLE 200000
+
+typedef struct TestSignal {
+   RSMutex mutex;
+   RSCond cond;
+   int value;
+} TestSignal;
+
+static void *testSignalRun(void *extra) {
+   TestSignal *signal = extra;
+   rsMutexLock(&signal->mutex);
+   signal->value = 1;
+   rsCondSignal(&signal->cond);
+   rsMutexUnlock(&signal->mutex);
+   return NULL;
+}
+
+static int testCond(void) {
+   TestSignal signal = {0};
+   RSThread thread;
+   RS_TEST_CHECK(rsMutexCreate(&signal.mutex) >= 0);
+   RS_TEST_CHECK(rsCondCreate(&signal.cond) >= 0);
+   RS_TEST_CHECK(rsThreadCreate(&thread, testSignalRun, &signal) >= 0);
+   rsMutexLock(&signal.mutex);
+   while (!signal.value) {
+      rsCondWait(&signal.cond, &signal.mutex);
+   }
+   rsMutexUnlock(&signal.mutex);
+   rsThreadDestroy(&thread);
+   rsCondDestroy(&signal.cond);
+   rsMutexDestroy(&signal.mutex);
+   return 0;
+}
+
+static void *testPostRun(void *extra) {
+   rsSemaphorePost(extra);
+   return NULL;
+}
+
+static int testSemaphore(void) {
+   RSSemaphore sem;
+   RSThread threads[TEST_THREADS];
+   RS_TEST_CHECK(rsSemaphoreCreate(&sem, 1) >= 0);
+   RS_TEST_CHECK(rsSemaphoreTryWait(&sem));
+   RS_TEST_CHECK(!rsSemaphoreTryWait(&sem));
+   for (int i = 0; i < TEST_THREADS; ++i) {
+      RS_TEST_CHECK(rsThreadCreate(&threads[i], testPostRun, &sem) >= 0);
+   }
+   for (int i = 0; i < TEST_THREADS; ++i) {
+      rsSemaphoreWait(&sem);
+   }
+   for (int i = 0; i < TEST_THREADS; ++i) {
+      rsThreadDestroy(&threads[i]);
+   }
+   RS_TEST_CHECK(!rsSemaphoreTryWait(&sem));
+   rsSemaphoreDestroy(&sem);
+   return 0;
+}
+
+static int testTaskRun(void *extra) {
+   int *counter = extra;
+   return rsAtomicAdd(counter, 1);
+}
+
+static int testFuture(void) {
+   // Without workers the task runs before submit returns
+   RSThreadPool pool;
+   RSFuture future;
+   int counter = 0;
+   RS_TEST_CHECK(rsThreadPoolCreate(&pool, 0) >= 0);
+   RS_TEST_CHECK(rsFutureCreate(&future) >= 0);
+   rsThreadPoolSubmit(&pool, &future, testTaskRun, &counter);
+   RS_TEST_CHECK(counter == 1);
+   RS_TEST_CHECK(rsFutureWait(&future) == 1);
+   rsFutureDestroy(&future);
+   rsThreadPoolDestroy(&pool);
+   return 0;
+}
+
+static int64_t testCpuTime(void) {
+   struct timespec time;
+   clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+   return (int64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+static int testPool(double *result) {
+   static RSFuture futures[TEST_BATCH];
+   RSThreadPool pool;
+   int counter = 0;
+   RS_TEST_CHECK(rsThreadPoolCreate(&pool, TEST_WORKERS) >= 0);
+
+   int64_t time = av_gettime_relative();
+   for (int i = 0; i < TEST_BATCHES; ++i) {
+      for (int j = 0; j < TEST_BATCH; ++j) {
+         RS_TEST_CHECK(rsFutureCreate(&futures[j]) >= 0);
+         rsThreadPoolSubmit(&pool, &futures[j], testTaskRun, &counter);
+      }
+      for (int j = 0; j < TEST_BATCH; ++j) {
+         RS_TEST_CHECK(rsFutureWait(&futures[j]) > 0);
+         rsFutureDestroy(&futures[j]);
+      }
+   }
+   time = av_gettime_relative() - time;
+   *result = (double)(TEST_BATCHES * TEST_BATCH) * AV_TIME_BASE / (double)time;
+   RS_TEST_CHECK(counter == TEST_BATCHES * TEST_BATCH);
+
+   // With every queue empty the workers should be asleep rather than scanning
+   int64_t cpu = testCpuTime();
+   av_usleep(TEST_IDLE);
+   cpu = testCpuTime() - cpu;
+   printf("Idle pool used %" PRIi64 " us of CPU in %i us\n", cpu, TEST_IDLE);
+   RS_TEST_CHECK(cpu < TEST_IDLE / 10);
+
+   rsThreadPoolDestroy(&pool);
+   return 0;
+}
+
+int main(void) {
+   double throughput;
+   RS_TEST_CHECK(testCond() == 0);
+   RS_TEST_CHECK(testSemaphore() == 0);
+   RS_TEST_CHECK(testFuture() == 0);
+   RS_TEST_CHECK(testPool(&throughput) == 0);
+   printf("%.0f tasks per second with %i workers\n", throughput, TEST_WORKERS);
+   return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2021  Joshua Minter
+ *
+ * This file is part of ReplaySorcery.
+ *
+ * ReplaySorcery is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ReplaySorcery is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ReplaySorcery.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "buffer.h"
+#include "config.h"
+#include "encoder/encoder.h"
+#include "test.h"
+#include "util.h"
+#include <libavutil/time.h>
+
+#define TEST_WIDTH 640
+#define TEST_HEIGHT 360
+#define TEST_FRAMERATE 30
+#define TEST_SECONDS 10
+#define TEST_GOP 30
+#define TEST_LONG_GOP 150
+// Enough to fill the buffer and trim it a few times
+#define TEST_FRAMES ((TEST_SECONDS + 5) * TEST_FRAMERATE)
+#define TEST_PATH "test-vencode.mp4"
+
+typedef struct TestResult {
+   int skipped;
+   double fps;
+   double meanBits;
+   double maxBits;
+   // Bytes per second of video kept in the buffer
+   double bufferRate;
+   int64_t startError;
+   int keyFrames;
+   int64_t saveTime;
+} TestResult;
+
+RSConfig rsConfig;
+
+// Moving noise has detail everywhere so every part of the picture costs bits to refresh
+static uint8_t testPixel(int x, int y, int index) {
+   uint32_t hash = (uint32_t)((x + index * 4) / 8) * 73856093u;
+   hash ^= (uint32_t)(y / 8) * 19349663u;
+   return (uint8_t)(hash >> 8);
+}
+
+static int testFrame(AVFrame *frame, int index) {
+   frame->format = AV_PIX_FMT_YUV420P;
+   frame->width = TEST_WIDTH;
+   frame->height = TEST_HEIGHT;
+   frame->pts = (int64_t)index * AV_TIME_BASE / TEST_FRAMERATE;
+   RS_TEST_CHECK(av_frame_get_buffer(frame, 0) >= 0);
+   for (int y = 0; y < TEST_HEIGHT; ++y) {
+      for (int x = 0; x < TEST_WIDTH; ++x) {
+         frame->data[0][y * frame->linesize[0] + x] = testPixel(x, y, index);
+      }
+   }
+   for (int i = 1; i < 3; ++i) {
+      for (int y = 0; y < TEST_HEIGHT / 2; ++y) {
+         memset(frame->data[i] + y * frame->linesize[i], 128, TEST_WIDTH / 2);
+      }
+   }
+   return 0;
+}
+
+static int testReceive(RSEncoder *encoder, RSBuffer *buffer, AVPacket *packet,
+                       double *bits, int *count) {
+   int ret;
+   while ((ret = rsEncoderNextPacket(encoder, packet)) >= 0) {
+      bits[(*count)++] = packet->size * 8.0;
+      RS_TEST_CHECK(rsBufferAddPacket(buffer, packet) >= 0);
+   }
+   RS_TEST_CHECK(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF);
+   return 0;
+}
+
+static int testSave(RSBuffer *buffer, int64_t *time) {
+   RSOutput output = {0};
+   RS_TEST_CHECK(avformat_alloc_output_context2(&output.formatCtx, NULL, "mp4",
+                                                TEST_PATH) >= 0);
+   RS_TEST_CHECK(avio_open(&output.formatCtx->pb, TEST_PATH, AVIO_FLAG_WRITE) >= 0);
+   rsOutputAddStream(&output, buffer->params);
+   RS_TEST_CHECK(rsOutputOpen(&output) >= 0);
+   int64_t start = av_gettime_relative();
+   RS_TEST_CHECK(rsBufferWrite(buffer, &output, 0, 1) >= 0);
+   *time = av_gettime_relative() - start;
+   RS_TEST_CHECK(av_write_trailer(output.formatCtx) >= 0);
+   rsOutputDestroy(&output);
+   remove(TEST_PATH);
+   return 0;
+}
+
+static int testEncode(const AVCodecParameters *input, int type, TestResult *result) {
+   static double bits[TEST_FRAMES];
+   RSEncoder encoder;
+   RSBuffer buffer;
+   rsClear(result, sizeof(TestResult));
+   if (rsVideoEncoderCreateType(&encoder, input, NULL, type) < 0) {
+      result->skipped = 1;
+      return 0;
+   }
+   RS_TEST_CHECK(rsBufferCreate(&buffer, &encoder, input) >= 0);
+   AVFrame *frame = av_frame_alloc();
+   AVPacket *packet = av_packet_alloc();
+   RS_TEST_CHECK(frame != NULL && packet != NULL);
+
+   int count = 0;
+   int64_t time = 0;
+   for (int i = 0; i < TEST_FRAMES; ++i) {
+      RS_TEST_CHECK(testFrame(frame, i) == 0);
+      int64_t start = av_gettime_relative();
+      RS_TEST_CHECK(rsEncoderSendFrame(&encoder, frame) >= 0);
+      RS_TEST_CHECK(testReceive(&encoder, &buffer, packet, bits, &count) == 0);
+      time += av_gettime_relative() - start;
+   }
+   RS_TEST_CHECK(rsEncoderSendFrame(&encoder, NULL) >= 0);
+   RS_TEST_CHECK(testReceive(&encoder, &buffer, packet, bits, &count) == 0);
+   RS_TEST_CHECK(count == TEST_FRAMES);
+   result->fps = TEST_FRAMES * (double)AV_TIME_BASE / (double)FFMAX(time, 1);
+
+   // The first frame is an IDR frame in every mode so it is left out
+   for (int i = 1; i < count; ++i) {
+      result->meanBits += bits[i] / (count - 1);
+      result->maxBits = FFMAX(result->maxBits, bits[i]);
+   }
+
+   int64_t bytes = 0;
+   for (RSPacketList *plist = buffer.tail; plist != NULL; plist = plist->next) {
+      bytes += plist->packet->size;
+      result->keyFrames += !!(plist->packet->flags & AV_PKT_FLAG_KEY);
+   }
+   int64_t duration = buffer.head->packet->pts - buffer.tail->packet->pts;
+   result->bufferRate = (double)bytes * AV_TIME_BASE / (double)duration;
+   int64_t startTime = rsBufferGetStartTime(&buffer);
+   RS_TEST_CHECK(startTime >= 0);
+   result->startError =
+       startTime - (buffer.head->packet->pts - rsConfig.recordSeconds * AV_TIME_BASE);
+   RS_TEST_CHECK(testSave(&buffer, &result->saveTime) == 0);
+
+   av_packet_free(&packet);
+   av_frame_free(&frame);
+   rsBufferDestroy(&buffer);
+   rsEncoderDestroy(&encoder);
+   return 0;
+}
+
+static void testPrint(const char *name, const TestResult *result) {
+   if (result->skipped) {
+      fprintf(stderr, "%s: not available\n", name);
+      return;
+   }
+   fprintf(stderr,
+           "%s: %.0f bits/frame, peak %.1fx the mean, %.1f KiB/s buffered, "
+           "%i sync points, starts %.0fms late, saved in %.1fms, %.1ffps\n",
+           name, result->meanBits, result->maxBits / result->meanBits,
+           result->bufferRate / 1024.0, result->keyFrames,
+           (double)result->startError / 1000.0, (double)result->saveTime / 1000.0,
+           result->fps);
+}
+
+int main(void) {
+   rsConfig.recordSeconds = TEST_SECONDS;
+   rsConfig.videoFramerate = TEST_FRAMERATE;
+   rsConfig.videoWidth = RS_CONFIG_AUTO;
+   rsConfig.videoHeight = RS_CONFIG_AUTO;
+   rsConfig.scaleWidth = RS_CONFIG_AUTO;
+   rsConfig.scaleHeight = RS_CONFIG_AUTO;
+   rsConfig.videoProfile = FF_PROFILE_H264_BASELINE;
+   rsConfig.videoPreset = RS_CONFIG_PRESET_FAST;
+   rsConfig.videoQuality = 28;
+   rsConfig.videoBitrate = RS_CONFIG_AUTO;
+   rsConfig.videoGOP = TEST_GOP;
+   rsConfig.videoSaveStart = RS_CONFIG_START_KEYFRAME;
+   AVCodecParameters *input = avcodec_parameters_alloc();
+   RS_TEST_CHECK(input != NULL);
+   input->codec_type = AVMEDIA_TYPE_VIDEO;
+   input->format = AV_PIX_FMT_YUV420P;
+   input->width = TEST_WIDTH;
+   input->height = TEST_HEIGHT;
+
+   // Intra refresh spreads the key-frame over the GOP, the buffer has to find the
+   // recovery points instead to start saves at
+   TestResult gop, intra;
+   rsConfig.videoRefresh = RS_CONFIG_REFRESH_GOP;
+   RS_TEST_CHECK(testEncode(input, RS_CONFIG_ENCODER_X264, &gop) == 0);
+   rsConfig.videoRefresh = RS_CONFIG_REFRESH_INTRA;
+   RS_TEST_CHECK(testEncode(input, RS_CONFIG_ENCODER_X264, &intra) == 0);
+   testPrint("x264 GOP", &gop);
+   testPrint("x264 intra refresh", &intra);
+   RS_TEST_CHECK(!gop.skipped && !intra.skipped);
+   int64_t frame = AV_TIME_BASE / TEST_FRAMERATE;
+   int64_t period = TEST_GOP * frame;
+   RS_TEST_CHECK(intra.keyFrames >= TEST_SECONDS * TEST_FRAMERATE / TEST_GOP - 1);
+   RS_TEST_CHECK(intra.startError >= 0 && intra.startError <= period + frame);
+   RS_TEST_CHECK(intra.maxBits < gop.maxBits);
+
+   // Long GOPs keep fewer key-frames in the buffer, an exact start re-encodes the frames
+   // from the requested time up to the next key-frame instead
+   TestResult exact;
+   rsConfig.videoRefresh = RS_CONFIG_REFRESH_GOP;
+   rsConfig.videoGOP = TEST_LONG_GOP;
+   rsConfig.videoSaveStart = RS_CONFIG_START_EXACT;
+   RS_TEST_CHECK(testEncode(input, RS_CONFIG_ENCODER_X264, &exact) == 0);
+   testPrint("x264 long GOP, exact start", &exact);
+   RS_TEST_CHECK(!exact.skipped);
+   RS_TEST_CHECK(exact.startError == 0);
+   RS_TEST_CHECK(exact.bufferRate < gop.bufferRate);
+   fprintf(stderr, "Long GOPs buffer %.0f%% less, the exact start costs %.1fms more\n",
+           100.0 - 100.0 * exact.bufferRate / gop.bufferRate,
+           (double)(exact.saveTime - gop.saveTime) / 1000.0);
+
+   // The other software backends against x264 with the same GOP and quality, they are
+   // skipped when FFmpeg was built without them
+   static const struct {
+      int type;
+      const char *name;
+   } backends[] = {
+       {RS_CONFIG_ENCODER_X265, "x265"},
+       {RS_CONFIG_ENCODER_SVTAV1, "SVT-AV1"},
+       {RS_CONFIG_ENCODER_VP9, "VP9"},
+   };
+   rsConfig.videoGOP = TEST_GOP;
+   rsConfig.videoSaveStart = RS_CONFIG_START_KEYFRAME;
+   for (size_t i = 0; i < FF_ARRAY_ELEMS(backends); ++i) {
+      TestResult result;
+      RS_TEST_CHECK(testEncode(input, backends[i].type, &result) == 0);
+      testPrint(backends[i].name, &result);
+      if (!result.skipped) {
+         fprintf(stderr, "%s: %.0f%% of the bits and %.0f%% of the speed of x264\n",
+                 backends[i].name, 100.0 * result.meanBits / gop.meanBits,
+                 100.0 * result.fps / gop.fps);
+      }
+   }
+
+   avcodec_parameters_free(&input);
+   return 0;
+}